@@ -16,88 +16,130 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-/* The buffer used in each connection is a linked list of lines. As the lines
- * are read in and written out the buffer expands and contracts. Basically,
- * by using this method we can increase the buffer size dynamically. However,
- * we have a hard limit of 64 KB for the size of the buffer. The buffer can be
- * thought of as a queue were we act on both the head and tail. The various
- * functions act on each end (the names are taken from what Perl uses to act on
- * the ends of an array. :)
+/* The buffer used in each connection is a fixed-size ring of MAXBUFFSIZE
+ * bytes. Data is read from the socket straight into the free space of the
+ * ring and written out of it again, so relaying a chunk of data costs no
+ * allocations and no extra copies. Since the free (or used) space may wrap
+ * around the end of the ring it is described by up to two segments, and both
+ * are handed to the kernel in a single readv()/sendmsg() call.
+ *
+ * The ring itself is only attached while the buffer holds data: it is
+ * taken from the pool right before a read and handed back as soon as the
+ * buffer drains. A connection which sits idle, like most long-lived
+ * tunnels do, thus keeps no buffer memory at all.
+ *
+ * How much is read at once and how full the ring may get before reading
+ * stops are set per buffer. In adaptive mode the read size follows the
+ * traffic: it doubles whenever a read fills it completely, as happens on
+ * bulk transfers, and halves when reads come back much smaller, as they
+ * do for interactive traffic.
  */
 
 #include "main.h"
 
 #include "buffer.h"
-#include "heap.h"
 #include "log.h"
+#include "pool.h"
+#include <pthread.h>
 
-#define BUFFER_HEAD(x) (x)->head
-#define BUFFER_TAIL(x) (x)->tail
+#define BUFFER_CAPACITY MAXBUFFSIZE
 
-struct bufline_s {
-        unsigned char *string;  /* the actual string of data */
-        struct bufline_s *next; /* pointer to next in linked list */
-        size_t length;          /* length of the string of data */
-        size_t pos;             /* start sending from this offset */
-};
+/* Number of buffers, and how many of them have a ring attached. */
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long buffers_total, buffers_active;
 
 /*
- * The buffer structure points to the beginning and end of the buffer list
- * (and includes the total size)
+ * The buffer structure holds the ring of data, the offset of the first
+ * byte which is still to be sent, and the number of bytes stored, along
+ * with the read size and the watermarks.
  */
 struct buffer_s {
-        struct bufline_s *head; /* top of the buffer */
-        struct bufline_s *tail; /* bottom of the buffer */
-        size_t size;            /* total size of the buffer */
+        unsigned char *data;    /* the ring itself, NULL while empty */
+        size_t start;           /* offset of the oldest byte */
+        size_t size;            /* number of bytes stored */
+
+        size_t chunk;           /* bytes to read at once */
+        unsigned int adaptive;  /* boolean: adjust chunk to the traffic */
+        size_t low, high;       /* watermarks */
+        unsigned int full;      /* boolean: high watermark was reached */
 };
 
 /*
- * Take a string of data and a length and make a new line which can be added
- * to the buffer. The data IS copied, so make sure if you allocated your
- * data buffer on the heap, delete it because you now have TWO copies.
+ * Describe the used part of the ring in at most two segments. Returns the
+ * number of segments filled in.
  */
-static struct bufline_s *makenewline (unsigned char *data, size_t length)
+static int used_segments (struct buffer_s *buffptr, struct iovec *iov)
 {
-        struct bufline_s *newline;
+        size_t first;
 
-        assert (data != NULL);
-        assert (length > 0);
+        if (buffptr->size == 0)
+                return 0;
 
-        newline = (struct bufline_s *) safemalloc (sizeof (struct bufline_s));
-        if (!newline)
-                return NULL;
+        first = min (buffptr->size, BUFFER_CAPACITY - buffptr->start);
+        iov[0].iov_base = buffptr->data + buffptr->start;
+        iov[0].iov_len = first;
+        if (first == buffptr->size)
+                return 1;
 
-        newline->string = (unsigned char *) safemalloc (length);
-        if (!newline->string) {
-                safefree (newline);
-                return NULL;
-        }
+        iov[1].iov_base = buffptr->data;
+        iov[1].iov_len = buffptr->size - first;
+        return 2;
+}
 
-        memcpy (newline->string, data, length);
+/*
+ * Describe the free part of the ring in at most two segments. Returns the
+ * number of segments filled in.
+ */
+static int free_segments (struct buffer_s *buffptr, struct iovec *iov)
+{
+        size_t end, room;
 
-        newline->next = NULL;
-        newline->length = length;
+        room = BUFFER_CAPACITY - buffptr->size;
+        if (room == 0)
+                return 0;
 
-        /* Position our "read" pointer at the beginning of the data */
-        newline->pos = 0;
+        end = (buffptr->start + buffptr->size) % BUFFER_CAPACITY;
+        iov[0].iov_base = buffptr->data + end;
+        iov[0].iov_len = min (room, BUFFER_CAPACITY - end);
+        if (iov[0].iov_len == room)
+                return 1;
 
-        return newline;
+        iov[1].iov_base = buffptr->data;
+        iov[1].iov_len = room - iov[0].iov_len;
+        return 2;
 }
 
 /*
- * Free the allocated buffer line
+ * Make sure the buffer has a ring to put data into.
  */
-static void free_line (struct bufline_s *line)
+static int attach_data (struct buffer_s *buffptr)
 {
-        assert (line != NULL);
+        if (buffptr->data)
+                return 0;
 
-        if (!line)
-                return;
+        buffptr->data = (unsigned char *) pool_alloc (BUFFER_CAPACITY);
+        if (!buffptr->data)
+                return -1;
+
+        buffptr->start = 0;
+        pthread_mutex_lock (&buffers_lock);
+        buffers_active++;
+        pthread_mutex_unlock (&buffers_lock);
+        return 0;
+}
 
-        if (line->string)
-                safefree (line->string);
+/*
+ * Give the ring back to the pool once the buffer has drained.
+ */
+static void release_data (struct buffer_s *buffptr)
+{
+        if (!buffptr->data || buffptr->size > 0)
+                return;
 
-        safefree (line);
+        poolfree (buffptr->data);
+        pthread_mutex_lock (&buffers_lock);
+        buffers_active--;
+        pthread_mutex_unlock (&buffers_lock);
 }
 
 /*
@@ -107,37 +149,38 @@ struct buffer_s *new_buffer (void)
 {
         struct buffer_s *buffptr;
 
-        buffptr = (struct buffer_s *) safemalloc (sizeof (struct buffer_s));
+        buffptr = (struct buffer_s *) pool_alloc (sizeof (struct buffer_s));
         if (!buffptr)
                 return NULL;
 
-        /*
-         * Since the buffer is initially empty, set the HEAD and TAIL
-         * pointers to NULL since they can't possibly point anywhere at the
-         * moment.
-         */
-        BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = NULL;
-        buffptr->size = 0;
+        buffptr->data = NULL;
+        buffptr->start = buffptr->size = 0;
+        buffptr->chunk = BUFFER_CAPACITY;
+        buffptr->adaptive = FALSE;
+        buffptr->low = buffptr->high = BUFFER_CAPACITY;
+        buffptr->full = FALSE;
+
+        pthread_mutex_lock (&buffers_lock);
+        buffers_total++;
+        pthread_mutex_unlock (&buffers_lock);
 
         return buffptr;
 }
 
 /*
- * Delete all the lines in the buffer and the buffer itself
+ * Delete the buffer and its data
  */
 void delete_buffer (struct buffer_s *buffptr)
 {
-        struct bufline_s *next;
-
         assert (buffptr != NULL);
 
-        while (BUFFER_HEAD (buffptr)) {
-                next = BUFFER_HEAD (buffptr)->next;
-                free_line (BUFFER_HEAD (buffptr));
-                BUFFER_HEAD (buffptr) = next;
-        }
+        buffptr->size = 0;
+        release_data (buffptr);
+        poolfree (buffptr);
 
-        safefree (buffptr);
+        pthread_mutex_lock (&buffers_lock);
+        buffers_total--;
+        pthread_mutex_unlock (&buffers_lock);
 }
 
 /*
@@ -149,70 +192,160 @@ size_t buffer_size (struct buffer_s *buffptr)
 }
 
 /*
- * Push a new line on to the end of the buffer.
+ * Report how many buffers hold data right now, and how many are idle.
+ */
+void buffer_get_stats (unsigned long *active, unsigned long *idle)
+{
+        pthread_mutex_lock (&buffers_lock);
+        *active = buffers_active;
+        *idle = buffers_total - buffers_active;
+        pthread_mutex_unlock (&buffers_lock);
+}
+
+/*
+ * Set how many bytes read_buffer() reads at once, and whether that
+ * amount adapts to the traffic.
+ */
+void buffer_set_read_chunk (struct buffer_s *buffptr, size_t chunk,
+                            unsigned int adaptive)
+{
+        assert (buffptr != NULL);
+
+        buffptr->chunk = max (MINREADCHUNK, min (chunk, BUFFER_CAPACITY));
+        buffptr->adaptive = adaptive;
+}
+
+/*
+ * Set the watermarks: once the buffer holds "high" bytes no more should
+ * be read into it until it has drained to "low" bytes.
+ */
+void buffer_set_watermarks (struct buffer_s *buffptr, size_t low,
+                            size_t high)
+{
+        assert (buffptr != NULL);
+
+        buffptr->high = max (1, min (high, BUFFER_CAPACITY));
+        buffptr->low = min (low, buffptr->high);
+        buffptr->full = FALSE;
+}
+
+/*
+ * Tell whether more data should be read into the buffer, going by the
+ * watermarks.
+ */
+int buffer_wants_data (struct buffer_s *buffptr)
+{
+        assert (buffptr != NULL);
+
+        if (buffptr->size >= buffptr->high)
+                buffptr->full = TRUE;
+        else if (buffptr->size <= buffptr->low)
+                buffptr->full = FALSE;
+
+        return !buffptr->full;
+}
+
+/*
+ * Adjust the read size of an adaptive buffer after a read which asked
+ * for "wanted" bytes and got "got".
+ */
+static void adapt_read_chunk (struct buffer_s *buffptr, size_t wanted,
+                              size_t got)
+{
+        if (got == wanted && wanted == buffptr->chunk)
+                buffptr->chunk = min (buffptr->chunk * 2, BUFFER_CAPACITY);
+        else if (got < buffptr->chunk / 4)
+                buffptr->chunk = max (buffptr->chunk / 2, MINREADCHUNK);
+}
+
+/*
+ * Describe the last "len" bytes stored in the buffer, such as those the
+ * last read_buffer() added, in at most two segments. Returns the number
+ * of segments filled in.
+ */
+int buffer_tail (struct buffer_s *buffptr, size_t len, struct iovec *iov)
+{
+        size_t tail;
+
+        assert (buffptr != NULL);
+        assert (len <= buffptr->size);
+
+        if (len == 0)
+                return 0;
+
+        tail = (buffptr->start + buffptr->size - len) % BUFFER_CAPACITY;
+        iov[0].iov_base = buffptr->data + tail;
+        iov[0].iov_len = min (len, BUFFER_CAPACITY - tail);
+        if (iov[0].iov_len == len)
+                return 1;
+
+        iov[1].iov_base = buffptr->data;
+        iov[1].iov_len = len - iov[0].iov_len;
+        return 2;
+}
+
+/*
+ * Append data to the end of the buffer. Fails if there is not enough room
+ * left for all of it.
  */
 int add_to_buffer (struct buffer_s *buffptr, unsigned char *data, size_t length)
 {
-        struct bufline_s *newline;
+        struct iovec iov[2];
+        int i, n;
 
         assert (buffptr != NULL);
         assert (data != NULL);
         assert (length > 0);
 
-        /*
-         * Sanity check here. A buffer with a non-NULL head pointer must
-         * have a size greater than zero, and vice-versa.
-         */
-        if (BUFFER_HEAD (buffptr) == NULL)
-                assert (buffptr->size == 0);
-        else
-                assert (buffptr->size > 0);
-
-        /*
-         * Make a new line so we can add it to the buffer.
-         */
-        if (!(newline = makenewline (data, length)))
+        if (length > BUFFER_CAPACITY - buffptr->size)
+                return -1;
+        if (attach_data (buffptr) < 0)
                 return -1;
 
-        if (buffptr->size == 0)
-                BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = newline;
-        else {
-                BUFFER_TAIL (buffptr)->next = newline;
-                BUFFER_TAIL (buffptr) = newline;
-        }
+        n = free_segments (buffptr, iov);
+        for (i = 0; i < n && length > 0; i++) {
+                size_t len = min (length, iov[i].iov_len);
 
-        buffptr->size += length;
+                memcpy (iov[i].iov_base, data, len);
+                data += len;
+                length -= len;
+                buffptr->size += len;
+        }
 
         return 0;
 }
 
 /*
- * Remove the first line from the top of the buffer
+ * Drop the last "len" bytes stored in the buffer, as when they turn out
+ * not to belong to what is being relayed.
  */
-static struct bufline_s *remove_from_buffer (struct buffer_s *buffptr)
+void buffer_trim (struct buffer_s *buffptr, size_t len)
 {
-        struct bufline_s *line;
-
         assert (buffptr != NULL);
-        assert (BUFFER_HEAD (buffptr) != NULL);
-
-        line = BUFFER_HEAD (buffptr);
-        BUFFER_HEAD (buffptr) = line->next;
-
-        buffptr->size -= line->length;
+        assert (len <= buffptr->size);
 
-        return line;
+        buffptr->size -= len;
+        release_data (buffptr);
 }
 
 /*
- * Reads the bytes from the socket, and adds them to the buffer.
+ * Reads the bytes from the socket into the free space of the buffer.
  * Takes a connection and returns the number of bytes read.
  */
-#define READ_BUFFER_SIZE (1024 * 2)
 ssize_t read_buffer (int fd, struct buffer_s * buffptr)
+{
+        return read_buffer_upto (fd, buffptr, BUFFER_CAPACITY);
+}
+
+/*
+ * Like read_buffer(), but read no more than "limit" bytes.
+ */
+ssize_t read_buffer_upto (int fd, struct buffer_s *buffptr, size_t limit)
 {
         ssize_t bytesin;
-        unsigned char *buffer;
+        struct iovec iov[2];
+        size_t wanted, chunk;
+        int n;
 
         assert (fd >= 0);
         assert (buffptr != NULL);
@@ -220,28 +353,40 @@ ssize_t read_buffer (int fd, struct buffer_s * buffptr)
         /*
          * Don't allow the buffer to grow larger than MAXBUFFSIZE
          */
-        if (buffptr->size >= MAXBUFFSIZE)
+        if (buffptr->size >= BUFFER_CAPACITY)
                 return 0;
 
-        buffer = (unsigned char *) safemalloc (READ_BUFFER_SIZE);
-        if (!buffer) {
+        if (attach_data (buffptr) < 0)
                 return -ENOMEM;
+
+        /* Keep the free space in one piece while we can. */
+        if (buffptr->size == 0)
+                buffptr->start = 0;
+
+        chunk = min (buffptr->chunk, limit);
+        n = free_segments (buffptr, iov);
+        if (iov[0].iov_len >= chunk) {
+                iov[0].iov_len = chunk;
+                n = 1;
+        } else if (n == 2) {
+                iov[1].iov_len = min (iov[1].iov_len,
+                                      chunk - iov[0].iov_len);
         }
+        wanted = iov[0].iov_len + (n == 2 ? iov[1].iov_len : 0);
 
-        bytesin = read (fd, buffer, READ_BUFFER_SIZE);
+        bytesin = readv (fd, iov, n);
 
         if (bytesin > 0) {
-                if (add_to_buffer (buffptr, buffer, bytesin) < 0) {
-                        log_message (LOG_ERR,
-                                     "readbuff: add_to_buffer() error.");
-                        bytesin = -1;
-                }
+                buffptr->size += bytesin;
+                if (buffptr->adaptive && chunk == buffptr->chunk)
+                        adapt_read_chunk (buffptr, wanted, bytesin);
         } else if (bytesin == 0) {
                 /* connection was closed by client */
                 bytesin = -1;
         } else {
                 switch (errno) {
                 case EINTR:
+                case EAGAIN:
                         bytesin = 0;
                         break;
                 default:
@@ -253,7 +398,7 @@ ssize_t read_buffer (int fd, struct buffer_s * buffptr)
                 }
         }
 
-        safefree (buffer);
+        release_data (buffptr);
         return bytesin;
 }
 
@@ -264,7 +409,8 @@ ssize_t read_buffer (int fd, struct buffer_s * buffptr)
 ssize_t write_buffer (int fd, struct buffer_s * buffptr)
 {
         ssize_t bytessent;
-        struct bufline_s *line;
+        struct iovec iov[2];
+        struct msghdr msg;
 
         assert (fd >= 0);
         assert (buffptr != NULL);
@@ -272,23 +418,27 @@ ssize_t write_buffer (int fd, struct buffer_s * buffptr)
         if (buffptr->size == 0)
                 return 0;
 
-        /* Sanity check. It would be bad to be using a NULL pointer! */
-        assert (BUFFER_HEAD (buffptr) != NULL);
-        line = BUFFER_HEAD (buffptr);
+        /*
+         * sendmsg() rather than writev() so that MSG_NOSIGNAL can be
+         * passed along with both segments.
+         */
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = used_segments (buffptr, iov);
 
-        bytessent =
-            send (fd, line->string + line->pos, line->length - line->pos,
-                  MSG_NOSIGNAL);
+        bytessent = sendmsg (fd, &msg, MSG_NOSIGNAL);
 
         if (bytessent >= 0) {
                 /* bytes sent, adjust buffer */
-                line->pos += bytessent;
-                if (line->pos == line->length)
-                        free_line (remove_from_buffer (buffptr));
+                buffptr->start =
+                    (buffptr->start + bytessent) % BUFFER_CAPACITY;
+                buffptr->size -= bytessent;
+                release_data (buffptr);
                 return bytessent;
         } else {
                 switch (errno) {
                 case EINTR:
+                case EAGAIN:
                         return 0;
                 case ENOBUFS:
                 case ENOMEM:
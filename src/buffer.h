@@ -27,14 +27,27 @@ struct buffer_s;
 extern struct buffer_s *new_buffer (void);
 extern void delete_buffer (struct buffer_s *buffptr);
 extern size_t buffer_size (struct buffer_s *buffptr);
+extern void buffer_get_stats (unsigned long *active, unsigned long *idle);
+
+extern void buffer_set_read_chunk (struct buffer_s *buffptr, size_t chunk,
+                                   unsigned int adaptive);
+extern void buffer_set_watermarks (struct buffer_s *buffptr, size_t low,
+                                   size_t high);
+extern int buffer_wants_data (struct buffer_s *buffptr);
+extern int buffer_tail (struct buffer_s *buffptr, size_t len,
+                        struct iovec *iov);
 
 /*
- * Add a new line to the given buffer. The data IS copied into the structure.
+ * Append data to the given buffer. The data IS copied into the structure.
  */
 extern int add_to_buffer (struct buffer_s *buffptr, unsigned char *data,
                           size_t length);
 
+extern void buffer_trim (struct buffer_s *buffptr, size_t len);
+
 extern ssize_t read_buffer (int fd, struct buffer_s *buffptr);
+extern ssize_t read_buffer_upto (int fd, struct buffer_s *buffptr,
+                                 size_t limit);
 extern ssize_t write_buffer (int fd, struct buffer_s *buffptr);
 
 #endif /* __BUFFER_H_ */
@@ -24,6 +24,7 @@
 
 #include "child.h"
 #include "daemon.h"
+#include "engine.h"
 #include "filter.h"
 #include "heap.h"
 #include "log.h"
@@ -35,42 +36,337 @@
 #include "loop.h"
 #include "conns.h"
 #include "mypoll.h"
+#include "pool.h"
+#include "stats.h"
 #include <pthread.h>
 
 static sblist* listen_fds;
+static unsigned int listen_copies = 1;  /* sockets per Listen address */
 
+/*
+ * An accepted connection waiting for a thread of the pool.  Clients
+ * accepted while MaxClients are already being serviced are "waiting"
+ * in the admission queue; they get a 503 if no thread becomes free
+ * within AdmissionTimeout seconds.
+ */
 struct client {
+        int fd;
         union sockaddr_union addr;
+        int waiting;
+        struct timespec since;
+        struct client *next;
 };
 
+/*
+ * A thread of the pool.  Threads wait on pool_cond for clients to show
+ * up in the queue and service them one at a time; idle threads beyond
+ * MaxSpareServers exit, and the main loop keeps MinSpareServers of them
+ * around.  Everything below is protected by pool_lock, and the counters
+ * make all the bookkeeping O(1).
+ */
 struct child {
 	pthread_t thread;
-	struct client client;
 	struct conn_s conn;
-	volatile int done;
+	int busy;
+	struct child *prev, *next;
 };
 
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+static int slot_wanted;         /* main loop is waiting on slot_cond */
+static struct child *childs;
+static struct client *queue_head, *queue_tail, *free_clients;
+static unsigned int nthreads;   /* threads in the pool */
+static unsigned int nidle;      /* threads waiting for a client */
+static unsigned int nqueued;    /* clients waiting for a thread */
+static unsigned int nclients;   /* clients queued or being serviced */
+
+/*
+ * Milliseconds elapsed since "since".
+ */
+static unsigned long elapsed_msec(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000L
+	       + (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
 static void* child_thread(void* data)
 {
 	struct child *c = data;
-	handle_connection (&c->conn, &c->client.addr);
-	c->done = 1;
+	struct client *cl;
+	union sockaddr_union addr;
+	unsigned long waited;
+	int fd;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (!queue_head && !config->quit
+		       && nidle <= config->maxspareservers)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		if (!queue_head || config->quit)
+			break;
+
+		cl = queue_head;
+		queue_head = cl->next;
+		if (!queue_head) queue_tail = NULL;
+		fd = cl->fd;
+		memcpy(&addr, &cl->addr, sizeof(addr));
+		waited = cl->waiting ? elapsed_msec(&cl->since) : 0;
+		cl->next = free_clients;
+		free_clients = cl;
+		nqueued--;
+		nidle--;
+		c->busy = 1;
+		pthread_mutex_unlock(&pool_lock);
+
+		if (waited)
+			update_stats_by (STAT_QUEUE_TIME, waited);
+
+		memset(&c->conn, 0, sizeof(c->conn));
+		conn_struct_init(&c->conn);
+		c->conn.client_fd = fd;
+		handle_connection (&c->conn, &addr);
+
+		pthread_mutex_lock(&pool_lock);
+		c->busy = 0;
+		nclients--;
+		nidle++;
+		if (slot_wanted)
+			pthread_cond_signal(&slot_cond);
+	}
+
+	nidle--;
+	nthreads--;
+	if (c->prev) c->prev->next = c->next;
+	else childs = c->next;
+	if (c->next) c->next->prev = c->prev;
+	pthread_mutex_unlock(&pool_lock);
+
+	poolfree(c);
 	return NULL;
 }
 
-static sblist *childs;
+/*
+ * Add an idle thread to the pool.  Called with pool_lock held.
+ */
+static int spawn_child(void)
+{
+	pthread_attr_t *attrp, attr;
+	struct child *c;
+	int ret;
+
+	c = pool_calloc(sizeof(struct child));
+	if (!c) return -1;
+
+	attrp = 0;
+	if (pthread_attr_init(&attr) == 0) {
+		attrp = &attr;
+		pthread_attr_setstacksize(attrp, 256*1024);
+		pthread_attr_setdetachstate(attrp, PTHREAD_CREATE_DETACHED);
+	}
+
+	/* The thread can't run before we drop the lock. */
+	c->next = childs;
+	if (childs) childs->prev = c;
+	childs = c;
+	nthreads++;
+	nidle++;
+
+	ret = pthread_create(&c->thread, attrp, child_thread, c);
+	if (attrp) pthread_attr_destroy(attrp);
+	if (ret != 0) {
+		childs = c->next;
+		if (childs) childs->prev = NULL;
+		nthreads--;
+		nidle--;
+		poolfree(c);
+		return -1;
+	}
+	return 0;
+}
 
-static void collect_threads(void)
+/*
+ * Top the pool up so that every queued client has a thread waiting for
+ * it, plus MinSpareServers spare ones.  Called with pool_lock held.
+ */
+static void spawn_spare_children(void)
 {
-	size_t i;
-	for (i = 0; i < sblist_getsize(childs); ) {
-		struct child *c = *((struct child**)sblist_get(childs, i));
-		if (c->done) {
-			pthread_join(c->thread, 0);
-			sblist_delete(childs, i);
-			safefree(c);
-		} else i++;
+	while (nidle < nqueued + config->minspareservers
+	       && nthreads < config->maxclients)
+		if (spawn_child() < 0) {
+			log_message (LOG_ERR, "Could not create a thread: %s",
+			             strerror(errno));
+			break;
+		}
+}
+
+/*
+ * Turn a client away because we are overloaded.  This has to be cheap
+ * exactly when the box is busiest: a canned response, no templates,
+ * and never blocking on the client.
+ */
+void child_shed_client(int fd)
+{
+	static const char response[] =
+		"HTTP/1.0 503 Service Unavailable\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: 42\r\n"
+		"Retry-After: 1\r\n"
+		"Connection: close\r\n"
+		"\r\n"
+		"The proxy is overloaded, try again later.\n";
+
+	if (send(fd, response, sizeof(response) - 1, MSG_DONTWAIT) < 0) {
+		/* nothing we can do about it */
+	}
+	close(fd);
+	update_stats (STAT_REFUSE);
+}
+
+/*
+ * Drop the clients that have been waiting for a thread for longer than
+ * AdmissionTimeout.  Called with pool_lock held; the sockets to answer
+ * are collected on "shed".
+ */
+static void expire_waiting_clients(struct client **shed)
+{
+	struct client *cl, *prev = NULL, *next;
+
+	for (cl = queue_head; cl; cl = next) {
+		next = cl->next;
+		if (!cl->waiting
+		    || elapsed_msec(&cl->since) < config->admission_timeout * 1000UL) {
+			prev = cl;
+			continue;
+		}
+
+		if (prev) prev->next = next;
+		else queue_head = next;
+		if (queue_tail == cl) queue_tail = prev;
+		nqueued--;
+		nclients--;
+
+		cl->next = *shed;
+		*shed = cl;
+	}
+}
+
+static void shed_clients(struct client *shed)
+{
+	struct client *cl;
+
+	if (!shed) return;
+
+	for (cl = shed; cl; cl = cl->next) {
+		log_message (LOG_INFO, "Waited too long for a free thread, "
+		             "dropping connection (file descriptor %d)", cl->fd);
+		child_shed_client(cl->fd);
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	while ((cl = shed) != NULL) {
+		shed = cl->next;
+		cl->next = free_clients;
+		free_clients = cl;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Hand an accepted connection to the pool, or turn it away if the
+ * admission queue is full as well.
+ */
+static int queue_client(int fd, union sockaddr_union *addr)
+{
+	struct client *cl;
+
+	pthread_mutex_lock(&pool_lock);
+
+	if (nclients >= config->maxclients + config->admission_queue) {
+		pthread_mutex_unlock(&pool_lock);
+		log_message (LOG_INFO, "Admission queue full, "
+		             "dropping connection (file descriptor %d)", fd);
+		child_shed_client(fd);
+		return 0;
+	}
+
+	cl = free_clients;
+	if (cl) free_clients = cl->next;
+	else cl = safemalloc(sizeof(struct client));
+	if (!cl) goto fail;
+
+	cl->fd = fd;
+	memcpy(&cl->addr, addr, sizeof(*addr));
+	cl->next = NULL;
+	if (queue_tail) queue_tail->next = cl;
+	else queue_head = cl;
+	queue_tail = cl;
+	nqueued++;
+	nclients++;
+
+	cl->waiting = nclients > config->maxclients;
+	if (cl->waiting) {
+		clock_gettime(CLOCK_MONOTONIC, &cl->since);
+		update_stats (STAT_QUEUED);
+	}
+
+	spawn_spare_children();
+	if (nthreads == 0) {
+		/* nobody will ever pick it up */
+		queue_head = queue_tail = NULL;
+		cl->next = free_clients;
+		free_clients = cl;
+		nqueued--;
+		nclients--;
+		goto fail;
 	}
+
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&pool_lock);
+	return -1;
+}
+
+/*
+ * Check whether another client may be accepted.  If neither a thread
+ * nor a place in the admission queue is free, and there is no queue to
+ * put clients on, wait (for at most a second) for a thread to finish
+ * instead.  Clients that waited too long in the queue are turned away
+ * on the way.
+ */
+static int admit_client(void)
+{
+	struct client *shed = NULL;
+	struct timespec deadline;
+	int full;
+
+	pthread_mutex_lock(&pool_lock);
+
+	if (config->admission_queue)
+		expire_waiting_clients(&shed);
+
+	full = nclients >= config->maxclients + config->admission_queue;
+	if (full && !config->admission_queue) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 1;
+		slot_wanted = 1;
+		pthread_cond_timedwait(&slot_cond, &pool_lock, &deadline);
+		slot_wanted = 0;
+		full = nclients >= config->maxclients;
+	} else
+		full = 0;
+
+	pthread_mutex_unlock(&pool_lock);
+
+	shed_clients(shed);
+	return !full;
 }
 
 /*
@@ -86,10 +382,21 @@ void child_main_loop (void)
         pollfd_struct *fds = safecalloc(nfds, sizeof *fds);
         ssize_t i;
         int ret, listenfd, was_full = 0;
-        pthread_attr_t *attrp, attr;
-        struct child *child;
+        unsigned int n;
 
-        childs = sblist_new(sizeof (struct child*), config->maxclients);
+#ifdef HAVE_SYS_EPOLL_H
+        if (config->ioengine != IOENGINE_THREADS) {
+                safefree(fds);
+                engine_main_loop (listen_fds, listen_copies);
+                return;
+        }
+#endif
+
+        pthread_mutex_lock(&pool_lock);
+        for (n = 0; n < config->startservers && n < config->maxclients; n++)
+                if (spawn_child() < 0) break;
+        pthread_mutex_unlock(&pool_lock);
+        log_message (LOG_INFO, "Started %u threads.", n);
 
         for (i = 0; i < nfds; i++) {
                 int *fd = sblist_get(listen_fds, i);
@@ -103,21 +410,6 @@ void child_main_loop (void)
          */
         while (!config->quit) {
 
-                collect_threads();
-
-                if (sblist_getsize(childs) >= config->maxclients) {
-                        if (!was_full)
-                                log_message (LOG_WARNING,
-                                             "Maximum number of connections reached. "
-                                             "Refusing new connections.");
-                        was_full = 1;
-                        usleep(16);
-                        continue;
-                }
-
-                was_full = 0;
-                listenfd = -1;
-
                 /* Handle log rotation if it was requested */
                 if (received_sighup) {
 
@@ -130,7 +422,23 @@ void child_main_loop (void)
                         received_sighup = FALSE;
                 }
 
-                ret = mypoll(fds, nfds, -1);
+                if (!admit_client()) {
+                        if (!was_full)
+                                log_message (LOG_WARNING,
+                                             "Maximum number of connections reached. "
+                                             "Refusing new connections.");
+                        was_full = 1;
+                        continue;
+                }
+
+                was_full = 0;
+                listenfd = -1;
+
+                /*
+                 * With an admission queue, wake up every second to
+                 * turn away the clients that waited too long.
+                 */
+                ret = mypoll(fds, nfds, config->admission_queue ? 1 : -1);
 
                 if (ret == -1) {
                         if (errno == EINTR) {
@@ -140,6 +448,8 @@ void child_main_loop (void)
                                      strerror(errno));
                         continue;
                 } else if (ret == 0) {
+                        if (config->admission_queue)
+                                continue;
                         log_message (LOG_WARNING, "Strange: " SELECT_OR_POLL " returned 0 "
                                      "but we did not specify a timeout...");
                         continue;
@@ -181,76 +491,69 @@ void child_main_loop (void)
                         continue;
                 }
 
-                child = safecalloc(1, sizeof(struct child));
-                if (!child) {
-oom:
+                if (queue_client(connfd, &cliaddr_storage) < 0) {
                         close(connfd);
                         log_message (LOG_CRIT,
-                                     "Could not allocate memory for child.");
+                                     "Could not hand the connection to a thread.");
                         usleep(16); /* prevent 100% CPU usage in OOM situation */
                         continue;
                 }
-
-                child->done = 0;
-
-                if (!sblist_add(childs, &child)) {
-                        free(child);
-                        goto oom;
-                }
-
-                conn_struct_init(&child->conn);
-                child->conn.client_fd = connfd;
-
-                memcpy(&child->client.addr, &cliaddr_storage, sizeof(cliaddr_storage));
-
-                attrp = 0;
-                if (pthread_attr_init(&attr) == 0) {
-                        attrp = &attr;
-                        pthread_attr_setstacksize(attrp, 256*1024);
-                }
-
-                if (pthread_create(&child->thread, attrp, child_thread, child) != 0) {
-                        sblist_delete(childs, sblist_getsize(childs) -1);
-                        free(child);
-                        goto oom;
-		}
         }
 	safefree(fds);
 }
 
 /*
- * Go through all the non-empty children and cancel them.
+ * Wake up all the threads and wait for them to finish.
  */
 void child_kill_children (int sig)
 {
-	size_t i, tries = 0;
+	size_t tries = 0;
+	struct child *c;
+	unsigned int left;
 
 	if (sig != SIGTERM) return;
+
+	pthread_mutex_lock(&pool_lock);
 	log_message (LOG_INFO,
-	             "trying to bring down %zu threads...",
-	             sblist_getsize(childs)
+	             "trying to bring down %u threads...",
+	             nthreads
 	);
-
+	pthread_mutex_unlock(&pool_lock);
 
 again:
-	for (i = 0; i < sblist_getsize(childs); i++) {
-		struct child *c = *((struct child**)sblist_get(childs, i));
-		if (!c->done) pthread_kill(c->thread, SIGCHLD);
-	}
+	pthread_mutex_lock(&pool_lock);
+	pthread_cond_broadcast(&pool_cond);
+	for (c = childs; c; c = c->next)
+		if (c->busy) pthread_kill(c->thread, SIGCHLD);
+	pthread_mutex_unlock(&pool_lock);
 	usleep(8192);
-	collect_threads();
-	if (sblist_getsize(childs) != 0)
+	pthread_mutex_lock(&pool_lock);
+	left = nthreads;
+	pthread_mutex_unlock(&pool_lock);
+	if (left != 0)
 		if(tries++ < 8) goto again;
-	if (sblist_getsize(childs) != 0)
+	if (left != 0)
 		log_message (LOG_CRIT,
-		             "child_kill_children: %zu threads still alive!",
-		             sblist_getsize(childs)
+		             "child_kill_children: %u threads still alive!",
+		             left
 		);
 }
 
 void child_free_children(void) {
-	sblist_free(childs);
-	childs = 0;
+	struct client *cl;
+
+	pthread_mutex_lock(&pool_lock);
+	while ((cl = queue_head) != NULL) {
+		queue_head = cl->next;
+		close(cl->fd);
+		safefree(cl);
+	}
+	queue_tail = NULL;
+	while ((cl = free_clients) != NULL) {
+		free_clients = cl->next;
+		safefree(cl);
+	}
+	pthread_mutex_unlock(&pool_lock);
 }
 
 /**
@@ -272,13 +575,23 @@ int child_listening_sockets(sblist *listen_addrs, uint16_t port)
                 }
         }
 
+        if (config->reuseport) {
+#ifdef HAVE_SYS_EPOLL_H
+                if (config->ioengine != IOENGINE_THREADS)
+                        listen_copies = engine_worker_count ();
+                else
+#endif
+                        log_message (LOG_WARNING, "ReusePort only has an "
+                                     "effect with IOEngine epoll or io_uring");
+        }
+
         if (!listen_addrs || !sblist_getsize(listen_addrs))
         {
                 /*
                  * no Listen directive:
                  * listen on the wildcard address(es)
                  */
-                ret = listen_sock(NULL, port, listen_fds);
+                ret = listen_sock(NULL, port, listen_copies, listen_fds);
                 return ret;
         }
 
@@ -292,7 +605,7 @@ int child_listening_sockets(sblist *listen_addrs, uint16_t port)
                         continue;
                 }
 
-                ret = listen_sock(*addr, port, listen_fds);
+                ret = listen_sock(*addr, port, listen_copies, listen_fds);
                 if (ret != 0) {
                         return ret;
                 }
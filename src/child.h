@@ -37,6 +37,7 @@ extern void child_close_sock (void);
 extern void child_main_loop (void);
 extern void child_kill_children (int sig);
 extern void child_free_children(void);
+extern void child_shed_client(int fd);
 
 extern short int child_configure (child_config_t type, unsigned int val);
 
@@ -59,7 +59,40 @@ config_directive_find (register const char *str, register size_t len)
       {"basicauth", CD_basicauth},
       {"basicauthrealm", CD_basicauthrealm},
       {"addheader", CD_addheader},
-      {"maxrequestsperchild", CD_maxrequestsperchild}
+      {"maxrequestsperchild", CD_maxrequestsperchild},
+      {"ioengine", CD_ioengine},
+      {"workers", CD_workers},
+      {"reuseport", CD_reuseport},
+      {"admissionqueue", CD_admissionqueue},
+      {"admissiontimeout", CD_admissiontimeout},
+      {"splice", CD_splice},
+      {"clientreadchunk", CD_clientreadchunk},
+      {"serverreadchunk", CD_serverreadchunk},
+      {"adaptivereadchunk", CD_adaptivereadchunk},
+      {"bufferhighwater", CD_bufferhighwater},
+      {"bufferlowwater", CD_bufferlowwater},
+      {"maxkeepaliverequests", CD_maxkeepaliverequests},
+      {"keepalivetimeout", CD_keepalivetimeout},
+      {"originpoolsize", CD_originpoolsize},
+      {"originpoolperhost", CD_originpoolperhost},
+      {"originidletimeout", CD_originidletimeout},
+      {"upstreampoolsize", CD_upstreampoolsize},
+      {"upstreamidletimeout", CD_upstreamidletimeout},
+      {"fastreject", CD_fastreject},
+      {"rejectlinger", CD_rejectlinger},
+      {"dnscachesize", CD_dnscachesize},
+      {"dnsminttl", CD_dnsminttl},
+      {"dnsmaxttl", CD_dnsmaxttl},
+      {"dnsserver", CD_dnsserver},
+      {"connectattemptdelay", CD_connectattemptdelay},
+      {"headtimeout", CD_headtimeout},
+      {"dnstimeout", CD_dnstimeout},
+      {"connecttimeout", CD_connecttimeout},
+      {"handshaketimeout", CD_handshaketimeout},
+      {"responsetimeout", CD_responsetimeout},
+      {"bindrotation", CD_bindrotation},
+      {"fastopenconnect", CD_fastopenconnect},
+      {"fastopenlisten", CD_fastopenlisten}
     };
 
 	for(i=0;i<sizeof(wordlist)/sizeof(wordlist[0]);++i) {
@@ -20,6 +20,39 @@ CD_maxspareservers,
 CD_minspareservers,
 CD_startservers,
 CD_maxrequestsperchild,
+CD_ioengine,
+CD_workers,
+CD_reuseport,
+CD_admissionqueue,
+CD_admissiontimeout,
+CD_splice,
+CD_clientreadchunk,
+CD_serverreadchunk,
+CD_adaptivereadchunk,
+CD_bufferhighwater,
+CD_bufferlowwater,
+CD_maxkeepaliverequests,
+CD_keepalivetimeout,
+CD_originpoolsize,
+CD_originpoolperhost,
+CD_originidletimeout,
+CD_upstreampoolsize,
+CD_upstreamidletimeout,
+CD_fastreject,
+CD_rejectlinger,
+CD_dnscachesize,
+CD_dnsminttl,
+CD_dnsmaxttl,
+CD_dnsserver,
+CD_connectattemptdelay,
+CD_headtimeout,
+CD_dnstimeout,
+CD_connecttimeout,
+CD_handshaketimeout,
+CD_responsetimeout,
+CD_bindrotation,
+CD_fastopenconnect,
+CD_fastopenlisten,
 CD_timeout,
 CD_connectport,
 CD_user,
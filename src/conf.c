@@ -123,14 +123,31 @@ static HANDLE_FUNC (handle_disabled_feature)
 static HANDLE_FUNC (handle_allow);
 static HANDLE_FUNC (handle_basicauth);
 static HANDLE_FUNC (handle_basicauthrealm);
+static HANDLE_FUNC (handle_admissionqueue);
+static HANDLE_FUNC (handle_admissiontimeout);
 static HANDLE_FUNC (handle_anonymous);
 static HANDLE_FUNC (handle_bind);
+static HANDLE_FUNC (handle_bindrotation);
 static HANDLE_FUNC (handle_bindsame);
+static HANDLE_FUNC (handle_bufferhighwater);
+static HANDLE_FUNC (handle_bufferlowwater);
+static HANDLE_FUNC (handle_clientreadchunk);
+static HANDLE_FUNC (handle_connectattemptdelay);
 static HANDLE_FUNC (handle_connectport);
+static HANDLE_FUNC (handle_connecttimeout);
 static HANDLE_FUNC (handle_defaulterrorfile);
 static HANDLE_FUNC (handle_deny);
+static HANDLE_FUNC (handle_dnscachesize);
+static HANDLE_FUNC (handle_dnsmaxttl);
+static HANDLE_FUNC (handle_dnsminttl);
+static HANDLE_FUNC (handle_dnsserver);
+static HANDLE_FUNC (handle_dnstimeout);
 static HANDLE_FUNC (handle_errorfile);
+static HANDLE_FUNC (handle_adaptivereadchunk);
 static HANDLE_FUNC (handle_addheader);
+static HANDLE_FUNC (handle_fastopenconnect);
+static HANDLE_FUNC (handle_fastopenlisten);
+static HANDLE_FUNC (handle_fastreject);
 #ifdef FILTER_ENABLE
 static HANDLE_FUNC (handle_filter);
 static HANDLE_FUNC (handle_filtercasesensitive);
@@ -140,27 +157,46 @@ static HANDLE_FUNC (handle_filterurls);
 static HANDLE_FUNC (handle_filtertype);
 #endif
 static HANDLE_FUNC (handle_group);
+static HANDLE_FUNC (handle_handshaketimeout);
+static HANDLE_FUNC (handle_headtimeout);
+static HANDLE_FUNC (handle_ioengine);
+static HANDLE_FUNC (handle_keepalivetimeout);
 static HANDLE_FUNC (handle_listen);
 static HANDLE_FUNC (handle_logfile);
 static HANDLE_FUNC (handle_loglevel);
 static HANDLE_FUNC (handle_maxclients);
+static HANDLE_FUNC (handle_maxkeepaliverequests);
+static HANDLE_FUNC (handle_maxspareservers);
+static HANDLE_FUNC (handle_minspareservers);
 static HANDLE_FUNC (handle_obsolete);
+static HANDLE_FUNC (handle_originidletimeout);
+static HANDLE_FUNC (handle_originpoolperhost);
+static HANDLE_FUNC (handle_originpoolsize);
 static HANDLE_FUNC (handle_pidfile);
 static HANDLE_FUNC (handle_port);
+static HANDLE_FUNC (handle_rejectlinger);
+static HANDLE_FUNC (handle_responsetimeout);
+static HANDLE_FUNC (handle_reuseport);
 #ifdef REVERSE_SUPPORT
 static HANDLE_FUNC (handle_reversebaseurl);
 static HANDLE_FUNC (handle_reversemagic);
 static HANDLE_FUNC (handle_reverseonly);
 static HANDLE_FUNC (handle_reversepath);
 #endif
+static HANDLE_FUNC (handle_serverreadchunk);
+static HANDLE_FUNC (handle_splice);
+static HANDLE_FUNC (handle_startservers);
 static HANDLE_FUNC (handle_statfile);
 static HANDLE_FUNC (handle_stathost);
 static HANDLE_FUNC (handle_syslog);
 static HANDLE_FUNC (handle_timeout);
+static HANDLE_FUNC (handle_upstreamidletimeout);
+static HANDLE_FUNC (handle_upstreampoolsize);
 
 static HANDLE_FUNC (handle_user);
 static HANDLE_FUNC (handle_viaproxyname);
 static HANDLE_FUNC (handle_disableviaheader);
+static HANDLE_FUNC (handle_workers);
 static HANDLE_FUNC (handle_xtinyproxy);
 
 #ifdef UPSTREAM_SUPPORT
@@ -210,10 +246,41 @@ struct {
         /* integer arguments */
         STDCONF (port, INT, handle_port),
         STDCONF (maxclients, INT, handle_maxclients),
-        STDCONF (maxspareservers, INT, handle_obsolete),
-        STDCONF (minspareservers, INT, handle_obsolete),
-        STDCONF (startservers, INT, handle_obsolete),
+        STDCONF (maxspareservers, INT, handle_maxspareservers),
+        STDCONF (minspareservers, INT, handle_minspareservers),
+        STDCONF (startservers, INT, handle_startservers),
         STDCONF (maxrequestsperchild, INT, handle_obsolete),
+        STDCONF (ioengine, "(threads|epoll|io_uring)", handle_ioengine),
+        STDCONF (workers, INT, handle_workers),
+        STDCONF (reuseport, BOOL, handle_reuseport),
+        STDCONF (admissionqueue, INT, handle_admissionqueue),
+        STDCONF (admissiontimeout, INT, handle_admissiontimeout),
+        STDCONF (splice, BOOL, handle_splice),
+        STDCONF (clientreadchunk, INT, handle_clientreadchunk),
+        STDCONF (serverreadchunk, INT, handle_serverreadchunk),
+        STDCONF (adaptivereadchunk, BOOL, handle_adaptivereadchunk),
+        STDCONF (bufferhighwater, INT, handle_bufferhighwater),
+        STDCONF (bufferlowwater, INT, handle_bufferlowwater),
+        STDCONF (maxkeepaliverequests, INT, handle_maxkeepaliverequests),
+        STDCONF (keepalivetimeout, INT, handle_keepalivetimeout),
+        STDCONF (originpoolsize, INT, handle_originpoolsize),
+        STDCONF (originpoolperhost, INT, handle_originpoolperhost),
+        STDCONF (originidletimeout, INT, handle_originidletimeout),
+        STDCONF (upstreampoolsize, INT, handle_upstreampoolsize),
+        STDCONF (upstreamidletimeout, INT, handle_upstreamidletimeout),
+        STDCONF (fastreject, BOOL, handle_fastreject),
+        STDCONF (rejectlinger, INT, handle_rejectlinger),
+        STDCONF (dnscachesize, INT, handle_dnscachesize),
+        STDCONF (dnsminttl, INT, handle_dnsminttl),
+        STDCONF (dnsmaxttl, INT, handle_dnsmaxttl),
+        STDCONF (connectattemptdelay, INT, handle_connectattemptdelay),
+        STDCONF (headtimeout, INT, handle_headtimeout),
+        STDCONF (dnstimeout, INT, handle_dnstimeout),
+        STDCONF (connecttimeout, INT, handle_connecttimeout),
+        STDCONF (handshaketimeout, INT, handle_handshaketimeout),
+        STDCONF (responsetimeout, INT, handle_responsetimeout),
+        STDCONF (fastopenconnect, BOOL, handle_fastopenconnect),
+        STDCONF (fastopenlisten, INT, handle_fastopenlisten),
         STDCONF (timeout, INT, handle_timeout),
         STDCONF (connectport, INT, handle_connectport),
         /* alphanumeric arguments */
@@ -226,6 +293,9 @@ struct {
         STDCONF (deny, "(" "(" IPMASK "|" IPV6MASK ")" "|" ALNUM ")",
                  handle_deny),
         STDCONF (bind, "(" IP "|" IPV6 ")", handle_bind),
+        STDCONF (bindrotation, "(order|roundrobin|hash)", handle_bindrotation),
+        STDCONF (dnsserver, "(" IP "|" IPV6 ")" "(" WS INT ")?",
+                 handle_dnsserver),
         /* other */
         STDCONF (basicauth, USERNAME WS PASSWORD, handle_basicauth),
         STDCONF (errorfile, INT WS STR, handle_errorfile),
@@ -304,6 +374,7 @@ void free_config (struct config_s *conf)
         stringlist_free(conf->basicauth_list);
         stringlist_free(conf->listen_addrs);
         stringlist_free(conf->bind_addrs);
+        stringlist_free(conf->dns_servers);
 #ifdef FILTER_ENABLE
         safefree (conf->filter);
 #endif                          /* FILTER_ENABLE */
@@ -490,6 +561,35 @@ static void initialize_config_defaults (struct config_s *conf)
         conf->logf_name = NULL;
         conf->pidpath = NULL;
         conf->maxclients = 100;
+        conf->startservers = 10;
+        conf->minspareservers = 5;
+        conf->maxspareservers = 20;
+        conf->admission_timeout = 10;
+#ifdef HAVE_SPLICE
+        conf->splice = 1;
+#endif
+        conf->client_read_chunk = 16384;
+        conf->server_read_chunk = 16384;
+        conf->adaptive_read_chunk = 1;
+        conf->buffer_high_water = MAXBUFFSIZE;
+        conf->buffer_low_water = MAXBUFFSIZE / 2;
+        conf->max_keepalive_requests = 100;
+        conf->keepalive_timeout = 0;
+        conf->origin_pool_size = 64;
+        conf->origin_pool_per_host = 8;
+        conf->origin_idle_timeout = 15;
+        conf->upstream_pool_size = 8;
+        conf->upstream_idle_timeout = 30;
+        conf->reject_linger = 1;
+        conf->dns_cache_size = 1024;
+        conf->dns_min_ttl = 5;
+        conf->dns_max_ttl = 3600;
+        conf->connect_attempt_delay = 250;
+        conf->head_timeout = 30;
+        conf->dns_timeout = 10;
+        conf->connect_timeout = 10;
+        conf->handshake_timeout = 10;
+        conf->response_timeout = 0;
 }
 
 /**
@@ -620,6 +720,30 @@ set_int_arg (unsigned int *var, const char *line, regmatch_t * match)
         return 0;
 }
 
+/*
+ * Read the size of a buffer related setting, keeping it within what the
+ * relay buffers can hold.
+ */
+static int
+set_buffer_size_arg (unsigned int *var, const char *line,
+                     regmatch_t * match, unsigned long lineno, size_t lowest)
+{
+        int r = set_int_arg (var, line, match);
+
+        if (r)
+                return r;
+        if (*var < lowest) {
+                CP_WARN ("Raising buffer setting to %lu bytes",
+                         (unsigned long) lowest);
+                *var = lowest;
+        } else if (*var > MAXBUFFSIZE) {
+                CP_WARN ("Lowering buffer setting to %lu bytes",
+                         (unsigned long) MAXBUFFSIZE);
+                *var = MAXBUFFSIZE;
+        }
+        return 0;
+}
+
 /***********************************************************************
  *
  * Below are all the directive handling functions.  You will notice
@@ -761,6 +885,31 @@ static HANDLE_FUNC (handle_maxclients)
         return 0;
 }
 
+static HANDLE_FUNC (handle_maxspareservers)
+{
+        return set_int_arg (&conf->maxspareservers, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_minspareservers)
+{
+        return set_int_arg (&conf->minspareservers, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_startservers)
+{
+        return set_int_arg (&conf->startservers, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_admissionqueue)
+{
+        return set_int_arg (&conf->admission_queue, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_admissiontimeout)
+{
+        return set_int_arg (&conf->admission_timeout, line, &match[2]);
+}
+
 static HANDLE_FUNC (handle_obsolete)
 {
         fprintf (stderr, "WARNING: obsolete config item on line %lu\n",
@@ -768,6 +917,202 @@ static HANDLE_FUNC (handle_obsolete)
         return 0;
 }
 
+static HANDLE_FUNC (handle_ioengine)
+{
+        char *engine = get_string_arg (line, &match[2]);
+        if (!engine) return -1;
+
+        if (!strcasecmp (engine, "epoll")) {
+#ifdef HAVE_SYS_EPOLL_H
+                conf->ioengine = IOENGINE_EPOLL;
+#else
+                CP_WARN ("IOEngine %s is not available on this platform, "
+                         "using threads", engine);
+                conf->ioengine = IOENGINE_THREADS;
+#endif
+        } else if (!strcasecmp (engine, "io_uring")) {
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_LINUX_IO_URING_H)
+                conf->ioengine = IOENGINE_URING;
+#elif defined(HAVE_SYS_EPOLL_H)
+                CP_WARN ("IOEngine %s is not available on this platform, "
+                         "using epoll", engine);
+                conf->ioengine = IOENGINE_EPOLL;
+#else
+                CP_WARN ("IOEngine %s is not available on this platform, "
+                         "using threads", engine);
+                conf->ioengine = IOENGINE_THREADS;
+#endif
+        } else
+                conf->ioengine = IOENGINE_THREADS;
+
+        safefree (engine);
+        return 0;
+}
+
+static HANDLE_FUNC (handle_workers)
+{
+        return set_int_arg (&conf->workers, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_reuseport)
+{
+        int r = set_bool_arg (&conf->reuseport, line, &match[2]);
+
+        if (r)
+                return r;
+#ifndef SO_REUSEPORT
+        if (conf->reuseport) {
+                CP_WARN ("%s", "ReusePort is not supported on this platform");
+                conf->reuseport = 0;
+        }
+#endif
+        return 0;
+}
+
+static HANDLE_FUNC (handle_splice)
+{
+        int r = set_bool_arg (&conf->splice, line, &match[2]);
+
+        if (r)
+                return r;
+#ifndef HAVE_SPLICE
+        if (conf->splice) {
+                CP_WARN ("%s", "Splice is not supported on this platform");
+                conf->splice = 0;
+        }
+#endif
+        return 0;
+}
+
+static HANDLE_FUNC (handle_clientreadchunk)
+{
+        return set_buffer_size_arg (&conf->client_read_chunk, line,
+                                    &match[2], lineno, MINREADCHUNK);
+}
+
+static HANDLE_FUNC (handle_serverreadchunk)
+{
+        return set_buffer_size_arg (&conf->server_read_chunk, line,
+                                    &match[2], lineno, MINREADCHUNK);
+}
+
+static HANDLE_FUNC (handle_adaptivereadchunk)
+{
+        return set_bool_arg (&conf->adaptive_read_chunk, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_bufferhighwater)
+{
+        return set_buffer_size_arg (&conf->buffer_high_water, line,
+                                    &match[2], lineno, MINREADCHUNK);
+}
+
+static HANDLE_FUNC (handle_bufferlowwater)
+{
+        return set_buffer_size_arg (&conf->buffer_low_water, line,
+                                    &match[2], lineno, 0);
+}
+
+static HANDLE_FUNC (handle_maxkeepaliverequests)
+{
+        return set_int_arg (&conf->max_keepalive_requests, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_keepalivetimeout)
+{
+        return set_int_arg (&conf->keepalive_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_originpoolsize)
+{
+        return set_int_arg (&conf->origin_pool_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_originpoolperhost)
+{
+        return set_int_arg (&conf->origin_pool_per_host, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_originidletimeout)
+{
+        return set_int_arg (&conf->origin_idle_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_upstreampoolsize)
+{
+        return set_int_arg (&conf->upstream_pool_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_upstreamidletimeout)
+{
+        return set_int_arg (&conf->upstream_idle_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_fastopenconnect)
+{
+        return set_bool_arg (&conf->fastopen_connect, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_fastopenlisten)
+{
+        return set_int_arg (&conf->fastopen_listen, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_fastreject)
+{
+        return set_bool_arg (&conf->fast_reject, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_rejectlinger)
+{
+        return set_int_arg (&conf->reject_linger, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnscachesize)
+{
+        return set_int_arg (&conf->dns_cache_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnsminttl)
+{
+        return set_int_arg (&conf->dns_min_ttl, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnsmaxttl)
+{
+        return set_int_arg (&conf->dns_max_ttl, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_connectattemptdelay)
+{
+        return set_int_arg (&conf->connect_attempt_delay, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_headtimeout)
+{
+        return set_int_arg (&conf->head_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnstimeout)
+{
+        return set_int_arg (&conf->dns_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_connecttimeout)
+{
+        return set_int_arg (&conf->connect_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_handshaketimeout)
+{
+        return set_int_arg (&conf->handshake_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_responsetimeout)
+{
+        return set_int_arg (&conf->response_timeout, line, &match[2]);
+}
+
 static HANDLE_FUNC (handle_timeout)
 {
         return set_int_arg (&conf->idletimeout, line, &match[2]);
@@ -840,6 +1185,64 @@ static HANDLE_FUNC (handle_bind)
         return 0;
 }
 
+static HANDLE_FUNC (handle_bindrotation)
+{
+        char *arg = get_string_arg (line, &match[2]);
+        if (!arg) return -1;
+
+        if (!strcasecmp (arg, "roundrobin"))
+                conf->bind_rotation = BIND_ROUNDROBIN;
+        else if (!strcasecmp (arg, "hash"))
+                conf->bind_rotation = BIND_HASH;
+        else
+                conf->bind_rotation = BIND_ORDER;
+
+        safefree (arg);
+        return 0;
+}
+
+static HANDLE_FUNC (handle_dnsserver)
+{
+        char *arg, *addr = get_string_arg (line, &match[2]);
+        long port = 53;
+
+        if (addr == NULL)
+                return -1;
+
+        /* match[17]: the port, if one is given */
+        if (match[17].rm_so != -1)
+                port = get_long_arg (line, &match[17]);
+        if (port <= 0 || port > 65535) {
+                CP_WARN ("Invalid port for DnsServer %s.", addr);
+                safefree (addr);
+                return -1;
+        }
+
+        arg = (char *) safemalloc (strlen (addr) + 7);
+        if (arg == NULL) {
+                safefree (addr);
+                return -1;
+        }
+        sprintf (arg, "%s %ld", addr, port);
+        safefree (addr);
+
+        if (conf->dns_servers == NULL) {
+               conf->dns_servers = sblist_new(sizeof(char*), 4);
+               if (conf->dns_servers == NULL) {
+                       CP_WARN ("Could not create a list "
+                                   "of name servers.", "");
+                       safefree(arg);
+                       return -1;
+               }
+        }
+
+        sblist_add (conf->dns_servers, &arg);
+
+        log_message(LOG_INFO, "Added name server [%s].", arg);
+
+        return 0;
+}
+
 static HANDLE_FUNC (handle_listen)
 {
         char *arg = get_string_arg (line, &match[2]);
@@ -34,6 +34,25 @@ typedef struct {
         char *value;
 } http_header_t;
 
+/*
+ * The ways connections can be serviced (see the IOEngine directive.)
+ */
+enum io_engine {
+        IOENGINE_THREADS = 0,   /* one thread per connection */
+        IOENGINE_EPOLL,         /* event loop workers (engine.c) */
+        IOENGINE_URING          /* the same, driven by io_uring */
+};
+
+/*
+ * How the source of an outgoing connection is picked among the Bind
+ * addresses (see the BindRotation directive.)
+ */
+enum bind_rotation {
+        BIND_ORDER = 0,         /* the first one that works */
+        BIND_ROUNDROBIN,        /* each one in turn */
+        BIND_HASH               /* by the address of the server */
+};
+
 /*
  * Hold all the configuration time information.
  */
@@ -46,6 +65,44 @@ struct config_s {
         char *stathost;
         unsigned int quit;      /* boolean */
         unsigned int maxclients;
+        unsigned int startservers;      /* threads created at startup */
+        unsigned int minspareservers;   /* idle threads kept around */
+        unsigned int maxspareservers;   /* idle threads beyond this exit */
+        unsigned int admission_queue;   /* clients waiting beyond maxclients */
+        unsigned int admission_timeout; /* seconds they may wait */
+        unsigned int ioengine;  /* enum io_engine */
+        unsigned int workers;   /* event loop threads, 0 = one per CPU */
+        unsigned int reuseport; /* boolean */
+        unsigned int splice;    /* boolean */
+        unsigned int client_read_chunk; /* bytes read from a client at once */
+        unsigned int server_read_chunk; /* bytes read from a server at once */
+        unsigned int adaptive_read_chunk;       /* boolean */
+        unsigned int buffer_high_water; /* stop reading at this many bytes */
+        unsigned int buffer_low_water;  /* resume reading below this */
+        unsigned int max_keepalive_requests;    /* per client, 0 = no limit */
+        unsigned int keepalive_timeout; /* seconds between two requests */
+        unsigned int origin_pool_size;  /* idle server connections, 0 = off */
+        unsigned int origin_pool_per_host;      /* per server, 0 = no limit */
+        unsigned int origin_idle_timeout;       /* seconds they are kept */
+        unsigned int upstream_pool_size;        /* per upstream, 0 = off */
+        unsigned int upstream_idle_timeout;     /* seconds they are kept */
+        unsigned int fast_reject;       /* boolean */
+        unsigned int reject_linger;     /* seconds to wait for the client */
+        unsigned int dns_cache_size;    /* names cached, 0 = off */
+        unsigned int dns_min_ttl;       /* seconds an answer is kept at least */
+        unsigned int dns_max_ttl;       /* seconds it is kept at most */
+        sblist *dns_servers;    /* "address port" of each DnsServer */
+        unsigned int connect_attempt_delay;     /* ms before trying the
+                                                   next address, 0 = after
+                                                   the last one failed */
+        unsigned int head_timeout;      /* seconds for each phase, */
+        unsigned int dns_timeout;       /* 0 = Timeout */
+        unsigned int connect_timeout;
+        unsigned int handshake_timeout;
+        unsigned int response_timeout;
+        unsigned int fastopen_connect;  /* boolean */
+        unsigned int fastopen_listen;   /* TFO queue of the listening
+                                           sockets, 0 = off */
         char *user;
         char *group;
         sblist *listen_addrs;
@@ -68,6 +125,7 @@ struct config_s {
         char *pidpath;
         unsigned int idletimeout;
         sblist *bind_addrs;
+        unsigned int bind_rotation;     /* enum bind_rotation */
         unsigned int bindsame;
 
         /*
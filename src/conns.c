@@ -25,15 +25,19 @@
 #include "main.h"
 
 #include "buffer.h"
+#include "conf.h"
 #include "conns.h"
 #include "heap.h"
 #include "log.h"
+#include "pool.h"
 #include "stats.h"
 
 void conn_struct_init(struct conn_s *connptr) {
         connptr->error_number = -1;
         connptr->client_fd = -1;
         connptr->server_fd = -1;
+        connptr->c2s_pipe[0] = connptr->c2s_pipe[1] = -1;
+        connptr->s2c_pipe[0] = connptr->s2c_pipe[1] = -1;
         /* There is _no_ content length initially */
         connptr->content_length.server = connptr->content_length.client = -1;
 }
@@ -54,6 +58,15 @@ int conn_init_contents (struct conn_s *connptr, const char *ipaddr,
         if (!cbuffer || !sbuffer)
                 goto error_exit;
 
+        buffer_set_read_chunk (cbuffer, config->client_read_chunk,
+                               config->adaptive_read_chunk);
+        buffer_set_read_chunk (sbuffer, config->server_read_chunk,
+                               config->adaptive_read_chunk);
+        buffer_set_watermarks (cbuffer, config->buffer_low_water,
+                               config->buffer_high_water);
+        buffer_set_watermarks (sbuffer, config->buffer_low_water,
+                               config->buffer_high_water);
+
         connptr->cbuffer = cbuffer;
         connptr->sbuffer = sbuffer;
 
@@ -77,6 +90,66 @@ error_exit:
         return 0;
 }
 
+/*
+ * Close the splice() pipes, if any.  Whatever they still hold is lost.
+ */
+void conn_close_pipes (struct conn_s *connptr)
+{
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                if (connptr->c2s_pipe[i] != -1)
+                        close (connptr->c2s_pipe[i]);
+                if (connptr->s2c_pipe[i] != -1)
+                        close (connptr->s2c_pipe[i]);
+                connptr->c2s_pipe[i] = connptr->s2c_pipe[i] = -1;
+        }
+        connptr->c2s_len = connptr->s2c_len = 0;
+}
+
+/*
+ * Forget about the request just served, and the server it went to, so
+ * that the next request of a keep-alive client starts afresh.  What the
+ * client sent past that request stays in the readahead buffer.
+ */
+void conn_reset_request (struct conn_s *connptr)
+{
+        if (connptr->server_fd != -1)
+                close (connptr->server_fd);
+        connptr->server_fd = -1;
+
+        conn_close_pipes (connptr);
+        buffer_trim (connptr->cbuffer, buffer_size (connptr->cbuffer));
+        buffer_trim (connptr->sbuffer, buffer_size (connptr->sbuffer));
+        readahead_release (&connptr->sreadahead);
+
+        pool_free (connptr->request_head);
+        connptr->request_head = connptr->request_line = NULL;
+
+#ifdef REVERSE_SUPPORT
+        if (connptr->reversepath)
+                safefree (connptr->reversepath);
+#endif
+
+        connptr->connect_method = connptr->show_stats = FALSE;
+        connptr->got_headers = FALSE;
+        connptr->content_length.server = connptr->content_length.client = -1;
+        connptr->response_chunked = FALSE;
+        memset (&connptr->schunked, 0, sizeof (connptr->schunked));
+        memset (&connptr->cchunked, 0, sizeof (connptr->cchunked));
+        connptr->expect_continue = FALSE;
+        connptr->keep_alive = FALSE;
+        connptr->server_keep_alive = connptr->server_reused = FALSE;
+        connptr->server_fastopen = FALSE;
+        if (connptr->retry_head)
+                safefree (connptr->retry_head);
+        if (connptr->socks)
+                safefree (connptr->socks);
+        connptr->protocol.major = connptr->protocol.minor = 0;
+        connptr->upstream_proxy = NULL;
+        connptr->requests++;
+}
+
 void conn_destroy_contents (struct conn_s *connptr)
 {
         assert (connptr != NULL);
@@ -92,13 +165,22 @@ void conn_destroy_contents (struct conn_s *connptr)
                                      connptr->server_fd, strerror (errno));
         connptr->server_fd = -1;
 
+        conn_close_pipes (connptr);
+
         if (connptr->cbuffer)
                 delete_buffer (connptr->cbuffer);
         if (connptr->sbuffer)
                 delete_buffer (connptr->sbuffer);
-
-        if (connptr->request_line)
-                safefree (connptr->request_line);
+        readahead_release (&connptr->creadahead);
+        readahead_release (&connptr->sreadahead);
+        outvec_free (&connptr->outhead);
+        if (connptr->retry_head)
+                safefree (connptr->retry_head);
+        if (connptr->socks)
+                safefree (connptr->socks);
+
+        pool_free (connptr->request_head);
+        connptr->request_head = connptr->request_line = NULL;
 
         if (connptr->error_variables) {
                 char *k;
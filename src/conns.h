@@ -23,10 +23,18 @@
 
 #include "main.h"
 #include "hsearch.h"
+#include "http-chunked.h"
+#include "network.h"
+#include "pseudomap.h"
+#include "timers.h"
+
+struct request_s;
 
 /*
  * Connection Definition
  */
+struct upstream_socks;
+
 struct conn_s {
         int client_fd;
         int server_fd;
@@ -34,12 +42,38 @@ struct conn_s {
         struct buffer_s *cbuffer;
         struct buffer_s *sbuffer;
 
-        /* The request line (first line) from the client */
+        /*
+         * What has been read from the client and the server while
+         * reading their heads line by line, and not consumed yet.
+         */
+        struct readahead_s creadahead, sreadahead;
+
+        /* The request head being put together for the server */
+        struct outvec_s outhead;
+
+        /*
+         * Pipes for relaying a tunnel with splice(), client to server
+         * and server to client, and the number of bytes held in each.
+         * The descriptors are -1 unless splice() is in use.
+         */
+        int c2s_pipe[2], s2c_pipe[2];
+        size_t c2s_len, s2c_len;
+
+        /*
+         * The request head from the client, and the request line (first
+         * line) within it.  The client's headers point into it as well.
+         */
+        char *request_head;
         char *request_line;
 
+        /* The parsed request and the client's headers */
+        struct request_s *request;
+        pseudomap *headers;
+
         /* Booleans */
         unsigned int connect_method;
         unsigned int show_stats;
+        unsigned int got_headers;
 
         /*
          * This structure stores key -> value mappings for substitution
@@ -50,12 +84,66 @@ struct conn_s {
         int error_number;
         char *error_string;
 
-        /* A Content-Length value from the remote server */
+        /*
+         * The Content-Length of the response, and what is left of it
+         * to relay.  For the request, what is left of its body to
+         * relay, or -2 if the body comes in chunks.
+         */
         struct {
                 long int server;
                 long int client;
         } content_length;
 
+        /*
+         * Whether the response to this request is relayed in chunks,
+         * and how far into them the relay of the response and of a
+         * chunked request body is.
+         */
+        unsigned int response_chunked;
+        struct chunked_s schunked, cchunked;
+
+        /*
+         * Whether the client holds its request body back until it is
+         * told to go on with a 100 Continue.  Should the server give its
+         * final answer first, this stays set and the body is not
+         * relayed at all.
+         */
+        unsigned int expect_continue;
+
+        /*
+         * Keep-alive: whether the client may send another request over
+         * this connection once the response is through, and how many
+         * requests it has sent before this one.
+         */
+        unsigned int keep_alive;
+        unsigned int requests;
+
+        /*
+         * Whether the server connection may go back to the origin pool
+         * once the response is through, and whether it came out of it.
+         * Should a pooled connection turn out to be closed, the request
+         * head is kept to be sent again on a new one.  A new one opened
+         * with FastOpenConnect is checked for its use of TCP Fast Open
+         * once it is done with.
+         */
+        unsigned int server_keep_alive;
+        unsigned int server_reused;
+        unsigned int server_fastopen;
+        char *retry_head;
+        size_t retry_len;
+
+        /*
+         * The handshake with a SOCKS upstream proxy, while it waits for
+         * the proxy's replies (see reqs.c.)
+         */
+        struct upstream_socks *socks;
+
+        /*
+         * The deadline of the phase the connection is in, in the
+         * "threads" model (see timers.c.)
+         */
+        struct timer_entry deadline;
+
         /*
          * Store the server's IP (for BindSame)
          */
@@ -94,6 +182,8 @@ extern void conn_struct_init(struct conn_s *connptr);
 /* second stage initializiation, sets up buffers and connection details */
 extern int conn_init_contents (struct conn_s *connptr, const char *ipaddr,
                                        const char *sock_ipaddr);
+extern void conn_close_pipes (struct conn_s *connptr);
+extern void conn_reset_request (struct conn_s *connptr);
 extern void conn_destroy_contents (struct conn_s *connptr);
 
 #endif
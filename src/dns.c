@@ -0,0 +1,1355 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Name lookups for the servers we connect to.  Instead of leaving them
+ * to getaddrinfo(), which blocks the thread (or the whole engine
+ * worker) for as long as the name server takes, the names are looked up
+ * by a small stub resolver of our own: a "dns_client" sends the A and
+ * AAAA questions over UDP to the name servers (DnsServer, or those of
+ * /etc/resolv.conf), keeps any number of lookups going at once, and
+ * reports each one through a callback when its answers are in.  Every
+ * engine worker has a client of its own and watches its sockets along
+ * with the connections; a thread of the "threads" model sets up a
+ * short-lived one and waits for it.
+ *
+ * An answer is only taken if it comes back on the socket the question
+ * went out on and carries its ID.  So that these are hard to guess for
+ * anyone who would slip a forged answer into the cache, each lookup has
+ * a socket of its own (a new one for each server it asks), which the
+ * kernel binds to a random port, and each question an ID drawn from
+ * /dev/urandom.  A truncated answer counts as none: the next server is
+ * asked, and nothing is cached.
+ *
+ * The answers go into a cache shared by all threads and workers, split
+ * into shards with a lock each so that they seldom wait for one
+ * another.  An entry is kept for as long as the TTL of the answer says,
+ * within DnsMinTTL and DnsMaxTTL; names which do not resolve are kept
+ * as well, for the TTL the name server gave for that.  Each shard drops
+ * its least recently used entries beyond its part of DnsCacheSize.
+ *
+ * Numeric addresses and the names in /etc/hosts are answered straight
+ * away.  Names without a dot (which the search list of resolv.conf may
+ * apply to), and all names when there is no name server to ask, are
+ * still left to getaddrinfo().
+ */
+
+#include "main.h"
+
+#include "dns.h"
+#include "conf.h"
+#include "heap.h"
+#include "log.h"
+#include "mypoll.h"
+#include "sock.h"
+#include "stats.h"
+#include "timers.h"
+#include <pthread.h>
+
+#define DNS_SHARDS      16
+#define DNS_BUCKETS     64      /* hash chains per shard */
+#define DNS_MAX_ADDRS   8       /* addresses kept per name */
+#define DNS_NAME_MAX    253
+#define DNS_PACKET_MAX  4096
+#define DNS_TIMEOUT     2       /* seconds before asking the next server */
+#define DNS_ATTEMPTS    2       /* times each server is asked */
+#define DNS_RECHECK     5       /* seconds between looks at the system files */
+
+#define DNS_TYPE_A      1
+#define DNS_TYPE_SOA    6
+#define DNS_TYPE_AAAA   28
+
+#define DNS_GET32(P) ((unsigned long) (P)[0] << 24 \
+                      | (unsigned long) (P)[1] << 16 \
+                      | (unsigned long) (P)[2] << 8 | (P)[3])
+
+struct dns_addr {
+        int family;
+        unsigned char addr[16];
+};
+
+struct dns_entry {
+        struct dns_entry *chain;        /* next in the hash chain */
+        struct dns_entry *prev, *next;  /* most recently used first */
+        char *host;
+        unsigned long hash;
+        time_t expires;
+        unsigned int naddrs;            /* 0: the name does not resolve */
+        struct dns_addr addrs[DNS_MAX_ADDRS];
+};
+
+struct dns_shard {
+        pthread_mutex_t lock;
+        struct dns_entry *buckets[DNS_BUCKETS];
+        struct dns_entry *first, *last;
+        unsigned long count;
+};
+
+/*
+ * Someone waiting for a lookup, and the port they want to connect to.
+ */
+struct dns_waiter {
+        struct dns_waiter *next;
+        void *waiter;
+        int port;
+};
+
+/*
+ * A name being looked up: an A and an AAAA question, asked of one
+ * server after the other until both are answered.
+ */
+struct dns_query {
+        struct dns_query *next;
+        char *host;
+        unsigned long hash;
+        unsigned short id[2];           /* of the A and the AAAA question */
+        unsigned int pending;           /* bit 0: A, bit 1: AAAA */
+        int slot;                       /* of its socket, -1: none */
+        unsigned int waiting;           /* boolean: for a socket to be free */
+        union sockaddr_union servers[DNS_MAX_SERVERS];
+        unsigned int nservers;
+        unsigned int server;            /* the server asked last */
+        unsigned int tries;
+        time_t resend;                  /* when the next server is asked */
+        struct timeval started;
+        unsigned long ttl;
+        unsigned int naddrs[2];
+        struct dns_addr addrs[2][DNS_MAX_ADDRS];
+        struct dns_waiter *waiters;
+};
+
+struct dns_client {
+        int fds[DNS_MAX_SOCKETS];       /* of the lookups, -1: free */
+        dns_done_func done;
+        dns_watch_func watch;
+        void *data;
+        struct dns_query *queries;
+        unsigned char random[64];       /* from /dev/urandom */
+        unsigned int nrandom;           /* bytes of it not used yet */
+};
+
+/*
+ * What one of the system files looked like when it was read.
+ */
+struct dns_file {
+        const char *path;
+        time_t mtime;
+        off_t size;
+        ino_t ino;
+};
+
+struct dns_host {
+        struct dns_host *next;
+        char *name;
+        struct dns_addr addr;
+};
+
+static struct dns_shard shards[DNS_SHARDS];
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+
+static int dns_urandom = -1;
+
+/* what the system files say, reread when they change */
+static pthread_mutex_t dns_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t dns_files_checked;
+static struct dns_file hosts_file = { "/etc/hosts", 0, 0, 0 };
+static struct dns_file resolv_file = { "/etc/resolv.conf", 0, 0, 0 };
+static struct dns_host *hosts;
+static union sockaddr_union resolv_servers[DNS_MAX_SERVERS];
+static unsigned int resolv_nservers;
+
+static pthread_mutex_t dns_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long dns_hits, dns_misses, dns_msec, dns_lookups;
+
+/*
+ * Parse a numeric address, IPv4 or IPv6.  Returns 1 if it is one.
+ */
+static int dns_numeric (const char *host, struct dns_addr *a)
+{
+        memset (a, 0, sizeof (*a));
+        if (inet_pton (AF_INET, host, a->addr) == 1) {
+                a->family = AF_INET;
+                return 1;
+        }
+        if (inet_pton (AF_INET6, host, a->addr) == 1) {
+                a->family = AF_INET6;
+                return 1;
+        }
+        return 0;
+}
+
+/*
+ * Parse a name server address, with an optional port after a space.
+ */
+static int dns_server_addr (const char *s, union sockaddr_union *sa)
+{
+        char buf[64];
+        const char *port;
+        struct dns_addr a;
+        size_t len;
+        int p = 53;
+
+        port = strchr (s, ' ');
+        len = port ? (size_t) (port - s) : strlen (s);
+        if (len >= sizeof (buf))
+                return -1;
+        memcpy (buf, s, len);
+        buf[len] = '\0';
+        if (port) {
+                p = atoi (port + 1);
+                if (p <= 0 || p > 65535)
+                        return -1;
+        }
+
+        if (!dns_numeric (buf, &a))
+                return -1;
+
+        memset (sa, 0, sizeof (*sa));
+        if (a.family == AF_INET) {
+                sa->v4.sin_family = AF_INET;
+                sa->v4.sin_port = htons ((unsigned short) p);
+                memcpy (&sa->v4.sin_addr, a.addr, 4);
+        } else {
+                sa->v6.sin6_family = AF_INET6;
+                sa->v6.sin6_port = htons ((unsigned short) p);
+                memcpy (&sa->v6.sin6_addr, a.addr, 16);
+        }
+        return 0;
+}
+
+/*
+ * The next word of a line from one of the system files, or NULL at the
+ * end of the line.
+ */
+static char *dns_word (char **line)
+{
+        char *word = *line + strspn (*line, " \t\r\n");
+
+        if (*word == '\0')
+                return NULL;
+        *line = word + strcspn (word, " \t\r\n");
+        if (**line != '\0')
+                *(*line)++ = '\0';
+        return word;
+}
+
+static void dns_load_hosts (void)
+{
+        char line[1024], *p, *addr, *name;
+        struct dns_addr a;
+        struct dns_host *h;
+        FILE *f;
+
+        while ((h = hosts) != NULL) {
+                hosts = h->next;
+                safefree (h->name);
+                safefree (h);
+        }
+
+        f = fopen (hosts_file.path, "r");
+        if (!f)
+                return;
+
+        while (fgets (line, sizeof (line), f)) {
+                if ((p = strchr (line, '#')) != NULL)
+                        *p = '\0';
+                p = line;
+                addr = dns_word (&p);
+                if (!addr || !dns_numeric (addr, &a))
+                        continue;
+                while ((name = dns_word (&p)) != NULL) {
+                        h = (struct dns_host *) safecalloc (1, sizeof (*h));
+                        if (!h || !(h->name = safestrdup (name))) {
+                                safefree (h);
+                                break;
+                        }
+                        h->addr = a;
+                        h->next = hosts;
+                        hosts = h;
+                }
+        }
+
+        fclose (f);
+}
+
+static void dns_load_resolv (void)
+{
+        char line[256], *p;
+        FILE *f;
+
+        resolv_nservers = 0;
+        f = fopen (resolv_file.path, "r");
+        if (!f)
+                return;
+
+        while (fgets (line, sizeof (line), f)
+               && resolv_nservers < DNS_MAX_SERVERS) {
+                if (strncmp (line, "nameserver", 10) != 0
+                    || (line[10] != ' ' && line[10] != '\t'))
+                        continue;
+                p = line + 10;
+                p = dns_word (&p);
+                if (p && dns_server_addr (p,
+                                 &resolv_servers[resolv_nservers]) == 0)
+                        resolv_nservers++;
+        }
+
+        fclose (f);
+}
+
+/*
+ * Returns 1 if the file is not what it was when last looked at (or
+ * is gone, or has appeared since.)
+ */
+static int dns_file_changed (struct dns_file *file)
+{
+        struct stat st;
+
+        if (stat (file->path, &st) < 0)
+                memset (&st, 0, sizeof (st));
+        if (st.st_mtime == file->mtime && st.st_size == file->size
+            && st.st_ino == file->ino)
+                return 0;
+
+        file->mtime = st.st_mtime;
+        file->size = st.st_size;
+        file->ino = st.st_ino;
+        return 1;
+}
+
+/*
+ * Reread /etc/hosts and /etc/resolv.conf if they have changed, looking
+ * every DNS_RECHECK seconds at most.  The caller holds dns_files_lock.
+ */
+static void dns_files_check (void)
+{
+        time_t now = time (NULL);
+
+        if (dns_files_checked != 0 && now >= dns_files_checked
+            && now < dns_files_checked + DNS_RECHECK)
+                return;
+        dns_files_checked = now;
+
+        if (dns_file_changed (&hosts_file))
+                dns_load_hosts ();
+        if (dns_file_changed (&resolv_file))
+                dns_load_resolv ();
+}
+
+static void dns_init (void)
+{
+        unsigned int i;
+
+        for (i = 0; i < DNS_SHARDS; i++)
+                pthread_mutex_init (&shards[i].lock, NULL);
+
+        dns_urandom = open ("/dev/urandom", O_RDONLY);
+        if (dns_urandom < 0)
+                log_message (LOG_WARNING, "dns: could not open "
+                             "/dev/urandom (%s), names are looked up "
+                             "with getaddrinfo()", strerror (errno));
+        else
+                fcntl (dns_urandom, F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * The name servers to ask: those given with DnsServer, or else those
+ * of /etc/resolv.conf.
+ */
+static unsigned int dns_servers (union sockaddr_union *servers)
+{
+        unsigned int i, n = 0;
+
+        if (config->dns_servers && sblist_getsize (config->dns_servers)) {
+                for (i = 0; i < sblist_getsize (config->dns_servers)
+                     && n < DNS_MAX_SERVERS; i++) {
+                        char **s = sblist_get (config->dns_servers, i);
+                        if (dns_server_addr (*s, &servers[n]) == 0)
+                                n++;
+                }
+                return n;
+        }
+
+        pthread_mutex_lock (&dns_files_lock);
+        dns_files_check ();
+        for (n = 0; n < resolv_nservers; n++)
+                servers[n] = resolv_servers[n];
+        pthread_mutex_unlock (&dns_files_lock);
+        return n;
+}
+
+/*
+ * Lower-case the name and drop a trailing dot.  Returns -1 if it cannot
+ * be asked for in DNS.
+ */
+static int dns_normalize (const char *host, char *name)
+{
+        size_t i, len = strlen (host), label = 0;
+
+        if (len > 0 && host[len - 1] == '.')
+                len--;
+        if (len == 0 || len > DNS_NAME_MAX)
+                return -1;
+
+        for (i = 0; i < len; i++) {
+                if (host[i] == '.') {
+                        if (label == 0)
+                                return -1;
+                        label = 0;
+                } else if (++label > 63
+                           || (unsigned char) host[i] <= ' ')
+                        return -1;
+                name[i] = tolower ((unsigned char) host[i]);
+        }
+        name[len] = '\0';
+        return 0;
+}
+
+static unsigned long dns_hash (const char *name)
+{
+        unsigned long h = 2166136261UL;
+
+        while (*name)
+                h = ((h ^ (unsigned char) *name++) * 16777619UL)
+                        & 0xffffffffUL;
+        return h;
+}
+
+/*
+ * The addresses as a list of struct addrinfo, each with its address
+ * right behind it, for connecting to "port".
+ */
+static struct addrinfo *dns_addrinfo (const struct dns_addr *addrs,
+                                      unsigned int n, int port)
+{
+        struct addrinfo *res = NULL, **link = &res, *ai;
+        union sockaddr_union *sa;
+        unsigned int i;
+
+        for (i = 0; i < n; i++) {
+                ai = (struct addrinfo *) safecalloc (1, sizeof (*ai)
+                                                     + sizeof (*sa));
+                if (!ai)
+                        break;
+                sa = (union sockaddr_union *) (ai + 1);
+                ai->ai_family = addrs[i].family;
+                ai->ai_socktype = SOCK_STREAM;
+                ai->ai_protocol = IPPROTO_TCP;
+                ai->ai_addr = (struct sockaddr *) sa;
+                if (addrs[i].family == AF_INET) {
+                        sa->v4.sin_family = AF_INET;
+                        sa->v4.sin_port = htons ((unsigned short) port);
+                        memcpy (&sa->v4.sin_addr, addrs[i].addr, 4);
+                        ai->ai_addrlen = sizeof (sa->v4);
+                } else {
+                        sa->v6.sin6_family = AF_INET6;
+                        sa->v6.sin6_port = htons ((unsigned short) port);
+                        memcpy (&sa->v6.sin6_addr, addrs[i].addr, 16);
+                        ai->ai_addrlen = sizeof (sa->v6);
+                }
+                *link = ai;
+                link = &ai->ai_next;
+        }
+
+        return res;
+}
+
+/*
+ * Release the addresses handed out by the resolver.
+ */
+void dns_free (struct addrinfo *res)
+{
+        struct addrinfo *next;
+
+        for (; res; res = next) {
+                next = res->ai_next;
+                safefree (res);
+        }
+}
+
+/*
+ * Leave the lookup to getaddrinfo(), for the names we do not ask the
+ * name servers about ourselves.
+ */
+static struct addrinfo *dns_getaddrinfo (const char *host, int port)
+{
+        struct addrinfo hints, *res, *ai;
+        struct dns_addr addrs[DNS_MAX_ADDRS];
+        unsigned int n = 0;
+        int err;
+
+        memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        err = getaddrinfo (host, NULL, &hints, &res);
+        if (err != 0) {
+                log_message (LOG_INFO, "dns: getaddrinfo for %s: %s",
+                             host, err == EAI_SYSTEM ? strerror (errno)
+                             : gai_strerror (err));
+                return NULL;
+        }
+
+        for (ai = res; ai && n < DNS_MAX_ADDRS; ai = ai->ai_next) {
+                memset (&addrs[n], 0, sizeof (addrs[n]));
+                addrs[n].family = ai->ai_family;
+                if (ai->ai_family == AF_INET)
+                        memcpy (addrs[n++].addr, &((struct sockaddr_in *)
+                                (void *) ai->ai_addr)->sin_addr, 4);
+                else if (ai->ai_family == AF_INET6)
+                        memcpy (addrs[n++].addr, &((struct sockaddr_in6 *)
+                                (void *) ai->ai_addr)->sin6_addr, 16);
+        }
+        freeaddrinfo (res);
+
+        return dns_addrinfo (addrs, n, port);
+}
+
+/*
+ * The addresses /etc/hosts has for the name, IPv4 first.
+ */
+static unsigned int dns_hosts_lookup (const char *name,
+                                      struct dns_addr *addrs)
+{
+        struct dns_host *h;
+        unsigned int n = 0;
+        int pass;
+
+        pthread_mutex_lock (&dns_files_lock);
+        dns_files_check ();
+        for (pass = 0; pass < 2; pass++)
+                for (h = hosts; h && n < DNS_MAX_ADDRS; h = h->next)
+                        if ((h->addr.family == AF_INET) == (pass == 0)
+                            && strcasecmp (h->name, name) == 0)
+                                addrs[n++] = h->addr;
+        pthread_mutex_unlock (&dns_files_lock);
+        return n;
+}
+
+/*
+ * Take an entry off its shard.  The caller holds the shard's lock.
+ */
+static void dns_cache_unlink (struct dns_shard *s, struct dns_entry *e)
+{
+        struct dns_entry **link;
+
+        for (link = &s->buckets[(e->hash / DNS_SHARDS) % DNS_BUCKETS];
+             *link != e; link = &(*link)->chain)
+                ;
+        *link = e->chain;
+
+        if (e->prev)
+                e->prev->next = e->next;
+        else
+                s->first = e->next;
+        if (e->next)
+                e->next->prev = e->prev;
+        else
+                s->last = e->prev;
+        s->count--;
+}
+
+/*
+ * Look the name up in the cache.  Returns 1 if it is there (with no
+ * addresses if it does not resolve), and 0 if not.
+ */
+static int dns_cache_get (const char *name, unsigned long hash,
+                          struct dns_addr *addrs, unsigned int *naddrs)
+{
+        struct dns_shard *s = &shards[hash % DNS_SHARDS];
+        struct dns_entry *e;
+        int found = 0;
+
+        pthread_mutex_lock (&s->lock);
+        for (e = s->buckets[(hash / DNS_SHARDS) % DNS_BUCKETS]; e;
+             e = e->chain)
+                if (e->hash == hash && strcmp (e->host, name) == 0)
+                        break;
+
+        if (e && e->expires <= time (NULL)) {
+                dns_cache_unlink (s, e);
+                safefree (e->host);
+                safefree (e);
+        } else if (e) {
+                *naddrs = e->naddrs;
+                memcpy (addrs, e->addrs, e->naddrs * sizeof (*addrs));
+                if (e != s->first) {
+                        /* move it to the front */
+                        e->prev->next = e->next;
+                        if (e->next)
+                                e->next->prev = e->prev;
+                        else
+                                s->last = e->prev;
+                        e->prev = NULL;
+                        e->next = s->first;
+                        s->first->prev = e;
+                        s->first = e;
+                }
+                found = 1;
+        }
+        pthread_mutex_unlock (&s->lock);
+
+        return found;
+}
+
+static void dns_cache_put (const char *name, unsigned long hash,
+                           const struct dns_addr *addrs, unsigned int naddrs,
+                           unsigned long ttl)
+{
+        struct dns_shard *s = &shards[hash % DNS_SHARDS];
+        struct dns_entry *e, **bucket;
+        unsigned long limit;
+
+        if (config->dns_cache_size == 0)
+                return;
+        limit = (config->dns_cache_size + DNS_SHARDS - 1) / DNS_SHARDS;
+
+        e = (struct dns_entry *) safecalloc (1, sizeof (*e));
+        if (!e || !(e->host = safestrdup (name))) {
+                safefree (e);
+                return;
+        }
+        e->hash = hash;
+        e->expires = time (NULL) + ttl;
+        e->naddrs = naddrs;
+        memcpy (e->addrs, addrs, naddrs * sizeof (*addrs));
+
+        pthread_mutex_lock (&s->lock);
+        bucket = &s->buckets[(hash / DNS_SHARDS) % DNS_BUCKETS];
+
+        /* A lookup which ran alongside may have got here first. */
+        {
+                struct dns_entry *old;
+
+                for (old = *bucket; old; old = old->chain)
+                        if (old->hash == hash && strcmp (old->host, name) == 0)
+                                break;
+                if (old) {
+                        dns_cache_unlink (s, old);
+                        safefree (old->host);
+                        safefree (old);
+                }
+        }
+
+        while (s->count >= limit && s->last) {
+                struct dns_entry *lru = s->last;
+
+                dns_cache_unlink (s, lru);
+                safefree (lru->host);
+                safefree (lru);
+        }
+
+        e->chain = *bucket;
+        *bucket = e;
+        e->next = s->first;
+        if (s->first)
+                s->first->prev = e;
+        else
+                s->last = e;
+        s->first = e;
+        s->count++;
+        pthread_mutex_unlock (&s->lock);
+}
+
+/*
+ * Answer a lookup without asking a name server: from the address
+ * itself, /etc/hosts or the cache, or with getaddrinfo() for the names
+ * the resolver leaves to it.  Returns 1 with "res" set (NULL if the
+ * name does not resolve), or 0 if the name servers have to be asked.
+ */
+int dns_resolve_cached (const char *host, int port, struct addrinfo **res)
+{
+        char name[DNS_NAME_MAX + 1];
+        struct dns_addr addrs[DNS_MAX_ADDRS];
+        union sockaddr_union servers[DNS_MAX_SERVERS];
+        unsigned int n;
+        unsigned long hash;
+
+        pthread_once (&dns_once, dns_init);
+        *res = NULL;
+
+        if (dns_numeric (host, &addrs[0])) {
+                *res = dns_addrinfo (addrs, 1, port);
+                return 1;
+        }
+
+        if (dns_normalize (host, name) < 0) {
+                *res = dns_getaddrinfo (host, port);
+                return 1;
+        }
+
+        n = dns_hosts_lookup (name, addrs);
+        if (n > 0) {
+                *res = dns_addrinfo (addrs, n, port);
+                return 1;
+        }
+
+        if (!strchr (name, '.') || dns_urandom < 0
+            || dns_servers (servers) == 0) {
+                *res = dns_getaddrinfo (host, port);
+                return 1;
+        }
+
+        hash = dns_hash (name);
+        if (!dns_cache_get (name, hash, addrs, &n))
+                return 0;
+
+        pthread_mutex_lock (&dns_stats_lock);
+        dns_hits++;
+        pthread_mutex_unlock (&dns_stats_lock);
+
+        *res = dns_addrinfo (addrs, n, port);
+        return 1;
+}
+
+/*
+ * Two random bytes from /dev/urandom, or -1 if there are none to be
+ * had.
+ */
+static long dns_random (struct dns_client *c)
+{
+        if (c->nrandom < 2) {
+                if (read (dns_urandom, c->random, sizeof (c->random))
+                    != (ssize_t) sizeof (c->random))
+                        return -1;
+                c->nrandom = sizeof (c->random);
+        }
+        c->nrandom -= 2;
+        return (long) c->random[c->nrandom] << 8
+                | c->random[c->nrandom + 1];
+}
+
+/*
+ * Set up a client.  "watch", if not NULL, is told about each socket
+ * it opens for a lookup, and again (with -1) before it is closed.
+ * Returns NULL if there is no randomness for the IDs.
+ */
+struct dns_client *dns_client_new (dns_done_func done, dns_watch_func watch,
+                                   void *data)
+{
+        struct dns_client *c;
+        unsigned int i;
+
+        pthread_once (&dns_once, dns_init);
+        if (dns_urandom < 0)
+                return NULL;
+
+        c = (struct dns_client *) safecalloc (1, sizeof (*c));
+        if (!c)
+                return NULL;
+        c->done = done;
+        c->watch = watch;
+        c->data = data;
+        for (i = 0; i < DNS_MAX_SOCKETS; i++)
+                c->fds[i] = -1;
+
+        return c;
+}
+
+/*
+ * Close the socket of the lookup, if it has one.
+ */
+static void dns_close (struct dns_client *c, struct dns_query *q)
+{
+        if (q->slot < 0)
+                return;
+        if (c->watch)
+                c->watch (c->data, q->slot, -1);
+        close (c->fds[q->slot]);
+        c->fds[q->slot] = -1;
+        q->slot = -1;
+}
+
+static void dns_query_free (struct dns_query *q)
+{
+        struct dns_waiter *wt;
+
+        while ((wt = q->waiters) != NULL) {
+                q->waiters = wt->next;
+                safefree (wt);
+        }
+        safefree (q->host);
+        safefree (q);
+}
+
+/*
+ * Release the client.  Its sockets are closed without a word to
+ * "watch".
+ */
+void dns_client_free (struct dns_client *c)
+{
+        struct dns_query *q;
+        unsigned int i;
+
+        if (!c)
+                return;
+        while ((q = c->queries) != NULL) {
+                c->queries = q->next;
+                dns_query_free (q);
+        }
+        for (i = 0; i < DNS_MAX_SOCKETS; i++)
+                if (c->fds[i] >= 0)
+                        close (c->fds[i]);
+        safefree (c);
+}
+
+/*
+ * The sockets to watch for answers.
+ */
+unsigned int dns_client_fds (struct dns_client *c, int *fds)
+{
+        unsigned int i, n = 0;
+
+        for (i = 0; i < DNS_MAX_SOCKETS; i++)
+                if (c->fds[i] >= 0)
+                        fds[n++] = c->fds[i];
+        return n;
+}
+
+/*
+ * Send the questions still unanswered to the current server.
+ */
+static void dns_send (struct dns_client *c, struct dns_query *q)
+{
+        unsigned char pkt[12 + DNS_NAME_MAX + 2 + 4];
+        const char *label, *dot;
+        size_t len;
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                if (!(q->pending & (1 << i)))
+                        continue;
+
+                memset (pkt, 0, 12);
+                pkt[0] = q->id[i] >> 8;
+                pkt[1] = q->id[i] & 0xff;
+                pkt[2] = 0x01;          /* recursion desired */
+                pkt[5] = 1;             /* one question */
+                len = 12;
+                for (label = q->host; *label; label = dot + 1) {
+                        dot = strchr (label, '.');
+                        if (!dot)
+                                dot = label + strlen (label);
+                        pkt[len++] = (unsigned char) (dot - label);
+                        memcpy (pkt + len, label, dot - label);
+                        len += dot - label;
+                        if (!*dot)
+                                break;
+                }
+                pkt[len++] = 0;
+                pkt[len++] = 0;
+                pkt[len++] = i == 0 ? DNS_TYPE_A : DNS_TYPE_AAAA;
+                pkt[len++] = 0;
+                pkt[len++] = 1;         /* class IN */
+
+                if (send (c->fds[q->slot], pkt, len, 0) < 0
+                    && errno != EAGAIN)
+                        log_message (LOG_INFO, "dns: could not ask about "
+                                     "%s: %s", q->host, strerror (errno));
+        }
+}
+
+/*
+ * The lookup is through: cache the outcome and tell everyone waiting
+ * for it.  "answered" is FALSE if no server gave an answer.
+ */
+static void dns_finish (struct dns_client *c, struct dns_query *q,
+                        int answered)
+{
+        struct dns_query **link;
+        struct dns_waiter *wt;
+        struct dns_addr addrs[DNS_MAX_ADDRS];
+        struct timeval now;
+        unsigned long ttl;
+        unsigned int i, n = 0;
+
+        dns_close (c, q);
+        for (link = &c->queries; *link != q; link = &(*link)->next)
+                ;
+        *link = q->next;
+
+        for (i = 0; i < 2; i++) {
+                unsigned int j;
+
+                for (j = 0; j < q->naddrs[i] && n < DNS_MAX_ADDRS; j++)
+                        addrs[n++] = q->addrs[i][j];
+        }
+
+        if (answered) {
+                /* no TTL given at all (an empty answer without SOA) */
+                ttl = q->ttl == (unsigned long) -1 ? config->dns_min_ttl
+                        : q->ttl;
+                if (ttl > config->dns_max_ttl)
+                        ttl = config->dns_max_ttl;
+                if (ttl < config->dns_min_ttl)
+                        ttl = config->dns_min_ttl;
+                dns_cache_put (q->host, q->hash, addrs, n, ttl);
+        } else
+                log_message (LOG_WARNING, "dns: no answer about %s from "
+                             "the name servers", q->host);
+
+        gettimeofday (&now, NULL);
+        pthread_mutex_lock (&dns_stats_lock);
+        dns_msec += (now.tv_sec - q->started.tv_sec) * 1000
+                + (now.tv_usec - q->started.tv_usec) / 1000;
+        dns_lookups++;
+        pthread_mutex_unlock (&dns_stats_lock);
+
+        while ((wt = q->waiters) != NULL) {
+                q->waiters = wt->next;
+                c->done (c->data, wt->waiter,
+                         dns_addrinfo (addrs, n, wt->port));
+                safefree (wt);
+        }
+        dns_query_free (q);
+}
+
+/*
+ * Ask the current server, on a new socket and with new IDs.  Returns
+ * 0 if there is no socket free for it, and the lookup has to wait for
+ * one.  If the question cannot be sent, the next server is asked on the
+ * next tick.
+ */
+static int dns_ask (struct dns_client *c, struct dns_query *q)
+{
+        union sockaddr_union *sa = &q->servers[q->server];
+        int af = SOCKADDR_UNION_AF (sa);
+        long id[2];
+        int slot, fd;
+
+        dns_close (c, q);
+        for (slot = 0; slot < DNS_MAX_SOCKETS && c->fds[slot] >= 0; slot++)
+                ;
+        q->waiting = slot == DNS_MAX_SOCKETS;
+        if (q->waiting)
+                return 0;
+        q->resend = time (NULL);
+
+        id[0] = dns_random (c);
+        do
+                id[1] = dns_random (c);
+        while (id[1] == id[0] && id[1] >= 0);
+        if (id[0] < 0 || id[1] < 0) {
+                log_message (LOG_ERR, "dns: could not read /dev/urandom: "
+                             "%s", strerror (errno));
+                return 1;
+        }
+
+        /* Not bound before the connect, it gets a random port. */
+        fd = socket (af, SOCK_DGRAM, IPPROTO_UDP);
+        if (fd >= 0 && (socket_nonblocking (fd, 1) < 0
+                        || connect (fd, (struct sockaddr *) sa,
+                                    af == AF_INET ? sizeof (sa->v4)
+                                    : sizeof (sa->v6)) < 0)) {
+                close (fd);
+                fd = -1;
+        }
+        if (fd < 0) {
+                log_message (LOG_ERR, "dns: could not set up a socket "
+                             "for the name server: %s", strerror (errno));
+                return 1;
+        }
+
+        q->id[0] = (unsigned short) id[0];
+        q->id[1] = (unsigned short) id[1];
+        q->slot = slot;
+        c->fds[slot] = fd;
+        if (c->watch)
+                c->watch (c->data, slot, fd);
+
+        q->resend += DNS_TIMEOUT;
+        dns_send (c, q);
+        return 1;
+}
+
+/*
+ * Ask the next server, or give up once each has been asked often
+ * enough.
+ */
+static void dns_retry (struct dns_client *c, struct dns_query *q)
+{
+        if (++q->tries >= q->nservers * DNS_ATTEMPTS) {
+                dns_finish (c, q, FALSE);
+                return;
+        }
+        q->server = (q->server + 1) % q->nservers;
+        dns_ask (c, q);
+}
+
+/*
+ * Start the lookups that wait for a socket, as long as there are
+ * sockets free.
+ */
+static void dns_start_waiting (struct dns_client *c)
+{
+        struct dns_query *q, *first;
+
+        do {
+                first = NULL;
+                for (q = c->queries; q; q = q->next)
+                        if (q->waiting)
+                                first = q;      /* the longest waiting */
+        } while (first && dns_ask (c, first));
+}
+
+/*
+ * Start looking up the name for "waiter", whose callback gets the
+ * addresses for "port".  Returns -1 if the name cannot be looked up.
+ */
+int dns_client_query (struct dns_client *c, const char *host, int port,
+                      void *waiter)
+{
+        char name[DNS_NAME_MAX + 1];
+        struct dns_query *q;
+        struct dns_waiter *wt;
+        unsigned long hash;
+        long r;
+
+        if (dns_normalize (host, name) < 0)
+                return -1;
+        hash = dns_hash (name);
+
+        wt = (struct dns_waiter *) safecalloc (1, sizeof (*wt));
+        if (!wt)
+                return -1;
+        wt->waiter = waiter;
+        wt->port = port;
+
+        /* Someone else is waiting for the same name already. */
+        for (q = c->queries; q; q = q->next)
+                if (q->hash == hash && strcmp (q->host, name) == 0) {
+                        wt->next = q->waiters;
+                        q->waiters = wt;
+                        return 0;
+                }
+
+        q = (struct dns_query *) safecalloc (1, sizeof (*q));
+        if (!q || !(q->host = safestrdup (name))) {
+                safefree (q);
+                safefree (wt);
+                return -1;
+        }
+        q->nservers = dns_servers (q->servers);
+        r = dns_random (c);
+        if (q->nservers == 0 || r < 0) {
+                safefree (q->host);
+                safefree (q);
+                safefree (wt);
+                return -1;
+        }
+        q->hash = hash;
+        q->waiters = wt;
+        q->pending = 3;
+        q->slot = -1;
+        q->ttl = (unsigned long) -1;
+        q->server = (unsigned int) r % q->nservers;
+        gettimeofday (&q->started, NULL);
+
+        q->next = c->queries;
+        c->queries = q;
+
+        pthread_mutex_lock (&dns_stats_lock);
+        dns_misses++;
+        pthread_mutex_unlock (&dns_stats_lock);
+
+        dns_ask (c, q);
+        return 0;
+}
+
+/*
+ * "waiter" is no longer interested.  The lookup goes on for the cache.
+ */
+void dns_client_cancel (struct dns_client *c, void *waiter)
+{
+        struct dns_query *q;
+        struct dns_waiter **link, *wt;
+
+        for (q = c->queries; q; q = q->next)
+                for (link = &q->waiters; (wt = *link) != NULL;
+                     link = &wt->next)
+                        if (wt->waiter == waiter) {
+                                *link = wt->next;
+                                safefree (wt);
+                                return;
+                        }
+}
+
+/*
+ * Skip a (possibly compressed) name.  Returns the offset after it, or
+ * 0 if the packet ends before.
+ */
+static size_t dns_skip_name (const unsigned char *p, size_t len, size_t off)
+{
+        while (off < len) {
+                if (p[off] == 0)
+                        return off + 1;
+                if ((p[off] & 0xc0) == 0xc0)
+                        return off + 2 <= len ? off + 2 : 0;
+                if (p[off] & 0xc0)
+                        return 0;
+                off += p[off] + 1;
+        }
+        return 0;
+}
+
+/*
+ * Check that the question in the answer is the one we asked.  A label
+ * has to match the next label of "host" exactly, length included: the
+ * answer comes off the network and may hold anything, NUL bytes too.
+ */
+static int dns_same_question (const unsigned char *p, size_t len,
+                              const char *host)
+{
+        size_t off = 12, n, i;
+
+        while (off < len && p[off] != 0) {
+                n = p[off++];
+                if (n > 63 || off + n > len || n != strcspn (host, ".")
+                    || memchr (p + off, '\0', n))
+                        return 0;
+                for (i = 0; i < n; i++)
+                        if (tolower (p[off + i])
+                            != tolower ((unsigned char) host[i]))
+                                return 0;
+                host += n;
+                off += n;
+                if (*host == '.')
+                        host++;
+                else if (*host != '\0')
+                        return 0;
+        }
+        return off < len && *host == '\0';
+}
+
+/*
+ * An answer came in on the socket of "q".
+ */
+static void dns_answer (struct dns_client *c, struct dns_query *q,
+                        const unsigned char *p, size_t len)
+{
+        unsigned int id, type, rcode, an, ns, i, k;
+        unsigned long ttl;
+        size_t off, rdlen;
+
+        if (len < 12 || !(p[2] & 0x80))
+                return;
+
+        id = (p[0] << 8) | p[1];
+        for (k = 0; k < 2; k++)
+                if (q->id[k] == id && (q->pending & (1 << k)))
+                        break;
+        if (k == 2 || ((p[4] << 8) | p[5]) != 1
+            || !dns_same_question (p, len, q->host))
+                return;
+
+        off = dns_skip_name (p, len, 12);
+        if (off == 0 || off + 4 > len
+            || ((p[off] << 8) | p[off + 1])
+               != (k == 0 ? DNS_TYPE_A : DNS_TYPE_AAAA))
+                return;
+        off += 4;
+
+        rcode = p[3] & 0x0f;
+        if ((rcode != 0 && rcode != 3) || (p[2] & 0x02)) {
+                /* the server failed us, or the answer was truncated:
+                 * ask the next one */
+                dns_retry (c, q);
+                return;
+        }
+
+        an = (p[6] << 8) | p[7];
+        ns = (p[8] << 8) | p[9];
+        for (i = 0; i < an + ns; i++) {
+                off = dns_skip_name (p, len, off);
+                if (off == 0 || off + 10 > len)
+                        break;
+                type = (p[off] << 8) | p[off + 1];
+                ttl = DNS_GET32 (p + off + 4);
+                rdlen = (p[off + 8] << 8) | p[off + 9];
+                off += 10;
+                if (off + rdlen > len)
+                        break;
+
+                if (i < an && type == (k == 0 ? DNS_TYPE_A : DNS_TYPE_AAAA)
+                    && rdlen == (k == 0 ? 4U : 16U)
+                    && q->naddrs[k] < DNS_MAX_ADDRS) {
+                        struct dns_addr *a = &q->addrs[k][q->naddrs[k]++];
+
+                        memset (a, 0, sizeof (*a));
+                        a->family = k == 0 ? AF_INET : AF_INET6;
+                        memcpy (a->addr, p + off, rdlen);
+                        if (ttl < q->ttl)
+                                q->ttl = ttl;
+                } else if (i >= an && type == DNS_TYPE_SOA) {
+                        /* how long not to ask again: the SOA minimum */
+                        size_t min = dns_skip_name (p, len, off);
+
+                        min = min ? dns_skip_name (p, len, min) : 0;
+                        if (min && min + 20 <= off + rdlen) {
+                                if (DNS_GET32 (p + min + 16) < ttl)
+                                        ttl = DNS_GET32 (p + min + 16);
+                                if (ttl < q->ttl && q->naddrs[0] == 0
+                                    && q->naddrs[1] == 0)
+                                        q->ttl = ttl;
+                        }
+                }
+                off += rdlen;
+        }
+
+        /* There is no point asking for the other type of a name that
+         * does not exist. */
+        q->pending &= rcode == 3 ? 0 : ~(1U << k);
+        if (q->pending == 0)
+                dns_finish (c, q, TRUE);
+}
+
+/*
+ * The lookup whose socket "fd" is, if any is.
+ */
+static struct dns_query *dns_query_by_fd (struct dns_client *c, int fd)
+{
+        struct dns_query *q;
+
+        for (q = c->queries; q; q = q->next)
+                if (q->slot >= 0 && c->fds[q->slot] == fd)
+                        return q;
+        return NULL;
+}
+
+/*
+ * Handle the answers that came in on one of the client's sockets.
+ */
+void dns_client_read (struct dns_client *c, int fd)
+{
+        unsigned char pkt[DNS_PACKET_MAX];
+        struct dns_query *q;
+        ssize_t len;
+
+        /* An answer may end the lookup, and close the socket. */
+        while ((q = dns_query_by_fd (c, fd)) != NULL) {
+                len = recv (fd, pkt, sizeof (pkt), 0);
+                if (len >= 0)
+                        dns_answer (c, q, pkt, len);
+                else if (errno == ECONNREFUSED)
+                        /* Nobody listening there: ask the next server
+                         * now. */
+                        dns_retry (c, q);
+                else if (errno != EINTR)
+                        break;
+        }
+
+        dns_start_waiting (c);
+}
+
+/*
+ * Ask the next server about the names the last one did not answer in
+ * time.
+ */
+void dns_client_tick (struct dns_client *c, time_t now)
+{
+        struct dns_query *q, *next;
+
+        for (q = c->queries; q; q = next) {
+                next = q->next;
+                if (!q->waiting && q->resend <= now)
+                        dns_retry (c, q);
+        }
+
+        dns_start_waiting (c);
+}
+
+struct dns_wait {
+        unsigned int done;      /* boolean */
+        struct addrinfo *res;
+};
+
+static void dns_wait_done (void *data, void *waiter, struct addrinfo *res)
+{
+        struct dns_wait *wait = (struct dns_wait *) waiter;
+
+        (void) data;
+        wait->done = TRUE;
+        wait->res = res;
+}
+
+/*
+ * Look a name up, waiting for the name servers if it has to (for
+ * DnsTimeout seconds at most.)  The result has to be released with
+ * dns_free().
+ */
+struct addrinfo *dns_resolve (const char *host, int port)
+{
+        pollfd_struct fds[DNS_MAX_SOCKETS];
+        struct dns_client *c;
+        struct dns_wait wait;
+        struct addrinfo *res;
+        int fd[DNS_MAX_SOCKETS];
+        unsigned int i, n;
+        time_t deadline;
+
+        if (dns_resolve_cached (host, port, &res))
+                return res;
+
+        c = dns_client_new (dns_wait_done, NULL, NULL);
+        if (!c)
+                return dns_getaddrinfo (host, port);
+
+        wait.done = FALSE;
+        wait.res = NULL;
+        if (dns_client_query (c, host, port, &wait) < 0) {
+                dns_client_free (c);
+                return NULL;
+        }
+
+        deadline = time (NULL) + timeout_for (TIMEOUT_DNS);
+        while (!wait.done) {
+                /* the socket changes with each server asked */
+                n = dns_client_fds (c, fd);
+                for (i = 0; i < n; i++) {
+                        fds[i].fd = fd[i];
+                        fds[i].events = MYPOLL_READ;
+                        fds[i].revents = 0;
+                }
+                if (mypoll (fds, n, 1) > 0)
+                        for (i = 0; i < n && !wait.done; i++)
+                                if (fds[i].revents)
+                                        dns_client_read (c, fd[i]);
+                if (wait.done)
+                        break;
+                if (time (NULL) >= deadline) {
+                        log_message (LOG_WARNING, "dns: looking up %s "
+                                     "timed out", host);
+                        update_stats (STAT_TIMEOUT_DNS);
+                        dns_client_cancel (c, &wait);
+                        break;
+                }
+                dns_client_tick (c, time (NULL));
+        }
+
+        dns_client_free (c);
+        return wait.res;
+}
+
+void dns_get_stats (unsigned long *hits, unsigned long *misses,
+                    unsigned long *msec)
+{
+        pthread_mutex_lock (&dns_stats_lock);
+        *hits = dns_hits;
+        *misses = dns_misses;
+        *msec = dns_lookups ? dns_msec / dns_lookups : 0;
+        pthread_mutex_unlock (&dns_stats_lock);
+}
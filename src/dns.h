@@ -0,0 +1,63 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'dns.c' for detailed information. */
+
+#ifndef TINYPROXY_DNS_H
+#define TINYPROXY_DNS_H
+
+#include "common.h"
+
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_SOCKETS 32      /* lookups a client asks about at once */
+
+struct dns_client;
+
+/*
+ * Called when a lookup started with dns_client_query() is through.
+ * "res" holds the addresses (to be released with dns_free()), or is
+ * NULL if the name could not be resolved.
+ */
+typedef void (*dns_done_func) (void *data, void *waiter,
+                               struct addrinfo *res);
+
+/*
+ * Called when the client opens the socket "fd" for a lookup, in one of
+ * its DNS_MAX_SOCKETS slots, and with -1 before it closes it.
+ */
+typedef void (*dns_watch_func) (void *data, unsigned int slot, int fd);
+
+extern struct addrinfo *dns_resolve (const char *host, int port);
+extern int dns_resolve_cached (const char *host, int port,
+                               struct addrinfo **res);
+extern void dns_free (struct addrinfo *res);
+
+extern struct dns_client *dns_client_new (dns_done_func done,
+                                          dns_watch_func watch, void *data);
+extern void dns_client_free (struct dns_client *c);
+extern unsigned int dns_client_fds (struct dns_client *c, int *fds);
+extern int dns_client_query (struct dns_client *c, const char *host,
+                             int port, void *waiter);
+extern void dns_client_cancel (struct dns_client *c, void *waiter);
+extern void dns_client_read (struct dns_client *c, int fd);
+extern void dns_client_tick (struct dns_client *c, time_t now);
+
+extern void dns_get_stats (unsigned long *hits, unsigned long *misses,
+                           unsigned long *msec);
+
+#endif
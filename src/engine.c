@@ -0,0 +1,1631 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The event engine ("IOEngine epoll").  Instead of a thread per
+ * connection, a fixed number of worker threads each run an epoll loop
+ * and move their connections through the stages of handle_connection()
+ * as their sockets become ready.  Nothing blocks while a connection
+ * waits for the request head, the connect to the server, the replies of
+ * a SOCKS upstream proxy, the response head or relay data; the short
+ * stages in between (parsing and sending headers) still run with the
+ * sockets in blocking mode, where a read or write gives up once the
+ * phase is out of time.  The timeout of the phase a connection is in is
+ * kept on a timer wheel per worker (see timers.c), which moves on once
+ * a second.
+ *
+ * With "IOEngine io_uring" the workers learn about ready sockets from an
+ * io_uring instead of epoll.  Watching a socket becomes a poll request
+ * on the ring, and accepting a connection an accept request (multishot
+ * where the kernel has it), so that all the (re)arming and accepting of
+ * a whole batch of events goes to the kernel in a single system call.
+ * That is all the ring is used for: no data goes through it, so there
+ * are no receive or send requests and no buffers registered with the
+ * kernel.  Once a socket is ready it is read and written with recv(),
+ * send() and splice() by the same code as with epoll, the relay in
+ * particular.  If the kernel has no io_uring, the workers use epoll.
+ *
+ * Each worker looks up the names of the servers with a resolver of its
+ * own (see dns.c), whose sockets it watches along with the
+ * connections: a connection waits for its lookup without holding up
+ * the others.  The connects to the addresses of a server are staggered
+ * as in opensock(), on a timerfd per worker.
+ */
+
+#include "main.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+
+#include "engine.h"
+#include "child.h"
+#include "conf.h"
+#include "conns.h"
+#include "dns.h"
+#include "filter.h"
+#include "heap.h"
+#include "html-error.h"
+#include "log.h"
+#include "mypoll.h"
+#include "network.h"
+#include "pool.h"
+#include "reqs.h"
+#include "sock.h"
+#include "stats.h"
+#include "timers.h"
+#include "uring.h"
+
+#ifndef EPOLLEXCLUSIVE
+#  define EPOLLEXCLUSIVE 0
+#endif
+#ifndef EPOLLRDHUP
+#  define EPOLLRDHUP 0
+#endif
+
+#define ENGINE_MAX_EVENTS       256
+#define ENGINE_ACCEPT_BATCH     64
+#define ENGINE_URING_ENTRIES    4096
+
+/* user_data of the io_uring requests which are not an engine_req */
+#define ENGINE_URING_CANCEL     0
+#define ENGINE_URING_TICK       1
+
+enum engine_state {
+        ES_HEAD,                /* waiting for the complete request head
+                                   (the first one or the next one) */
+        ES_RESOLVE,             /* looking up the server's name */
+        ES_CONNECT,             /* connecting to the server */
+        ES_HANDSHAKE,           /* waiting for a SOCKS upstream proxy */
+        ES_RESPONSE,            /* waiting for the complete response head */
+        ES_RELAY,               /* relaying data in both directions */
+        ES_FLUSH,               /* sending out what is left, then closing */
+        ES_LINGER,              /* turned away, waiting for the client to
+                                   stop sending before closing */
+        ES_CLOSED               /* gone, freed once the event batch is done */
+};
+
+struct engine_conn;
+struct engine_req;
+
+/*
+ * What epoll hands back for an event: the connection (NULL for a
+ * listening socket or a resolver socket) and which of its sockets it is
+ * about.
+ */
+struct engine_handle {
+        struct engine_conn *ec;
+        int fd;
+        unsigned int events;    /* currently registered with epoll */
+        struct engine_req *req; /* io_uring request watching it, if any */
+};
+
+/*
+ * A poll or accept request in flight on an io_uring.  Once cancelled
+ * it only waits for its last completion to be freed.
+ */
+struct engine_req {
+        struct engine_handle *h;
+        unsigned int cancelled; /* boolean */
+};
+
+struct engine_conn {
+        struct conn_s conn;
+        union sockaddr_union addr;
+        enum engine_state state;
+        unsigned int failed;    /* error page pending from the setup */
+        struct engine_handle client, server;
+        struct addrinfo *addrs, *addr_cur;
+        struct engine_handle attempts[CONNECT_ATTEMPTS_MAX];
+        struct addrinfo *attempt_addr[CONNECT_ATTEMPTS_MAX];
+        unsigned long attempt_started[CONNECT_ATTEMPTS_MAX];
+        unsigned int nattempts; /* connects under way */
+        unsigned long due;      /* when the next address is tried (ms) */
+        unsigned int queued;    /* boolean: waiting for "due" */
+        struct engine_conn *due_prev, *due_next;
+        struct timer_entry timer;       /* the timeout of the current phase */
+        unsigned int inflight;  /* io_uring requests not yet completed */
+        struct engine_conn *prev, *next;
+};
+
+struct engine_worker {
+        pthread_t thread;
+        int epfd;
+        struct engine_handle *listeners;
+        size_t nlisteners;
+        unsigned int accepting; /* boolean */
+        struct engine_conn *conns;
+        struct engine_conn *closed;
+        struct dns_client *resolver;    /* NULL: lookups block */
+        struct engine_handle dns[DNS_MAX_SOCKETS];      /* its sockets */
+        struct engine_handle timer;     /* timerfd for the staggered connects */
+        unsigned long timer_due;        /* what it is set to, 0 = not set */
+        struct engine_conn *due_first, *due_last;
+        struct timer_wheel wheel;       /* the timeouts of the connections */
+
+#ifdef HAVE_LINUX_IO_URING_H
+        struct uring *ring;     /* NULL when using epoll */
+        unsigned int pending;   /* engine_reqs in flight */
+        unsigned int ticking;   /* boolean: the one second timeout is armed */
+        unsigned int multishot; /* boolean: multishot accept works */
+        struct __kernel_timespec tick;
+#endif
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+#  define ENGINE_URING(w) ((w)->ring != NULL)
+#else
+#  define ENGINE_URING(w) 0
+#endif
+
+#define ENGINE_DNS(w, h) ((h) >= (w)->dns \
+                          && (h) < (w)->dns + DNS_MAX_SOCKETS)
+#define ENGINE_TIMER(w, h) ((h) == &(w)->timer)
+
+static struct engine_worker *workers;
+static size_t nworkers;
+
+/*
+ * Connections open across all workers, for the MaxClients limit.
+ */
+static unsigned int nconns;
+static pthread_mutex_t nconns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int engine_slot_get (void)
+{
+        int ret = 0;
+
+        pthread_mutex_lock (&nconns_lock);
+        if (nconns < config->maxclients) {
+                nconns++;
+                ret = 1;
+        }
+        pthread_mutex_unlock (&nconns_lock);
+
+        return ret;
+}
+
+static void engine_slot_put (void)
+{
+        pthread_mutex_lock (&nconns_lock);
+        nconns--;
+        pthread_mutex_unlock (&nconns_lock);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * Queue a request on the ring for the events a socket is watched for:
+ * a poll, or an accept for a listening socket.
+ */
+static void engine_uring_arm (struct engine_worker *w,
+                              struct engine_handle *h)
+{
+        struct engine_req *req;
+        struct io_uring_sqe *sqe;
+
+        req = (struct engine_req *) pool_alloc (sizeof (*req));
+        sqe = req ? uring_get_sqe (w->ring) : NULL;
+        if (!sqe) {
+                log_message (LOG_ERR, "engine: could not queue an io_uring "
+                             "request for fd %d", h->fd);
+                pool_free (req);
+                return;
+        }
+
+        req->h = h;
+        req->cancelled = FALSE;
+
+        sqe->fd = h->fd;
+        sqe->user_data = (unsigned long) req;
+        if (h->ec == NULL && !ENGINE_DNS (w, h) && !ENGINE_TIMER (w, h)) {
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->accept_flags = SOCK_NONBLOCK;
+#ifdef IORING_ACCEPT_MULTISHOT
+                /*
+                 * A multishot accept hands over all the listen queue
+                 * has; close to MaxClients, clients are taken one at a
+                 * time, so that those there is no room for stay queued.
+                 */
+                if (w->multishot && nconns < config->maxclients / 2)
+                        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+#endif
+        } else {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->poll32_events = h->events;
+                if (h->ec)
+                        h->ec->inflight++;
+        }
+
+        h->req = req;
+        w->pending++;
+}
+
+/*
+ * Cancel the request watching a socket.  Its completion still comes in
+ * later and is dropped then.
+ */
+static void engine_uring_cancel (struct engine_worker *w,
+                                 struct engine_handle *h)
+{
+        struct io_uring_sqe *sqe;
+
+        h->req->cancelled = TRUE;
+        sqe = uring_get_sqe (w->ring);
+        if (sqe) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (unsigned long) h->req;
+                sqe->user_data = ENGINE_URING_CANCEL;
+        } else
+                log_message (LOG_ERR, "engine: could not cancel the io_uring "
+                             "request for fd %d", h->fd);
+        h->req = NULL;
+}
+#endif
+
+/*
+ * Bring the events epoll watches on a socket in line with "want".
+ */
+static void engine_watch (struct engine_worker *w, struct engine_handle *h,
+                          unsigned int want)
+{
+        struct epoll_event ev;
+        int op;
+
+        if (h->fd < 0 || h->events == want)
+                return;
+
+#ifdef HAVE_LINUX_IO_URING_H
+        if (ENGINE_URING (w)) {
+                if (h->req)
+                        engine_uring_cancel (w, h);
+                h->events = want;
+                if (want)
+                        engine_uring_arm (w, h);
+                return;
+        }
+#endif
+
+        if (want == 0)
+                op = EPOLL_CTL_DEL;
+        else if (h->events == 0)
+                op = EPOLL_CTL_ADD;
+        else
+                op = EPOLL_CTL_MOD;
+
+        memset (&ev, 0, sizeof (ev));
+        ev.events = want;
+        ev.data.ptr = h;
+
+        if (epoll_ctl (w->epfd, op, h->fd, &ev) < 0)
+                log_message (LOG_ERR, "engine: epoll_ctl on fd %d: %s",
+                             h->fd, strerror (errno));
+        h->events = want;
+}
+
+static unsigned int engine_events (short mypoll_events)
+{
+        unsigned int events = 0;
+
+        if (mypoll_events & MYPOLL_READ)
+                events |= EPOLLIN | EPOLLRDHUP;
+        if (mypoll_events & MYPOLL_WRITE)
+                events |= EPOLLOUT;
+
+        return events;
+}
+
+static short mypoll_events (unsigned int events)
+{
+        short ret = 0;
+
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                ret |= MYPOLL_READ;
+        if (events & EPOLLOUT)
+                ret |= MYPOLL_WRITE;
+
+        return ret;
+}
+
+/*
+ * Put both sockets of a connection into blocking (on = 1) or
+ * non-blocking mode, around the stages that run synchronously.  While
+ * they block, a read or write on them gives up when the deadline of
+ * the connection's phase has passed (or after a second, if it has
+ * already), so that a stalled peer holds up the worker no longer than
+ * that phase's timeout.
+ */
+static void engine_blocking (struct engine_conn *ec, int on)
+{
+        long left = 0;
+
+        if (on) {
+                left = (long) (ec->timer.expires - time (NULL));
+                if (left < 1)
+                        left = 1;
+        }
+
+        socket_nonblocking (ec->conn.client_fd, !on);
+        socket_block_timeout (ec->conn.client_fd, (unsigned int) left);
+        if (ec->conn.server_fd >= 0) {
+                socket_nonblocking (ec->conn.server_fd, !on);
+                socket_block_timeout (ec->conn.server_fd,
+                                      (unsigned int) left);
+        }
+}
+
+/*
+ * Milliseconds on the monotonic clock.
+ */
+static unsigned long engine_msec (void)
+{
+        struct timespec now;
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        return (unsigned long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Give the connection "secs" seconds for the phase it is entering.
+ */
+static void engine_deadline (struct engine_worker *w, struct engine_conn *ec,
+                             unsigned int phase, unsigned int secs)
+{
+        timer_set (&w->wheel, &ec->timer, phase, time (NULL) + secs);
+}
+
+/*
+ * Have the next address of the server tried in ConnectAttemptDelay
+ * milliseconds.  The delay is the same for all, so the queue stays in
+ * the order of "due".
+ */
+static void engine_queue (struct engine_worker *w, struct engine_conn *ec)
+{
+        ec->due = engine_msec () + config->connect_attempt_delay;
+        ec->queued = TRUE;
+        ec->due_next = NULL;
+        ec->due_prev = w->due_last;
+        if (w->due_last)
+                w->due_last->due_next = ec;
+        else
+                w->due_first = ec;
+        w->due_last = ec;
+}
+
+static void engine_unqueue (struct engine_worker *w, struct engine_conn *ec)
+{
+        if (!ec->queued)
+                return;
+        if (ec->due_prev)
+                ec->due_prev->due_next = ec->due_next;
+        else
+                w->due_first = ec->due_next;
+        if (ec->due_next)
+                ec->due_next->due_prev = ec->due_prev;
+        else
+                w->due_last = ec->due_prev;
+        ec->queued = FALSE;
+}
+
+/*
+ * Give up on the connects still under way.  Those that have taken
+ * longer than the delay are remembered as failed.
+ */
+static void engine_attempts_close (struct engine_worker *w,
+                                   struct engine_conn *ec)
+{
+        unsigned long now = engine_msec ();
+        unsigned int i;
+
+        engine_unqueue (w, ec);
+        for (i = 0; i < CONNECT_ATTEMPTS_MAX; i++) {
+                if (ec->attempts[i].fd < 0)
+                        continue;
+                if (now - ec->attempt_started[i]
+                    >= config->connect_attempt_delay)
+                        opensock_given_up (ec->attempt_addr[i]);
+                engine_watch (w, &ec->attempts[i], 0);
+                close (ec->attempts[i].fd);
+                ec->attempts[i].fd = -1;
+        }
+        ec->nattempts = 0;
+}
+
+/*
+ * Tear a connection down.  A "ret" of -1 sends the error page that was
+ * set up for the client first, as handle_connection() does.  A client
+ * which got the short response instead lingers for RejectLinger
+ * seconds before it is closed.
+ */
+static void engine_close (struct engine_worker *w, struct engine_conn *ec,
+                          int ret)
+{
+        engine_watch (w, &ec->client, 0);
+        engine_watch (w, &ec->server, 0);
+        if (ec->state == ES_RESOLVE)
+                dns_client_cancel (w->resolver, ec);
+        engine_attempts_close (w, ec);
+
+        if (ret == -1) {
+                engine_blocking (ec, 1);
+                if (handle_connection_failure (&ec->conn,
+                                               ec->conn.got_headers) > 0
+                    && config->reject_linger > 0) {
+                        engine_blocking (ec, 0);
+                        ec->state = ES_LINGER;
+                        engine_deadline (w, ec, TIMEOUT_LINGER,
+                                         config->reject_linger);
+                        engine_watch (w, &ec->client, EPOLLIN | EPOLLRDHUP);
+                        return;
+                }
+        } else if (ec->state == ES_FLUSH) {
+                log_message (LOG_INFO,
+                             "Closed connection between local client (fd:%d) "
+                             "and remote client (fd:%d)",
+                             ec->conn.client_fd, ec->conn.server_fd);
+        }
+
+        timer_cancel (&w->wheel, &ec->timer);
+        if (ec->addrs)
+                dns_free (ec->addrs);
+        handle_connection_done (&ec->conn);
+
+        if (ec->prev)
+                ec->prev->next = ec->next;
+        else
+                w->conns = ec->next;
+        if (ec->next)
+                ec->next->prev = ec->prev;
+
+        /*
+         * Later events of the current batch may still point at it.
+         */
+        ec->state = ES_CLOSED;
+        ec->next = w->closed;
+        w->closed = ec;
+        engine_slot_put ();
+}
+
+/*
+ * Free the connections closed during the last batch of events, except
+ * those an io_uring request in flight still points at.
+ */
+static void engine_reap (struct engine_worker *w)
+{
+        struct engine_conn *ec, **link = &w->closed;
+
+        while ((ec = *link) != NULL) {
+                if (ec->inflight > 0) {
+                        link = &ec->next;
+                        continue;
+                }
+                *link = ec->next;
+                poolfree (ec);
+        }
+}
+
+static void engine_head (struct engine_worker *w, struct engine_conn *ec,
+                         unsigned int events);
+static void engine_connect (struct engine_worker *w, struct engine_conn *ec);
+
+/*
+ * The response is through and the client keeps its connection open:
+ * wait for its next request, which may already be read ahead.
+ */
+static void engine_next (struct engine_worker *w, struct engine_conn *ec)
+{
+        engine_watch (w, &ec->server, 0);
+        if (handle_connection_next (&ec->conn) < 0) {
+                engine_close (w, ec, 0);
+                return;
+        }
+
+        ec->server.fd = -1;
+        ec->state = ES_HEAD;
+        engine_deadline (w, ec, TIMEOUT_IDLE, config->keepalive_timeout);
+        engine_watch (w, &ec->client, EPOLLIN | EPOLLRDHUP);
+        engine_head (w, ec, 0);
+}
+
+/*
+ * The relay is over; only what is still buffered goes out, client first.
+ * Once a side has nothing more to write it is done with, unless the
+ * client is kept for another request.
+ */
+static void engine_flush (struct engine_worker *w, struct engine_conn *ec,
+                          struct engine_handle *h, unsigned int events)
+{
+        struct conn_s *connptr = &ec->conn;
+        size_t to_client, to_server;
+
+        if (h == &ec->client && (events & EPOLLOUT)
+            && relay_connection_io (connptr, MYPOLL_WRITE, 0) < 0) {
+                engine_close (w, ec, 0);
+                return;
+        }
+        if (h == &ec->server && (events & EPOLLOUT)
+            && relay_connection_io (connptr, 0, MYPOLL_WRITE) < 0) {
+                engine_close (w, ec, 0);
+                return;
+        }
+
+        relay_connection_pending (connptr, &to_client, &to_server);
+        if (to_client > 0) {
+                engine_watch (w, &ec->client, EPOLLOUT);
+                return;
+        }
+        engine_watch (w, &ec->client, 0);
+        if (connptr->keep_alive) {
+                engine_next (w, ec);
+                return;
+        }
+        shutdown (connptr->client_fd, SHUT_WR);
+
+        if (to_server > 0) {
+                engine_watch (w, &ec->server, EPOLLOUT);
+                return;
+        }
+
+        engine_close (w, ec, 0);
+}
+
+/*
+ * Start relaying: from here on both sockets stay non-blocking.
+ */
+static void engine_relay_start (struct engine_worker *w,
+                                struct engine_conn *ec)
+{
+        short cev, sev;
+
+        engine_blocking (ec, 0);
+        ec->state = ES_RELAY;
+        engine_deadline (w, ec, TIMEOUT_IDLE, config->idletimeout);
+        if (relay_connection_start (&ec->conn) < 0) {
+                ec->state = ES_FLUSH;
+                engine_flush (w, ec, &ec->client, 0);
+                return;
+        }
+
+        relay_connection_events (&ec->conn, &cev, &sev);
+        engine_watch (w, &ec->client, engine_events (cev));
+        engine_watch (w, &ec->server, engine_events (sev));
+}
+
+static void engine_relay (struct engine_worker *w, struct engine_conn *ec,
+                          struct engine_handle *h, unsigned int events)
+{
+        short cev, sev;
+        int ret;
+
+        if (h == &ec->client)
+                ret = relay_connection_io (&ec->conn, mypoll_events (events), 0);
+        else
+                ret = relay_connection_io (&ec->conn, 0, mypoll_events (events));
+
+        if (ret < 0) {
+                ec->state = ES_FLUSH;
+                engine_watch (w, &ec->client, 0);
+                engine_watch (w, &ec->server, 0);
+                engine_flush (w, ec, h, 0);
+                return;
+        }
+
+        relay_connection_events (&ec->conn, &cev, &sev);
+        engine_watch (w, &ec->client, engine_events (cev));
+        engine_watch (w, &ec->server, engine_events (sev));
+}
+
+/*
+ * Until the response head is in, watch the server for it, along with
+ * whatever sending the rest of the request body on takes.
+ */
+static void engine_request_watch (struct engine_worker *w,
+                                  struct engine_conn *ec)
+{
+        short cev, sev;
+
+        relay_request_events (&ec->conn, &cev, &sev);
+        engine_watch (w, &ec->client, engine_events (cev));
+        engine_watch (w, &ec->server, engine_events (sev));
+}
+
+/*
+ * Relay the request body while waiting for the response head.  Once
+ * the head is complete (or the server gave up), pass it on.
+ */
+static void engine_response (struct engine_worker *w, struct engine_conn *ec,
+                             struct engine_handle *h, unsigned int events)
+{
+        int ret;
+
+        if (h == &ec->client || (events & EPOLLOUT)) {
+                if (relay_connection_io (&ec->conn,
+                                         h == &ec->client ? MYPOLL_READ : 0,
+                                         h == &ec->server ? MYPOLL_WRITE : 0)
+                    < 0) {
+                        engine_close (w, ec, -1);
+                        return;
+                }
+        }
+
+        ret = 0;
+        if (h == &ec->server
+            && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                ret = peek_http_head (ec->conn.server_fd, MAXBUFFSIZE);
+                if (ret == 0 && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                        ret = -1;
+        }
+        if (ret == 0) {
+                engine_request_watch (w, ec);
+                return;
+        }
+
+        engine_watch (w, &ec->client, 0);
+        engine_watch (w, &ec->server, 0);
+        engine_blocking (ec, 1);
+
+        ret = handle_connection_response (&ec->conn);
+        if (ret > 0) {
+                engine_blocking (ec, 0);
+                engine_request_watch (w, ec);
+                return;
+        }
+        if (ret == -3) {
+                handle_connection_retry (&ec->conn);
+                engine_connect (w, ec);
+                return;
+        }
+        if (ret < 0) {
+                engine_close (w, ec, -1);
+                return;
+        }
+
+        engine_relay_start (w, ec);
+}
+
+/*
+ * Start a connect to the next address of the server that takes one,
+ * and have the one after tried a little later.  Once no connect is
+ * under way and no address is left, the connection fails.
+ */
+static void engine_connect_next (struct engine_worker *w,
+                                 struct engine_conn *ec)
+{
+        unsigned int i;
+        int fd;
+
+        engine_unqueue (w, ec);
+
+        for (i = 0; i < CONNECT_ATTEMPTS_MAX && ec->attempts[i].fd >= 0; i++)
+                ;
+        for (; ec->addr_cur && i < CONNECT_ATTEMPTS_MAX;
+             ec->addr_cur = ec->addr_cur->ai_next) {
+                fd = opensock_begin (ec->addr_cur, ec->conn.server_ip_addr,
+                                     !ec->addrs->ai_next);
+                if (fd < 0)
+                        continue;
+
+                ec->attempts[i].fd = fd;
+                ec->attempt_addr[i] = ec->addr_cur;
+                ec->attempt_started[i] = engine_msec ();
+                ec->nattempts++;
+                engine_watch (w, &ec->attempts[i], EPOLLOUT);
+                ec->addr_cur = ec->addr_cur->ai_next;
+                break;
+        }
+
+        if (ec->nattempts > 0) {
+                ec->state = ES_CONNECT;
+                if (ec->addr_cur && ec->nattempts < CONNECT_ATTEMPTS_MAX
+                    && config->connect_attempt_delay > 0 && w->timer.fd >= 0)
+                        engine_queue (w, ec);
+                return;
+        }
+
+        log_message (LOG_ERR,
+                     "opensock: Could not establish a connection to %s",
+                     ec->conn.request->host);
+        handle_connection_connect_error (&ec->conn);
+        engine_close (w, ec, -1);
+}
+
+/*
+ * Start connecting to the addresses of the server.
+ */
+static void engine_connect_start (struct engine_worker *w,
+                                  struct engine_conn *ec)
+{
+        ec->addrs = ec->addr_cur = opensock_order (ec->addrs);
+        engine_deadline (w, ec, TIMEOUT_CONNECT,
+                         timeout_for (TIMEOUT_CONNECT));
+        engine_connect_next (w, ec);
+}
+
+/*
+ * The server connection is up: go through the handshake with a SOCKS
+ * upstream proxy, a reply of the proxy at a time, and send the request
+ * on.
+ */
+static void engine_server_ready (struct engine_worker *w,
+                                 struct engine_conn *ec)
+{
+        int ret;
+
+        if (ec->state != ES_HANDSHAKE) {
+                ret = ec->conn.upstream_proxy ? TIMEOUT_HANDSHAKE
+                        : TIMEOUT_RESPONSE;
+                engine_deadline (w, ec, ret, timeout_for (ret));
+        }
+
+        ret = handle_connection_handshake (&ec->conn);
+        if (ret == 0) {
+                ec->state = ES_HANDSHAKE;
+                engine_watch (w, &ec->server, EPOLLIN | EPOLLRDHUP);
+                return;
+        }
+        engine_watch (w, &ec->server, 0);
+        if (ret < 0) {
+                engine_close (w, ec, -1);
+                return;
+        }
+
+        engine_blocking (ec, 1);
+        ret = handle_connection_server (&ec->conn);
+        if (ret == -3) {
+                handle_connection_retry (&ec->conn);
+                engine_connect (w, ec);
+                return;
+        }
+        if (ret < 0) {
+                engine_close (w, ec, -1);
+                return;
+        }
+
+        if (ret > 0) {
+                engine_blocking (ec, 0);
+                ec->state = ES_RESPONSE;
+                engine_deadline (w, ec, TIMEOUT_RESPONSE,
+                                 timeout_for (TIMEOUT_RESPONSE));
+                engine_request_watch (w, ec);
+                return;
+        }
+
+        engine_relay_start (w, ec);
+}
+
+/*
+ * One of the connects to the server has finished one way or the other.
+ * The first to get through is kept, and the others are given up.
+ */
+static void engine_connected (struct engine_worker *w, struct engine_conn *ec,
+                              struct engine_handle *h)
+{
+        unsigned int i = h - ec->attempts;
+        int fd = h->fd;
+
+        engine_watch (w, h, 0);
+        h->fd = -1;
+        ec->nattempts--;
+
+        if (opensock_end (fd, ec->attempt_addr[i]) < 0) {
+                close (fd);
+                /* no need to wait for the next address */
+                engine_connect_next (w, ec);
+                return;
+        }
+
+        engine_attempts_close (w, ec);
+        ec->conn.server_fd = ec->server.fd = fd;
+        dns_free (ec->addrs);
+        ec->addrs = ec->addr_cur = NULL;
+
+        engine_server_ready (w, ec);
+}
+
+/*
+ * The resolver is through with the server's name.
+ */
+static void engine_resolved (void *data, void *waiter, struct addrinfo *res)
+{
+        struct engine_worker *w = (struct engine_worker *) data;
+        struct engine_conn *ec = (struct engine_conn *) waiter;
+
+        ec->addrs = res;
+        ec->state = ES_CONNECT;
+        engine_connect_start (w, ec);
+}
+
+/*
+ * The resolver opened a socket for a lookup, or is about to close it.
+ */
+static void engine_dns_watch (void *data, unsigned int slot, int fd)
+{
+        struct engine_worker *w = (struct engine_worker *) data;
+        struct engine_handle *h = &w->dns[slot];
+
+        if (fd < 0) {
+                engine_watch (w, h, 0);
+                h->fd = -1;
+        } else {
+                h->fd = fd;
+                engine_watch (w, h, EPOLLIN);
+        }
+}
+
+/*
+ * Look the server up and start connecting to it.  Unless the resolver
+ * has the addresses at hand, the connection waits for its answer.
+ */
+static void engine_connect (struct engine_worker *w, struct engine_conn *ec)
+{
+        const char *host;
+        int port;
+
+        ec->server.fd = -1;
+        host = handle_connection_target (&ec->conn, &port);
+        log_message (LOG_INFO,
+                     "opensock: opening connection to %s:%d", host, port);
+
+        engine_blocking (ec, 0);
+        if (!w->resolver)
+                ec->addrs = resolve_host (host, port);
+        else if (!dns_resolve_cached (host, port, &ec->addrs)
+                 && dns_client_query (w->resolver, host, port, ec) == 0) {
+                ec->state = ES_RESOLVE;
+                engine_deadline (w, ec, TIMEOUT_DNS,
+                                 timeout_for (TIMEOUT_DNS));
+                return;
+        }
+
+        engine_connect_start (w, ec);
+}
+
+/*
+ * Data arrived from a client: once the whole request head is
+ * there, read and process it and get a connection to the server, out
+ * of the origin pool or a new one.
+ */
+static void engine_head (struct engine_worker *w, struct engine_conn *ec,
+                         unsigned int events)
+{
+        int ret;
+
+        if (ec->failed) {
+                engine_close (w, ec, -1);
+                return;
+        }
+
+        ret = readahead_has_head (ec->conn.client_fd, &ec->conn.creadahead);
+        if (ret == 0 && !(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                return;
+
+        engine_watch (w, &ec->client, 0);
+        engine_blocking (ec, 1);
+
+        ret = handle_connection_request (&ec->conn);
+        if (ret < 0) {
+                engine_close (w, ec, ret);
+                return;
+        }
+
+        if (handle_connection_pooled (&ec->conn)) {
+                ec->server.fd = ec->conn.server_fd;
+                engine_server_ready (w, ec);
+                return;
+        }
+
+        engine_connect (w, ec);
+}
+
+static void engine_event (struct engine_worker *w, struct engine_handle *h,
+                          unsigned int events)
+{
+        struct engine_conn *ec = h->ec;
+
+        /*
+         * Skip events for sockets that are no longer watched; they were
+         * queued before the connection moved on (or went away.)
+         */
+        if (ec->state == ES_CLOSED || h->events == 0)
+                return;
+
+        /*
+         * The idle timeout starts over with every bit relayed, and so
+         * does the wait for the response while the request body goes
+         * out.  The request head, once begun, has to be complete in
+         * time however it trickles in.
+         */
+        if (ec->state == ES_RELAY || ec->state == ES_FLUSH)
+                engine_deadline (w, ec, TIMEOUT_IDLE, config->idletimeout);
+        else if (ec->state == ES_RESPONSE
+                 && (h == &ec->client || (events & EPOLLOUT)))
+                engine_deadline (w, ec, TIMEOUT_RESPONSE,
+                                 timeout_for (TIMEOUT_RESPONSE));
+        else if (ec->state == ES_HEAD && ec->timer.phase == TIMEOUT_IDLE)
+                engine_deadline (w, ec, TIMEOUT_HEAD,
+                                 timeout_for (TIMEOUT_HEAD));
+
+        switch (ec->state) {
+        case ES_HEAD:
+                engine_head (w, ec, events);
+                break;
+        case ES_RESOLVE:
+                break;
+        case ES_CONNECT:
+                engine_connected (w, ec, h);
+                break;
+        case ES_HANDSHAKE:
+                engine_server_ready (w, ec);
+                break;
+        case ES_RESPONSE:
+                engine_response (w, ec, h, events);
+                break;
+        case ES_RELAY:
+                engine_relay (w, ec, h, events);
+                break;
+        case ES_FLUSH:
+                engine_flush (w, ec, h, events);
+                break;
+        case ES_LINGER:
+                if (handle_connection_drain (&ec->conn) < 0)
+                        engine_close (w, ec, 0);
+                break;
+        case ES_CLOSED:
+                break;
+        }
+}
+
+/*
+ * Stop or resume watching the listening sockets.
+ */
+static void engine_accepting (struct engine_worker *w, unsigned int on)
+{
+        size_t i;
+
+        if (w->accepting == on)
+                return;
+
+        for (i = 0; i < w->nlisteners; i++)
+                engine_watch (w, &w->listeners[i],
+                              on ? EPOLLIN | EPOLLEXCLUSIVE : 0);
+        w->accepting = on;
+}
+
+/*
+ * Take on a freshly accepted client; the caller holds a slot for it.
+ */
+static void engine_accept_fd (struct engine_worker *w, int fd,
+                              union sockaddr_union *addr)
+{
+        struct engine_conn *ec;
+        unsigned int i;
+        int ret;
+
+        ec = (struct engine_conn *) pool_calloc (sizeof (*ec));
+        if (!ec) {
+                close (fd);
+                engine_slot_put ();
+                log_message (LOG_CRIT,
+                             "Could not allocate memory for connection.");
+                return;
+        }
+
+        conn_struct_init (&ec->conn);
+        ec->conn.client_fd = fd;
+        memcpy (&ec->addr, addr, sizeof (*addr));
+
+        ret = handle_connection_setup (&ec->conn, &ec->addr);
+        if (ret == -2) {
+                poolfree (ec);
+                engine_slot_put ();
+                return;
+        }
+
+        ec->failed = (ret < 0);
+        ec->state = ES_HEAD;
+        ec->timer.owner = ec;
+        engine_deadline (w, ec, TIMEOUT_HEAD, timeout_for (TIMEOUT_HEAD));
+        ec->client.ec = ec->server.ec = ec;
+        ec->client.fd = fd;
+        ec->server.fd = -1;
+        for (i = 0; i < CONNECT_ATTEMPTS_MAX; i++) {
+                ec->attempts[i].ec = ec;
+                ec->attempts[i].fd = -1;
+        }
+
+        ec->next = w->conns;
+        if (w->conns)
+                w->conns->prev = ec;
+        w->conns = ec;
+
+        /* The short response needs nothing from the client first. */
+        if (ec->failed && config->fast_reject) {
+                engine_close (w, ec, -1);
+                return;
+        }
+
+        engine_watch (w, &ec->client, EPOLLIN | EPOLLRDHUP);
+}
+
+static int engine_accept_slot (struct engine_worker *w)
+{
+        if (engine_slot_get ())
+                return 1;
+
+        log_message (LOG_WARNING,
+                     "Maximum number of connections reached. "
+                     "Refusing new connections.");
+        engine_accepting (w, FALSE);
+        return 0;
+}
+
+static void engine_accept (struct engine_worker *w, int listenfd)
+{
+        union sockaddr_union addr;
+        socklen_t addrlen;
+        int fd, i;
+
+        for (i = 0; i < ENGINE_ACCEPT_BATCH; i++) {
+                if (!engine_accept_slot (w))
+                        return;
+
+                addrlen = sizeof (addr);
+#ifdef HAVE_ACCEPT4
+                fd = accept4 (listenfd, (struct sockaddr *) &addr, &addrlen,
+                              SOCK_NONBLOCK);
+#else
+                fd = accept (listenfd, (struct sockaddr *) &addr, &addrlen);
+                if (fd >= 0 && socket_nonblocking (fd, 1) < 0) {
+                        close (fd);
+                        fd = -1;
+                }
+#endif
+                if (fd < 0) {
+                        engine_slot_put ();
+                        if (errno != EAGAIN && errno != EINTR)
+                                log_message (LOG_ERR,
+                                             "Accept returned an error (%s) ... retrying.",
+                                             strerror (errno));
+                        return;
+                }
+
+                engine_accept_fd (w, fd, &addr);
+        }
+}
+
+/*
+ * A connection has taken too long for the phase it is in.  Where the
+ * server is to blame, the client gets an error page.
+ */
+static void engine_expired (struct timer_entry *t, void *data)
+{
+        struct engine_worker *w = (struct engine_worker *) data;
+        struct engine_conn *ec = (struct engine_conn *) t->owner;
+
+        if (t->phase == TIMEOUT_LINGER) {
+                engine_close (w, ec, 0);
+                return;
+        }
+
+        handle_connection_timeout (&ec->conn, t->phase);
+        engine_close (w, ec, t->phase == TIMEOUT_HEAD
+                      || t->phase == TIMEOUT_IDLE ? 0 : -1);
+}
+
+/*
+ * Try the next address for the connections whose connects have not got
+ * through in time.
+ */
+static void engine_timer_fired (struct engine_worker *w)
+{
+        unsigned long now = engine_msec ();
+        uint64_t expirations;
+
+        if (read (w->timer.fd, &expirations, sizeof (expirations)) < 0
+            && errno != EAGAIN)
+                log_message (LOG_ERR, "engine: reading the timerfd: %s",
+                             strerror (errno));
+        w->timer_due = 0;
+
+        while (w->due_first && (long) (now - w->due_first->due) >= 0)
+                engine_connect_next (w, w->due_first);
+}
+
+/*
+ * Set the timerfd to go off when the first connection in the queue is
+ * due.
+ */
+static void engine_timer_set (struct engine_worker *w)
+{
+        struct itimerspec its;
+        unsigned long now;
+        long left;
+
+        if (w->timer.fd < 0 || !w->due_first
+            || w->timer_due == w->due_first->due)
+                return;
+
+        now = engine_msec ();
+        left = (long) (w->due_first->due - now);
+        if (left < 1)
+                left = 1;
+
+        memset (&its, 0, sizeof (its));
+        its.it_value.tv_sec = left / 1000;
+        its.it_value.tv_nsec = (left % 1000) * 1000000;
+        if (timerfd_settime (w->timer.fd, 0, &its, NULL) < 0)
+                log_message (LOG_ERR, "engine: timerfd_settime: %s",
+                             strerror (errno));
+        w->timer_due = w->due_first->due;
+}
+
+/*
+ * What is left to do once a batch of events has been handled.
+ */
+static void engine_batch_done (struct engine_worker *w, time_t *last_tick)
+{
+        time_t now;
+
+        engine_reap (w);
+        engine_timer_set (w);
+
+        now = time (NULL);
+        if (now != *last_tick) {
+                if (w->resolver)
+                        dns_client_tick (w->resolver, now);
+                timer_wheel_run (&w->wheel, now, engine_expired, w);
+                *last_tick = now;
+        }
+
+        if (!w->accepting && nconns < config->maxclients)
+                engine_accepting (w, TRUE);
+}
+
+static void engine_epoll_loop (struct engine_worker *w)
+{
+        struct epoll_event events[ENGINE_MAX_EVENTS];
+        struct engine_handle *h;
+        time_t last_tick = 0;
+        int i, n;
+
+        while (!config->quit) {
+                n = epoll_wait (w->epfd, events, ENGINE_MAX_EVENTS, 1000);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_message (LOG_ERR, "engine: epoll_wait: %s",
+                                     strerror (errno));
+                        break;
+                }
+
+                for (i = 0; i < n; i++) {
+                        h = events[i].data.ptr;
+                        if (ENGINE_DNS (w, h))
+                                dns_client_read (w->resolver, h->fd);
+                        else if (ENGINE_TIMER (w, h))
+                                engine_timer_fired (w);
+                        else if (h->ec == NULL)
+                                engine_accept (w, h->fd);
+                        else
+                                engine_event (w, h, events[i].events);
+                }
+
+                engine_batch_done (w, &last_tick);
+        }
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * Take on a client an accept request handed over.  A multishot accept
+ * goes on handing clients over until its cancellation gets through, so
+ * once MaxClients is reached (or the worker is done) a few may still
+ * come: they get the same 503 as clients shed by the thread pool.
+ */
+static void engine_uring_take (struct engine_worker *w, int fd)
+{
+        union sockaddr_union addr;
+        socklen_t addrlen = sizeof (addr);
+
+        if (config->quit || !engine_accept_slot (w)) {
+                log_message (LOG_INFO, "No room for another client, "
+                             "dropping connection (file descriptor %d)",
+                             fd);
+                child_shed_client (fd);
+                return;
+        }
+
+        memset (&addr, 0, sizeof (addr));
+        getpeername (fd, (struct sockaddr *) &addr, &addrlen);
+        engine_accept_fd (w, fd, &addr);
+
+        /* That was the last slot: let the next clients wait in the
+         * listen queue rather than be handed over and turned away. */
+        if (nconns >= config->maxclients)
+                engine_accepting (w, FALSE);
+}
+
+/*
+ * A listening socket's accept request completed with "res".
+ */
+static void engine_uring_accepted (struct engine_worker *w,
+                                   struct engine_handle *h, int res)
+{
+        if (res >= 0) {
+                engine_uring_take (w, res);
+        } else if (res == -EINVAL && w->multishot) {
+                log_message (LOG_INFO, "engine: no multishot accept, "
+                             "accepting one connection at a time");
+                w->multishot = FALSE;
+        } else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+                log_message (LOG_ERR,
+                             "Accept returned an error (%s) ... retrying.",
+                             strerror (-res));
+        }
+
+        if (!h->req && w->accepting)
+                engine_uring_arm (w, h);
+}
+
+static void engine_uring_complete (struct engine_worker *w,
+                                   struct io_uring_cqe *cqe)
+{
+        unsigned long data = (unsigned long) cqe->user_data;
+        int res = cqe->res, more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        struct engine_handle *h;
+        struct engine_conn *ec;
+        struct engine_req *req;
+
+        uring_cqe_seen (w->ring);
+
+        if (data == ENGINE_URING_CANCEL)
+                return;
+        if (data == ENGINE_URING_TICK) {
+                w->ticking = FALSE;
+                return;
+        }
+
+        req = (struct engine_req *) data;
+        h = req->h;
+        ec = h->ec;
+        if (!more) {
+                w->pending--;
+                if (ec)
+                        ec->inflight--;
+        }
+
+        if (req->cancelled) {
+                /* A multishot accept may still hand over a client. */
+                if (!ec && !ENGINE_DNS (w, h) && !ENGINE_TIMER (w, h)
+                    && res >= 0)
+                        engine_uring_take (w, res);
+                if (!more)
+                        pool_free (req);
+                return;
+        }
+        if (!more) {
+                h->req = NULL;
+                pool_free (req);
+        }
+
+        if (ENGINE_DNS (w, h) || ENGINE_TIMER (w, h)) {
+                if (ENGINE_DNS (w, h))
+                        dns_client_read (w->resolver, h->fd);
+                else
+                        engine_timer_fired (w);
+                if (h->events && !h->req)
+                        engine_uring_arm (w, h);
+                return;
+        }
+        if (!ec) {
+                engine_uring_accepted (w, h, res);
+                return;
+        }
+
+        engine_event (w, h, res < 0 ? EPOLLERR : (unsigned int) res);
+
+        /* Polls fire once; keep watching what is still wanted. */
+        if (ec->state != ES_CLOSED && h->events && !h->req)
+                engine_uring_arm (w, h);
+}
+
+/*
+ * Submit what is queued and wait for at least one completion, or for
+ * the one second tick, then handle every completion there is.
+ */
+static int engine_uring_wait (struct engine_worker *w)
+{
+        struct io_uring_sqe *sqe;
+        struct io_uring_cqe *cqe;
+
+        if (!w->ticking && (sqe = uring_get_sqe (w->ring)) != NULL) {
+                w->tick.tv_sec = 1;
+                w->tick.tv_nsec = 0;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->addr = (unsigned long) &w->tick;
+                sqe->len = 1;
+                sqe->user_data = ENGINE_URING_TICK;
+                w->ticking = TRUE;
+        }
+
+        if (uring_submit (w->ring, 1) < 0 && errno != EINTR) {
+                log_message (LOG_ERR, "engine: io_uring_enter: %s",
+                             strerror (errno));
+                return -1;
+        }
+
+        while ((cqe = uring_peek_cqe (w->ring)) != NULL)
+                engine_uring_complete (w, cqe);
+
+        return 0;
+}
+
+static void engine_uring_loop (struct engine_worker *w)
+{
+        time_t last_tick = 0;
+
+        while (!config->quit) {
+                if (engine_uring_wait (w) < 0)
+                        break;
+                engine_batch_done (w, &last_tick);
+        }
+}
+#endif
+
+static void *engine_worker_thread (void *data)
+{
+        struct engine_worker *w = data;
+        struct engine_conn *ec;
+        int i;
+
+        timer_wheel_init (&w->wheel, time (NULL));
+        for (i = 0; i < DNS_MAX_SOCKETS; i++)
+                w->dns[i].fd = -1;
+        w->resolver = dns_client_new (engine_resolved, engine_dns_watch, w);
+
+        w->timer.fd = timerfd_create (CLOCK_MONOTONIC,
+                                      TFD_NONBLOCK | TFD_CLOEXEC);
+        if (w->timer.fd < 0)
+                log_message (LOG_WARNING, "engine: no timerfd (%s), "
+                             "connecting to one address at a time",
+                             strerror (errno));
+        else
+                engine_watch (w, &w->timer, EPOLLIN);
+
+        engine_accepting (w, TRUE);
+
+#ifdef HAVE_LINUX_IO_URING_H
+        if (ENGINE_URING (w))
+                engine_uring_loop (w);
+        else
+#endif
+                engine_epoll_loop (w);
+
+        engine_accepting (w, FALSE);
+        while (w->conns)
+                engine_close (w, w->conns, 0);
+        for (i = 0; i < DNS_MAX_SOCKETS; i++)
+                engine_watch (w, &w->dns[i], 0);
+        engine_watch (w, &w->timer, 0);
+
+#ifdef HAVE_LINUX_IO_URING_H
+        /* Give the cancelled requests a moment to come back. */
+        for (i = 0; ENGINE_URING (w) && w->pending > 0 && i < 3; i++)
+                if (engine_uring_wait (w) < 0)
+                        break;
+#endif
+        (void) i;
+
+        /* Whatever did not come back by now never will. */
+        for (ec = w->closed; ec; ec = ec->next)
+                ec->inflight = 0;
+        engine_reap (w);
+        dns_client_free (w->resolver);
+        if (w->timer.fd >= 0)
+                close (w->timer.fd);
+
+        return NULL;
+}
+
+/*
+ * The number of workers the engine is going to start.
+ */
+unsigned int engine_worker_count (void)
+{
+        long ncpu;
+
+        if (config->workers > 0)
+                return config->workers;
+
+        ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+        return ncpu > 0 ? (unsigned int) ncpu : 1;
+}
+
+/*
+ * Run the event engine on the listening sockets until we are told to
+ * quit.  The calling thread only takes care of reloads.
+ *
+ * With "copies" > 1 the list holds that many SO_REUSEPORT sockets per
+ * address (see listen_sock()), and each worker gets one of every
+ * address to itself instead of all of them sharing every socket.
+ */
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * Give every worker an io_uring.  Returns FALSE, leaving none of them
+ * with one, if the kernel does not support it.
+ */
+static int engine_uring_setup (void)
+{
+        size_t i;
+
+        for (i = 0; i < nworkers; i++) {
+                struct engine_worker *w = &workers[i];
+
+                w->ring = (struct uring *) safecalloc (1, sizeof (*w->ring));
+                if (!w->ring || uring_init (w->ring, ENGINE_URING_ENTRIES) < 0)
+                        break;
+                w->multishot = TRUE;
+        }
+
+        if (i == nworkers)
+                return TRUE;
+
+        log_message (LOG_WARNING, "io_uring is not available (%s), "
+                     "falling back to epoll", strerror (errno));
+        do {
+                if (workers[i].ring)
+                        uring_exit (workers[i].ring);
+                safefree (workers[i].ring);
+        } while (i-- > 0);
+        return FALSE;
+}
+
+static void engine_uring_teardown (struct engine_worker *w)
+{
+        if (!w->ring)
+                return;
+        uring_exit (w->ring);
+        safefree (w->ring);
+}
+#endif
+
+void engine_main_loop (sblist *listen_fds, unsigned int copies)
+{
+        size_t i, j, nfds = sblist_getsize (listen_fds);
+        const char *backend = "epoll";
+        sigset_t mask, oldmask;
+
+        nworkers = copies > 1 ? copies : engine_worker_count ();
+
+        workers = (struct engine_worker *)
+                safecalloc (nworkers, sizeof (struct engine_worker));
+        if (!workers) {
+                log_message (LOG_CRIT, "Could not allocate the engine workers.");
+                return;
+        }
+
+#ifdef HAVE_LINUX_IO_URING_H
+        if (config->ioengine == IOENGINE_URING && engine_uring_setup ())
+                backend = "io_uring";
+#endif
+
+        /*
+         * io_uring waits for a client to accept on its own, which it
+         * only does for a blocking socket on older kernels.
+         */
+        for (j = 0; j < nfds; j++)
+                socket_nonblocking (*(int *) sblist_get (listen_fds, j),
+                                    !ENGINE_URING (&workers[0]));
+
+        /*
+         * The signals telling us to quit or reload go to this thread,
+         * so that they cut its sleep short; the workers are woken up
+         * below.
+         */
+        sigemptyset (&mask);
+        sigaddset (&mask, SIGTERM);
+        sigaddset (&mask, SIGINT);
+        sigaddset (&mask, SIGHUP);
+        sigaddset (&mask, SIGUSR1);
+        pthread_sigmask (SIG_BLOCK, &mask, &oldmask);
+
+        for (i = 0; i < nworkers; i++) {
+                struct engine_worker *w = &workers[i];
+
+                w->epfd = ENGINE_URING (w) ? -1
+                        : epoll_create (ENGINE_MAX_EVENTS);
+                w->listeners = (struct engine_handle *)
+                        safecalloc (nfds, sizeof (struct engine_handle));
+                if ((w->epfd < 0 && !ENGINE_URING (w)) || !w->listeners) {
+                        log_message (LOG_CRIT,
+                                     "Could not set up engine worker %zu: %s",
+                                     i, strerror (errno));
+                        break;
+                }
+
+                for (j = 0; j < nfds; j++) {
+                        if (copies > 1 && j % copies != i)
+                                continue;
+                        w->listeners[w->nlisteners++].fd =
+                                *(int *) sblist_get (listen_fds, j);
+                }
+
+                if (pthread_create (&w->thread, NULL,
+                                    engine_worker_thread, w) != 0) {
+                        log_message (LOG_CRIT,
+                                     "Could not start engine worker %zu.", i);
+                        break;
+                }
+        }
+
+        pthread_sigmask (SIG_SETMASK, &oldmask, NULL);
+
+        if (i < nworkers) {
+                if (workers[i].epfd >= 0)
+                        close (workers[i].epfd);
+                safefree (workers[i].listeners);
+#ifdef HAVE_LINUX_IO_URING_H
+                for (j = i; j < nworkers; j++)
+                        engine_uring_teardown (&workers[j]);
+#endif
+                nworkers = i;
+                /*
+                 * Connections to the sockets of a worker that did not
+                 * start would never be accepted.
+                 */
+                if (nworkers == 0 || copies > 1)
+                        config->quit = TRUE;
+        }
+
+        log_message (LOG_INFO, "Started %zu event engine workers (%s).",
+                     nworkers, backend);
+
+        while (!config->quit) {
+                /* Handle log rotation if it was requested */
+                if (received_sighup) {
+
+                        reload_config (1);
+
+#ifdef FILTER_ENABLE
+                        filter_reload ();
+#endif /* FILTER_ENABLE */
+
+                        received_sighup = FALSE;
+                }
+
+                sleep (1);
+        }
+
+        /* Interrupt the workers' wait rather than sit out their tick. */
+        for (i = 0; i < nworkers; i++)
+                pthread_kill (workers[i].thread, SIGCHLD);
+
+        for (i = 0; i < nworkers; i++) {
+                pthread_join (workers[i].thread, NULL);
+                if (workers[i].epfd >= 0)
+                        close (workers[i].epfd);
+                safefree (workers[i].listeners);
+#ifdef HAVE_LINUX_IO_URING_H
+                engine_uring_teardown (&workers[i]);
+#endif
+        }
+
+        safefree (workers);
+        nworkers = 0;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,76 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include "header-tokens.h"
+
+#ifdef HAVE_GPERF
+#include "header-tokens-gperf.inc"
+#else
+
+#include <strings.h>
+
+const struct http_header_entry *
+http_header_find (register const char *str, register size_t len)
+{
+  size_t i;
+  static const struct http_header_entry wordlist[] =
+    {
+      {"host", HDR_host},
+      {"content-length", HDR_content_length},
+      {"transfer-encoding", HDR_transfer_encoding},
+      {"connection", HDR_connection},
+      {"proxy-connection", HDR_proxy_connection},
+      {"keep-alive", HDR_keep_alive},
+      {"te", HDR_te},
+      {"trailer", HDR_trailer},
+      {"trailers", HDR_trailers},
+      {"upgrade", HDR_upgrade},
+      {"via", HDR_via},
+      {"proxy-authorization", HDR_proxy_authorization},
+      {"proxy-authenticate", HDR_proxy_authenticate},
+      {"authorization", HDR_authorization},
+      {"www-authenticate", HDR_www_authenticate},
+      {"cookie", HDR_cookie},
+      {"set-cookie", HDR_set_cookie},
+      {"location", HDR_location},
+      {"expect", HDR_expect},
+      {"content-type", HDR_content_type},
+      {"content-encoding", HDR_content_encoding},
+      {"user-agent", HDR_user_agent},
+      {"accept", HDR_accept},
+      {"accept-encoding", HDR_accept_encoding},
+      {"accept-language", HDR_accept_language},
+      {"referer", HDR_referer},
+      {"date", HDR_date},
+      {"server", HDR_server},
+      {"cache-control", HDR_cache_control},
+      {"pragma", HDR_pragma},
+      {"expires", HDR_expires},
+      {"age", HDR_age},
+      {"etag", HDR_etag},
+      {"last-modified", HDR_last_modified},
+      {"if-modified-since", HDR_if_modified_since},
+      {"if-none-match", HDR_if_none_match},
+      {"range", HDR_range},
+      {"origin", HDR_origin},
+      {"vary", HDR_vary},
+      {"x-forwarded-for", HDR_x_forwarded_for}
+    };
+
+	for(i=0;i<sizeof(wordlist)/sizeof(wordlist[0]);++i) {
+		if(strlen(wordlist[i].name) == len &&
+		   !strncasecmp(str, wordlist[i].name, len))
+			return &wordlist[i];
+	}
+	return 0;
+}
+
+#endif
+
+enum http_header http_header_id(const char *name, size_t len) {
+	const struct http_header_entry *e = http_header_find(name, len);
+	return e ? e->value : HDR_NIL;
+}
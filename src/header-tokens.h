@@ -0,0 +1,61 @@
+#ifndef HEADER_TOKENS_H
+#define HEADER_TOKENS_H
+
+#include <stddef.h>
+
+/* Well-known HTTP header fields, which get a number of their own when
+   a message head is parsed so that they can be found without comparing
+   names.  The names are in header-tokens.gperf. */
+enum http_header {
+HDR_NIL = 0,
+HDR_host,
+HDR_content_length,
+HDR_transfer_encoding,
+HDR_connection,
+HDR_proxy_connection,
+HDR_keep_alive,
+HDR_te,
+HDR_trailer,
+HDR_trailers,
+HDR_upgrade,
+HDR_via,
+HDR_proxy_authorization,
+HDR_proxy_authenticate,
+HDR_authorization,
+HDR_www_authenticate,
+HDR_cookie,
+HDR_set_cookie,
+HDR_location,
+HDR_expect,
+HDR_content_type,
+HDR_content_encoding,
+HDR_user_agent,
+HDR_accept,
+HDR_accept_encoding,
+HDR_accept_language,
+HDR_referer,
+HDR_date,
+HDR_server,
+HDR_cache_control,
+HDR_pragma,
+HDR_expires,
+HDR_age,
+HDR_etag,
+HDR_last_modified,
+HDR_if_modified_since,
+HDR_if_none_match,
+HDR_range,
+HDR_origin,
+HDR_vary,
+HDR_x_forwarded_for,
+HDR_COUNT /* number of ids, not an id */
+};
+
+struct http_header_entry { const char* name; enum http_header value; };
+
+const struct http_header_entry *
+http_header_find (register const char *str, register size_t len);
+
+enum http_header http_header_id (const char *name, size_t len);
+
+#endif
@@ -0,0 +1,175 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Following the framing of a chunked message body (RFC 9112, section 7.1)
+ * while it is passed along unchanged.  Nothing is decoded or copied; the
+ * scanner only keeps track of where it is in the body, so that the body
+ * can be fed to it in pieces of any size, as they are read, and it can
+ * tell where the body (including any trailer fields) ends.
+ *
+ * The grammar is kept to strictly: a chunk size may only be followed by
+ * whitespace and ";" extensions, and every line has to end with CRLF.
+ * A body the proxy reads differently from the server would leave the
+ * connection out of step, which on a pooled connection is the next
+ * client's problem.
+ */
+
+#include "main.h"
+
+#include "http-chunked.h"
+
+/* The largest chunk accepted: as with the request bodies read before. */
+#define CHUNK_SIZE_MAX 0x0fffffffUL
+
+enum chunked_state {
+        CK_SIZE_START = 0,      /* first digit of a chunk size */
+        CK_SIZE,                /* more digits, or the end of the size */
+        CK_SIZE_WS,             /* whitespace after the size */
+        CK_EXT,                 /* chunk extensions, up to the CR */
+        CK_SIZE_LF,             /* the LF ending the chunk size line */
+        CK_DATA,                /* "size" bytes of chunk data */
+        CK_DATA_CR,             /* the CR after the data */
+        CK_DATA_LF,             /* the LF after the data */
+        CK_TRAILER,             /* start of a trailer line */
+        CK_TRAILER_LINE,        /* rest of a trailer line, up to the CR */
+        CK_TRAILER_LF,          /* the LF ending a trailer line */
+        CK_END_LF,              /* the LF of the final empty line */
+        CK_DONE
+};
+
+static int hex_value (char c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+        return -1;
+}
+
+/* Control characters other than tab have no place in a line. */
+#define IS_CTL(c) (((unsigned char) (c) < 0x20 && (c) != '\t') || (c) == 0x7f)
+
+/*
+ * Scan the next "len" bytes of a chunked body.  Returns how many of them
+ * belong to the body: all of them, unless the body ends within them.
+ * Returns -1 if the framing is broken.
+ */
+ssize_t chunked_scan (struct chunked_s *ck, const char *data, size_t len)
+{
+        size_t i = 0, n;
+        int digit;
+        char c;
+
+        while (i < len && ck->state != CK_DONE) {
+                if (ck->state == CK_DATA) {
+                        n = min (len - i, ck->size);
+                        i += n;
+                        ck->size -= n;
+                        if (ck->size == 0)
+                                ck->state = CK_DATA_CR;
+                        continue;
+                }
+
+                c = data[i++];
+                switch (ck->state) {
+                case CK_SIZE_START:
+                case CK_SIZE:
+                        digit = hex_value (c);
+                        if (digit >= 0) {
+                                if (ck->size > CHUNK_SIZE_MAX / 16)
+                                        return -1;
+                                ck->size = ck->size * 16 + digit;
+                                ck->state = CK_SIZE;
+                                break;
+                        }
+                        if (ck->state == CK_SIZE_START)
+                                return -1;
+                        /* fall through */
+                case CK_SIZE_WS:
+                        if (c == ' ' || c == '\t')
+                                ck->state = CK_SIZE_WS;
+                        else if (c == ';')
+                                ck->state = CK_EXT;
+                        else if (c == '\r')
+                                ck->state = CK_SIZE_LF;
+                        else
+                                return -1;
+                        break;
+                case CK_EXT:
+                        if (c == '\r')
+                                ck->state = CK_SIZE_LF;
+                        else if (IS_CTL (c))
+                                return -1;
+                        break;
+                case CK_SIZE_LF:
+                        if (c != '\n')
+                                return -1;
+                        if (ck->size == 0)
+                                ck->state = CK_TRAILER;
+                        else
+                                ck->state = CK_DATA;
+                        break;
+                case CK_DATA_CR:
+                        if (c != '\r')
+                                return -1;
+                        ck->state = CK_DATA_LF;
+                        break;
+                case CK_DATA_LF:
+                        if (c != '\n')
+                                return -1;
+                        ck->state = CK_SIZE_START;
+                        break;
+                case CK_TRAILER:
+                        if (c == '\r')
+                                ck->state = CK_END_LF;
+                        else if (IS_CTL (c))
+                                return -1;
+                        else
+                                ck->state = CK_TRAILER_LINE;
+                        break;
+                case CK_TRAILER_LINE:
+                        if (c == '\r')
+                                ck->state = CK_TRAILER_LF;
+                        else if (IS_CTL (c))
+                                return -1;
+                        break;
+                case CK_TRAILER_LF:
+                        if (c != '\n')
+                                return -1;
+                        ck->state = CK_TRAILER;
+                        break;
+                case CK_END_LF:
+                        if (c != '\n')
+                                return -1;
+                        ck->state = CK_DONE;
+                        break;
+                }
+        }
+
+        return i;
+}
+
+/*
+ * Tell whether the scan has reached the end of the body.
+ */
+int chunked_done (const struct chunked_s *ck)
+{
+        return ck->state == CK_DONE;
+}
@@ -0,0 +1,37 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'http-chunked.c' for detailed information. */
+
+#ifndef TINYPROXY_HTTP_CHUNKED_H
+#define TINYPROXY_HTTP_CHUNKED_H
+
+/*
+ * Where in a chunked message body a scan stopped.  A zero-filled
+ * structure is at the start of a body.
+ */
+struct chunked_s {
+        unsigned int state;
+        unsigned long size;     /* chunk size, or bytes left of its data */
+};
+
+extern ssize_t chunked_scan (struct chunked_s *ck, const char *data,
+                             size_t len);
+extern int chunked_done (const struct chunked_s *ck);
+
+#endif
@@ -0,0 +1,166 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Parsing of HTTP message heads, as read by readahead_head().  A head is
+ * tokenized where it lies: the start line and every header field are
+ * NULL terminated in place, a continuation line (obs-fold) is joined to
+ * the field it continues by moving it down the buffer, and the fields
+ * go into the header map as pointers into the head.  Nothing is
+ * allocated per field, and nothing is copied but continuation lines.
+ * Well-known fields are given their id here, by name and length.
+ */
+
+#include "main.h"
+
+#include "http-head.h"
+
+/*
+ * Define maximum number of header lines that we accept.
+ * This should be big enough to handle legitimate cases,
+ * but limited to avoid DoS.
+ */
+#define MAX_HEADERS 10000
+
+#define IS_OWS(c) ((c) == ' ' || (c) == '\t')
+
+/*
+ * Return the end of the line at "p", without its line ending, and set
+ * "*next" to the start of the line after it.  Returns NULL if there is
+ * no complete line before "end".
+ */
+static char *line_end (char *p, char *end, char **next)
+{
+        char *nl = (char *) memchr (p, '\n', end - p);
+
+        if (!nl)
+                return NULL;
+
+        *next = nl + 1;
+        if (nl > p && nl[-1] == '\r')
+                nl--;
+        return nl;
+}
+
+/*
+ * Terminate a field whose value ends at "vend" and add it to the map.
+ */
+static void add_field (pseudomap *headers, enum http_header id,
+                       char *name, char *value, char *vend)
+{
+        while (vend > value && IS_OWS (vend[-1]))
+                vend--;
+        *vend = '\0';
+
+        /* Repeated Content-Length fields are kept, for the framing
+         * checks of reqs.c to refuse. */
+        pseudomap_append_ref (headers, id, name, value);
+}
+
+/*
+ * Tokenize the "len" bytes of message head at "head", which has to run
+ * up to and including the empty line ending it, and index its header
+ * fields in "headers".  The start line is left NULL terminated at
+ * "head".  Field names and values are only valid as long as the head.
+ *
+ * Returns 0 on success, and -1 if the head is malformed (whitespace
+ * between a field name and its colon included) or has too many lines.
+ */
+int http_head_parse (char *head, size_t len, pseudomap *headers)
+{
+        char *end = head + len, *p, *next, *eol, *sep;
+        char *name = NULL, *value = NULL, *vend = NULL;
+        enum http_header id = HDR_NIL;
+        unsigned int double_cgi = FALSE;        /* boolean */
+        int count;
+
+        assert (head != NULL);
+        assert (headers != NULL);
+
+        eol = line_end (head, end, &next);
+        if (!eol)
+                return -1;
+        *eol = '\0';
+
+        for (count = 0, p = next; count < MAX_HEADERS; count++, p = next) {
+                eol = line_end (p, end, &next);
+                if (!eol)
+                        return -1;
+
+                /*
+                 * A continuation line is appended to the field before
+                 * it, with a single space in place of the line break.
+                 */
+                if (eol > p && IS_OWS (*p)) {
+                        if (!name)
+                                continue;
+                        while (p < eol && IS_OWS (*p))
+                                p++;
+                        if (p < eol) {
+                                *vend++ = ' ';
+                                memmove (vend, p, eol - p);
+                                vend += eol - p;
+                        }
+                        continue;
+                }
+
+                if (name && !double_cgi)
+                        add_field (headers, id, name, value, vend);
+                name = NULL;
+
+                /* An empty line ends the head. */
+                if (eol == p)
+                        return 0;
+
+                /*
+                 * BUG FIX: The following code detects a "Double CGI"
+                 * situation so that we can handle the nonconforming system.
+                 * This problem was found when accessing cgi.ebay.com, and it
+                 * turns out to be a wider spread problem as well.
+                 *
+                 * If "Double CGI" is in effect, duplicate headers are
+                 * ignored.
+                 *
+                 * FIXME: Might need to change this to a more robust check.
+                 */
+                if (eol - p >= 5 && strncasecmp (p, "HTTP/", 5) == 0)
+                        double_cgi = TRUE;
+
+                sep = (char *) memchr (p, ':', eol - p);
+                if (!sep)
+                        continue; /* just skip invalid header */
+
+                /*
+                 * "Transfer-Encoding : chunked" would get past the
+                 * framing checks under a name of its own, and yet mean
+                 * Transfer-Encoding to some servers (RFC 9112, 5.1).
+                 */
+                if (sep > p && IS_OWS (sep[-1]))
+                        return -1;
+                id = http_header_id (p, sep - p);
+
+                /* Blank out colons, spaces, and tabs. */
+                while (sep < eol && (*sep == ':' || IS_OWS (*sep)))
+                        *sep++ = '\0';
+
+                name = p;
+                value = sep;
+                vend = eol;
+        }
+
+        return -1;
+}
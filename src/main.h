@@ -26,6 +26,7 @@
 
 /* Global variables for the main controls of the program */
 #define MAXBUFFSIZE     ((size_t)(1024 * 96))   /* Max size of buffer */
+#define MINREADCHUNK    ((size_t)1024)  /* Smallest read from a socket */
 #define MAX_IDLE_TIME   (60 * 10)       /* 10 minutes of no activity */
 
 /* Global Structures used in the program */
@@ -1,15 +1,19 @@
 #include "mypoll.h"
 
-#ifdef HAVE_POLL_H
 int mypoll(pollfd_struct* fds, int nfds, int timeout) {
+	return mypoll_ms(fds, nfds, timeout <= 0 ? timeout : timeout*1000);
+}
+
+#ifdef HAVE_POLL_H
+int mypoll_ms(pollfd_struct* fds, int nfds, int timeout) {
 	int i, ret;
 	for(i=0; i<nfds; ++i) if(!fds[i].events) fds[i].fd=~fds[i].fd;
-	ret = poll(fds, nfds, timeout <= 0 ? timeout : timeout*1000);
+	ret = poll(fds, nfds, timeout);
 	for(i=0; i<nfds; ++i) if(!fds[i].events) fds[i].fd=~fds[i].fd;
 	return ret;
 }
 #else
-int mypoll(pollfd_struct* fds, int nfds, int timeout) {
+int mypoll_ms(pollfd_struct* fds, int nfds, int timeout) {
 	fd_set rset, wset, *r=0, *w=0;
 	int i, ret, maxfd=-1;
 	struct timeval tv = {0}, *t = 0;
@@ -28,7 +32,10 @@ int mypoll(pollfd_struct* fds, int nfds, int timeout) {
 	}
 
 	if(timeout >= 0) t = &tv;
-	if(timeout > 0) tv.tv_sec = timeout;
+	if(timeout > 0) {
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+	}
 
 	ret = select(maxfd+1, r, w, 0, t);
 
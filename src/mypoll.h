@@ -27,5 +27,6 @@ typedef struct mypollfd {
 #endif
 
 int mypoll(pollfd_struct* fds, int nfds, int timeout);
+int mypoll_ms(pollfd_struct* fds, int nfds, int timeout);
 
 #endif
@@ -18,8 +18,8 @@
 
 /* The functions found here are used for communicating across a
  * network.  They include both safe reading and writing (which are
- * the basic building blocks) along with two functions for
- * easily reading a line of text from the network, and a function
+ * the basic building blocks) along with a buffered reader for
+ * easily reading lines of text from the network, and a function
  * to write an arbitrary amount of data to the network.
  */
 
@@ -27,6 +27,7 @@
 
 #include "heap.h"
 #include "network.h"
+#include "pool.h"
 
 /*
  * Write the buffer to the socket. If an EINTR occurs, pick up and try
@@ -129,120 +130,574 @@ int write_message (int fd, const char *fmt, ...)
 }
 
 /*
- * Read in a "line" from the socket. It might take a few loops through
- * the read sequence. The full string is allocate off the heap and stored
- * at the whole_buffer pointer. The caller needs to free the memory when
- * it is no longer in use. The returned line is NULL terminated.
- *
- * Returns the length of the buffer on success (not including the NULL
- * termination), 0 if the socket was closed, and -1 on all other errors.
+ * A message head is made of many small pieces: the request or status
+ * line, every header, and the blank line.  Rather than sending each of
+ * them on its own, they are gathered up in an outvec and go out in a
+ * single sendmsg(), together with whatever body bytes are already at
+ * hand.  Formatted pieces are copied into one text buffer and merged
+ * when they follow each other; pieces added by reference are not copied
+ * and have to stay around until the message has been sent.
+ */
+#define OUTVEC_TEXT_SIZE (1024)
+#define OUTVEC_IOV (8)
+
+#ifndef IOV_MAX
+#  define IOV_MAX (16)
+#endif
+
+/*
+ * Make room for one more piece.
+ */
+static int outvec_grow (struct outvec_s *out)
+{
+        struct iovec *iov;
+        size_t room;
+
+        if (out->count < out->room)
+                return 0;
+
+        room = out->room ? out->room * 2 : OUTVEC_IOV;
+        iov = (struct iovec *) saferealloc (out->iov,
+                                            room * sizeof (struct iovec));
+        if (!iov)
+                return -1;
+        out->iov = iov;
+        out->room = room;
+        return 0;
+}
+
+/*
+ * Append a formatted piece to the message.  Returns -1 if there was no
+ * memory for it, in which case sending the message fails as well.
  */
-#define SEGMENT_LEN (512)
+int outvec_printf (struct outvec_s *out, const char *fmt, ...)
+{
+        va_list ap;
+        char *text;
+        size_t room;
+        int n;
+
+        if (out->failed)
+                return -1;
+
+        while (1) {
+                room = out->textroom - out->textlen;
+                va_start (ap, fmt);
+                n = vsnprintf (out->text ? out->text + out->textlen : NULL,
+                               room, fmt, ap);
+                va_end (ap);
+
+                if (n < 0)
+                        goto fail;
+                if ((size_t) n < room)
+                        break;
+
+                room = out->textroom ? out->textroom * 2 : OUTVEC_TEXT_SIZE;
+                while (room <= out->textlen + n)
+                        room *= 2;
+                text = (char *) saferealloc (out->text, room);
+                if (!text)
+                        goto fail;
+                out->text = text;
+                out->textroom = room;
+        }
+
+        if (n == 0)
+                return 0;
+
+        out->textlen += n;
+        if (out->count > 0 && out->iov[out->count - 1].iov_base == NULL) {
+                out->iov[out->count - 1].iov_len += n;
+                return 0;
+        }
+        if (outvec_grow (out) < 0)
+                goto fail;
+        out->iov[out->count].iov_base = NULL;
+        out->iov[out->count].iov_len = n;
+        out->count++;
+        return 0;
+
+fail:
+        out->failed = TRUE;
+        return -1;
+}
+
+/*
+ * Append "len" bytes at "data" to the message without copying them.
+ */
+int outvec_ref (struct outvec_s *out, void *data, size_t len)
+{
+        if (out->failed)
+                return -1;
+        if (len == 0)
+                return 0;
+
+        if (outvec_grow (out) < 0) {
+                out->failed = TRUE;
+                return -1;
+        }
+        out->iov[out->count].iov_base = data;
+        out->iov[out->count].iov_len = len;
+        out->count++;
+        return 0;
+}
+
+/*
+ * Send the whole message and empty it.  Only a short write makes this
+ * take more than one call.  Returns -1 on error.
+ */
+int outvec_send (int fd, struct outvec_s *out)
+{
+        struct msghdr msg;
+        struct iovec *iov;
+        size_t i, n, offset = 0;
+        ssize_t len;
+        int ret = 0;
+
+        if (out->failed) {
+                ret = -1;
+                goto done;
+        }
+
+        /* Now that the text is complete, point the pieces into it. */
+        for (i = 0; i < out->count; i++) {
+                if (out->iov[i].iov_base)
+                        continue;
+                out->iov[i].iov_base = out->text + offset;
+                offset += out->iov[i].iov_len;
+        }
+
+        iov = out->iov;
+        n = out->count;
+        while (n > 0) {
+                memset (&msg, 0, sizeof (msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = min (n, (size_t) IOV_MAX);
+
+                len = sendmsg (fd, &msg, MSG_NOSIGNAL);
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        ret = -1;
+                        break;
+                }
+
+                while (n > 0 && (size_t) len >= iov->iov_len) {
+                        len -= iov->iov_len;
+                        iov++;
+                        n--;
+                }
+                if (n > 0) {
+                        iov->iov_base = (char *) iov->iov_base + len;
+                        iov->iov_len -= len;
+                }
+        }
+
+done:
+        out->count = out->textlen = 0;
+        out->failed = FALSE;
+        return ret;
+}
+
+/*
+ * Give the memory held by the message back.
+ */
+void outvec_free (struct outvec_s *out)
+{
+        safefree (out->iov);
+        safefree (out->text);
+        memset (out, 0, sizeof (*out));
+}
+
+/*
+ * Lines are read from a socket through a readahead buffer: it is filled
+ * with reads of up to READAHEAD_CHUNK bytes, and the lines are handed
+ * out of it in place.  The buffer starts out at READAHEAD_SIZE bytes and
+ * only grows for a line longer than that.  Reading at most a chunk at a
+ * time also bounds what can be left over behind the last line read.
+ */
+#define READAHEAD_SIZE (4096)
+#define READAHEAD_CHUNK (16 * 1024)
 #define MAXIMUM_BUFFER_LENGTH (128 * 1024)
-ssize_t readline (int fd, char **whole_buffer)
+
+/*
+ * Put back the byte the NUL terminating the last line replaced.
+ */
+static void readahead_restore (struct readahead_s *ra)
+{
+        if (ra->cut) {
+                ra->data[ra->cut] = ra->saved;
+                ra->cut = 0;
+        }
+        if (ra->start == ra->end)
+                ra->start = ra->end = 0;
+}
+
+/*
+ * Make room for another read behind the bytes still held.
+ */
+static int readahead_room (struct readahead_s *ra)
 {
-        ssize_t whole_buffer_len;
-        char buffer[SEGMENT_LEN];
-        char *ptr;
+        char *data;
+        size_t size, held = ra->end - ra->start;
 
-        ssize_t ret;
-        ssize_t diff;
+        if (!ra->data) {
+                ra->data = (char *) pool_alloc (READAHEAD_SIZE);
+                if (!ra->data)
+                        return -1;
+                ra->size = READAHEAD_SIZE;
+                ra->start = ra->end = 0;
+                return 0;
+        }
 
-        struct read_lines_s {
-                char *data;
-                size_t len;
-                struct read_lines_s *next;
-        };
-        struct read_lines_s *first_line, *line_ptr;
+        if (ra->start > 0) {
+                memmove (ra->data, ra->data + ra->start, held);
+                ra->start = 0;
+                ra->end = held;
+        }
+        if (ra->end + 1 < ra->size)
+                return 0;
 
-        first_line =
-            (struct read_lines_s *) safecalloc (sizeof (struct read_lines_s),
-                                                1);
-        if (!first_line)
-                return -ENOMEM;
+        size = min (ra->size * 2, MAXIMUM_BUFFER_LENGTH + 1);
+        data = (char *) pool_alloc (size);
+        if (!data)
+                return -1;
+        memcpy (data, ra->data, held);
+        pool_free (ra->data);
+        ra->data = data;
+        ra->size = size;
+        return 0;
+}
 
-        line_ptr = first_line;
+/*
+ * Read in a "line" from the socket.  It might take a few reads, but
+ * every read fetches as much as is there (up to READAHEAD_CHUNK bytes),
+ * so that most lines come straight out of the readahead buffer.  The
+ * line, including its end of line, is stored at the line pointer; it is
+ * NULL terminated and points into the buffer, so it stays valid only
+ * until the next call on the same buffer.
+ *
+ * Returns the length of the line on success (not including the NULL
+ * termination), 0 if the socket was closed, and a negative value on
+ * all other errors.
+ */
+ssize_t readline (int fd, struct readahead_s *ra, char **line)
+{
+        size_t scanned = 0, len;
+        char *nl;
+        ssize_t ret;
 
-        whole_buffer_len = 0;
-        for (;;) {
-                ret = recv (fd, buffer, SEGMENT_LEN, MSG_PEEK);
-                if (ret <= 0)
-                        goto CLEANUP;
+        assert (fd >= 0);
+        assert (ra != NULL);
+        assert (line != NULL);
 
-                ptr = (char *) memchr (buffer, '\n', ret);
-                if (ptr)
-                        diff = ptr - buffer + 1;
-                else
-                        diff = ret;
+        readahead_restore (ra);
 
-                whole_buffer_len += diff;
+        for (;;) {
+                len = ra->end - ra->start;
+                if (len > scanned) {
+                        nl = (char *) memchr (ra->data + ra->start + scanned,
+                                              '\n', len - scanned);
+                        if (nl)
+                                break;
+                        scanned = len;
+                }
 
                 /*
-                 * Don't allow the buffer to grow without bound. If we
+                 * Don't allow the line to grow without bound. If we
                  * get to more than MAXIMUM_BUFFER_LENGTH close.
                  */
-                if (whole_buffer_len > MAXIMUM_BUFFER_LENGTH) {
-                        ret = -ERANGE;
-                        goto CLEANUP;
-                }
+                if (len >= MAXIMUM_BUFFER_LENGTH)
+                        return -ERANGE;
 
-                line_ptr->data = (char *) safemalloc (diff);
-                if (!line_ptr->data) {
-                        ret = -ENOMEM;
-                        goto CLEANUP;
-                }
+                if (readahead_room (ra) < 0)
+                        return -ENOMEM;
 
-                ret = recv (fd, line_ptr->data, diff, 0);
-                if (ret == -1) {
-                        goto CLEANUP;
-                }
+                do {
+                        ret = recv (fd, ra->data + ra->end,
+                                    min (ra->size - 1 - ra->end,
+                                         READAHEAD_CHUNK), 0);
+                } while (ret < 0 && errno == EINTR);
+                if (ret <= 0)
+                        return ret;
 
-                line_ptr->len = diff;
+                ra->end += ret;
+        }
 
-                if (ptr) {
-                        line_ptr->next = NULL;
-                        break;
+        len = nl - (ra->data + ra->start) + 1;
+        *line = ra->data + ra->start;
+        ra->start += len;
+
+        ra->cut = ra->start;
+        ra->saved = ra->data[ra->cut];
+        ra->data[ra->cut] = '\0';
+
+        return len;
+}
+
+/*
+ * Find the end of the message head at "p": the empty line after the
+ * start line and the header fields.  "*scanned" is how far earlier
+ * calls got, and is updated.  Returns the length of the head including
+ * the empty line, or 0 if it is not complete yet.
+ */
+static size_t head_end (const char *p, size_t len, size_t *scanned)
+{
+        const char *nl;
+        size_t i = *scanned;
+
+        while (i < len && (nl = (char *) memchr (p + i, '\n', len - i))) {
+                i = nl - p + 1;
+                if (i < len && p[i] == '\n')
+                        return i + 1;
+                if (i + 1 < len && p[i] == '\r' && p[i + 1] == '\n')
+                        return i + 2;
+                if (i == len || (i + 1 == len && p[i] == '\r')) {
+                        *scanned = nl - p;
+                        return 0;
                 }
+        }
+
+        *scanned = len;
+        return 0;
+}
+
+/*
+ * Read in a whole message head: the start line and the header fields,
+ * up to the empty line which ends them.  Empty lines in front of the
+ * start line are skipped.  Rather than being copied out, the head is
+ * left where it was read and the readahead buffer holding it is handed
+ * over; only what was read past the head moves to a new buffer.  On
+ * success "*buf" is that buffer, to be released with pool_free(), and
+ * "*head" the NULL terminated head within it.
+ *
+ * Returns the length of the head, 0 if the socket was closed, and a
+ * negative value on all other errors.
+ */
+ssize_t readahead_head (int fd, struct readahead_s *ra, char **buf,
+                        char **head)
+{
+        size_t scanned = 0, len, left;
+        char *data;
+        ssize_t ret;
 
-                line_ptr->next =
-                    (struct read_lines_s *)
-                    safecalloc (sizeof (struct read_lines_s), 1);
-                if (!line_ptr->next) {
-                        ret = -ENOMEM;
-                        goto CLEANUP;
+        assert (fd >= 0);
+        assert (ra != NULL);
+
+        readahead_restore (ra);
+
+        for (;;) {
+                while (ra->start < ra->end
+                       && (ra->data[ra->start] == '\r'
+                           || ra->data[ra->start] == '\n')) {
+                        ra->start++;
+                        scanned = 0;
                 }
-                line_ptr = line_ptr->next;
+
+                len = ra->end - ra->start;
+                if (len > 0 && (len = head_end (ra->data + ra->start, len,
+                                                &scanned)) > 0)
+                        break;
+
+                if (ra->end - ra->start >= MAXIMUM_BUFFER_LENGTH)
+                        return -ERANGE;
+
+                if (readahead_room (ra) < 0)
+                        return -ENOMEM;
+
+                do {
+                        ret = recv (fd, ra->data + ra->end,
+                                    min (ra->size - 1 - ra->end,
+                                         READAHEAD_CHUNK), 0);
+                } while (ret < 0 && errno == EINTR);
+                if (ret <= 0)
+                        return ret;
+
+                ra->end += ret;
         }
 
-        *whole_buffer = (char *) safemalloc (whole_buffer_len + 1);
-        if (!*whole_buffer) {
-                ret = -ENOMEM;
-                goto CLEANUP;
+        left = ra->end - ra->start - len;
+        data = NULL;
+        if (left > 0) {
+                data = (char *) pool_alloc (max (READAHEAD_SIZE, left + 1));
+                if (!data)
+                        return -ENOMEM;
+                memcpy (data, ra->data + ra->start + len, left);
+        }
+
+        *buf = ra->data;
+        *head = ra->data + ra->start;
+        (*head)[len] = '\0';
+
+        memset (ra, 0, sizeof (*ra));
+        if (data) {
+                ra->data = data;
+                ra->size = max (READAHEAD_SIZE, left + 1);
+                ra->end = left;
+        }
+
+        return len;
+}
+
+/*
+ * Read whatever is waiting on a non-blocking socket into the readahead
+ * buffer, and check whether the buffer now holds a complete message
+ * head, so that readahead_head() can have it without blocking.  Empty
+ * lines in front of the head are dropped as readahead_head() would.
+ *
+ * Returns 1 if the head is complete, 0 if more data is needed, and -1 if
+ * the peer has closed the connection, the read failed, or the head does
+ * not end within MAXIMUM_BUFFER_LENGTH bytes.
+ */
+int readahead_has_head (int fd, struct readahead_s *ra)
+{
+        size_t scanned = 0, len;
+        ssize_t ret;
+
+        assert (fd >= 0);
+        assert (ra != NULL);
+
+        readahead_restore (ra);
+
+        for (;;) {
+                while (ra->start < ra->end
+                       && (ra->data[ra->start] == '\r'
+                           || ra->data[ra->start] == '\n')) {
+                        ra->start++;
+                        scanned = 0;
+                }
+
+                len = ra->end - ra->start;
+                if (len > 0 && head_end (ra->data + ra->start, len,
+                                         &scanned) > 0)
+                        return 1;
+
+                if (len >= MAXIMUM_BUFFER_LENGTH)
+                        return -1;
+
+                if (readahead_room (ra) < 0)
+                        return -1;
+
+                do {
+                        ret = recv (fd, ra->data + ra->end,
+                                    min (ra->size - 1 - ra->end,
+                                         READAHEAD_CHUNK), 0);
+                } while (ret < 0 && errno == EINTR);
+                if (ret < 0 && errno == EAGAIN)
+                        return 0;
+                if (ret <= 0)
+                        return -1;
+
+                ra->end += ret;
         }
+}
+
+/*
+ * Return how many bytes read past the last line are still held.
+ */
+size_t readahead_pending (struct readahead_s *ra)
+{
+        assert (ra != NULL);
 
-        *(*whole_buffer + whole_buffer_len) = '\0';
+        return ra->end - ra->start;
+}
 
-        whole_buffer_len = 0;
-        line_ptr = first_line;
-        while (line_ptr) {
-                memcpy (*whole_buffer + whole_buffer_len, line_ptr->data,
-                        line_ptr->len);
-                whole_buffer_len += line_ptr->len;
+/*
+ * Take up to "len" of the bytes read past the last line out of the
+ * readahead buffer.  They are stored at the data pointer, valid until
+ * the next call on the buffer.  Returns how many bytes were taken.
+ */
+size_t readahead_take (struct readahead_s *ra, char **data, size_t len)
+{
+        assert (ra != NULL);
+        assert (data != NULL);
 
-                line_ptr = line_ptr->next;
+        readahead_restore (ra);
+
+        if (!ra->data) {
+                *data = NULL;
+                return 0;
         }
 
-        ret = whole_buffer_len;
+        len = min (len, ra->end - ra->start);
+        *data = ra->data + ra->start;
+        ra->start += len;
+        return len;
+}
+
+/*
+ * Give the buffer's memory back; it is taken again when needed.  Any
+ * bytes still held are dropped.
+ */
+/*
+ * Put back the last "len" bytes readahead_take() handed out, when they
+ * turn out not to be wanted yet.
+ */
+void readahead_untake (struct readahead_s *ra, size_t len)
+{
+        assert (ra != NULL);
+        assert (len <= ra->start);
+
+        ra->start -= len;
+}
+
+void readahead_release (struct readahead_s *ra)
+{
+        assert (ra != NULL);
+
+        pool_free (ra->data);
+        memset (ra, 0, sizeof (*ra));
+}
+
+/*
+ * Look at the data waiting on a socket, without consuming any of it,
+ * and check whether it holds a complete HTTP message head: a start line
+ * and headers up to the empty line that ends them.  Blank lines in front
+ * of the start line are skipped, just as the request reader does.
+ *
+ * Returns 1 if the head is complete, 0 if more data is needed, and -1 if
+ * the peer has closed the connection, the read failed, or there is no
+ * end of the head within the first "limit" bytes.
+ */
+int peek_http_head (int fd, size_t limit)
+{
+        char *buffer, *ptr, *end;
+        ssize_t len;
+        int ret = 0;
+
+        buffer = (char *) safemalloc (limit);
+        if (!buffer)
+                return -1;
 
-CLEANUP:
         do {
-                line_ptr = first_line->next;
-                if (first_line->data)
-                        safefree (first_line->data);
-                safefree (first_line);
-                first_line = line_ptr;
-        } while (first_line);
+                len = recv (fd, buffer, limit, MSG_PEEK);
+        } while (len < 0 && errno == EINTR);
+
+        if (len <= 0) {
+                if (len == 0 || errno != EAGAIN)
+                        ret = -1;
+                goto CLEANUP;
+        }
+
+        ptr = buffer;
+        end = buffer + len;
+        while (ptr < end && (*ptr == '\r' || *ptr == '\n'))
+                ptr++;
 
+        while ((ptr = (char *) memchr (ptr, '\n', end - ptr)) != NULL) {
+                ptr++;
+                if ((ptr < end && *ptr == '\n')
+                    || (ptr + 1 < end && ptr[0] == '\r' && ptr[1] == '\n')) {
+                        ret = 1;
+                        break;
+                }
+        }
+
+        if (ret == 0 && (size_t) len == limit)
+                ret = -1;
+
+CLEANUP:
+        safefree (buffer);
         return ret;
 }
 
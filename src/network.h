@@ -24,8 +24,45 @@
 extern ssize_t safe_write (int fd, const void *buf, size_t count);
 extern ssize_t safe_read (int fd, void *buf, size_t count);
 
+/*
+ * Bytes read from a socket but not consumed yet (see readline()).
+ * A zero-filled structure is an empty buffer.
+ */
+struct readahead_s {
+        char *data;             /* NULL until first used */
+        size_t size;
+        size_t start, end;      /* the bytes not consumed yet */
+        size_t cut;             /* end of the last line handed out */
+        char saved;             /* the byte its NUL terminator replaced */
+};
+
+/*
+ * A message put together piece by piece and sent with a single call
+ * (see outvec_send()).  A zero-filled structure is an empty message.
+ */
+struct outvec_s {
+        struct iovec *iov;      /* formatted pieces have no base yet */
+        size_t count, room;
+        char *text;             /* the formatted pieces, back to back */
+        size_t textlen, textroom;
+        unsigned int failed;    /* boolean: a piece could not be added */
+};
+
 extern int write_message (int fd, const char *fmt, ...);
-extern ssize_t readline (int fd, char **whole_buffer);
+extern int outvec_printf (struct outvec_s *out, const char *fmt, ...);
+extern int outvec_ref (struct outvec_s *out, void *data, size_t len);
+extern int outvec_send (int fd, struct outvec_s *out);
+extern void outvec_free (struct outvec_s *out);
+extern ssize_t readline (int fd, struct readahead_s *ra, char **line);
+extern ssize_t readahead_head (int fd, struct readahead_s *ra, char **buf,
+                               char **head);
+extern int readahead_has_head (int fd, struct readahead_s *ra);
+extern size_t readahead_pending (struct readahead_s *ra);
+extern size_t readahead_take (struct readahead_s *ra, char **data,
+                              size_t len);
+extern void readahead_untake (struct readahead_s *ra, size_t len);
+extern void readahead_release (struct readahead_s *ra);
+extern int peek_http_head (int fd, size_t limit);
 
 extern const char *get_ip_string (struct sockaddr *sa, char *buf, size_t len);
 extern int full_inet_pton (const char *ip, void *dst);
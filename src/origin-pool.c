@@ -0,0 +1,289 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Idle connections to origin servers and to HTTP upstream proxies, kept
+ * open for later requests going the same way.  Once a response has
+ * ended where its framing said it would, and the server did not ask to
+ * close, its connection is put in here rather than closed, under the
+ * host and port it was opened to and the local address it was bound
+ * to.  The next request for the same server (or through the same
+ * upstream proxy) takes it back out, and saves itself the name lookup,
+ * the handshake and TCP slow start.
+ *
+ * The pool is shared by all threads (or engine workers.)  It is a plain
+ * list, the connection put back last coming first: it only ever holds
+ * a few dozen connections, and walking them is cheaper than keeping an
+ * index up to date.  Connections to origin servers are kept for
+ * OriginIdleTimeout seconds, at most OriginPoolPerHost per server and
+ * OriginPoolSize in all; connections to upstream proxies for
+ * UpstreamIdleTimeout seconds, at most UpstreamPoolSize per proxy.  The
+ * oldest connection makes room once a limit is reached, and those
+ * idle for too long are dropped whenever the pool is used.  Before a
+ * connection is handed out, it is checked for having been closed by the
+ * server in the meantime.
+ */
+
+#include "main.h"
+
+#include "origin-pool.h"
+#include "conf.h"
+#include "heap.h"
+#include "log.h"
+#include "sock.h"
+#include <pthread.h>
+
+struct origin_conn {
+        struct origin_conn *next, *prev;
+        int fd;
+        int port;
+        char *host;
+        char *bind_to;          /* NULL if not bound to an address */
+        unsigned int upstream;  /* boolean: to an upstream proxy */
+        time_t expires;         /* when it is closed if still idle */
+};
+
+static pthread_mutex_t origin_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct origin_conn *idle_first, *idle_last;
+static unsigned long idle_count, idle_direct;
+static unsigned long origin_hits, origin_misses;
+
+static int same_origin (struct origin_conn *oc, const char *host, int port,
+                        const char *bind_to, unsigned int upstream)
+{
+        if (oc->port != port || oc->upstream != upstream
+            || strcasecmp (oc->host, host) != 0)
+                return 0;
+        if (!oc->bind_to || !bind_to)
+                return oc->bind_to == bind_to;
+        return strcmp (oc->bind_to, bind_to) == 0;
+}
+
+/*
+ * Take a connection off the list.  The caller holds origin_lock.
+ */
+static void origin_unlink (struct origin_conn *oc)
+{
+        if (oc->prev)
+                oc->prev->next = oc->next;
+        else
+                idle_first = oc->next;
+        if (oc->next)
+                oc->next->prev = oc->prev;
+        else
+                idle_last = oc->prev;
+        idle_count--;
+        if (!oc->upstream)
+                idle_direct--;
+}
+
+/*
+ * Release a connection taken off the list, closing its socket unless
+ * it is still wanted.
+ */
+static void origin_free (struct origin_conn *oc, int close_fd)
+{
+        if (close_fd)
+                close (oc->fd);
+        safefree (oc->host);
+        safefree (oc->bind_to);
+        safefree (oc);
+}
+
+/*
+ * Drop the connections which have been idle for too long.  The caller
+ * holds origin_lock.
+ */
+static void origin_expire (time_t now)
+{
+        struct origin_conn *oc, *next;
+
+        for (oc = idle_first; oc; oc = next) {
+                next = oc->next;
+                if (now >= oc->expires) {
+                        origin_unlink (oc);
+                        origin_free (oc, TRUE);
+                }
+        }
+}
+
+/*
+ * An idle connection should have nothing to read.  If the server has
+ * closed it, or sent something nobody asked for, it can't be used.
+ */
+static int origin_alive (int fd)
+{
+        char c;
+        ssize_t n;
+
+        n = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n < 0 && errno == EAGAIN;
+}
+
+/*
+ * Take an idle connection to "host" on "port", bound to "bind_to" (or
+ * to no address in particular, if it is NULL), out of the pool.
+ * "upstream" tells whether the host is an upstream proxy.  Returns the
+ * socket, in blocking mode, or -1 if there is none.
+ */
+int origin_pool_get (const char *host, int port, const char *bind_to,
+                     unsigned int upstream)
+{
+        struct origin_conn *oc;
+        int fd;
+
+        for (;;) {
+                pthread_mutex_lock (&origin_lock);
+                origin_expire (time (NULL));
+                for (oc = idle_first; oc; oc = oc->next)
+                        if (same_origin (oc, host, port, bind_to, upstream))
+                                break;
+                if (!oc) {
+                        origin_misses++;
+                        pthread_mutex_unlock (&origin_lock);
+                        return -1;
+                }
+                origin_unlink (oc);
+                pthread_mutex_unlock (&origin_lock);
+
+                fd = oc->fd;
+                origin_free (oc, FALSE);
+                if (origin_alive (fd))
+                        break;
+
+                log_message (LOG_INFO,
+                             "origin_pool_get: dropping connection to "
+                             "%s:%d (fd:%d) closed by the server",
+                             host, port, fd);
+                close (fd);
+        }
+
+        pthread_mutex_lock (&origin_lock);
+        origin_hits++;
+        pthread_mutex_unlock (&origin_lock);
+
+        socket_nonblocking (fd, FALSE);
+        return fd;
+}
+
+/*
+ * Put the connection "fd" to "host" on "port" into the pool, or close
+ * it if the pool can't take it.
+ */
+void origin_pool_put (int fd, const char *host, int port, const char *bind_to,
+                      unsigned int upstream)
+{
+        struct origin_conn *oc, *it, *oldest;
+        unsigned int per_host, timeout;
+        unsigned long same;
+
+        per_host = upstream ? config->upstream_pool_size
+                : config->origin_pool_per_host;
+        timeout = upstream ? config->upstream_idle_timeout
+                : config->origin_idle_timeout;
+        if ((upstream ? per_host : config->origin_pool_size) == 0)
+                goto fail;
+
+        oc = (struct origin_conn *) safecalloc (1, sizeof (*oc));
+        if (!oc)
+                goto fail;
+        oc->fd = fd;
+        oc->port = port;
+        oc->host = safestrdup (host);
+        oc->bind_to = bind_to ? safestrdup (bind_to) : NULL;
+        oc->upstream = upstream;
+        oc->expires = time (NULL) + timeout;
+        if (!oc->host || (bind_to && !oc->bind_to)) {
+                origin_free (oc, FALSE);
+                goto fail;
+        }
+
+        pthread_mutex_lock (&origin_lock);
+        origin_expire (oc->expires - timeout);
+
+        /* Make room, oldest connection first. */
+        if (per_host) {
+                same = 0;
+                oldest = NULL;
+                for (it = idle_first; it; it = it->next)
+                        if (same_origin (it, host, port, bind_to, upstream)) {
+                                same++;
+                                oldest = it;
+                        }
+                if (same >= per_host) {
+                        origin_unlink (oldest);
+                        origin_free (oldest, TRUE);
+                }
+        }
+        if (!upstream && idle_direct >= config->origin_pool_size) {
+                for (oldest = idle_last; oldest->upstream;
+                     oldest = oldest->prev)
+                        ;
+                origin_unlink (oldest);
+                origin_free (oldest, TRUE);
+        }
+
+        oc->prev = NULL;
+        oc->next = idle_first;
+        if (idle_first)
+                idle_first->prev = oc;
+        else
+                idle_last = oc;
+        idle_first = oc;
+        idle_count++;
+        if (!upstream)
+                idle_direct++;
+        pthread_mutex_unlock (&origin_lock);
+        return;
+
+fail:
+        close (fd);
+}
+
+/*
+ * Close all idle connections to "host" on "port", as when the upstream
+ * proxy there stopped answering.
+ */
+void origin_pool_flush (const char *host, int port, unsigned int upstream)
+{
+        struct origin_conn *oc, *next;
+
+        pthread_mutex_lock (&origin_lock);
+        for (oc = idle_first; oc; oc = next) {
+                next = oc->next;
+                if (oc->port == port && oc->upstream == upstream
+                    && strcasecmp (oc->host, host) == 0) {
+                        origin_unlink (oc);
+                        origin_free (oc, TRUE);
+                }
+        }
+        pthread_mutex_unlock (&origin_lock);
+}
+
+/*
+ * How many requests found a connection in the pool and how many had to
+ * open one, and how many connections are idle in it right now.
+ */
+void origin_pool_get_stats (unsigned long *hits, unsigned long *misses,
+                            unsigned long *idle)
+{
+        pthread_mutex_lock (&origin_lock);
+        *hits = origin_hits;
+        *misses = origin_misses;
+        *idle = idle_count;
+        pthread_mutex_unlock (&origin_lock);
+}
@@ -0,0 +1,33 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'origin-pool.c' for detailed information. */
+
+#ifndef TINYPROXY_ORIGIN_POOL_H
+#define TINYPROXY_ORIGIN_POOL_H
+
+extern int origin_pool_get (const char *host, int port, const char *bind_to,
+                            unsigned int upstream);
+extern void origin_pool_put (int fd, const char *host, int port,
+                             const char *bind_to, unsigned int upstream);
+extern void origin_pool_flush (const char *host, int port,
+                               unsigned int upstream);
+extern void origin_pool_get_stats (unsigned long *hits, unsigned long *misses,
+                                   unsigned long *idle);
+
+#endif
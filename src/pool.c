@@ -0,0 +1,353 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A pool allocator for the objects every connection allocates and frees:
+ * relay buffers, connection structures and header strings.
+ *
+ * Requests are rounded up to one of a few size classes. Freed objects are
+ * kept on a free list per class instead of being handed back to malloc().
+ * Each thread has a small cache of free objects of every class, so the
+ * common case takes no lock at all; only when a cache runs empty or
+ * overflows is a batch of objects moved from or to the shared list of the
+ * class. Objects which do not fit in any class go straight to malloc().
+ *
+ * Every object is preceded by a small header recording its class, so
+ * pool_free() needs nothing but the pointer.
+ */
+
+#include "main.h"
+
+#include "pool.h"
+#include <pthread.h>
+
+/*
+ * The header in front of each object; the union keeps the object itself
+ * suitably aligned for anything.
+ */
+union pool_header {
+        unsigned int cls;
+        double align[2];
+};
+
+#define HEADER_SIZE sizeof (union pool_header)
+#define NO_CLASS ((unsigned int) -1)
+
+/* Free objects are chained through their first word. */
+struct pool_object {
+        struct pool_object *next;
+};
+
+struct pool_class {
+        size_t size;
+        unsigned int cache_max;   /* objects cached per thread */
+        unsigned int global_max;  /* objects kept on the shared list */
+
+        pthread_mutex_t lock;
+        struct pool_object *free;
+        unsigned int nfree;
+
+        unsigned long hits, misses, resident;
+};
+
+#define POOL_CLASS(size) { size, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, \
+                           0, 0, 0 }
+
+static struct pool_class classes[] = {
+        POOL_CLASS (32),
+        POOL_CLASS (64),
+        POOL_CLASS (128),
+        POOL_CLASS (256),
+        POOL_CLASS (512),
+        POOL_CLASS (1024),
+        POOL_CLASS (2048),
+        POOL_CLASS (4096),
+        POOL_CLASS (MAXBUFFSIZE)
+};
+
+#define NCLASSES (sizeof (classes) / sizeof (classes[0]))
+
+/* Bytes worth of objects of one class a thread may keep to itself... */
+#define CACHE_BYTES (256 * 1024)
+/* ...and that are kept on the shared list before going back to malloc. */
+#define GLOBAL_BYTES (8 * 1024 * 1024)
+
+/* Cache hits are folded into the shared counters this often. */
+#define HITS_BATCH 64
+
+struct pool_cache {
+        struct pool_object *free[NCLASSES];
+        unsigned int nfree[NCLASSES];
+        unsigned int hits[NCLASSES];
+};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static int cache_ok;
+
+static unsigned int clamp (size_t value, unsigned int lo, unsigned int hi)
+{
+        if (value < lo)
+                return lo;
+        if (value > hi)
+                return hi;
+        return (unsigned int) value;
+}
+
+static unsigned int find_class (size_t size)
+{
+        unsigned int i;
+
+        for (i = 0; i < NCLASSES; i++)
+                if (size <= classes[i].size)
+                        return i;
+        return NO_CLASS;
+}
+
+/*
+ * Move up to 'count' objects from the cache to the shared list of the
+ * class, releasing whatever the shared list has no room for.
+ */
+static void cache_flush (struct pool_cache *cache, unsigned int cls,
+                         unsigned int count)
+{
+        struct pool_class *pc = &classes[cls];
+        struct pool_object *obj;
+
+        pthread_mutex_lock (&pc->lock);
+        pc->hits += cache->hits[cls];
+        cache->hits[cls] = 0;
+        while (count-- > 0 && (obj = cache->free[cls])) {
+                cache->free[cls] = obj->next;
+                cache->nfree[cls]--;
+                if (pc->nfree < pc->global_max) {
+                        obj->next = pc->free;
+                        pc->free = obj;
+                        pc->nfree++;
+                } else {
+                        pc->resident -= pc->size + HEADER_SIZE;
+                        free ((char *) obj - HEADER_SIZE);
+                }
+        }
+        pthread_mutex_unlock (&pc->lock);
+}
+
+static void cache_destroy (void *arg)
+{
+        struct pool_cache *cache = (struct pool_cache *) arg;
+        unsigned int i;
+
+        for (i = 0; i < NCLASSES; i++)
+                cache_flush (cache, i, cache->nfree[i]);
+        free (cache);
+}
+
+static void cache_init (void)
+{
+        unsigned int i;
+
+        for (i = 0; i < NCLASSES; i++) {
+                classes[i].cache_max =
+                    clamp (CACHE_BYTES / classes[i].size, 2, 64);
+                classes[i].global_max =
+                    clamp (GLOBAL_BYTES / classes[i].size, 16, 4096);
+        }
+        cache_ok = pthread_key_create (&cache_key, cache_destroy) == 0;
+}
+
+/*
+ * Return the calling thread's cache, creating it on first use. Returns
+ * NULL if there is none, in which case the shared lists are used directly.
+ */
+static struct pool_cache *get_cache (void)
+{
+        struct pool_cache *cache;
+
+        pthread_once (&cache_once, cache_init);
+        if (!cache_ok)
+                return NULL;
+
+        cache = (struct pool_cache *) pthread_getspecific (cache_key);
+        if (cache)
+                return cache;
+
+        cache = (struct pool_cache *) calloc (1, sizeof (*cache));
+        if (cache && pthread_setspecific (cache_key, cache) != 0) {
+                free (cache);
+                cache = NULL;
+        }
+        return cache;
+}
+
+/*
+ * Take an object of the class from the shared list, moving a batch of
+ * further ones into the cache. Returns NULL if the list is empty.
+ */
+static struct pool_object *take_shared (struct pool_cache *cache,
+                                        unsigned int cls)
+{
+        struct pool_class *pc = &classes[cls];
+        struct pool_object *obj;
+        unsigned int batch = pc->cache_max / 2;
+
+        pthread_mutex_lock (&pc->lock);
+        obj = pc->free;
+        if (obj) {
+                pc->free = obj->next;
+                pc->nfree--;
+                pc->hits++;
+                while (cache && batch-- > 0 && pc->free) {
+                        struct pool_object *next = pc->free->next;
+
+                        pc->free->next = cache->free[cls];
+                        cache->free[cls] = pc->free;
+                        cache->nfree[cls]++;
+                        pc->free = next;
+                        pc->nfree--;
+                }
+        } else {
+                pc->misses++;
+                pc->resident += pc->size + HEADER_SIZE;
+        }
+        pthread_mutex_unlock (&pc->lock);
+
+        return obj;
+}
+
+void *pool_alloc (size_t size)
+{
+        union pool_header *hdr;
+        struct pool_cache *cache;
+        struct pool_object *obj;
+        unsigned int cls;
+
+        assert (size > 0);
+
+        cls = find_class (size);
+        if (cls == NO_CLASS) {
+                hdr = (union pool_header *) malloc (HEADER_SIZE + size);
+                if (!hdr)
+                        return NULL;
+                hdr->cls = NO_CLASS;
+                return hdr + 1;
+        }
+
+        cache = get_cache ();
+        if (cache && (obj = cache->free[cls])) {
+                cache->free[cls] = obj->next;
+                cache->nfree[cls]--;
+                if (++cache->hits[cls] >= HITS_BATCH)
+                        cache_flush (cache, cls, 0);
+                return obj;
+        }
+
+        obj = take_shared (cache, cls);
+        if (obj)
+                return obj;
+
+        hdr = (union pool_header *) malloc (HEADER_SIZE + classes[cls].size);
+        if (!hdr) {
+                pthread_mutex_lock (&classes[cls].lock);
+                classes[cls].resident -= classes[cls].size + HEADER_SIZE;
+                pthread_mutex_unlock (&classes[cls].lock);
+                return NULL;
+        }
+        hdr->cls = cls;
+        return hdr + 1;
+}
+
+void *pool_calloc (size_t size)
+{
+        void *ptr = pool_alloc (size);
+
+        if (ptr)
+                memset (ptr, 0, size);
+        return ptr;
+}
+
+char *pool_strdup (const char *s)
+{
+        size_t len;
+        char *ptr;
+
+        assert (s != NULL);
+
+        len = strlen (s) + 1;
+        ptr = (char *) pool_alloc (len);
+        if (ptr)
+                memcpy (ptr, s, len);
+        return ptr;
+}
+
+void pool_free (void *ptr)
+{
+        union pool_header *hdr;
+        struct pool_cache *cache;
+        struct pool_object *obj;
+        unsigned int cls;
+
+        if (!ptr)
+                return;
+
+        hdr = (union pool_header *) ptr - 1;
+        cls = hdr->cls;
+        if (cls == NO_CLASS) {
+                free (hdr);
+                return;
+        }
+        assert (cls < NCLASSES);
+
+        obj = (struct pool_object *) ptr;
+        cache = get_cache ();
+        if (cache) {
+                obj->next = cache->free[cls];
+                cache->free[cls] = obj;
+                if (++cache->nfree[cls] > classes[cls].cache_max)
+                        cache_flush (cache, cls, cache->nfree[cls] / 2);
+                return;
+        }
+
+        /* No cache for this thread; go through a one-off cache of one. */
+        {
+                struct pool_cache one;
+
+                memset (&one, 0, sizeof (one));
+                one.free[cls] = obj;
+                one.nfree[cls] = 1;
+                obj->next = NULL;
+                cache_flush (&one, cls, 1);
+        }
+}
+
+/*
+ * Sum up the counters of all classes. Hits still sitting in the threads'
+ * caches are not included, so the numbers lag slightly behind.
+ */
+void pool_get_stats (unsigned long *hits, unsigned long *misses,
+                     unsigned long *resident)
+{
+        unsigned int i;
+
+        *hits = *misses = *resident = 0;
+        for (i = 0; i < NCLASSES; i++) {
+                pthread_mutex_lock (&classes[i].lock);
+                *hits += classes[i].hits;
+                *misses += classes[i].misses;
+                *resident += classes[i].resident;
+                pthread_mutex_unlock (&classes[i].lock);
+        }
+}
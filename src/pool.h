@@ -0,0 +1,36 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'pool.c' for detailed information. */
+
+#ifndef TINYPROXY_POOL_H
+#define TINYPROXY_POOL_H
+
+#include <stddef.h>
+
+extern void *pool_alloc (size_t size);
+extern void *pool_calloc (size_t size);
+extern char *pool_strdup (const char *s);
+extern void pool_free (void *ptr);
+
+extern void pool_get_stats (unsigned long *hits, unsigned long *misses,
+                            unsigned long *resident);
+
+#define poolfree(x) (pool_free (x), *(&(x)) = NULL)
+
+#endif
@@ -1,5 +1,6 @@
 #include "config.h"
 #include "pseudomap.h"
+#include "pool.h"
 #include <strings.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,72 +18,148 @@
       to iterate through our list to find the right header; and
    2) use of plain HTTP is getting exceedingly extinct by the day, so
       in most usecases CONNECT method is used anyway.
+   that holds for headers we know nothing about, but the ones tinyproxy
+   itself looks at and strips are looked up and removed many times per
+   request. those well-known headers get an id (see header-tokens.gperf)
+   when they are added, and the map remembers where each of them is, so
+   they are found without a scan. entries with the same id are chained
+   in order. removed entries stay in the list with their key set to
+   NULL, which keeps the positions valid.
 */
 
 /* restrict the number of headers to 256 to prevent an attacker from
    launching a denial of service attack. */
 #define MAX_SIZE 256
 
+#define NONE ((size_t)-1)
+
 pseudomap *pseudomap_create(void) {
-	return sblist_new(sizeof(struct pseudomap_entry), 64);
+	size_t i;
+	pseudomap *o = malloc(sizeof *o);
+	if(!o) return 0;
+	o->entries = sblist_new(sizeof(struct pseudomap_entry), 64);
+	if(!o->entries) {
+		free(o);
+		return 0;
+	}
+	for(i = 0; i < HDR_COUNT; ++i) o->first[i] = o->last[i] = NONE;
+	return o;
+}
+
+static void entry_clear(struct pseudomap_entry *e) {
+	if(e->key && e->owned) {
+		pool_free(e->key);
+		pool_free(e->value);
+	}
+	e->key = e->value = 0;
 }
 
 void pseudomap_destroy(pseudomap *o) {
 	if(!o) return;
-	while(sblist_getsize(o)) {
+	while(sblist_getsize(o->entries)) {
 		/* retrieve latest element, and "shrink" list in place,
 		   so we don't have to constantly rearrange list items
 		   by using sblist_delete(). */
-		struct pseudomap_entry *e = sblist_get(o, sblist_getsize(o)-1);
-		free(e->key);
-		free(e->value);
-		--o->count;
+		entry_clear(sblist_get(o->entries, sblist_getsize(o->entries)-1));
+		--o->entries->count;
 	}
-	sblist_free(o);
+	sblist_free(o->entries);
+	free(o);
+}
+
+static int pseudomap_add(pseudomap *o, struct pseudomap_entry *e) {
+	size_t i = sblist_getsize(o->entries);
+	e->next = NONE;
+	if(!sblist_add(o->entries, e)) return 0;
+	if(e->id == HDR_NIL) return 1;
+	if(o->last[e->id] == NONE)
+		o->first[e->id] = i;
+	else
+		((struct pseudomap_entry *)
+		 sblist_get(o->entries, o->last[e->id]))->next = i;
+	o->last[e->id] = i;
+	return 1;
 }
 
 int pseudomap_append(pseudomap *o, const char *key, char *value ) {
 	struct pseudomap_entry e;
-	if(sblist_getsize(o) >= MAX_SIZE) return 0;
-	e.key = strdup(key);
-	e.value = strdup(value);
+	if(sblist_getsize(o->entries) >= MAX_SIZE) return 0;
+	e.key = pool_strdup(key);
+	e.value = pool_strdup(value);
+	e.owned = 1;
 	if(!e.key || !e.value) goto oom;
-	if(!sblist_add(o, &e)) goto oom;
+	e.id = http_header_id(key, strlen(key));
+	if(!pseudomap_add(o, &e)) goto oom;
 	return 1;
 oom:
-	free(e.key);
-	free(e.value);
+	pool_free(e.key);
+	pool_free(e.value);
 	return 0;
 }
 
-static size_t pseudomap_find_index(pseudomap *o, const char *key) {
+/* add an entry without copying key and value; they have to stay around
+   (and unchanged) for as long as the entry does. this is how the headers
+   parsed in place in a message head are stored, with the id looked up
+   by the parser. */
+int pseudomap_append_ref(pseudomap *o, enum http_header id, char *key, char *value ) {
+	struct pseudomap_entry e;
+	if(sblist_getsize(o->entries) >= MAX_SIZE) return 0;
+	e.key = key;
+	e.value = value;
+	e.owned = 0;
+	e.id = id;
+	return pseudomap_add(o, &e);
+}
+
+/* index of the first entry with an unknown key matching key */
+static size_t pseudomap_find_index(pseudomap *o, const char *key, size_t from) {
 	size_t i;
 	struct pseudomap_entry *e;
-	for(i = 0; i < sblist_getsize(o); ++i) {
-		e = sblist_get(o, i);
-		if(!strcasecmp(key, e->key)) return i;
+	for(i = from; i < sblist_getsize(o->entries); ++i) {
+		e = sblist_get(o->entries, i);
+		if(e->key && e->id == HDR_NIL && !strcasecmp(key, e->key)) return i;
 	}
-	return (size_t)-1;
+	return NONE;
+}
+
+char* pseudomap_find_id(pseudomap *o, enum http_header id) {
+	if(id == HDR_NIL || o->first[id] == NONE) return 0;
+	return ((struct pseudomap_entry *)
+		sblist_get(o->entries, o->first[id]))->value;
 }
 
 char* pseudomap_find(pseudomap *o, const char *key) {
 	struct pseudomap_entry *e;
-	size_t i = pseudomap_find_index(o, key);
-	if(i == (size_t)-1) return 0;
-	e = sblist_get(o, i);
+	enum http_header id = http_header_id(key, strlen(key));
+	size_t i;
+	if(id != HDR_NIL) return pseudomap_find_id(o, id);
+	i = pseudomap_find_index(o, key, 0);
+	if(i == NONE) return 0;
+	e = sblist_get(o->entries, i);
 	return e->value;
 }
 
-/* remove *all* entries that match key, to mimic behaviour of hashmap */
-int pseudomap_remove(pseudomap *o, const char *key) {
+/* remove *all* entries with the id, to mimic behaviour of hashmap */
+int pseudomap_remove_id(pseudomap *o, enum http_header id) {
 	struct pseudomap_entry *e;
 	size_t i;
+	if(id == HDR_NIL || o->first[id] == NONE) return 0;
+	for(i = o->first[id]; i != NONE; i = e->next) {
+		e = sblist_get(o->entries, i);
+		entry_clear(e);
+	}
+	o->first[id] = o->last[id] = NONE;
+	return 1;
+}
+
+/* remove *all* entries that match key, to mimic behaviour of hashmap */
+int pseudomap_remove(pseudomap *o, const char *key) {
+	enum http_header id = http_header_id(key, strlen(key));
+	size_t i = 0;
 	int ret = 0;
-	while((i = pseudomap_find_index(o, key)) != (size_t)-1) {
-		e = sblist_get(o, i);
-		free(e->key);
-		free(e->value);
-		sblist_delete(o, i);
+	if(id != HDR_NIL) return pseudomap_remove_id(o, id);
+	while((i = pseudomap_find_index(o, key, i)) != NONE) {
+		entry_clear(sblist_get(o->entries, i));
 		ret = 1;
 	}
 	return ret;
@@ -90,10 +167,29 @@ int pseudomap_remove(pseudomap *o, const char *key) {
 
 size_t pseudomap_next(pseudomap *o, size_t iter, char** key, char** value) {
 	struct pseudomap_entry *e;
-	if(iter >= sblist_getsize(o)) return 0;
-	e = sblist_get(o, iter);
-	*key = e->key;
-	*value = e->value;
-	return iter + 1;
+	for(; iter < sblist_getsize(o->entries); ++iter) {
+		e = sblist_get(o->entries, iter);
+		if(!e->key) continue;
+		*key = e->key;
+		*value = e->value;
+		return iter + 1;
+	}
+	return 0;
 }
 
+/* like pseudomap_next, but only for the entries with the id, following
+   their chain. */
+size_t pseudomap_next_id(pseudomap *o, enum http_header id, size_t iter, char** value) {
+	struct pseudomap_entry *e;
+	size_t i;
+	if(id == HDR_NIL) return 0;
+	if(iter) i = ((struct pseudomap_entry *) sblist_get(o->entries, iter-1))->next;
+	else i = o->first[id];
+	for(; i != NONE; i = e->next) {
+		e = sblist_get(o->entries, i);
+		if(!e->key) continue;
+		*value = e->value;
+		return i + 1;
+	}
+	return 0;
+}
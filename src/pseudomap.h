@@ -3,20 +3,32 @@
 
 #include <stdlib.h>
 #include "sblist.h"
+#include "header-tokens.h"
 
 struct pseudomap_entry {
-	char *key;
+	char *key; /* NULL once removed */
 	char *value;
+	int owned; /* key and value are our own copies */
+	enum http_header id;
+	size_t next; /* next entry with the same id */
 };
 
-typedef sblist pseudomap;
+typedef struct pseudomap {
+	sblist *entries;
+	/* first and last entry of every well-known header */
+	size_t first[HDR_COUNT], last[HDR_COUNT];
+} pseudomap;
 
 pseudomap *pseudomap_create(void);
 void pseudomap_destroy(pseudomap *o);
 int pseudomap_append(pseudomap *o, const char *key, char *value );
+int pseudomap_append_ref(pseudomap *o, enum http_header id, char *key, char *value );
 char* pseudomap_find(pseudomap *o, const char *key);
+char* pseudomap_find_id(pseudomap *o, enum http_header id);
 int pseudomap_remove(pseudomap *o, const char *key);
+int pseudomap_remove_id(pseudomap *o, enum http_header id);
 size_t pseudomap_next(pseudomap *o, size_t iter, char** key, char** value);
+size_t pseudomap_next_id(pseudomap *o, enum http_header id, size_t iter, char** value);
 
 #endif
 
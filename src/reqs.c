@@ -36,8 +36,11 @@
 #include "pseudomap.h"
 #include "heap.h"
 #include "html-error.h"
+#include "http-head.h"
 #include "log.h"
 #include "network.h"
+#include "origin-pool.h"
+#include "pool.h"
 #include "reqs.h"
 #include "sock.h"
 #include "stats.h"
@@ -52,6 +55,7 @@
 #include "basicauth.h"
 #include "loop.h"
 #include "mypoll.h"
+#include "timers.h"
 
 /*
  * Maximum length of a HTTP line
@@ -73,49 +77,48 @@
 #endif
 
 /*
- * Codify the test for the carriage return and new line characters.
+ * Whether the client is read from while the response is relayed.  Not
+ * if what it sends belongs to its next request, not if the server
+ * connection is to be reused, which must not see anything past the
+ * request, and not if the server turned down the request body.
  */
-#define CHECK_CRLF(header, len)                                 \
-  (((len) == 1 && header[0] == '\n') ||                         \
-   ((len) == 2 && header[0] == '\r' && header[1] == '\n'))
+#define RELAY_READS_CLIENT(conn) \
+        (!(conn)->keep_alive && !(conn)->server_keep_alive \
+         && !(conn)->expect_continue)
 
 /*
- * Codify the test for header fields folded over multiple lines.
- */
-#define CHECK_LWS(header, len)                                  \
-  ((len) > 0 && (header[0] == ' ' || header[0] == '\t'))
-
-/*
- * Read in the first line from the client (the request line for HTTP
- * connections. The request line is allocated from the heap, but it must
- * be freed in another function.
+ * Read in the request head from the client and index its headers in
+ * connptr->headers.  The head stays in connptr->request_head, where the
+ * request line and the headers point into, until the connection is
+ * done with.
+ *
+ * Returns 0 on success, -1 if the head could not be parsed, and -2 if
+ * the client went away before sending one.
  */
-static int read_request_line (struct conn_s *connptr)
+static int read_request_head (struct conn_s *connptr)
 {
         ssize_t len;
+        char *head;
+        int ret;
 
-retry:
-        len = readline (connptr->client_fd, &connptr->request_line);
-        if (len <= 0) {
-                log_message (LOG_ERR,
-                             "read_request_line: Client (file descriptor: %d) "
+        len = readahead_head (connptr->client_fd, &connptr->creadahead,
+                              &connptr->request_head, &head);
+        if (len <= 0 && len != -ERANGE) {
+                /* A keep-alive client may just be done with us. */
+                log_message (connptr->requests ? LOG_CONN : LOG_ERR,
+                             "read_request_head: Client (file descriptor: %d) "
                              "closed socket before read.", connptr->client_fd);
 
-                return -1;
+                return -2;
         }
 
-        /*
-         * Strip the new line and carriage return from the string.
-         */
-        if (chomp (connptr->request_line, len) == len) {
-                /*
-                 * If the number of characters removed is the same as the
-                 * length then it was a blank line. Free the buffer and
-                 * try again (since we're looking for a request line.)
-                 */
-                safefree (connptr->request_line);
-                goto retry;
-        }
+        if (len < 0)
+                return -1;
+
+        ret = http_head_parse (head, len, connptr->headers);
+        connptr->request_line = head;
+        if (ret < 0)
+                return -1;
 
         log_message (LOG_CONN, "Request (file descriptor %d): %s",
                      connptr->client_fd, connptr->request_line);
@@ -139,7 +142,7 @@ static void free_request_struct (struct request_s *request)
         if (request->path)
                 safefree (request->path);
 
-        safefree (request);
+        poolfree (request);
 }
 
 /*
@@ -253,13 +256,18 @@ ERROR_EXIT:
 }
 
 /*
- * Create a connection for HTTP connections.
+ * Start the request head for HTTP connections.  It is sent along with
+ * the client's headers by process_client_headers().
  */
 static int
 establish_http_connection (struct conn_s *connptr, struct request_s *request)
 {
         char portbuff[7];
         char dst[sizeof(struct in6_addr)];
+        const char *connection;
+
+        /* HTTP/1.1 servers keep the connection open unless asked not to */
+        connection = connptr->server_keep_alive ? "" : "Connection: close\r\n";
 
         /* Build a port string if it's not a standard port */
         if (request->port != HTTP_PORT && request->port != HTTP_PORT_SSL)
@@ -270,36 +278,36 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
         if (inet_pton(AF_INET6, request->host, dst) > 0) {
                 /* host is an IPv6 address literal, so surround it with
                  * [] */
-                return write_message (connptr->server_fd,
+                return outvec_printf (&connptr->outhead,
                                       "%s %s HTTP/1.%u\r\n"
                                       "Host: [%s]%s\r\n"
-                                      "Connection: close\r\n",
+                                      "%s",
                                       request->method, request->path,
                                       connptr->protocol.major != 1 ? 0 :
                                                connptr->protocol.minor,
-                                      request->host, portbuff);
+                                      request->host, portbuff, connection);
         } else if (connptr->upstream_proxy &&
                    connptr->upstream_proxy->type == PT_HTTP &&
                    connptr->upstream_proxy->ua.authstr) {
-                return write_message (connptr->server_fd,
+                return outvec_printf (&connptr->outhead,
                                       "%s %s HTTP/1.%u\r\n"
                                       "Host: %s%s\r\n"
-                                      "Connection: close\r\n"
+                                      "%s"
                                       "Proxy-Authorization: Basic %s\r\n",
                                       request->method, request->path,
                                       connptr->protocol.major != 1 ? 0 :
                                                connptr->protocol.minor,
-                                      request->host, portbuff,
+                                      request->host, portbuff, connection,
                                       connptr->upstream_proxy->ua.authstr);
         } else {
-                return write_message (connptr->server_fd,
+                return outvec_printf (&connptr->outhead,
                                       "%s %s HTTP/1.%u\r\n"
                                       "Host: %s%s\r\n"
-                                      "Connection: close\r\n",
+                                      "%s",
                                       request->method, request->path,
                                       connptr->protocol.major != 1 ? 0 :
                                                connptr->protocol.minor,
-                                      request->host, portbuff);
+                                      request->host, portbuff, connection);
         }
 }
 
@@ -343,7 +351,7 @@ static struct request_s *process_request (struct conn_s *connptr,
 
         /* NULL out all the fields so frees don't cause segfaults. */
         request =
-            (struct request_s *) safecalloc (1, sizeof (struct request_s));
+            (struct request_s *) pool_calloc (sizeof (struct request_s));
         if (!request)
                 return NULL;
 
@@ -398,7 +406,7 @@ BAD_REQUEST_ERROR:
         /*
          * Check to see if they're requesting the stat host
          */
-        if (is_stathost (pseudomap_find (hashofheaders, "host"))) {
+        if (is_stathost (pseudomap_find_id (hashofheaders, HDR_host))) {
 got_stathost:
                 log_message (LOG_NOTICE, "Request for the stathost.");
                 connptr->show_stats = TRUE;
@@ -531,80 +539,6 @@ fail:
         return NULL;
 }
 
-/*
- * pull_client_data is used to pull across any client data (like in a
- * POST) which needs to be handled before an error can be reported, or
- * server headers can be processed.
- *	- rjkaes
- */
-static int pull_client_data (struct conn_s *connptr, long int length)
-{
-        char *buffer;
-        ssize_t len;
-
-        buffer =
-            (char *) safemalloc (min (MAXBUFFSIZE, (unsigned long int) length));
-        if (!buffer)
-                return -1;
-
-        do {
-                len = safe_read (connptr->client_fd, buffer,
-                                 min (MAXBUFFSIZE, (unsigned long int) length));
-                if (len <= 0)
-                        goto ERROR_EXIT;
-
-                if (!connptr->error_variables) {
-                        if (safe_write (connptr->server_fd, buffer, len) < 0)
-                                goto ERROR_EXIT;
-                }
-
-                length -= len;
-        } while (length > 0);
-
-        safefree (buffer);
-        return 0;
-
-ERROR_EXIT:
-        safefree (buffer);
-        return -1;
-}
-
-/* pull chunked client data */
-static int pull_client_data_chunked (struct conn_s *connptr) {
-        char *buffer = 0;
-        ssize_t len;
-        long chunklen;
-
-        while(1) {
-                if (buffer) safefree(buffer);
-                len = readline (connptr->client_fd, &buffer);
-
-                if (len <= 0)
-                        goto ERROR_EXIT;
-
-                if (!connptr->error_variables) {
-                        if (safe_write (connptr->server_fd, buffer, len) < 0)
-                                goto ERROR_EXIT;
-                }
-
-                chunklen = strtol (buffer, (char**)0, 16);
-                /* prevent negative or huge values causing overflow */
-                if (chunklen < 0 || chunklen > 0x0fffffff) goto ERROR_EXIT;
-
-                if (pull_client_data (connptr, chunklen+2) < 0)
-                        goto ERROR_EXIT;
-
-                if(!chunklen) break;
-        }
-
-        safefree (buffer);
-        return 0;
-
-ERROR_EXIT:
-        safefree (buffer);
-        return -1;
-}
-
 #ifdef XTINYPROXY_ENABLE
 /*
  * Add the X-Tinyproxy header to the collection of headers being sent to
@@ -614,142 +548,11 @@ ERROR_EXIT:
 static int add_xtinyproxy_header (struct conn_s *connptr)
 {
         assert (connptr && connptr->server_fd >= 0);
-        return write_message (connptr->server_fd,
+        return outvec_printf (&connptr->outhead,
                               "X-Tinyproxy: %s\r\n", connptr->client_ip_addr);
 }
 #endif /* XTINYPROXY */
 
-/*
- * Take a complete header line and break it apart (into a key and the data.)
- * Now insert this information into the hashmap for the connection so it
- * can be retrieved and manipulated later.
- */
-static int
-add_header_to_connection (pseudomap *hashofheaders, char *header, size_t len)
-{
-        char *sep;
-
-        /* Get rid of the new line and return at the end */
-        len -= chomp (header, len);
-
-        sep = strchr (header, ':');
-        if (!sep)
-                return 0; /* just skip invalid header, do not give error */
-
-        /* Blank out colons, spaces, and tabs. */
-        while (*sep == ':' || *sep == ' ' || *sep == '\t')
-                *sep++ = '\0';
-
-        /* Calculate the new length of just the data */
-        len -= sep - header - 1;
-
-        /* prevent multiple content-length headers from being inserted */
-        if (!strcasecmp(header, "content-length") &&
-            pseudomap_find (hashofheaders, "content-length"))
-                return 0;
-
-        return pseudomap_append (hashofheaders, header, sep);
-}
-
-/*
- * Define maximum number of headers that we accept.
- * This should be big enough to handle legitimate cases,
- * but limited to avoid DoS.
- */
-#define MAX_HEADERS 10000
-
-/*
- * Read all the headers from the stream
- */
-static int get_all_headers (int fd, pseudomap *hashofheaders)
-{
-        char *line = NULL;
-        char *header = NULL;
-        int count;
-        char *tmp;
-        ssize_t linelen;
-        ssize_t len = 0;
-        unsigned int double_cgi = FALSE;        /* boolean */
-
-        assert (fd >= 0);
-        assert (hashofheaders != NULL);
-
-        for (count = 0; count < MAX_HEADERS; count++) {
-                if ((linelen = readline (fd, &line)) <= 0) {
-                        safefree (header);
-                        safefree (line);
-                        return -1;
-                }
-
-                /*
-                 * If we received a CR LF or a non-continuation line, then add
-                 * the accumulated header field, if any, to the hashmap, and
-                 * reset it.
-                 */
-                if (CHECK_CRLF (line, linelen) || !CHECK_LWS (line, linelen)) {
-                        if (!double_cgi
-                            && len > 0
-                            && add_header_to_connection (hashofheaders, header,
-                                                         len) < 0) {
-                                safefree (header);
-                                safefree (line);
-                                return -1;
-                        }
-
-                        len = 0;
-                }
-
-                /*
-                 * If we received just a CR LF on a line, the headers are
-                 * finished.
-                 */
-                if (CHECK_CRLF (line, linelen)) {
-                        safefree (header);
-                        safefree (line);
-                        return 0;
-                }
-
-                /*
-                 * BUG FIX: The following code detects a "Double CGI"
-                 * situation so that we can handle the nonconforming system.
-                 * This problem was found when accessing cgi.ebay.com, and it
-                 * turns out to be a wider spread problem as well.
-                 *
-                 * If "Double CGI" is in effect, duplicate headers are
-                 * ignored.
-                 *
-                 * FIXME: Might need to change this to a more robust check.
-                 */
-                if (linelen >= 5 && strncasecmp (line, "HTTP/", 5) == 0) {
-                        double_cgi = TRUE;
-                }
-
-                /*
-                 * Append the new line to the current header field.
-                 */
-                tmp = (char *) saferealloc (header, len + linelen);
-                if (tmp == NULL) {
-                        safefree (header);
-                        safefree (line);
-                        return -1;
-                }
-
-                header = tmp;
-                memcpy (header + len, line, linelen);
-                len += linelen;
-
-                safefree (line);
-        }
-
-        /*
-         * If we get here, this means we reached MAX_HEADERS count.
-         * Bail out with error.
-         */
-        safefree (header);
-        safefree (line);
-        return -1;
-}
-
 /*
  * Extract the headers to remove.  These headers were listed in the Connection
  * and Proxy-Connection headers.
@@ -760,6 +563,10 @@ static int remove_connection_headers (pseudomap *hashofheaders)
                 "connection",
                 "proxy-connection"
         };
+        static const enum http_header ids[] = {
+                HDR_connection,
+                HDR_proxy_connection
+        };
 
         char *data;
         char *ptr;
@@ -768,7 +575,7 @@ static int remove_connection_headers (pseudomap *hashofheaders)
 
         for (i = 0; i != (sizeof (headers) / sizeof (char *)); ++i) {
                 /* Look for the connection header.  If it's not found, return. */
-                data = pseudomap_find(hashofheaders, headers[i]);
+                data = pseudomap_find_id (hashofheaders, ids[i]);
 
                 if (!data)
                         return 0;
@@ -803,45 +610,447 @@ static int remove_connection_headers (pseudomap *hashofheaders)
                 }
 
                 /* Now remove the connection header it self. */
-                pseudomap_remove (hashofheaders, headers[i]);
+                pseudomap_remove_id (hashofheaders, ids[i]);
+        }
+
+        return 0;
+}
+
+/*
+ * How the body of a message is delimited, as message_framing() finds.
+ */
+enum framing {
+        FRAMING_BAD = -1,       /* can't be told for sure */
+        FRAMING_LENGTH,         /* by Content-Length, if there is one */
+        FRAMING_CHUNKED,        /* by the last chunk */
+        FRAMING_CLOSE           /* by the end of the connection */
+};
+
+/*
+ * Parse a Content-Length value, which has to be a plain decimal number:
+ * no sign, no spaces and no list of them.  Returns -1 if it isn't.
+ */
+static long parse_content_length (const char *value)
+{
+        long length = 0;
+
+        if (*value == '\0')
+                return -1;
+
+        for (; *value; value++) {
+                if (*value < '0' || *value > '9')
+                        return -1;
+                if (length > (LONG_MAX - (*value - '0')) / 10)
+                        return -1;
+                length = length * 10 + (*value - '0');
+        }
+
+        return length;
+}
+
+/*
+ * Go through the codings listed in a Transfer-Encoding value.  "*state"
+ * is 1 while chunked is the last coding seen, 0 after another one and
+ * -1 before any.  Returns -1 if chunked is followed by anything, as it
+ * has to be applied once and last.
+ */
+static int transfer_codings (const char *value, int *state)
+{
+        size_t len;
+
+        while (*value) {
+                value += strspn (value, " \t,");
+                len = strcspn (value, ",");
+                while (len > 0 && (value[len - 1] == ' '
+                                   || value[len - 1] == '\t'))
+                        len--;
+                if (len == 0)
+                        break;
+
+                if (*state == 1)
+                        return -1;
+                *state = len == 7 && strncasecmp (value, "chunked", 7) == 0;
+
+                value += strcspn (value, ",");
+        }
+
+        return 0;
+}
+
+/*
+ * Work out how the body of a message is delimited from its
+ * Transfer-Encoding and Content-Length fields, setting "*length" to the
+ * Content-Length, or -1 if there is none.  Content-Length has to be a
+ * single plain number, and chunked, if there, the last coding.
+ *
+ * Leniency here is what request smuggling is made of: a message read
+ * one way by the proxy and another by the server leaves the rest of the
+ * connection out of step, and with pooled connections what follows may
+ * be another client's.
+ */
+static enum framing message_framing (pseudomap *hashofheaders, long *length)
+{
+        char *data;
+        size_t iter = 0;
+        int state = -1;
+        unsigned int encoded = FALSE;
+
+        *length = -1;
+        while ((iter = pseudomap_next_id (hashofheaders, HDR_content_length,
+                                          iter, &data))) {
+                if (*length != -1)
+                        return FRAMING_BAD;
+                *length = parse_content_length (data);
+                if (*length < 0)
+                        return FRAMING_BAD;
+        }
+
+        while ((iter = pseudomap_next_id (hashofheaders,
+                                          HDR_transfer_encoding,
+                                          iter, &data))) {
+                encoded = TRUE;
+                if (transfer_codings (data, &state) < 0)
+                        return FRAMING_BAD;
         }
 
+        if (!encoded)
+                return FRAMING_LENGTH;
+        return state == 1 ? FRAMING_CHUNKED : FRAMING_CLOSE;
+}
+
+/*
+ * Whether the body of a request can be told apart from what follows it
+ * for sure.  A request with both Transfer-Encoding and Content-Length
+ * (see GH issue #609), or encoded other than chunked last, is refused,
+ * as is one with a Content-Length that isn't a single plain number.
+ */
+static int request_framing_valid (pseudomap *hashofheaders)
+{
+        long length;
+
+        switch (message_framing (hashofheaders, &length)) {
+        case FRAMING_LENGTH:
+                return TRUE;
+        case FRAMING_CHUNKED:
+                return length == -1;
+        default:
+                return FALSE;
+        }
+}
+
+/*
+ * Tell whether "token" is one of the comma separated tokens in "value",
+ * as "close" may be in a Connection header.
+ */
+static int has_token (const char *value, const char *token)
+{
+        size_t len = strlen (token);
+
+        while (*value) {
+                value += strspn (value, " \t,");
+                if (strncasecmp (value, token, len) == 0
+                    && (value[len] == '\0' || value[len] == ','
+                        || value[len] == ' ' || value[len] == '\t'))
+                        return 1;
+                value += strcspn (value, ",");
+        }
         return 0;
 }
 
 /*
- * If there is a Content-Length header, then return the value; otherwise, return
- * -1.
+ * Work out whether the client wants to send another request over its
+ * connection after this one, and whether it may.  This has to be done
+ * before remove_connection_headers() takes the Connection header apart.
+ */
+static int client_keep_alive (struct conn_s *connptr,
+                              pseudomap *hashofheaders)
+{
+        static const enum http_header ids[] = {
+                HDR_connection,
+                HDR_proxy_connection
+        };
+        int persistent, i;
+        char *data;
+
+        if (config->keepalive_timeout == 0 || connptr->connect_method)
+                return FALSE;
+        if (config->max_keepalive_requests
+            && connptr->requests + 1 >= config->max_keepalive_requests)
+                return FALSE;
+
+        /* HTTP/1.1 connections persist unless closed, HTTP/1.0 ones
+         * only if the client asks for it. */
+        persistent = connptr->protocol.major > 1
+                || (connptr->protocol.major == 1
+                    && connptr->protocol.minor >= 1);
+
+        for (i = 0; i != (sizeof (ids) / sizeof (ids[0])); i++) {
+                data = pseudomap_find_id (hashofheaders, ids[i]);
+                if (!data)
+                        continue;
+                if (has_token (data, "close"))
+                        return FALSE;
+                if (has_token (data, "keep-alive"))
+                        persistent = TRUE;
+        }
+
+        return persistent;
+}
+
+/*
+ * Whether any of the header fields "ids" names NTLM or Negotiate.  Those
+ * authenticate the connection rather than the request, so a server
+ * connection that took part in such a handshake must never be handed
+ * to another client.
  */
-static long get_content_length (pseudomap *hashofheaders)
+static int connection_auth (pseudomap *hashofheaders,
+                            const enum http_header *ids, size_t n)
 {
+        size_t i, iter;
         char *data;
-        long content_length = -1;
 
-        data = pseudomap_find (hashofheaders, "content-length");
+        for (i = 0; i < n; i++) {
+                iter = 0;
+                while ((iter = pseudomap_next_id (hashofheaders, ids[i],
+                                                  iter, &data)))
+                        if (has_token (data, "NTLM")
+                            || has_token (data, "Negotiate"))
+                                return TRUE;
+        }
+        return FALSE;
+}
+
+/*
+ * Whether the connection to the server may be kept for later requests
+ * once this one is done.  Only plain HTTP/1.1 requests qualify, as the
+ * response to an HTTP/1.0 request may well end with the connection,
+ * and they have to go straight to the server or through an http
+ * upstream proxy which has been answering.  Nor may a connection the
+ * client authenticates with NTLM or Negotiate.
+ */
+static int server_may_persist (struct conn_s *connptr)
+{
+        static const enum http_header ids[] = {
+                HDR_authorization,
+                HDR_proxy_authorization
+        };
 
-        if (data)
-                content_length = atol (data);
+        if (connptr->connect_method || connptr->protocol.major != 1
+            || connptr->protocol.minor < 1)
+                return FALSE;
+        if (connection_auth (connptr->headers, ids,
+                             sizeof (ids) / sizeof (ids[0])))
+                return FALSE;
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy)
+                return connptr->upstream_proxy->type == PT_HTTP
+                        && config->upstream_pool_size > 0
+                        && upstream_healthy (connptr->upstream_proxy);
+#endif
+        return config->origin_pool_size > 0;
+}
 
-        return content_length;
+/*
+ * Let the upstream proxy in use, if any, know how the request went.
+ */
+static void upstream_result (struct conn_s *connptr, int ok)
+{
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy)
+                upstream_report (connptr->upstream_proxy, ok);
+#endif
 }
 
-static int is_chunked_transfer (pseudomap *hashofheaders)
+/*
+ * Tell whether the server keeps its connection open after this
+ * response, as HTTP/1.1 servers do unless they say otherwise.
+ */
+static int server_persists (const char *response_line,
+                            pseudomap *hashofheaders)
 {
         char *data;
-        data = pseudomap_find (hashofheaders, "transfer-encoding");
-        return data ? !strcasecmp (data, "chunked") : 0;
+
+        if (strncmp (response_line, "HTTP/1.1 ", 9) != 0)
+                return FALSE;
+
+        data = pseudomap_find_id (hashofheaders, HDR_connection);
+        return !data || !has_token (data, "close");
+}
+
+/*
+ * Get the status code out of a response line.
+ */
+static int response_status (const char *response_line)
+{
+        const char *p;
+
+        p = strchr (response_line, ' ');
+        return p ? atoi (p + 1) : 0;
+}
+
+/*
+ * Work out from the response head where the response body ends: after
+ * Content-Length bytes, with the last chunk, right away for responses
+ * which have no body, or only when the server closes the connection.
+ * Neither the client nor the server connection can be kept open unless
+ * that is known.
+ * Returns -1 if the response can't be told apart from what follows it.
+ */
+static int response_framing (struct conn_s *connptr, const char *response_line,
+                             pseudomap *hashofheaders)
+{
+        int status = response_status (response_line);
+        long *length = &connptr->content_length.server;
+
+        *length = -1;
+        if (connptr->connect_method)
+                return 0;
+
+        /* Switches to another protocol are relayed until the server
+         * closes, as they always were. */
+        if (status < 200) {
+                connptr->keep_alive = connptr->server_keep_alive = FALSE;
+                return 0;
+        }
+
+        if (status == 204 || status == 304
+            || strcmp (connptr->request->method, "HEAD") == 0) {
+                *length = 0;
+                return 0;
+        }
+
+        switch (message_framing (hashofheaders, length)) {
+        case FRAMING_CHUNKED:
+                /* Transfer-Encoding wins over Content-Length, but a
+                 * server sending both isn't asked for more. */
+                if (*length != -1) {
+                        pseudomap_remove_id (hashofheaders,
+                                             HDR_content_length);
+                        connptr->server_keep_alive = FALSE;
+                }
+                *length = -1;
+                connptr->response_chunked = TRUE;
+                break;
+        case FRAMING_CLOSE:
+                pseudomap_remove_id (hashofheaders, HDR_content_length);
+                *length = -1;
+                connptr->keep_alive = connptr->server_keep_alive = FALSE;
+                break;
+        case FRAMING_LENGTH:
+                if (*length < 0)
+                        connptr->keep_alive = connptr->server_keep_alive
+                                = FALSE;
+                break;
+        default:
+                connptr->keep_alive = connptr->server_keep_alive = FALSE;
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Account for "len" bytes of the response body just read from the
+ * server.  Returns 1 once the whole response has been read.  Anything
+ * the server sends past its response means it can't be trusted to keep
+ * to the framing, so neither connection is kept after it.
+ */
+static int response_body_read (struct conn_s *connptr, const char *data,
+                               size_t len)
+{
+        ssize_t used;
+
+        if (connptr->content_length.server == 0) {
+                if (len > 0)
+                        connptr->keep_alive = connptr->server_keep_alive
+                                = FALSE;
+                return 1;
+        }
+
+        if (connptr->response_chunked) {
+                used = chunked_scan (&connptr->schunked, data, len);
+                if (used < 0) {
+                        /* Broken chunks: relay until the server closes. */
+                        connptr->response_chunked = FALSE;
+                        connptr->keep_alive = connptr->server_keep_alive
+                                = FALSE;
+                        return 0;
+                }
+                if (!chunked_done (&connptr->schunked))
+                        return 0;
+                if ((size_t) used < len)
+                        connptr->keep_alive = connptr->server_keep_alive
+                                = FALSE;
+                connptr->content_length.server = 0;
+                return 1;
+        }
+
+        if (connptr->content_length.server < 0)
+                return 0;
+
+        if (len > (size_t) connptr->content_length.server) {
+                connptr->keep_alive = connptr->server_keep_alive = FALSE;
+                len = connptr->content_length.server;
+        }
+        connptr->content_length.server -= len;
+        return connptr->content_length.server == 0;
+}
+
+/*
+ * Whether some of the request body is still to come from the client.
+ */
+static int request_body_pending (struct conn_s *connptr)
+{
+        if (connptr->content_length.client == -2)
+                return !chunked_done (&connptr->cchunked);
+        return connptr->content_length.client > 0;
+}
+
+/*
+ * The server gave its final answer to a client which still waits for
+ * a 100 Continue: the request body is not wanted, so none of it goes
+ * to the server.  As the client may send it all the same, neither
+ * connection can be kept after the response.
+ */
+static void request_body_refuse (struct conn_s *connptr)
+{
+        log_message (LOG_INFO,
+                     "Server answered before the request body was sent, "
+                     "not relaying it (client_fd:%d)", connptr->client_fd);
+
+        connptr->content_length.client = 0;
+        connptr->keep_alive = connptr->server_keep_alive = FALSE;
+        buffer_trim (connptr->cbuffer, buffer_size (connptr->cbuffer));
+}
+
+/*
+ * Account for "len" bytes of the request body just read from the
+ * client.  Returns how many of them belong to the body, as a chunked
+ * body may end within them, or -1 if its chunks are broken.
+ */
+static ssize_t request_body_read (struct conn_s *connptr, const char *data,
+                                  size_t len)
+{
+        if (connptr->content_length.client == -2)
+                return chunked_scan (&connptr->cchunked, data, len);
+
+        if (connptr->content_length.client <= 0)
+                return 0;
+        len = min (len, (size_t) connptr->content_length.client);
+        connptr->content_length.client -= len;
+        return len;
 }
 
 /*
- * Search for Via header in a hash of headers and either write a new Via
- * header, or append our information to the end of an existing Via header.
+ * Search for Via header in a hash of headers and either add a new Via
+ * header to the outgoing head, or append our information to the end of
+ * an existing Via header.
  *
  * FIXME: Need to add code to "hide" our internal information for security
  * purposes.
  */
 static int
-write_via_header (int fd, pseudomap *hashofheaders,
+write_via_header (struct outvec_s *out, pseudomap *hashofheaders,
                   unsigned int major, unsigned int minor)
 {
         char hostname[512];
@@ -863,15 +1072,15 @@ write_via_header (int fd, pseudomap *hashofheaders,
          * See if there is a "Via" header.  If so, again we need to do a bit
          * of processing.
          */
-        data = pseudomap_find (hashofheaders, "via");
+        data = pseudomap_find_id (hashofheaders, HDR_via);
         if (data) {
-                ret = write_message (fd,
+                ret = outvec_printf (out,
                                      "Via: %s, %hu.%hu %s (%s)\r\n",
                                      data, major, minor, hostname, PACKAGE);
 
-                pseudomap_remove (hashofheaders, "via");
+                pseudomap_remove_id (hashofheaders, HDR_via);
         } else {
-                ret = write_message (fd,
+                ret = outvec_printf (out,
                                      "Via: %hu.%hu %s (%s)\r\n",
                                      major, minor, hostname, PACKAGE);
         }
@@ -881,25 +1090,61 @@ done:
 }
 
 /*
- * Here we loop through all the headers the client is sending. If we
- * are running in anonymous mode, we will _only_ send the headers listed
- * (plus a few which are required for various methods).
- *	- rjkaes
+ * A request on a connection out of the origin pool may find it closed
+ * by the server just before the request got there.  If the request has
+ * no body and can safely be repeated, keep a copy of its head (which is
+ * all formatted text then) so that it can be sent again on a new
+ * connection.
  */
-static int
-process_client_headers (struct conn_s *connptr, pseudomap *hashofheaders)
+static void keep_retry_head (struct conn_s *connptr, struct outvec_s *out)
 {
-        static const char *skipheaders[] = {
-                "host",
-                "keep-alive",
-                "proxy-connection",
-                "te",
-                "trailers",
-                "upgrade"
+        static const char *const methods[] = {
+                "GET", "HEAD", "OPTIONS", "TRACE", "DELETE"
         };
-        int i;
-        size_t iter;
-        int ret = 0;
+        size_t i;
+
+        if (!connptr->server_reused || out->failed
+            || connptr->content_length.client > 0
+            || connptr->content_length.client == -2)
+                return;
+
+        for (i = 0; i != (sizeof (methods) / sizeof (methods[0])); i++)
+                if (strcmp (connptr->request->method, methods[i]) == 0)
+                        break;
+        if (i == (sizeof (methods) / sizeof (methods[0])))
+                return;
+
+        connptr->retry_head = (char *) safemalloc (out->textlen);
+        if (!connptr->retry_head)
+                return;
+        memcpy (connptr->retry_head, out->text, out->textlen);
+        connptr->retry_len = out->textlen;
+}
+
+/*
+ * Here we loop through all the headers the client is sending. If we
+ * are running in anonymous mode, we will _only_ send the headers listed
+ * (plus a few which are required for various methods).
+ * Returns -3 if a pooled server connection turned out to be closed and
+ * the request is to be sent again on a new one.
+ *	- rjkaes
+ */
+static int
+process_client_headers (struct conn_s *connptr, pseudomap *hashofheaders)
+{
+        static const enum http_header skipheaders[] = {
+                HDR_host,
+                HDR_keep_alive,
+                HDR_proxy_connection,
+                HDR_te,
+                HDR_trailers,
+                HDR_upgrade
+        };
+        struct outvec_s *out = &connptr->outhead;
+        size_t len;
+        ssize_t used;
+        int i;
+        size_t iter;
 
         char *data, *header;
 
@@ -916,19 +1161,26 @@ process_client_headers (struct conn_s *connptr, pseudomap *hashofheaders)
         }
 
         /*
-         * See if there is a "Content-Length" header.  If so, again we need
-         * to do a bit of processing.
+         * Find out how the body, if any, ends; request_framing_valid()
+         * has made sure it can be told.
          */
-        connptr->content_length.client = get_content_length (hashofheaders);
+        if (message_framing (hashofheaders, &connptr->content_length.client)
+            == FRAMING_CHUNKED)
+                connptr->content_length.client = -2;
 
-        /* Check whether client sends chunked data. */
-        if (is_chunked_transfer (hashofheaders)) {
-                if (connptr->content_length.client != -1)
-                        /* request smuggling, see GH issue #609 */
-                        pseudomap_remove (hashofheaders, "content-length");
+        connptr->keep_alive = client_keep_alive (connptr, hashofheaders);
 
-                connptr->content_length.client = -2;
-        }
+        /*
+         * An HTTP/1.1 client asking for a 100 Continue waits for it (or
+         * for the final response) before it sends the body.  The server
+         * is left to decide; the body is only relayed once it comes.
+         */
+        data = pseudomap_find_id (hashofheaders, HDR_expect);
+        connptr->expect_continue = data && has_token (data, "100-continue")
+                && request_body_pending (connptr)
+                && (connptr->protocol.major > 1
+                    || (connptr->protocol.major == 1
+                        && connptr->protocol.minor >= 1));
 
         /*
          * See if there is a "Connection" header.  If so, we need to do a bit
@@ -939,127 +1191,158 @@ process_client_headers (struct conn_s *connptr, pseudomap *hashofheaders)
         /*
          * Delete the headers listed in the skipheaders list
          */
-        for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
-                pseudomap_remove (hashofheaders, skipheaders[i]);
+        for (i = 0; i != (sizeof (skipheaders) / sizeof (skipheaders[0])); i++) {
+                pseudomap_remove_id (hashofheaders, skipheaders[i]);
         }
 
-        /* Send, or add the Via header */
-        ret = write_via_header (connptr->server_fd, hashofheaders,
-                                connptr->protocol.major,
-                                connptr->protocol.minor);
-        if (ret < 0) {
-                indicate_http_error (connptr, 503,
-                                     "Could not send data to remote server",
-                                     "detail",
-                                     "A network error occurred while "
-                                     "trying to write data to the remote web server.",
-                                     NULL);
-                goto PULL_CLIENT_DATA;
-        }
+        /* Add the Via header, or our part of it */
+        write_via_header (out, hashofheaders, connptr->protocol.major,
+                          connptr->protocol.minor);
 
         /*
-         * Output all the remaining headers to the remote machine.
+         * Add all the remaining headers for the remote machine.
          */
         iter = 0;
         while((iter = pseudomap_next(hashofheaders, iter, &data, &header))) {
                 if (!is_anonymous_enabled (config)
-                    || anonymous_search (config, data) > 0) {
-                        ret =
-                            write_message (connptr->server_fd,
-                                           "%s: %s\r\n", data, header);
-                        if (ret < 0) {
-                                indicate_http_error (connptr, 503,
-                                                     "Could not send data to remote server",
-                                                     "detail",
-                                                     "A network error occurred while "
-                                                     "trying to write data to the "
-                                                     "remote web server.",
-                                                     NULL);
-                                goto PULL_CLIENT_DATA;
-                        }
-                }
+                    || anonymous_search (config, data) > 0)
+                        outvec_printf (out, "%s: %s\r\n", data, header);
         }
 #if defined(XTINYPROXY_ENABLE)
         if (config->add_xtinyproxy)
                 add_xtinyproxy_header (connptr);
 #endif
 
-        /* Write the final "blank" line to signify the end of the headers */
-        if (safe_write (connptr->server_fd, "\r\n", 2) < 0)
+        /* Add the final "blank" line to signify the end of the headers */
+        outvec_printf (out, "\r\n");
+        keep_retry_head (connptr, out);
+
+        /*
+         * Whatever part of the body came in with the head goes out
+         * with it, all in one go.  The rest is relayed as it comes in.
+         */
+        if (request_body_pending (connptr)) {
+                len = readahead_take (&connptr->creadahead, &data,
+                                      connptr->content_length.client > 0
+                                      ? (size_t) connptr->content_length.client
+                                      : MAXBUFFSIZE);
+                used = request_body_read (connptr, data, len);
+                if (used < 0) {
+                        outvec_free (out);
+                        indicate_http_error (connptr, 400, "Bad Request",
+                                             "detail",
+                                             "Could not make sense of the "
+                                             "chunks of the request body.",
+                                             NULL);
+                        return -1;
+                }
+                readahead_untake (&connptr->creadahead, len - used);
+                outvec_ref (out, data, used);
+        }
+
+        if (outvec_send (connptr->server_fd, out) < 0) {
+                if (connptr->retry_head
+                    && (errno == EPIPE || errno == ECONNRESET))
+                        return -3;
+                indicate_http_error (connptr, 503,
+                                     "Could not send data to remote server",
+                                     "detail",
+                                     "A network error occurred while "
+                                     "trying to write data to the "
+                                     "remote web server.",
+                                     NULL);
                 return -1;
+        }
 
         /*
-         * Spin here pulling the data from the client.
+         * With the Expect header kept from the server by the Anonymous
+         * filter, no 100 Continue will come from there: let the client
+         * go on right away.
          */
-PULL_CLIENT_DATA:
-        if (connptr->content_length.client > 0) {
-                ret = pull_client_data (connptr,
-                                        connptr->content_length.client);
-        } else if (connptr->content_length.client == -2)
-                ret = pull_client_data_chunked (connptr);
+        if (connptr->expect_continue && is_anonymous_enabled (config)
+            && anonymous_search (config, "Expect") <= 0) {
+                static const char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
 
-        return ret;
+                connptr->expect_continue = FALSE;
+                if (safe_write (connptr->client_fd, go_on,
+                                sizeof (go_on) - 1) < 0)
+                        return -1;
+        }
+
+        return 0;
 }
 
 /*
  * Loop through all the headers (including the response code) from the
- * server.
+ * server.  Returns -3 if a pooled server connection was closed before
+ * any of the response came in, and the request can be sent again, and
+ * 1 if that was an interim response, with the final one still to come.
  */
 static int process_server_headers (struct conn_s *connptr)
 {
-        static const char *skipheaders[] = {
-                "keep-alive",
-                "proxy-authenticate",
-                "proxy-authorization",
-                "proxy-connection",
+        static const enum http_header skipheaders[] = {
+                HDR_keep_alive,
+                HDR_proxy_authenticate,
+                HDR_proxy_authorization,
+                HDR_proxy_connection,
+        };
+        static const enum http_header challenges[] = {
+                HDR_www_authenticate,
+                HDR_proxy_authenticate
         };
 
-        char *response_line;
+        char *head, *response_line;
 
         pseudomap *hashofheaders;
+        struct outvec_s out;
         size_t iter;
         char *data, *header;
         ssize_t len;
         int i;
-        int ret;
+        int ret, status, interim;
 
 #ifdef REVERSE_SUPPORT
         struct reversepath *reverse = config->reversepath_list;
 #endif
 
-        /* Get the response line from the remote server. */
-retry:
-        len = readline (connptr->server_fd, &response_line);
-        if (len <= 0)
-                return -1;
-
+next_head:
         /*
-         * Strip the new line and character return from the string.
+         * Get the response line and all the headers from the remote
+         * server in a big hash.  Both point into "head", which has to
+         * stay around until they have been sent on.
          */
-        if (chomp (response_line, len) == len) {
-                /*
-                 * If the number of characters removed is the same as the
-                 * length then it was a blank line. Free the buffer and
-                 * try again (since we're looking for a request line.)
-                 */
-                safefree (response_line);
-                goto retry;
+        len = readahead_head (connptr->server_fd, &connptr->sreadahead,
+                              &head, &response_line);
+        if (len <= 0 && len != -ERANGE) {
+                if (connptr->retry_head && (len == 0 || errno == ECONNRESET)
+                    && readahead_pending (&connptr->sreadahead) == 0)
+                        return -3;
+                upstream_result (connptr, FALSE);
+                return -1;
         }
 
         hashofheaders = pseudomap_create ();
-        if (!hashofheaders) {
-                safefree (response_line);
+        if (len >= 0 && hashofheaders
+            && http_head_parse (response_line, len, hashofheaders) < 0) {
+                upstream_result (connptr, FALSE);
+                log_message (LOG_WARNING,
+                             "Malformed response head from the remote "
+                             "server (server_fd:%d)", connptr->server_fd);
+                pseudomap_destroy (hashofheaders);
+                pool_free (head);
+
+                indicate_http_error (connptr, 502, "Bad Gateway",
+                                     "detail",
+                                     "The remote web server sent a "
+                                     "malformed response head.", NULL);
                 return -1;
         }
-
-        /*
-         * Get all the headers from the remote server in a big hash
-         */
-        if (get_all_headers (connptr->server_fd, hashofheaders) < 0) {
+        if (len < 0 || !hashofheaders) {
+                upstream_result (connptr, FALSE);
                 log_message (LOG_WARNING,
                              "Could not retrieve all the headers from the remote server.");
                 pseudomap_destroy (hashofheaders);
-                safefree (response_line);
+                pool_free (head);
 
                 indicate_http_error (connptr, 503,
                                      "Could not retrieve all the headers",
@@ -1070,6 +1353,8 @@ retry:
                 return -1;
         }
 
+        upstream_result (connptr, TRUE);
+
         /*
          * At this point we've received the response line and all the
          * headers.  However, if this is a simple HTTP/0.9 request we
@@ -1078,21 +1363,59 @@ retry:
          */
         if (connptr->protocol.major < 1) {
                 pseudomap_destroy (hashofheaders);
-                safefree (response_line);
+                pool_free (head);
                 return 0;
         }
 
-        /* Send the saved response line first */
-        ret = write_message (connptr->client_fd, "%s\r\n", response_line);
-        safefree (response_line);
-        if (ret < 0)
-                goto ERROR_EXIT;
+        /* The saved response line goes first */
+        memset (&out, 0, sizeof (out));
+        outvec_printf (&out, "%s\r\n", response_line);
 
         /*
-         * If there is a "Content-Length" header, retrieve the information
-         * from it for later use.
+         * An interim response, such as the 100 Continue a client waiting
+         * to send its body asked for, goes on by itself and leaves the
+         * framing to the final response after it.
          */
-        connptr->content_length.server = get_content_length (hashofheaders);
+        status = response_status (response_line);
+        interim = status >= 100 && status < 200 && status != 101
+                  && !connptr->connect_method;
+        if (interim) {
+                connptr->content_length.server = 0;
+                connptr->expect_continue = FALSE;
+                if (connptr->retry_head)
+                        safefree (connptr->retry_head);
+        } else {
+                /*
+                 * Find out how the body ends, and with it whether the
+                 * connections can be kept.
+                 */
+                if (connptr->server_keep_alive)
+                        connptr->server_keep_alive =
+                                server_persists (response_line,
+                                                 hashofheaders)
+                                && !connection_auth (hashofheaders,
+                                        challenges,
+                                        sizeof (challenges)
+                                        / sizeof (challenges[0]));
+                if (response_framing (connptr, response_line,
+                                      hashofheaders) < 0) {
+                        log_message (LOG_WARNING,
+                                     "The length of the response body "
+                                     "could not be worked out (server_fd:%d)",
+                                     connptr->server_fd);
+                        pseudomap_destroy (hashofheaders);
+                        pool_free (head);
+
+                        indicate_http_error (connptr, 502, "Bad Gateway",
+                                             "detail",
+                                             "The remote web server sent a "
+                                             "response whose length could "
+                                             "not be worked out.", NULL);
+                        return -1;
+                }
+                if (connptr->expect_continue && status >= 200)
+                        request_body_refuse (connptr);
+        }
 
         /*
          * See if there is a connection header.  If so, we need to to a bit of
@@ -1103,30 +1426,33 @@ retry:
         /*
          * Delete the headers listed in the skipheaders list
          */
-        for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
-                pseudomap_remove (hashofheaders, skipheaders[i]);
+        for (i = 0; i != (sizeof (skipheaders) / sizeof (skipheaders[0])); i++) {
+                pseudomap_remove_id (hashofheaders, skipheaders[i]);
         }
 
-        /* Send, or add the Via header */
-        ret = write_via_header (connptr->client_fd, hashofheaders,
-                                connptr->protocol.major,
-                                connptr->protocol.minor);
-        if (ret < 0)
-                goto ERROR_EXIT;
+        /* Add the Via header, or our part of it */
+        write_via_header (&out, hashofheaders, connptr->protocol.major,
+                          connptr->protocol.minor);
 
-#ifdef REVERSE_SUPPORT
-        /* Write tracking cookie for the magical reverse proxy path hack */
-        if (config->reversemagic && connptr->reversepath) {
-                ret = write_message (connptr->client_fd,
-                                     "Set-Cookie: " REVERSE_COOKIE
-                                     "=%s; path=/\r\n", connptr->reversepath);
-                if (ret < 0)
-                        goto ERROR_EXIT;
+        /*
+         * Tell the client whether its connection stays open.  The status
+         * line may well say HTTP/1.0, so keep-alive is spelled out.
+         */
+        if (connptr->keep_alive && !interim) {
+                outvec_printf (&out, "Connection: keep-alive\r\n");
+        } else if (!connptr->connect_method && status >= 200) {
+                outvec_printf (&out, "Connection: close\r\n");
         }
 
+#ifdef REVERSE_SUPPORT
+        /* Add tracking cookie for the magical reverse proxy path hack */
+        if (config->reversemagic && connptr->reversepath)
+                outvec_printf (&out, "Set-Cookie: " REVERSE_COOKIE
+                               "=%s; path=/\r\n", connptr->reversepath);
+
         /* Rewrite the HTTP redirect if needed */
         if (config->reversebaseurl &&
-            (header = pseudomap_find (hashofheaders, "location"))) {
+            (header = pseudomap_find_id (hashofheaders, HDR_location))) {
 
                 /* Look for a matching entry in the reversepath list */
                 while (reverse) {
@@ -1139,326 +1465,826 @@ retry:
                 }
 
                 if (reverse) {
-                        ret =
-                            write_message (connptr->client_fd,
-                                           "Location: %s%s%s\r\n",
-                                           config->reversebaseurl,
-                                           (reverse->path + 1), (header + len));
-                        if (ret < 0)
-                                goto ERROR_EXIT;
+                        outvec_printf (&out, "Location: %s%s%s\r\n",
+                                       config->reversebaseurl,
+                                       (reverse->path + 1), (header + len));
 
                         log_message (LOG_INFO,
                                      "Rewriting HTTP redirect: %s -> %s%s%s",
                                      header, config->reversebaseurl,
                                      (reverse->path + 1), (header + len));
-                        pseudomap_remove (hashofheaders, "location");
+                        pseudomap_remove_id (hashofheaders, HDR_location);
                 }
         }
 #endif
 
         /*
-         * All right, output all the remaining headers to the client.
+         * All right, add all the remaining headers and the final blank
+         * line.
          */
         iter = 0;
-        while ((iter = pseudomap_next(hashofheaders, iter, &data, &header))) {
+        while ((iter = pseudomap_next(hashofheaders, iter, &data, &header)))
+                outvec_printf (&out, "%s: %s\r\n", data, header);
+        outvec_printf (&out, "\r\n");
 
-                ret = write_message (connptr->client_fd,
-                                     "%s: %s\r\n", data, header);
-                if (ret < 0)
-                        goto ERROR_EXIT;
+        /*
+         * The part of the body which came in with the head goes out
+         * with it.  Without a Content-Length all of it is taken; a
+         * chunked body is scanned for its end as it goes.
+         */
+        if (connptr->content_length.server != 0) {
+                len = readahead_take (&connptr->sreadahead, &data,
+                                      connptr->content_length.server > 0
+                                      ? (size_t) connptr->content_length.server
+                                      : MAXBUFFSIZE);
+                outvec_ref (&out, data, len);
+                response_body_read (connptr, data, len);
         }
+
+        /* HTTP/1.0 clients know nothing of interim responses. */
+        if (interim && connptr->protocol.major == 1
+            && connptr->protocol.minor == 0)
+                ret = 0;
+        else
+                ret = outvec_send (connptr->client_fd, &out);
+
+        outvec_free (&out);
         pseudomap_destroy (hashofheaders);
+        pool_free (head);
+        if (!interim || ret < 0)
+                return ret;
+
+        /* The final response may have come in along with it. */
+        if (readahead_pending (&connptr->sreadahead) > 0)
+                goto next_head;
+        return 1;
+}
+
+#ifdef HAVE_SPLICE
+/* What a pipe holds by default on Linux. */
+#define SPLICE_PIPE_SIZE 65536
+
+#define SPLICING(connptr) ((connptr)->c2s_pipe[0] != -1)
+
+/*
+ * Move up to "len" bytes between two descriptors, one of them a pipe,
+ * without copying them to user space.  Returns the number of bytes
+ * moved, 0 if none could be moved right now, and -1 on end of file or
+ * on error.
+ */
+static ssize_t splice_bytes (int from, int to, size_t len)
+{
+        ssize_t n;
+
+        do {
+                n = splice (from, NULL, to, NULL, len,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (n < 0 && errno == EINTR);
 
-        /* Write the final blank line to signify the end of the headers */
-        if (safe_write (connptr->client_fd, "\r\n", 2) < 0)
+        if (n < 0)
+                return errno == EAGAIN ? 0 : -1;
+        if (n == 0)
                 return -1;
+        return n;
+}
 
-        return 0;
+/*
+ * Read from a socket into one of the splice pipes.  If the kernel can't
+ * splice from this socket at all, fall back to the buffers for good.
+ */
+static ssize_t splice_read (struct conn_s *connptr, int fd, int *pipefd,
+                            size_t *len)
+{
+        ssize_t n = splice_bytes (fd, pipefd[1], SPLICE_PIPE_SIZE - *len);
 
-ERROR_EXIT:
-        pseudomap_destroy (hashofheaders);
-        return -1;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)
+            && connptr->c2s_len == 0 && connptr->s2c_len == 0) {
+                log_message (LOG_INFO, "splice() not supported, "
+                             "relaying through buffers");
+                conn_close_pipes (connptr);
+                return 0;
+        }
+        if (n > 0)
+                *len += n;
+        return n;
 }
+#else
+#define SPLICING(connptr) 0
+#endif
 
 /*
- * Begin relaying the bytes between the two connections.
- * We continue to use the buffering code
- * since we want to be able to buffer a certain amount for slower
- * connections (as this was the reason why I originally modified
- * tinyproxy oh so long ago...)
- *	- rjkaes
+ * Move what was read past the head of one side into the buffer
+ * relaying it to the other side, and release the readahead buffer.
+ * Returns the number of bytes moved.
  */
-static void relay_connection (struct conn_s *connptr)
+static size_t relay_readahead (struct readahead_s *ra,
+                               struct buffer_s *buffptr)
 {
-        int ret;
-        ssize_t bytes_received;
+        char *data;
+        size_t len;
+
+        len = readahead_take (ra, &data, MAXBUFFSIZE);
+        if (len > 0 && add_to_buffer (buffptr, (unsigned char *) data,
+                                      len) < 0) {
+                log_message (LOG_ERR, "relay_readahead: could not buffer "
+                             "%lu bytes read ahead", (unsigned long) len);
+                len = 0;
+        }
+        readahead_release (ra);
+        return len;
+}
 
-        for (;;) {
-                pollfd_struct fds[2] = {0};
-                fds[0].fd = connptr->client_fd;
-                fds[1].fd = connptr->server_fd;
+/*
+ * Account for the "len" bytes of response body that the last read put
+ * into the server buffer.  Returns 1 once the whole response is in.
+ */
+static int relay_response_read (struct conn_s *connptr, size_t len)
+{
+        struct iovec iov[2];
+        int i, n, done = 0;
 
-                if (buffer_size (connptr->sbuffer) > 0)
-                        fds[0].events |= MYPOLL_WRITE;
-                if (buffer_size (connptr->cbuffer) > 0)
-                        fds[1].events |= MYPOLL_WRITE;
-                if (buffer_size (connptr->sbuffer) < MAXBUFFSIZE)
-                        fds[1].events |= MYPOLL_READ;
-                if (buffer_size (connptr->cbuffer) < MAXBUFFSIZE)
-                        fds[0].events |= MYPOLL_READ;
+        if (len == 0)
+                return response_body_read (connptr, NULL, 0);
 
-                ret = mypoll(fds, 2, config->idletimeout);
+        n = buffer_tail (connptr->sbuffer, len, iov);
+        for (i = 0; i < n; i++)
+                done = response_body_read (connptr, (char *) iov[i].iov_base,
+                                           iov[i].iov_len);
+        return done;
+}
 
-                if (ret == 0) {
-                        log_message (LOG_INFO,
-                                     "Idle Timeout (after " SELECT_OR_POLL ")");
-                                return;
-                } else if (ret < 0) {
-                        log_message (LOG_ERR,
-                                     "relay_connection: " SELECT_OR_POLL "() error \"%s\". "
-                                     "Closing connection (client_fd:%d, server_fd:%d)",
-                                     strerror (errno), connptr->client_fd,
-                                     connptr->server_fd);
-                        return;
-                }
+/*
+ * Read from the client into the client buffer.  While there is request
+ * body to come, no further than its end, since what follows it is the
+ * client's next request.  After that, only if the relay just goes on
+ * until either side closes.
+ */
+static int relay_request_read (struct conn_s *connptr)
+{
+        struct iovec iov[2];
+        size_t limit = MAXBUFFSIZE;
+        ssize_t len, used, n;
+        int i, segs;
 
-                if (fds[1].revents & MYPOLL_READ) {
-                        bytes_received =
-                            read_buffer (connptr->server_fd, connptr->sbuffer);
-                        if (bytes_received < 0)
-                                break;
+        if (!request_body_pending (connptr)) {
+                if (!RELAY_READS_CLIENT (connptr))
+                        return 0;
+                return read_buffer (connptr->client_fd,
+                                    connptr->cbuffer) < 0 ? -1 : 0;
+        }
 
-                        connptr->content_length.server -= bytes_received;
-                        if (connptr->content_length.server == 0)
-                                break;
-                }
-                if ((fds[0].revents & MYPOLL_READ)
-                    && read_buffer (connptr->client_fd, connptr->cbuffer) < 0) {
-                        break;
-                }
-                if ((fds[1].revents & MYPOLL_WRITE)
-                    && write_buffer (connptr->server_fd, connptr->cbuffer) < 0) {
-                        break;
+        if (connptr->content_length.client > 0)
+                limit = min (limit, (size_t) connptr->content_length.client);
+        len = read_buffer_upto (connptr->client_fd, connptr->cbuffer, limit);
+        if (len <= 0)
+                return len < 0 ? -1 : 0;
+
+        used = 0;
+        segs = buffer_tail (connptr->cbuffer, len, iov);
+        for (i = 0; i < segs; i++) {
+                n = request_body_read (connptr, (char *) iov[i].iov_base,
+                                       iov[i].iov_len);
+                if (n < 0) {
+                        log_message (LOG_WARNING,
+                                     "Broken chunks in the request body "
+                                     "from client (fd:%d)",
+                                     connptr->client_fd);
+                        return -1;
                 }
-                if ((fds[0].revents & MYPOLL_WRITE)
-                    && write_buffer (connptr->client_fd, connptr->sbuffer) < 0) {
+                used += n;
+                if ((size_t) n < iov[i].iov_len)
                         break;
-                }
         }
 
-        while (buffer_size (connptr->sbuffer) > 0) {
-                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0)
-                        break;
+        /* What follows a chunked body must not reach the server. */
+        if (used < len) {
+                buffer_trim (connptr->cbuffer, len - used);
+                connptr->keep_alive = FALSE;
         }
-        shutdown (connptr->client_fd, SHUT_WR);
+        return 0;
+}
 
-        /*
-         * Try to send any remaining data to the server if we can.
-         */
-        while (buffer_size (connptr->cbuffer) > 0) {
-                if (write_buffer (connptr->server_fd, connptr->cbuffer) < 0)
-                        break;
-        }
+/*
+ * Work out which events are wanted while the request body is sent on,
+ * before the response head has come in: reading the body from the
+ * client, writing it to the server, and whatever the server has to say.
+ */
+void relay_request_events (struct conn_s *connptr, short *cev, short *sev)
+{
+        size_t to_client, to_server;
 
-        return;
+        *cev = 0;
+        *sev = MYPOLL_READ;
+
+        relay_connection_pending (connptr, &to_client, &to_server);
+        if (to_server > 0)
+                *sev |= MYPOLL_WRITE;
+        if (request_body_pending (connptr)
+            && buffer_wants_data (connptr->cbuffer))
+                *cev |= MYPOLL_READ;
 }
 
-#ifdef UPSTREAM_SUPPORT
-static int
-connect_to_upstream_proxy(struct conn_s *connptr, struct request_s *request)
-{
-	unsigned len;
-	unsigned char buff[512]; /* won't use more than 7 + 255 */
-	unsigned short port;
-	size_t ulen, passlen;
-
-	struct upstream *cur_upstream = connptr->upstream_proxy;
-
-	ulen = cur_upstream->ua.user ? strlen(cur_upstream->ua.user) : 0;
-	passlen = cur_upstream->pass ? strlen(cur_upstream->pass) : 0;
-
-
-	log_message(LOG_CONN,
-		    "Established connection to %s proxy \"%s\" using file descriptor %d.",
-		    proxy_type_name(cur_upstream->type), cur_upstream->host, connptr->server_fd);
-
-	if (cur_upstream->type == PT_SOCKS4) {
-
-		buff[0] = 4; /* socks version */
-		buff[1] = 1; /* connect command */
-		port = htons(request->port);
-		memcpy(&buff[2], &port, 2); /* dest port */
-		memcpy(&buff[4], "\0\0\0\1" /* socks4a fake ip */
-				 "\0" /* user */, 5);
-		len = strlen(request->host);
-		if(len>255)
-			return -1;
-		memcpy(&buff[9], request->host, len+1);
-		if (9+len+1 != safe_write(connptr->server_fd, buff, 9+len+1))
-			return -1;
-		if (8 != safe_read(connptr->server_fd, buff, 8))
-			return -1;
-		if (buff[0]!=0 || buff[1]!=90)
-			return -1;
-
-	} else if (cur_upstream->type == PT_SOCKS5) {
-
-		/* init */
-		int n_methods = ulen ? 2 : 1;
-		buff[0] = 5; /* socks version */
-		buff[1] = n_methods; /* number of methods  */
-		buff[2] = 0; /* no auth method */
-		if (ulen) buff[3] = 2;  /* auth method -> username / password */
-		if (2+n_methods != safe_write(connptr->server_fd, buff, 2+n_methods))
-			return -1;
-		if (2 != safe_read(connptr->server_fd, buff, 2))
-			return -1;
-		if (buff[0] != 5 || (buff[1] != 0 && buff[1] != 2))
-			return -1;
-
-		if (buff[1] == 2) {
-			/* authentication */
-			char in[2];
-			char out[515];
-			char *cur = out;
-			size_t c;
-			*cur++ = 1;	/* version */
-			c = ulen & 0xFF;
-			*cur++ = c;
-			memcpy(cur, cur_upstream->ua.user, c);
-			cur += c;
-			c = passlen & 0xFF;
-			*cur++ = c;
-			memcpy(cur, cur_upstream->pass, c);
-			cur += c;
-
-			if((cur - out) != safe_write(connptr->server_fd, out, cur - out))
-				return -1;
-
-			if(2 != safe_read(connptr->server_fd, in, 2))
-				return -1;
-			if(in[1] != 0 || !(in[0] == 5 || in[0] == 1)) {
-				return -1;
-			}
-		}
-		/* connect */
-		buff[0] = 5; /* socks version */
-		buff[1] = 1; /* connect */
-		buff[2] = 0; /* reserved */
-		buff[3] = 3; /* domainname */
-		len=strlen(request->host);
-		if(len>255)
-			return -1;
-		buff[4] = len; /* length of domainname */
-		memcpy(&buff[5], request->host, len); /* dest ip */
-		port = htons(request->port);
-		memcpy(&buff[5+len], &port, 2); /* dest port */
-		if (7+len != safe_write(connptr->server_fd, buff, 7+len))
-			return -1;
-		if (4 != safe_read(connptr->server_fd, buff, 4))
-			return -1;
-		if (buff[0]!=5 || buff[1]!=0)
-			return -1;
-		switch(buff[3]) {
-			case 1: len=4; break; /* ip v4 */
-			case 4: len=16; break; /* ip v6 */
-			case 3: /* domainname */
-				if (1 != safe_read(connptr->server_fd, buff, 1))
-					return -1;
-				len = buff[0]; /* max = 255 */
-				break;
-			default: return -1;
-		}
-		if (2+len != safe_read(connptr->server_fd, buff, 2+len))
-			return -1;
-	} else {
-		return -1;
-	}
-
-	if (connptr->connect_method)
-		return 0;
-
-	return establish_http_connection(connptr, request);
+/*
+ * Whether the request body is through, read from the client and sent
+ * on to the server.
+ */
+int relay_request_done (struct conn_s *connptr)
+{
+        size_t to_client, to_server;
+
+        relay_connection_pending (connptr, &to_client, &to_server);
+        return to_server == 0 && !request_body_pending (connptr);
 }
-#endif
 
 /*
- * Establish a connection to the upstream proxy server.
+ * Get the relay going.  A CONNECT tunnel only passes bytes along, so on
+ * Linux it is relayed with splice(), which moves the payload from
+ * socket to pipe to socket without copying it to user space.  Anything
+ * else, or if the pipes can't be had, goes through the buffers.
+ *
+ * Returns -1 if there is nothing left to relay but what is already
+ * buffered, as when the whole response body came in with its head.
  */
-static int
-connect_to_upstream (struct conn_s *connptr, struct request_s *request)
+int relay_connection_start (struct conn_s *connptr)
 {
-#ifndef UPSTREAM_SUPPORT
+        size_t len;
+
         /*
-         * This function does nothing if upstream support was not compiled
-         * into tinyproxy.
+         * Whatever a keep-alive client sent past its request belongs to
+         * its next request, and it is not read from while the response
+         * is relayed.  Neither is a client whose server connection is
+         * to be reused.
          */
-        return -1;
-#else
-        char *combined_string;
-        int len;
-
-        struct upstream *cur_upstream = connptr->upstream_proxy;
-
-        if (!cur_upstream) {
-                log_message (LOG_WARNING,
-                             "No upstream proxy defined for %s.",
-                             request->host);
-                indicate_http_error (connptr, 502,
-                                     "Unable to connect to upstream proxy.");
+        if (RELAY_READS_CLIENT (connptr))
+                relay_readahead (&connptr->creadahead, connptr->cbuffer);
+        len = relay_readahead (&connptr->sreadahead, connptr->sbuffer);
+        if (relay_response_read (connptr, len))
                 return -1;
-        }
 
-        connptr->server_fd =
-            opensock (cur_upstream->host, cur_upstream->port,
-                      connptr->server_ip_addr);
+#ifdef HAVE_SPLICE
+        if (!config->splice || !connptr->connect_method
+            || connptr->content_length.server != -1)
+                return 0;
 
-        if (connptr->server_fd < 0) {
-                log_message (LOG_WARNING,
-                             "Could not connect to upstream proxy.");
-                indicate_http_error (connptr, 502,
-                                     "Unable to connect to upstream proxy",
-                                     "detail",
-                                     "A network error occurred while trying to "
-                                     "connect to the upstream web proxy.",
-                                     NULL);
-                return -1;
+        if (pipe (connptr->c2s_pipe) < 0) {
+                connptr->c2s_pipe[0] = connptr->c2s_pipe[1] = -1;
+                return 0;
         }
+        if (pipe (connptr->s2c_pipe) < 0) {
+                connptr->s2c_pipe[0] = connptr->s2c_pipe[1] = -1;
+                conn_close_pipes (connptr);
+        }
+#endif
+        return 0;
+}
 
-	if (cur_upstream->type != PT_HTTP)
-		return connect_to_upstream_proxy(connptr, request);
+/*
+ * The number of bytes relayed but not yet written out, towards the
+ * client and towards the server.
+ */
+void relay_connection_pending (struct conn_s *connptr, size_t *to_client,
+                               size_t *to_server)
+{
+        *to_client = buffer_size (connptr->sbuffer) + connptr->s2c_len;
+        *to_server = buffer_size (connptr->cbuffer) + connptr->c2s_len;
+}
 
-        log_message (LOG_CONN,
-                     "Established connection to upstream proxy \"%s\" "
-                     "using file descriptor %d.",
-                     cur_upstream->host, connptr->server_fd);
+/*
+ * Work out which events the relay wants to see on the client and the
+ * server socket, given how full the two buffers currently are.
+ */
+void relay_connection_events (struct conn_s *connptr, short *cev, short *sev)
+{
+        size_t to_client, to_server;
+
+        *cev = *sev = 0;
+
+        relay_connection_pending (connptr, &to_client, &to_server);
+        if (to_client > 0)
+                *cev |= MYPOLL_WRITE;
+        if (to_server > 0)
+                *sev |= MYPOLL_WRITE;
+
+#ifdef HAVE_SPLICE
+        if (SPLICING (connptr)) {
+                if (connptr->s2c_len < SPLICE_PIPE_SIZE)
+                        *sev |= MYPOLL_READ;
+                if (connptr->c2s_len < SPLICE_PIPE_SIZE)
+                        *cev |= MYPOLL_READ;
+                return;
+        }
+#endif
 
-        /*
-         * We need to re-write the "path" part of the request so that we
-         * can reuse the establish_http_connection() function. It expects a
-         * method and path.
-         */
-        if (connptr->connect_method) {
-                len = strlen (request->host) + 7;
+        if (buffer_wants_data (connptr->sbuffer))
+                *sev |= MYPOLL_READ;
+        if ((request_body_pending (connptr) || RELAY_READS_CLIENT (connptr))
+            && buffer_wants_data (connptr->cbuffer))
+                *cev |= MYPOLL_READ;
+}
 
-                combined_string = (char *) safemalloc (len);
-                if (!combined_string) {
-                        return -1;
-                }
+/*
+ * Send what is pending for one side: first anything left in its
+ * buffer, then what is waiting in its splice pipe.
+ */
+static int relay_write (struct conn_s *connptr, int fd,
+                        struct buffer_s *buffptr, int *pipefd, size_t *len)
+{
+        if (buffer_size (buffptr) > 0)
+                return write_buffer (fd, buffptr) < 0 ? -1 : 0;
 
-                snprintf (combined_string, len, "%s:%d", request->host,
-                          request->port);
-        } else {
-                len = strlen (request->host) + strlen (request->path) + 14;
-                combined_string = (char *) safemalloc (len);
-                if (!combined_string) {
+#ifdef HAVE_SPLICE
+        if (*len > 0) {
+                ssize_t n = splice_bytes (pipefd[0], fd, *len);
+                if (n < 0)
                         return -1;
-                }
-
-                snprintf (combined_string, len, "http://%s:%d%s", request->host,
-                          request->port, request->path);
+                *len -= n;
         }
-
+#endif
+        return 0;
+}
+
+/*
+ * Move whatever the returned events allow between the two sockets.
+ * Returns 0 if the relay should go on, and -1 once either side is done.
+ * The client connection is only kept open if the relay ended because
+ * the response was complete.
+ */
+int relay_connection_io (struct conn_s *connptr, short crev, short srev)
+{
+        ssize_t bytes_received;
+
+#ifdef HAVE_SPLICE
+        if (SPLICING (connptr)) {
+                if ((srev & MYPOLL_READ)
+                    && splice_read (connptr, connptr->server_fd,
+                                    connptr->s2c_pipe, &connptr->s2c_len) < 0)
+                        goto fail;
+        }
+        if (SPLICING (connptr)) {
+                if ((crev & MYPOLL_READ)
+                    && splice_read (connptr, connptr->client_fd,
+                                    connptr->c2s_pipe, &connptr->c2s_len) < 0)
+                        goto fail;
+                crev &= ~MYPOLL_READ;
+                srev &= ~MYPOLL_READ;
+        }
+#endif
+
+        if (srev & MYPOLL_READ) {
+                bytes_received =
+                    read_buffer (connptr->server_fd, connptr->sbuffer);
+                if (bytes_received < 0)
+                        goto fail;
+
+                if (bytes_received > 0
+                    && relay_response_read (connptr, bytes_received))
+                        return -1;
+        }
+        if ((crev & MYPOLL_READ) && relay_request_read (connptr) < 0)
+                goto fail;
+        if ((srev & MYPOLL_WRITE)
+            && relay_write (connptr, connptr->server_fd, connptr->cbuffer,
+                            connptr->c2s_pipe, &connptr->c2s_len) < 0) {
+                goto fail;
+        }
+        if ((crev & MYPOLL_WRITE)
+            && relay_write (connptr, connptr->client_fd, connptr->sbuffer,
+                            connptr->s2c_pipe, &connptr->s2c_len) < 0) {
+                goto fail;
+        }
+
+        return 0;
+
+fail:
+        connptr->keep_alive = connptr->server_keep_alive = FALSE;
+        return -1;
+}
+
+/*
+ * Once the relay is over, push out whatever is still buffered for
+ * either side and half-close the client, unless it is kept open for
+ * another request.
+ */
+void relay_connection_flush (struct conn_s *connptr)
+{
+        size_t to_client, to_server, before;
+
+        for (;;) {
+                relay_connection_pending (connptr, &to_client, &to_server);
+                if (to_client == 0)
+                        break;
+                before = to_client;
+                if (relay_write (connptr, connptr->client_fd,
+                                 connptr->sbuffer, connptr->s2c_pipe,
+                                 &connptr->s2c_len) < 0)
+                        break;
+                relay_connection_pending (connptr, &to_client, &to_server);
+                if (to_client == before)
+                        break;
+        }
+        if (to_client > 0)
+                connptr->keep_alive = FALSE;
+
+        /*
+         * The server may have answered before it had the whole request
+         * body; the rest of it is then left unread.
+         */
+        if (request_body_pending (connptr))
+                connptr->keep_alive = connptr->server_keep_alive = FALSE;
+        if (connptr->keep_alive)
+                return;
+        shutdown (connptr->client_fd, SHUT_WR);
+
+        /*
+         * Try to send any remaining data to the server if we can.
+         */
+        for (;;) {
+                relay_connection_pending (connptr, &to_client, &to_server);
+                if (to_server == 0)
+                        break;
+                before = to_server;
+                if (relay_write (connptr, connptr->server_fd,
+                                 connptr->cbuffer, connptr->c2s_pipe,
+                                 &connptr->c2s_len) < 0)
+                        break;
+                relay_connection_pending (connptr, &to_client, &to_server);
+                if (to_server == before)
+                        break;
+        }
+}
+
+/*
+ * Send the rest of the request body on before the response is read,
+ * as the sockets allow.  This stops early once the server has
+ * something to say, since it may well answer before it has the whole
+ * body; the rest of it is then relayed along with the response.
+ */
+static int relay_request_body (struct conn_s *connptr)
+{
+        int ret;
+
+        while (!relay_request_done (connptr)) {
+                pollfd_struct fds[2] = {0};
+                fds[0].fd = connptr->client_fd;
+                fds[1].fd = connptr->server_fd;
+
+                relay_request_events (connptr, &fds[0].events,
+                                      &fds[1].events);
+
+                ret = mypoll (fds, 2, config->idletimeout);
+                if (ret <= 0) {
+                        log_message (LOG_INFO,
+                                     "relay_request_body: timed out or "
+                                     "failed sending the request body "
+                                     "(client_fd:%d, server_fd:%d)",
+                                     connptr->client_fd, connptr->server_fd);
+                        return -1;
+                }
+
+                if (fds[1].revents & ~MYPOLL_WRITE)
+                        break;
+                if (relay_connection_io (connptr,
+                                         fds[0].revents ? MYPOLL_READ : 0,
+                                         fds[1].revents) < 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Begin relaying the bytes between the two connections.
+ * We continue to use the buffering code
+ * since we want to be able to buffer a certain amount for slower
+ * connections (as this was the reason why I originally modified
+ * tinyproxy oh so long ago...)
+ *	- rjkaes
+ */
+static void relay_connection (struct conn_s *connptr)
+{
+        int ret;
+
+        if (relay_connection_start (connptr) < 0) {
+                relay_connection_flush (connptr);
+                return;
+        }
+
+        for (;;) {
+                pollfd_struct fds[2] = {0};
+                fds[0].fd = connptr->client_fd;
+                fds[1].fd = connptr->server_fd;
+
+                relay_connection_events (connptr, &fds[0].events,
+                                         &fds[1].events);
+
+                ret = mypoll(fds, 2, config->idletimeout);
+
+                if (ret <= 0)
+                        connptr->keep_alive = FALSE;
+                if (ret == 0) {
+                        log_message (LOG_INFO,
+                                     "Idle Timeout (after " SELECT_OR_POLL ")");
+                        update_stats (STAT_TIMEOUT_IDLE);
+                                return;
+                } else if (ret < 0) {
+                        log_message (LOG_ERR,
+                                     "relay_connection: " SELECT_OR_POLL "() error \"%s\". "
+                                     "Closing connection (client_fd:%d, server_fd:%d)",
+                                     strerror (errno), connptr->client_fd,
+                                     connptr->server_fd);
+                        return;
+                }
+
+                if (relay_connection_io (connptr, fds[0].revents,
+                                         fds[1].revents) < 0)
+                        break;
+        }
+
+        relay_connection_flush (connptr);
+}
+
+#ifdef UPSTREAM_SUPPORT
+/*
+ * The handshake with a SOCKS upstream proxy goes one reply of the
+ * proxy at a time, each read without waiting for it: the event engine
+ * goes on with other connections until the proxy's next reply is there,
+ * while the "threads" model waits for it in upstream_handshake().
+ */
+enum socks_state {
+        SOCKS4_REPLY,           /* to the connect request */
+        SOCKS5_METHOD,          /* the authentication method chosen */
+        SOCKS5_AUTH,            /* to the username and password */
+        SOCKS5_REPLY,           /* to the connect request, up to the
+                                   address type */
+        SOCKS5_NAMELEN,         /* ... and the length of a bound name */
+        SOCKS5_ADDRESS,         /* ... and the bound address and port */
+        SOCKS_DONE
+};
+
+struct upstream_socks {
+        enum socks_state state;
+        size_t want, got;               /* of the reply being read */
+        unsigned char buff[262];        /* the longest: 4 + 1 + 255 + 2 */
+};
+
+static void socks_expect (struct upstream_socks *s, enum socks_state state,
+                          size_t want)
+{
+        s->state = state;
+        s->want = want;
+        s->got = 0;
+}
+
+static int socks_send (struct conn_s *connptr, const void *buff, size_t len)
+{
+        return safe_write (connptr->server_fd, buff, len) == (ssize_t) len
+                ? 0 : -1;
+}
+
+static int socks5_connect (struct conn_s *connptr)
+{
+        struct request_s *request = connptr->request;
+        unsigned char buff[262];
+        unsigned short port;
+        size_t len = strlen (request->host);
+
+        if (len > 255)
+                return -1;
+        buff[0] = 5;            /* socks version */
+        buff[1] = 1;            /* connect */
+        buff[2] = 0;            /* reserved */
+        buff[3] = 3;            /* domainname */
+        buff[4] = len;          /* length of domainname */
+        memcpy (&buff[5], request->host, len);
+        port = htons (request->port);
+        memcpy (&buff[5 + len], &port, 2);
+
+        socks_expect (connptr->socks, SOCKS5_REPLY, 4);
+        return socks_send (connptr, buff, 7 + len);
+}
+
+static int socks5_auth (struct conn_s *connptr)
+{
+        struct upstream *up = connptr->upstream_proxy;
+        unsigned char out[515];
+        size_t ulen, passlen, len = 0;
+
+        ulen = up->ua.user ? strlen (up->ua.user) & 0xff : 0;
+        passlen = up->pass ? strlen (up->pass) & 0xff : 0;
+
+        out[len++] = 1;         /* version */
+        out[len++] = ulen;
+        memcpy (out + len, up->ua.user, ulen);
+        len += ulen;
+        out[len++] = passlen;
+        memcpy (out + len, up->pass, passlen);
+        len += passlen;
+
+        socks_expect (connptr->socks, SOCKS5_AUTH, 2);
+        return socks_send (connptr, out, len);
+}
+
+/*
+ * Open the handshake with the proxy.
+ */
+static int socks_begin (struct conn_s *connptr)
+{
+        struct upstream *up = connptr->upstream_proxy;
+        struct request_s *request = connptr->request;
+        unsigned char buff[512];        /* won't use more than 9 + 255 + 1 */
+        unsigned short port;
+        size_t len;
+
+        connptr->socks = (struct upstream_socks *)
+                safecalloc (1, sizeof (struct upstream_socks));
+        if (!connptr->socks)
+                return -1;
+
+        log_message (LOG_CONN,
+                     "Established connection to %s proxy \"%s\" using "
+                     "file descriptor %d.", proxy_type_name (up->type),
+                     up->host, connptr->server_fd);
+
+        if (up->type == PT_SOCKS4) {
+                buff[0] = 4;    /* socks version */
+                buff[1] = 1;    /* connect command */
+                port = htons (request->port);
+                memcpy (&buff[2], &port, 2);    /* dest port */
+                memcpy (&buff[4], "\0\0\0\1"    /* socks4a fake ip */
+                        "\0", 5);               /* user */
+                len = strlen (request->host);
+                if (len > 255)
+                        return -1;
+                memcpy (&buff[9], request->host, len + 1);
+
+                socks_expect (connptr->socks, SOCKS4_REPLY, 8);
+                return socks_send (connptr, buff, 9 + len + 1);
+        }
+
+        if (up->type == PT_SOCKS5) {
+                len = 0;
+                buff[len++] = 5;        /* socks version */
+                buff[len++] = up->ua.user ? 2 : 1;      /* methods */
+                buff[len++] = 0;        /* no auth method */
+                if (up->ua.user)
+                        buff[len++] = 2;        /* username / password */
+
+                socks_expect (connptr->socks, SOCKS5_METHOD, 2);
+                return socks_send (connptr, buff, len);
+        }
+
+        return -1;
+}
+
+/*
+ * Go on with the handshake as far as the proxy's replies allow.
+ * Returns 1 once it is through, 0 if the next reply has to be waited
+ * for, and -1 if the proxy turned the request down or went away.
+ */
+static int upstream_socks (struct conn_s *connptr)
+{
+        struct upstream_socks *s;
+        ssize_t n;
+
+        if (!connptr->socks && socks_begin (connptr) < 0)
+                return -1;
+        s = connptr->socks;
+
+        while (s->state != SOCKS_DONE) {
+                if (s->got < s->want) {
+                        do {
+                                n = recv (connptr->server_fd, s->buff + s->got,
+                                          s->want - s->got, MSG_DONTWAIT);
+                        } while (n < 0 && errno == EINTR);
+                        if (n < 0 && errno == EAGAIN)
+                                return 0;
+                        if (n <= 0)
+                                return -1;
+                        s->got += n;
+                        continue;
+                }
+
+                switch (s->state) {
+                case SOCKS4_REPLY:
+                        if (s->buff[0] != 0 || s->buff[1] != 90)
+                                return -1;
+                        s->state = SOCKS_DONE;
+                        break;
+                case SOCKS5_METHOD:
+                        if (s->buff[0] != 5
+                            || (s->buff[1] != 0 && s->buff[1] != 2))
+                                return -1;
+                        if ((s->buff[1] == 2 ? socks5_auth (connptr)
+                             : socks5_connect (connptr)) < 0)
+                                return -1;
+                        break;
+                case SOCKS5_AUTH:
+                        if (s->buff[1] != 0
+                            || !(s->buff[0] == 5 || s->buff[0] == 1))
+                                return -1;
+                        if (socks5_connect (connptr) < 0)
+                                return -1;
+                        break;
+                case SOCKS5_REPLY:
+                        if (s->buff[0] != 5 || s->buff[1] != 0)
+                                return -1;
+                        s->state = SOCKS5_ADDRESS;
+                        switch (s->buff[3]) {
+                        case 1:         /* ip v4 */
+                                s->want += 4 + 2;
+                                break;
+                        case 4:         /* ip v6 */
+                                s->want += 16 + 2;
+                                break;
+                        case 3:         /* domainname */
+                                s->want += 1;
+                                s->state = SOCKS5_NAMELEN;
+                                break;
+                        default:
+                                return -1;
+                        }
+                        break;
+                case SOCKS5_NAMELEN:
+                        s->want += s->buff[4] + 2;
+                        s->state = SOCKS5_ADDRESS;
+                        break;
+                case SOCKS5_ADDRESS:
+                        s->state = SOCKS_DONE;
+                        break;
+                default:
+                        return -1;
+                }
+        }
+
+        return 1;
+}
+#endif
+
+/*
+ * Talk to the upstream proxy once the connection to it is up.
+ */
+static int
+upstream_handshake (struct conn_s *connptr, struct request_s *request)
+{
+#ifndef UPSTREAM_SUPPORT
+        return -1;
+#else
+        char *combined_string;
+        int len;
+
+        struct upstream *cur_upstream = connptr->upstream_proxy;
+
+	if (cur_upstream->type != PT_HTTP) {
+                pollfd_struct fds[1];
+                int ret;
+
+                /* The event engine has been through it already. */
+                while ((ret = upstream_socks (connptr)) == 0) {
+                        fds[0].fd = connptr->server_fd;
+                        fds[0].events = MYPOLL_READ;
+                        if (mypoll (fds, 1, -1) < 0 && errno != EINTR)
+                                break;
+                }
+                if (connptr->socks)
+                        safefree (connptr->socks);
+                if (ret <= 0)
+                        return -1;
+                if (connptr->connect_method)
+                        return 0;
+                return establish_http_connection (connptr, request);
+        }
+
+        log_message (LOG_CONN,
+                     "Established connection to upstream proxy \"%s\" "
+                     "using file descriptor %d.",
+                     cur_upstream->host, connptr->server_fd);
+
+        /*
+         * We need to re-write the "path" part of the request so that we
+         * can reuse the establish_http_connection() function. It expects a
+         * method and path.
+         */
+        if (connptr->connect_method) {
+                len = strlen (request->host) + 7;
+
+                combined_string = (char *) safemalloc (len);
+                if (!combined_string) {
+                        return -1;
+                }
+
+                snprintf (combined_string, len, "%s:%d", request->host,
+                          request->port);
+        } else {
+                len = strlen (request->host) + strlen (request->path) + 14;
+                combined_string = (char *) safemalloc (len);
+                if (!combined_string) {
+                        return -1;
+                }
+
+                snprintf (combined_string, len, "http://%s:%d%s", request->host,
+                          request->port, request->path);
+        }
+
         if (request->path)
                 safefree (request->path);
         request->path = combined_string;
@@ -1511,8 +2337,114 @@ get_request_entity(struct conn_s *connptr)
         return ret;
 }
 
-static void handle_connection_failure(struct conn_s *connptr, int got_headers)
+/*
+ * Turn a request away for who sent it or for how it looks with a short
+ * fixed response, sent in one write, rather than with the error page
+ * that has to be filled in from its template.  Nothing the client may
+ * still send is waited for first.  Returns 0 if it was turned away so,
+ * and -1 if the full error page is to be sent.
+ */
+static int reject_fast (struct conn_s *connptr)
+{
+        char auth[256], buf[768];
+        const char *auth_type;
+        int len;
+
+        if (!config->fast_reject || connptr->show_stats)
+                return -1;
+
+        switch (connptr->error_number) {
+        case 400:
+        case 403:
+                auth_type = NULL;
+                break;
+        case 401:
+                auth_type = "WWW-Authenticate";
+                break;
+        case 407:
+                auth_type = "Proxy-Authenticate";
+                break;
+        default:
+                return -1;
+        }
+
+        auth[0] = '\0';
+        if (auth_type) {
+                len = snprintf (auth, sizeof (auth),
+                                "%s: Basic realm=\"%s\"\r\n",
+                                auth_type, config->basicauth_realm);
+                if (len < 0 || (size_t) len >= sizeof (auth))
+                        return -1;
+        }
+
+        len = snprintf (buf, sizeof (buf),
+                        "HTTP/1.%u %d %s\r\n"
+                        "Server: %s\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %lu\r\n"
+                        "%s"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "%s\n",
+                        connptr->protocol.major != 1 ? 0
+                                : connptr->protocol.minor,
+                        connptr->error_number, connptr->error_string,
+                        PACKAGE,
+                        (unsigned long) strlen (connptr->error_string) + 1,
+                        auth, connptr->error_string);
+        if (len < 0 || (size_t) len >= sizeof (buf))
+                return -1;
+
+        update_stats (STAT_FAST_REJECT);
+        safe_write (connptr->client_fd, buf, len);
+        shutdown (connptr->client_fd, SHUT_WR);
+        return 0;
+}
+
+/*
+ * Read and drop what a client turned away still sends, so that closing
+ * on unread data does not reset the connection before the response is
+ * through.  Returns -1 once the client is done sending, 0 otherwise.
+ */
+int handle_connection_drain (struct conn_s *connptr)
 {
+        char buf[4096];
+        ssize_t len;
+
+        len = read (connptr->client_fd, buf, sizeof (buf));
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+                return 0;
+        return len > 0 ? 0 : -1;
+}
+
+/*
+ * Wait a little for a client turned away to stop sending, no longer
+ * than RejectLinger seconds.
+ */
+static void reject_linger (struct conn_s *connptr)
+{
+        pollfd_struct fds[1] = {0};
+        time_t deadline = time (NULL) + config->reject_linger;
+        time_t now;
+
+        fds[0].fd = connptr->client_fd;
+        fds[0].events = MYPOLL_READ;
+        while ((now = time (NULL)) < deadline
+               && mypoll (fds, 1, deadline - now) > 0
+               && handle_connection_drain (connptr) == 0)
+                ;
+}
+
+/*
+ * Report the failure to the client.  Returns 1 if the short response
+ * was sent instead of the error page: the client connection then
+ * lingers for a moment before it is closed.
+ */
+int handle_connection_failure(struct conn_s *connptr, int got_headers)
+{
+        if (reject_fast (connptr) == 0)
+                return 1;
+
         /*
          * First, get the body if there is one.
          * If we don't read all there is from the socket first,
@@ -1531,9 +2463,11 @@ static void handle_connection_failure(struct conn_s *connptr, int got_headers)
 
         if (connptr->error_variables) {
                 send_http_error_message (connptr);
+                update_stats (STAT_ERROR_PAGE);
         } else if (connptr->show_stats) {
                 showstats (connptr);
         }
+        return 0;
 }
 
 static void auth_error(struct conn_s *connptr, int code) {
@@ -1551,22 +2485,86 @@ static void auth_error(struct conn_s *connptr, int code) {
 }
 
 /*
- * This is the main drive for each connection.
- * this function is called directly from child_thread() with the newly
- * received fd from accept().
+ * Set up the error page for a failed connection to the remote server
+ * (or to the upstream proxy in front of it.)
  */
-void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
+void handle_connection_connect_error (struct conn_s *connptr)
+{
+        if (connptr->upstream_proxy) {
+                upstream_result (connptr, FALSE);
+                log_message (LOG_WARNING,
+                             "Could not connect to upstream proxy.");
+                indicate_http_error (connptr, 502,
+                                     "Unable to connect to upstream proxy",
+                                     "detail",
+                                     "A network error occurred while trying to "
+                                     "connect to the upstream web proxy.",
+                                     NULL);
+        } else {
+                indicate_http_error (connptr, 500, "Unable to connect",
+                                     "detail",
+                                     PACKAGE_NAME " "
+                                     "was unable to connect to the remote web server.",
+                                     "error", strerror (errno), NULL);
+        }
+}
+
+/*
+ * A phase of the connection took longer than its timeout allows: log
+ * and count it, and set up the error page if the phase has one.
+ */
+void handle_connection_timeout (struct conn_s *connptr, unsigned int phase)
 {
+        log_message (LOG_INFO, "%s Timeout (client_fd:%d, server_fd:%d)",
+                     timeout_name (phase), connptr->client_fd,
+                     connptr->server_fd);
+        update_stats ((status_t) (STAT_TIMEOUT_HEAD + phase));
+        if (phase == TIMEOUT_HANDSHAKE)
+                upstream_result (connptr, FALSE);
+
+        if (connptr->error_variables)
+                return;
 
-#define HC_FAIL() \
-        do {handle_connection_failure(connptr, got_headers); goto done;} \
-        while(0)
+        switch (phase) {
+        case TIMEOUT_DNS:
+        case TIMEOUT_CONNECT:
+                errno = ETIMEDOUT;
+                handle_connection_connect_error (connptr);
+                break;
+        case TIMEOUT_HANDSHAKE:
+        case TIMEOUT_RESPONSE:
+                indicate_http_error (connptr, 504, "Gateway Timeout",
+                                     "detail",
+                                     phase == TIMEOUT_HANDSHAKE ?
+                                     "The upstream proxy did not answer "
+                                     "in time." :
+                                     "The remote web server did not "
+                                     "answer in time.", NULL);
+                break;
+        }
+}
 
-        int got_headers = 0, fd = connptr->client_fd;
-        size_t i;
-        struct request_s *request = NULL;
-        pseudomap *hashofheaders = NULL;
+/*
+ * The steps below are the stages every connection goes through.  The
+ * threaded model runs them back to back in handle_connection(), while the
+ * event engine runs each one once the socket it waits on is ready.  Each
+ * stage returns 0 on success, -1 if the connection failed and
+ * handle_connection_failure() should report it, and -2 if the
+ * connection should just be closed.  A -2 from handle_connection_setup()
+ * means the client socket is already gone and there is nothing left
+ * for handle_connection_done() to release.  A -3 from the stages which
+ * talk to the server means a connection out of the origin pool turned
+ * out to be closed: handle_connection_retry() drops it, and the request
+ * is sent again once a new connection is up.
+ */
 
+/*
+ * First stage: log the new client and check whether it may use us at all.
+ */
+int handle_connection_setup (struct conn_s *connptr,
+                             union sockaddr_union *addr)
+{
+        int fd = connptr->client_fd;
         char sock_ipaddr[IP_LENGTH];
         char peer_ipaddr[IP_LENGTH];
 
@@ -1583,11 +2581,15 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
         if(!conn_init_contents (connptr, peer_ipaddr,
                                    config->bindsame ? sock_ipaddr : NULL)) {
                 close (fd);
-                return;
+                connptr->client_fd = -1;
+                return -2;
         }
 
         set_socket_timeout(fd);
 
+        if (config->fastopen_listen > 0 && socket_fastopened (fd))
+                update_stats (STAT_FASTOPEN_CLIENT);
+
         if (connection_loops (addr))  {
                 log_message (LOG_CONN,
                              "Prevented endless loop (file descriptor %d): %s",
@@ -1598,7 +2600,7 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
                                     "You tried to connect to the "
                                     "machine the proxy is running on",
                                     NULL);
-                HC_FAIL();
+                return -1;
         }
 
 
@@ -1609,32 +2611,46 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
                                      "The administrator of this proxy has not configured "
                                      "it to service requests from your host.",
                                      NULL);
-                HC_FAIL();
+                return -1;
         }
 
-        if (read_request_line (connptr) < 0) {
-                update_stats (STAT_BADCONN);
-                goto done;
-        }
+        return 0;
+}
+
+/*
+ * Second stage: read the request line and the headers from the client,
+ * check the credentials and work out where the request has to go.
+ */
+int handle_connection_request (struct conn_s *connptr)
+{
+        size_t i;
+        int ret;
 
         /*
          * The "hashofheaders" store the client's headers.
          */
-        hashofheaders = pseudomap_create ();
-        if (hashofheaders == NULL) {
+        connptr->headers = pseudomap_create ();
+        if (connptr->headers == NULL) {
                 update_stats (STAT_BADCONN);
                 indicate_http_error (connptr, 503, "Internal error",
                                      "detail",
                                      "An internal server error occurred while processing "
                                      "your request. Please contact the administrator.",
                                      NULL);
-                HC_FAIL();
+                return -1;
         }
 
         /*
-         * Get all the headers from the client in a big hash.
+         * Get the request line and all the headers from the client in a
+         * big hash.
          */
-        if (get_all_headers (connptr->client_fd, hashofheaders) < 0) {
+        ret = read_request_head (connptr);
+        if (ret == -2) {
+                if (!connptr->requests)
+                        update_stats (STAT_BADCONN);
+                return -2;
+        }
+        if (ret < 0) {
                 log_message (LOG_WARNING,
                              "Could not retrieve all the headers from the client");
                 indicate_http_error (connptr, 400, "Bad Request",
@@ -1642,26 +2658,39 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
                                      "Could not retrieve all the headers from "
                                      "the client.", NULL);
                 update_stats (STAT_BADCONN);
-                HC_FAIL();
+                return -1;
+        }
+        connptr->got_headers = 1;
+
+        if (!request_framing_valid (connptr->headers)) {
+                log_message (LOG_WARNING,
+                             "Refusing a request whose body length is "
+                             "ambiguous (file descriptor %d)",
+                             connptr->client_fd);
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "The length of the request body could "
+                                     "not be worked out for sure.", NULL);
+                update_stats (STAT_BADCONN);
+                return -1;
         }
-        got_headers = 1;
 
         if (config->basicauth_list != NULL) {
                 char *authstring;
                 int failure = 1, stathost_connect = 0;
-                authstring = pseudomap_find (hashofheaders, "proxy-authorization");
+                authstring = pseudomap_find_id (connptr->headers, HDR_proxy_authorization);
 
                 if (!authstring && config->stathost) {
-                        authstring = pseudomap_find (hashofheaders, "host");
+                        authstring = pseudomap_find_id (connptr->headers, HDR_host);
                         if (authstring && is_stathost(authstring)) {
-                                authstring = pseudomap_find (hashofheaders, "authorization");
+                                authstring = pseudomap_find_id (connptr->headers, HDR_authorization);
                                 stathost_connect = 1;
                         } else authstring = 0;
                 }
 
                 if (!authstring) {
                         auth_error(connptr, stathost_connect ? 401 : 407);
-                        HC_FAIL();
+                        return -1;
                 }
                 if ( /* currently only "basic" auth supported */
                         (strncmp(authstring, "Basic ", 6) == 0 ||
@@ -1670,9 +2699,9 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
                                 failure = 0;
                 if(failure) {
                         auth_error(connptr, stathost_connect ? 401 : 407);
-                        HC_FAIL();
+                        return -1;
                 }
-                pseudomap_remove (hashofheaders, "proxy-authorization");
+                pseudomap_remove_id (connptr->headers, HDR_proxy_authorization);
         }
 
         /*
@@ -1683,34 +2712,184 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
         for (i = 0; i < sblist_getsize (config->add_headers); i++) {
                 http_header_t *header = sblist_get (config->add_headers, i);
 
-                pseudomap_append (hashofheaders, header->name, header->value);
+                pseudomap_append (connptr->headers, header->name, header->value);
         }
 
-        request = process_request (connptr, hashofheaders);
-        if (!request) {
+        connptr->request = process_request (connptr, connptr->headers);
+        if (!connptr->request) {
                 if (!connptr->show_stats) {
                         update_stats (STAT_BADCONN);
                 }
-                HC_FAIL();
+                return -1;
         }
 
-        connptr->upstream_proxy = UPSTREAM_HOST (request->host);
-        if (connptr->upstream_proxy != NULL) {
-                if (connect_to_upstream (connptr, request) < 0) {
-                        HC_FAIL();
-                }
-        } else {
-                connptr->server_fd = opensock (request->host, request->port,
-                                               connptr->server_ip_addr);
-                if (connptr->server_fd < 0) {
-                        indicate_http_error (connptr, 500, "Unable to connect",
+        connptr->upstream_proxy = UPSTREAM_HOST (connptr->request->host);
+
+        return 0;
+}
+
+/*
+ * Return the host and port the server socket has to be connected to:
+ * the upstream proxy if one is in use, the requested host otherwise.
+ */
+const char *handle_connection_target (struct conn_s *connptr, int *port)
+{
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy) {
+                *port = connptr->upstream_proxy->port;
+                return connptr->upstream_proxy->host;
+        }
+#endif
+        *port = connptr->request->port;
+        return connptr->request->host;
+}
+
+/*
+ * Take an idle connection to the server out of the origin pool, if the
+ * request may use one and there is one.  Returns 1 if connptr->server_fd
+ * is set up with it, and 0 if a new connection has to be opened.
+ */
+int handle_connection_pooled (struct conn_s *connptr)
+{
+        const char *host;
+        int port, fd;
+
+        if (!server_may_persist (connptr))
+                return 0;
+
+        host = handle_connection_target (connptr, &port);
+        fd = origin_pool_get (host, port, connptr->server_ip_addr,
+                              connptr->upstream_proxy != NULL);
+        if (fd < 0)
+                return 0;
+
+        log_message (LOG_INFO,
+                     "Reusing connection to %s:%d (fd:%d)", host, port, fd);
+        connptr->server_fd = fd;
+        connptr->server_reused = TRUE;
+        return 1;
+}
+
+/*
+ * The connection out of the origin pool was closed by the server: drop
+ * it, so that a new one gets opened.
+ */
+void handle_connection_retry (struct conn_s *connptr)
+{
+        log_message (LOG_INFO,
+                     "Connection to \"%s\" (fd:%d) was closed by the "
+                     "server, sending the request on a new one",
+                     connptr->request->host, connptr->server_fd);
+
+        close (connptr->server_fd);
+        connptr->server_fd = -1;
+        connptr->server_reused = FALSE;
+        readahead_release (&connptr->sreadahead);
+}
+
+/*
+ * Done with the server connection: put it back into the origin pool if
+ * the response ended where it said it would and the server keeps the
+ * connection open.  Otherwise it is closed along with the rest.
+ */
+static void release_server (struct conn_s *connptr)
+{
+        size_t to_client, to_server;
+        const char *host;
+        int port;
+
+        if (connptr->server_fastopen && connptr->server_fd != -1) {
+                connptr->server_fastopen = FALSE;
+                if (socket_fastopened (connptr->server_fd))
+                        update_stats (STAT_FASTOPEN);
+        }
+
+        if (connptr->server_fd == -1 || !connptr->server_keep_alive
+            || connptr->content_length.server != 0 || !connptr->request
+            || request_body_pending (connptr))
+                return;
+
+        relay_connection_pending (connptr, &to_client, &to_server);
+        if (to_server > 0 || readahead_pending (&connptr->sreadahead) > 0)
+                return;
+
+        host = handle_connection_target (connptr, &port);
+        origin_pool_put (connptr->server_fd, host, port,
+                         connptr->server_ip_addr,
+                         connptr->upstream_proxy != NULL);
+        connptr->server_fd = -1;
+}
+
+/*
+ * Before the third stage, the event engine runs the handshake with a
+ * SOCKS upstream proxy here, as far as the proxy's replies allow.
+ * Returns 1 once it is through (or there is none), 0 while the next
+ * reply is awaited, and -1 if it failed.
+ */
+int handle_connection_handshake (struct conn_s *connptr)
+{
+#ifdef UPSTREAM_SUPPORT
+        int ret;
+
+        if (!connptr->upstream_proxy || connptr->retry_head
+            || connptr->upstream_proxy->type == PT_HTTP)
+                return 1;
+
+        ret = upstream_socks (connptr);
+        if (ret < 0)
+                upstream_result (connptr, FALSE);
+        return ret;
+#else
+        (void) connptr;
+        return 1;
+#endif
+}
+
+/*
+ * Third stage, run once connptr->server_fd is connected: finish any
+ * upstream handshake and send the request head (and body) on.  Returns
+ * 1 if a response head has to be read from the server next, and 0 if
+ * the connection goes straight to relaying.
+ */
+int handle_connection_server (struct conn_s *connptr)
+{
+        struct request_s *request = connptr->request;
+        int ret;
+
+        connptr->server_fastopen = config->fastopen_connect
+                && !connptr->server_reused;
+
+        if (connptr->retry_head) {
+                ret = safe_write (connptr->server_fd, connptr->retry_head,
+                                  connptr->retry_len);
+                safefree (connptr->retry_head);
+                if (ret < 0) {
+                        indicate_http_error (connptr, 503,
+                                             "Could not send data to remote server",
                                              "detail",
-                                             PACKAGE_NAME " "
-                                             "was unable to connect to the remote web server.",
-                                             "error", strerror (errno), NULL);
-                        HC_FAIL();
+                                             "A network error occurred while "
+                                             "trying to write data to the "
+                                             "remote web server.",
+                                             NULL);
+                        return -1;
                 }
+                return 1;
+        }
 
+        connptr->server_keep_alive = server_may_persist (connptr);
+        if (connptr->upstream_proxy != NULL) {
+                deadline_set (connptr, TIMEOUT_HANDSHAKE);
+                ret = upstream_handshake (connptr, request);
+                if (deadline_clear (connptr)) {
+                        handle_connection_timeout (connptr,
+                                                   TIMEOUT_HANDSHAKE);
+                        return -1;
+                }
+                if (ret < 0) {
+                        upstream_result (connptr, FALSE);
+                        return -1;
+                }
+        } else {
                 log_message (LOG_CONN,
                              "Established connection to host \"%s\" using "
                              "file descriptor %d.", request->host,
@@ -1720,7 +2899,10 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
                         establish_http_connection (connptr, request);
         }
 
-        if (process_client_headers (connptr, hashofheaders) < 0) {
+        ret = process_client_headers (connptr, connptr->headers);
+        if (ret == -3)
+                return -3;
+        if (ret < 0) {
                 update_stats (STAT_BADCONN);
                 log_message (LOG_INFO,
                              "process_client_headers failed: %s. host \"%s\" using "
@@ -1728,41 +2910,192 @@ void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
                              request->host,
                              connptr->server_fd);
 
-                HC_FAIL();
+                return -1;
         }
 
-        if (!connptr->connect_method || UPSTREAM_IS_HTTP(connptr)) {
-                if (process_server_headers (connptr) < 0) {
-                        update_stats (STAT_BADCONN);
-                        log_message (LOG_INFO,
-                             "process_server_headers failed: %s. host \"%s\" using "
-                             "file descriptor %d.", strerror(errno),
-                             request->host,
-                             connptr->server_fd);
+        if (!connptr->connect_method || UPSTREAM_IS_HTTP(connptr))
+                return 1;
+        upstream_result (connptr, TRUE);
 
-                        HC_FAIL();
-                }
-        } else {
-                if (send_connect_method_response (connptr) < 0) {
-                        log_message (LOG_ERR,
-                                     "handle_connection: Could not send CONNECT"
-                                     " method greeting to client.");
-                        update_stats (STAT_BADCONN);
-                        HC_FAIL();
-                }
+        if (send_connect_method_response (connptr) < 0) {
+                log_message (LOG_ERR,
+                             "handle_connection: Could not send CONNECT"
+                             " method greeting to client.");
+                update_stats (STAT_BADCONN);
+                return -1;
+        }
+
+        return 0;
+}
+
+/*
+ * Fourth stage: read the response head from the server and pass it on
+ * to the client.  Returns 1 if that was an interim response: the rest
+ * of the request body is then relayed while the final one is awaited.
+ */
+int handle_connection_response (struct conn_s *connptr)
+{
+        int ret;
+
+        ret = process_server_headers (connptr);
+        if (ret == -3)
+                return -3;
+        if (ret < 0) {
+                update_stats (STAT_BADCONN);
+                log_message (LOG_INFO,
+                     "process_server_headers failed: %s. host \"%s\" using "
+                     "file descriptor %d.", strerror(errno),
+                     connptr->request->host,
+                     connptr->server_fd);
+
+                return -1;
+        }
+
+        return ret;
+}
+
+/*
+ * After the relay: if the client keeps its connection open, drop what
+ * belonged to the request just served and get ready for the next one.
+ * Returns 0 if the next request is to be read, and -1 if the
+ * connection is done with.
+ */
+int handle_connection_next (struct conn_s *connptr)
+{
+        release_server (connptr);
+        if (!connptr->keep_alive)
+                return -1;
+
+        log_message (LOG_INFO,
+                     "Done with remote client, keeping local client "
+                     "(fd:%d) for its next request", connptr->client_fd);
+
+        free_request_struct (connptr->request);
+        connptr->request = NULL;
+        pseudomap_destroy (connptr->headers);
+        connptr->headers = NULL;
+        conn_reset_request (connptr);
+
+        return 0;
+}
+
+/*
+ * Wait for a keep-alive client to start its next request.  Returns 0
+ * once there is something to read, and -1 if the client stays quiet for
+ * longer than KeepAliveTimeout.
+ */
+static int wait_next_request (struct conn_s *connptr)
+{
+        pollfd_struct fds[1] = {0};
+
+        if (readahead_pending (&connptr->creadahead) > 0)
+                return 0;
+
+        fds[0].fd = connptr->client_fd;
+        fds[0].events = MYPOLL_READ;
+        if (mypoll (fds, 1, config->keepalive_timeout) <= 0) {
+                log_message (LOG_INFO,
+                             "Keep-alive timeout (client_fd:%d)",
+                             connptr->client_fd);
+                update_stats (STAT_TIMEOUT_IDLE);
+                return -1;
         }
 
-        relay_connection (connptr);
+        return 0;
+}
+
+/*
+ * Last stage: release everything the connection still holds.
+ */
+void handle_connection_done (struct conn_s *connptr)
+{
+        release_server (connptr);
+        free_request_struct (connptr->request);
+        connptr->request = NULL;
+        pseudomap_destroy (connptr->headers);
+        connptr->headers = NULL;
+        conn_destroy_contents (connptr);
+}
+
+/*
+ * This is the main drive for each connection.
+ * this function is called directly from child_thread() with the newly
+ * received fd from accept().
+ */
+void handle_connection (struct conn_s *connptr, union sockaddr_union* addr)
+{
+        int ret, port;
+        const char *host;
+
+        ret = handle_connection_setup (connptr, addr);
+        if (ret == -2)
+                return;
+
+        for (;;) {
+                if (ret == 0) {
+                        deadline_set (connptr, TIMEOUT_HEAD);
+                        ret = handle_connection_request (connptr);
+                        if (deadline_clear (connptr)) {
+                                handle_connection_timeout (connptr,
+                                                           TIMEOUT_HEAD);
+                                ret = -2;
+                        }
+                }
+                if (ret < 0)
+                        goto fail;
+
+                host = handle_connection_target (connptr, &port);
+                handle_connection_pooled (connptr);
+                do {
+                        if (connptr->server_fd < 0)
+                                connptr->server_fd =
+                                        opensock (host, port,
+                                                  connptr->server_ip_addr);
+                        if (connptr->server_fd < 0) {
+                                handle_connection_connect_error (connptr);
+                                ret = -1;
+                                goto fail;
+                        }
+
+                        ret = handle_connection_server (connptr);
+                        while (ret > 0) {
+                                if (relay_request_body (connptr) < 0) {
+                                        ret = -1;
+                                        break;
+                                }
+                                deadline_set (connptr, TIMEOUT_RESPONSE);
+                                ret = handle_connection_response (connptr);
+                                if (deadline_clear (connptr)) {
+                                        handle_connection_timeout
+                                                (connptr, TIMEOUT_RESPONSE);
+                                        ret = -1;
+                                }
+                        }
+                        if (ret == -3)
+                                handle_connection_retry (connptr);
+                } while (ret == -3);
+                if (ret < 0)
+                        goto fail;
+
+                relay_connection (connptr);
+
+                if (handle_connection_next (connptr) < 0
+                    || wait_next_request (connptr) < 0)
+                        break;
+                ret = 0;
+        }
 
         log_message (LOG_INFO,
                      "Closed connection between local client (fd:%d) "
                      "and remote client (fd:%d)",
                      connptr->client_fd, connptr->server_fd);
 
-done:
-        free_request_struct (request);
-        pseudomap_destroy (hashofheaders);
-        conn_destroy_contents (connptr);
+        handle_connection_done (connptr);
         return;
-#undef HC_FAIL
+
+fail:
+        if (ret == -1
+            && handle_connection_failure (connptr, connptr->got_headers) > 0)
+                reject_linger (connptr);
+        handle_connection_done (connptr);
 }
@@ -47,4 +47,33 @@ struct request_s {
 
 extern void handle_connection (struct conn_s *, union sockaddr_union* addr);
 
+/*
+ * The single stages of handle_connection(), for the event engine.
+ */
+extern int handle_connection_setup (struct conn_s *,
+                                    union sockaddr_union *addr);
+extern int handle_connection_request (struct conn_s *);
+extern const char *handle_connection_target (struct conn_s *, int *port);
+extern void handle_connection_connect_error (struct conn_s *);
+extern void handle_connection_timeout (struct conn_s *, unsigned int phase);
+extern int handle_connection_pooled (struct conn_s *);
+extern void handle_connection_retry (struct conn_s *);
+extern int handle_connection_handshake (struct conn_s *);
+extern int handle_connection_server (struct conn_s *);
+extern int handle_connection_response (struct conn_s *);
+extern int handle_connection_next (struct conn_s *);
+extern int handle_connection_failure (struct conn_s *, int got_headers);
+extern int handle_connection_drain (struct conn_s *);
+extern void handle_connection_done (struct conn_s *);
+
+extern void relay_request_events (struct conn_s *, short *cev, short *sev);
+extern int relay_request_done (struct conn_s *);
+extern int relay_connection_start (struct conn_s *);
+extern void relay_connection_pending (struct conn_s *, size_t *to_client,
+                                      size_t *to_server);
+extern void relay_connection_events (struct conn_s *, short *cev,
+                                     short *sev);
+extern int relay_connection_io (struct conn_s *, short crev, short srev);
+extern void relay_connection_flush (struct conn_s *);
+
 #endif
@@ -153,8 +153,8 @@ char *reverse_rewrite_url (struct conn_s *connptr, pseudomap *hashofheaders,
                                 sprintf (rewrite_url, "%s%s", reverse->url, url + lrp);
                         }
                 } else if (config->reversemagic
-                           && (cookie = pseudomap_find (hashofheaders,
-                                                    "cookie"))) {
+                           && (cookie = pseudomap_find_id (hashofheaders,
+                                                       HDR_cookie))) {
 
                         /* No match - try the magical tracking cookie next */
                         if ((cookieval = strstr (cookie, REVERSE_COOKIE "="))
@@ -27,6 +27,7 @@
 
 #include "main.h"
 
+#include "dns.h"
 #include "log.h"
 #include "heap.h"
 #include "network.h"
@@ -34,7 +35,48 @@
 #include "text.h"
 #include "conf.h"
 #include "loop.h"
+#include "mypoll.h"
 #include "sblist.h"
+#include "stats.h"
+#include "timers.h"
+#include <pthread.h>
+#include <netinet/tcp.h>
+
+/*
+ * Addresses a connect to failed lately, so that the next connections
+ * try them last.  A small direct-mapped table shared by all threads: a
+ * failure pushes out whatever other address had the slot.
+ */
+#define FAILED_ADDRS            64
+#define FAILED_ADDR_SECONDS     60
+
+struct failed_addr {
+        int family;
+        unsigned char addr[16];
+        time_t until;
+};
+
+static struct failed_addr failed_addrs[FAILED_ADDRS];
+static pthread_mutex_t failed_addrs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The Bind addresses used as the source of outgoing connections: how
+ * many connections each was bound for, and how many of them failed for
+ * want of a free local port.  Kept by the address as configured, so
+ * the counts survive a reload of the configuration.
+ */
+#define BIND_SOURCES    16
+
+struct bind_source {
+        char addr[INET6_ADDRSTRLEN];
+        union sockaddr_union sa;        /* as bound to, without the port */
+        unsigned long used, failed;
+};
+
+static struct bind_source bind_sources[BIND_SOURCES];
+static unsigned int nbind_sources;
+static unsigned long bind_next;         /* for BindRotation roundrobin */
+static pthread_mutex_t bind_sources_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Return a human readable error for getaddrinfo() and getnameinfo().
@@ -60,10 +102,12 @@ static const char * family_string (int af)
 /*
  * Bind the given socket to the supplied address.  The socket is
  * returned if the bind succeeded.  Otherwise, -1 is returned
- * to indicate an error.
+ * to indicate an error.  If "bound" is given, it gets the address
+ * bound to.
  */
 static int
-bind_socket (int sockfd, const char *addr, int family)
+bind_socket (int sockfd, const char *addr, int family,
+             union sockaddr_union *bound)
 {
         struct addrinfo hints, *res, *ressave;
         int n;
@@ -85,12 +129,25 @@ bind_socket (int sockfd, const char *addr, int family)
 
         ressave = res;
 
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        /*
+         * Leave the choice of the local port to connect(), which can
+         * then use one that is in use towards other servers already.
+         */
+        n = 1;
+        setsockopt (sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+                    (void *) &n, sizeof (n));
+#endif
+
         /* Loop through the addresses and try to bind to each */
         do {
                 if (bind (sockfd, res->ai_addr, res->ai_addrlen) == 0)
                         break;  /* success */
         } while ((res = res->ai_next) != NULL);
 
+        if (res != NULL && bound != NULL)
+                memcpy (bound, res->ai_addr, res->ai_addrlen);
+
         freeaddrinfo (ressave);
         if (res == NULL)        /* was not able to bind to any address */
                 return -1;
@@ -98,110 +155,595 @@ bind_socket (int sockfd, const char *addr, int family)
         return sockfd;
 }
 
+/*
+ * The counters of a Bind address, set up on its first use.  Called
+ * with bind_sources_lock held; NULL once the table is full.
+ */
+static struct bind_source *bind_source_get (const char *addr)
+{
+        struct bind_source *src;
+        unsigned int i;
+
+        for (i = 0; i < nbind_sources; i++)
+                if (strcmp (bind_sources[i].addr, addr) == 0)
+                        return &bind_sources[i];
+        if (nbind_sources == BIND_SOURCES)
+                return NULL;
+
+        src = &bind_sources[nbind_sources++];
+        strlcpy (src->addr, addr, sizeof (src->addr));
+        return src;
+}
+
+/*
+ * Whether two addresses are the same, ports aside.
+ */
+static int same_address (union sockaddr_union *a, union sockaddr_union *b)
+{
+        if (a->v4.sin_family != b->v4.sin_family)
+                return 0;
+        if (a->v4.sin_family == AF_INET)
+                return a->v4.sin_addr.s_addr == b->v4.sin_addr.s_addr;
+        return memcmp (&a->v6.sin6_addr, &b->v6.sin6_addr,
+                       sizeof (a->v6.sin6_addr)) == 0;
+}
+
+/*
+ * A connect from a socket bound to one of the Bind addresses failed
+ * with EADDRNOTAVAIL: that address has no local port left towards the
+ * server.  Returns 1 if the socket was bound to one of them.
+ */
+static int bind_source_exhausted (int sockfd)
+{
+        union sockaddr_union local;
+        socklen_t len = sizeof (local);
+        unsigned int i;
+        int ret = 0;
+
+        if (getsockname (sockfd, (struct sockaddr *) (void *) &local,
+                         &len) < 0)
+                return 0;
+
+        pthread_mutex_lock (&bind_sources_lock);
+        for (i = 0; i < nbind_sources; i++)
+                if (same_address (&bind_sources[i].sa, &local)) {
+                        bind_sources[i].failed++;
+                        ret = 1;
+                        break;
+                }
+        pthread_mutex_unlock (&bind_sources_lock);
+
+        return ret;
+}
+
+/*
+ * A hash of the address of a server, and the address bytes.
+ */
+static unsigned long address_hash (struct addrinfo *res,
+                                   const unsigned char **addr, size_t *len)
+{
+        union sockaddr_union *sa = (union sockaddr_union *) (void *) res->ai_addr;
+        unsigned long h = 5381;
+        size_t i;
+
+        if (res->ai_family == AF_INET) {
+                *addr = (const unsigned char *) &sa->v4.sin_addr;
+                *len = 4;
+        } else {
+                *addr = (const unsigned char *) &sa->v6.sin6_addr;
+                *len = 16;
+        }
+        for (i = 0; i < *len; i++)
+                h = h * 33 + (*addr)[i];
+        return h;
+}
+
 /**
- * Try binding the given socket to supplied addresses, stopping when one succeeds.
+ * Try binding the given socket to supplied addresses, stopping when one
+ * succeeds.  Which one is tried first depends on BindRotation: the
+ * first one, the next one in turn, or the one the address of the server
+ * "res" hashes to.  "attempt" moves on from there, for a retry after
+ * the last choice had no port left.
  */
 static int
-bind_socket_list (int sockfd, sblist *addresses, int family)
+bind_socket_list (int sockfd, sblist *addresses, int family,
+                  struct addrinfo *res, unsigned int attempt)
 {
         size_t nb_addresses = sblist_getsize(addresses);
-        size_t i;
+        struct bind_source *src;
+        union sockaddr_union bound;
+        const unsigned char *addr;
+        unsigned long start = 0;
+        size_t i, len;
+
+        if (config->bind_rotation == BIND_HASH)
+                start = address_hash (res, &addr, &len);
+        else if (config->bind_rotation == BIND_ROUNDROBIN) {
+                pthread_mutex_lock (&bind_sources_lock);
+                start = bind_next++;
+                pthread_mutex_unlock (&bind_sources_lock);
+        }
+        start += attempt;
 
         for (i = 0; i < nb_addresses; i++) {
-                const char *address = *(const char **)sblist_get(addresses, i);
-                if (bind_socket(sockfd, address, family) >= 0) {
+                const char *address = *(const char **)sblist_get(addresses,
+                        (start + i) % nb_addresses);
+                errno = 0;
+                if (bind_socket(sockfd, address, family, &bound) >= 0) {
                         log_message(LOG_INFO, "Bound to %s", address);
+                        pthread_mutex_lock (&bind_sources_lock);
+                        src = bind_source_get (address);
+                        if (src) {
+                                src->sa = bound;
+                                src->used++;
+                        }
+                        pthread_mutex_unlock (&bind_sources_lock);
                         return 0;
                 }
+                if (errno == EADDRNOTAVAIL || errno == EADDRINUSE) {
+                        pthread_mutex_lock (&bind_sources_lock);
+                        src = bind_source_get (address);
+                        if (src)
+                                src->failed++;
+                        pthread_mutex_unlock (&bind_sources_lock);
+                }
         }
 
         return -1;
 }
 
+/*
+ * Describe the use of each Bind address so far, for the statistics
+ * page.
+ */
+void bind_get_stats (char *buf, size_t len)
+{
+        unsigned int i;
+        size_t n = 0;
+
+        buf[0] = '\0';
+        pthread_mutex_lock (&bind_sources_lock);
+        for (i = 0; i < nbind_sources && n < len; i++)
+                n += snprintf (buf + n, len - n, "%s%s: %lu (%lu failed)",
+                               i ? ", " : "", bind_sources[i].addr,
+                               bind_sources[i].used, bind_sources[i].failed);
+        pthread_mutex_unlock (&bind_sources_lock);
+        if (i == 0)
+                strlcpy (buf, "none", len);
+}
+
+/*
+ * Bound the writes which block on a socket by the idle Timeout.  Reads
+ * are not bounded here: each phase of a connection has a timeout of
+ * its own (see timers.c.)
+ */
 void set_socket_timeout(int fd) {
         struct timeval tv;
         tv.tv_usec = 0;
         tv.tv_sec = config->idletimeout;
         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (void*) &tv, sizeof(tv));
+}
+
+/*
+ * Bound both the reads and the writes which block on a socket by
+ * "secs" seconds, or (with 0) put back the bounds set_socket_timeout()
+ * sets.
+ */
+void socket_block_timeout (int fd, unsigned int secs)
+{
+        struct timeval tv;
+
         tv.tv_usec = 0;
-        tv.tv_sec = config->idletimeout;
-        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void*) &tv, sizeof(tv));
+        tv.tv_sec = secs;
+        setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, (void *) &tv, sizeof (tv));
+        if (secs == 0)
+                tv.tv_sec = config->idletimeout;
+        setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, (void *) &tv, sizeof (tv));
 }
 
 /*
- * Open a connection to a remote host.  It's been re-written to use
- * the getaddrinfo() library function, which allows for a protocol
- * independent implementation (mostly for IPv4 and IPv6 addresses.)
+ * Switch a socket between blocking and non-blocking mode.
  */
-int opensock (const char *host, int port, const char *bind_to)
+int socket_nonblocking (int fd, int on)
 {
-        int sockfd, n;
-        struct addrinfo hints, *res, *ressave;
-        char portstr[6];
+        int flags = fcntl (fd, F_GETFL);
+
+        if (flags < 0)
+                return -1;
+
+        flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+        return fcntl (fd, F_SETFL, flags);
+}
+
+/*
+ * Create a socket for one of the addresses getaddrinfo() returned and
+ * bind it to the configured outgoing address, if there is one.
+ */
+static int socket_for_address (struct addrinfo *res, const char *bind_to,
+                               unsigned int attempt, int fastopen)
+{
+        int sockfd;
+
+        sockfd = socket (res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (sockfd < 0)
+                return -1;
+
+        /* Bind to the specified address */
+        if (bind_to) {
+                if (bind_socket (sockfd, bind_to, res->ai_family,
+                                 NULL) < 0) {
+                        close (sockfd);
+                        return -1;
+                }
+        } else if (config->bind_addrs) {
+                if (bind_socket_list (sockfd, config->bind_addrs,
+                                      res->ai_family, res, attempt) < 0) {
+                        close (sockfd);
+                        return -1;
+                }
+        }
+
+        set_socket_timeout(sockfd);
+
+#ifdef TCP_FASTOPEN_CONNECT
+        /*
+         * connect() returns at once if the server gave us a cookie
+         * before, and the request head goes out with the SYN.  Whether
+         * the server answers is only known once the first read or write
+         * on the socket fails or not, too late to try another address
+         * or to tell the failure table about it.
+         */
+        if (fastopen) {
+                int on = 1;
+
+                setsockopt (sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                            (void *) &on, sizeof (on));
+        }
+#endif
+
+        return sockfd;
+}
+
+/*
+ * Whether the SYN of a connection carried data (TCP Fast Open) and the
+ * other side took it, whichever side sent it.
+ */
+int socket_fastopened (int fd)
+{
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+        struct tcp_info info;
+        socklen_t len = sizeof (info);
+
+        if (getsockopt (fd, IPPROTO_TCP, TCP_INFO, (void *) &info,
+                        &len) == 0
+            && (info.tcpi_options & TCPI_OPT_SYN_DATA))
+                return 1;
+#else
+        (void) fd;
+#endif
+        return 0;
+}
+
+/*
+ * A connection to our own port might be a loop back into ourselves;
+ * remember its local address so that connection_loops() can tell.
+ */
+static void record_connection (int sockfd, struct addrinfo *res)
+{
+        union sockaddr_union *p = (void*) res->ai_addr, u;
+        int af = res->ai_addr->sa_family;
+        unsigned dport = ntohs(af == AF_INET ? p->v4.sin_port : p->v6.sin6_port);
+        socklen_t slen = sizeof u;
+
+        if (dport == config->port) {
+                getsockname(sockfd, (void*)&u, &slen);
+                loop_records_add(&u);
+        }
+}
+
+/*
+ * Look up the addresses of a remote host.  The result has to be
+ * released with dns_free().
+ */
+struct addrinfo *resolve_host (const char *host, int port)
+{
+        struct addrinfo *res;
 
         assert (host != NULL);
         assert (port > 0);
 
+        res = dns_resolve (host, port);
+        if (res == NULL) {
+                log_message (LOG_ERR,
+                             "opensock: Could not retrieve address info for %s:%d", host, port);
+                return NULL;
+        }
+
         log_message(LOG_INFO,
-                    "opensock: opening connection to %s:%d", host, port);
+                    "opensock: name lookup done for %s:%d", host, port);
 
-        memset (&hints, 0, sizeof (struct addrinfo));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
+        return res;
+}
 
-        snprintf (portstr, sizeof (portstr), "%d", port);
+/*
+ * The slot of the failure table for an address, and the address bytes.
+ */
+static struct failed_addr *failed_slot (struct addrinfo *res,
+                                        const unsigned char **addr,
+                                        size_t *len)
+{
+        return &failed_addrs[address_hash (res, addr, len) % FAILED_ADDRS];
+}
 
-        n = getaddrinfo (host, portstr, &hints, &res);
-        if (n != 0) {
-                log_message (LOG_ERR,
-                             "opensock: Could not retrieve address info for %s:%d: %s", host, port, get_gai_error (n));
+/*
+ * Remember whether a connect to the address went through.
+ */
+static void connect_outcome (struct addrinfo *res, int failed)
+{
+        const unsigned char *addr;
+        struct failed_addr *f;
+        size_t len;
+
+        f = failed_slot (res, &addr, &len);
+        pthread_mutex_lock (&failed_addrs_lock);
+        if (failed) {
+                f->family = res->ai_family;
+                memcpy (f->addr, addr, len);
+                f->until = time (NULL) + FAILED_ADDR_SECONDS;
+        } else if (f->family == res->ai_family
+                   && memcmp (f->addr, addr, len) == 0)
+                f->until = 0;
+        pthread_mutex_unlock (&failed_addrs_lock);
+}
+
+static int connect_failed_lately (struct addrinfo *res, time_t now)
+{
+        const unsigned char *addr;
+        struct failed_addr *f;
+        size_t len;
+        int ret;
+
+        f = failed_slot (res, &addr, &len);
+        pthread_mutex_lock (&failed_addrs_lock);
+        ret = f->until > now && f->family == res->ai_family
+                && memcmp (f->addr, addr, len) == 0;
+        pthread_mutex_unlock (&failed_addrs_lock);
+        return ret;
+}
+
+/*
+ * A connect to the address was given up on, having taken longer than
+ * ConnectAttemptDelay while another one got through (or none did.)
+ */
+void opensock_given_up (struct addrinfo *res)
+{
+        connect_outcome (res, TRUE);
+}
+
+/*
+ * Put the addresses of a server in the order to try them in (RFC 8305):
+ * alternating between IPv6 and IPv4, starting with the family of the
+ * first address, and those a connect failed to lately at the end.
+ * Returns the new head of the list.
+ */
+struct addrinfo *opensock_order (struct addrinfo *res)
+{
+        struct addrinfo *fam[2] = { NULL, NULL }, **famtail[2];
+        struct addrinfo *bad = NULL, **badtail = &bad;
+        struct addrinfo *head = NULL, **tail = &head, *next;
+        time_t now = time (NULL);
+        int first, k;
+
+        if (!res || !res->ai_next)
+                return res;
+
+        famtail[0] = &fam[0];
+        famtail[1] = &fam[1];
+        first = res->ai_family;
+        for (; res; res = next) {
+                next = res->ai_next;
+                res->ai_next = NULL;
+                if (connect_failed_lately (res, now)) {
+                        *badtail = res;
+                        badtail = &res->ai_next;
+                } else {
+                        k = res->ai_family != first;
+                        *famtail[k] = res;
+                        famtail[k] = &res->ai_next;
+                }
+        }
+
+        for (k = 0; fam[0] || fam[1]; k = !k) {
+                if (!fam[k])
+                        continue;
+                *tail = fam[k];
+                fam[k] = fam[k]->ai_next;
+                tail = &(*tail)->ai_next;
+        }
+        *tail = bad;
+
+        return head;
+}
+
+/*
+ * Start a non-blocking connect to one address.  Returns the socket,
+ * which becomes writable once the connect has finished one way or the
+ * other, or -1 if the attempt failed straight away.  "fastopen" asks
+ * for TCP Fast Open (if FastOpenConnect is set), which only makes sense
+ * when there is no other address to fall back on.
+ */
+int opensock_begin (struct addrinfo *res, const char *bind_to, int fastopen)
+{
+        unsigned int attempt;
+        int sockfd, err;
+
+        for (attempt = 0; ; attempt++) {
+                sockfd = socket_for_address (res, bind_to, attempt,
+                                             fastopen
+                                             && config->fastopen_connect);
+                if (sockfd < 0)
+                        return -1;
+
+                if (socket_nonblocking (sockfd, 1) < 0) {
+                        close (sockfd);
+                        return -1;
+                }
+                if (connect (sockfd, res->ai_addr, res->ai_addrlen) == 0
+                    || errno == EINPROGRESS)
+                        return sockfd;
+                err = errno;
+
+                /*
+                 * The Bind address has no port left towards the
+                 * server; another one may.
+                 */
+                if (err == EADDRNOTAVAIL && !bind_to && config->bind_addrs
+                    && bind_source_exhausted (sockfd)
+                    && attempt + 1 < sblist_getsize (config->bind_addrs)) {
+                        close (sockfd);
+                        continue;
+                }
+
+                if (err != EADDRNOTAVAIL)
+                        connect_outcome (res, TRUE);
+                close (sockfd);
+                errno = err;
+                return -1;
+        }
+}
+
+/*
+ * Check the outcome of a connect started by opensock_begin().  Returns 0
+ * if the socket is connected, and -1 (with errno set) if it is not.
+ */
+int opensock_end (int sockfd, struct addrinfo *res)
+{
+        int err = 0;
+        socklen_t len = sizeof (err);
+
+        if (getsockopt (sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                return -1;
+        if (err != 0) {
+                connect_outcome (res, TRUE);
+                errno = err;
                 return -1;
         }
 
+        connect_outcome (res, FALSE);
+        record_connection (sockfd, res);
+        return 0;
+}
+
+static long msec_since (struct timespec *then)
+{
+        struct timespec now;
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - then->tv_sec) * 1000
+                + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/*
+ * Open a connection to a remote host.  The addresses are tried "Happy
+ * Eyeballs" style (RFC 8305): a connect to the next one starts when the
+ * last one has not got through within ConnectAttemptDelay milliseconds
+ * (or has failed), without giving up on those under way, and the first
+ * one to connect is used.  This way an address that does not answer
+ * costs a moment rather than the whole ConnectTimeout.
+ */
+int opensock (const char *host, int port, const char *bind_to)
+{
+        pollfd_struct fds[CONNECT_ATTEMPTS_MAX];
+        struct addrinfo *attempt[CONNECT_ATTEMPTS_MAX];
+        struct timespec attempt_started[CONNECT_ATTEMPTS_MAX];
+        struct addrinfo *res, *next;
+        struct timespec started, last;
+        long delay = config->connect_attempt_delay, wait;
+        long timeout = (long) timeout_for (TIMEOUT_CONNECT) * 1000;
+        int sockfd = -1, n = 0, i, failed = FALSE;
+
+        assert (host != NULL);
+        assert (port > 0);
+
         log_message(LOG_INFO,
-                    "opensock: getaddrinfo returned for %s:%d", host, port);
+                    "opensock: opening connection to %s:%d", host, port);
 
-        ressave = res;
-        do {
-                sockfd =
-                    socket (res->ai_family, res->ai_socktype, res->ai_protocol);
-                if (sockfd < 0)
-                        continue;       /* ignore this one */
-
-                /* Bind to the specified address */
-                if (bind_to) {
-                        if (bind_socket (sockfd, bind_to,
-                                         res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
-                        }
-                } else if (config->bind_addrs) {
-                        if (bind_socket_list (sockfd, config->bind_addrs,
-                                              res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
+        res = resolve_host (host, port);
+        if (res == NULL)
+                return -1;
+
+        res = next = opensock_order (res);
+        clock_gettime (CLOCK_MONOTONIC, &started);
+        last = started;
+
+        while (sockfd < 0) {
+                /* Start on the next address if it is time to. */
+                if (next && n < CONNECT_ATTEMPTS_MAX
+                    && (n == 0 || failed
+                        || (delay > 0 && msec_since (&last) >= delay))) {
+                        failed = FALSE;
+                        fds[n].fd = opensock_begin (next, bind_to,
+                                                    !res->ai_next);
+                        if (fds[n].fd >= 0) {
+                                clock_gettime (CLOCK_MONOTONIC, &last);
+                                attempt_started[n] = last;
+                                attempt[n++] = next;
                         }
+                        next = next->ai_next;
+                        continue;
+                }
+
+                wait = timeout - msec_since (&started);
+                if (n == 0)
+                        break;
+                if (wait <= 0) {
+                        log_message (LOG_INFO, "opensock: connect to %s:%d "
+                                     "timed out", host, port);
+                        update_stats (STAT_TIMEOUT_CONNECT);
+                        errno = ETIMEDOUT;
+                        break;
                 }
+                if (next && n < CONNECT_ATTEMPTS_MAX && delay > 0
+                    && delay - msec_since (&last) < wait)
+                        wait = delay - msec_since (&last);
 
-                set_socket_timeout(sockfd);
+                for (i = 0; i < n; i++) {
+                        fds[i].events = MYPOLL_WRITE;
+                        fds[i].revents = 0;
+                }
+                if (mypoll_ms (fds, n, wait > 0 ? wait : 0) < 0
+                    && errno != EINTR)
+                        break;
 
-                if (connect (sockfd, res->ai_addr, res->ai_addrlen) == 0) {
-                        union sockaddr_union *p = (void*) res->ai_addr, u;
-			int af = res->ai_addr->sa_family;
-                        unsigned dport = ntohs(af == AF_INET ? p->v4.sin_port : p->v6.sin6_port);
-                        socklen_t slen = sizeof u;
-                        if (dport == config->port) {
-                                getsockname(sockfd, (void*)&u, &slen);
-                                loop_records_add(&u);
+                for (i = 0; i < n; i++) {
+                        if (!fds[i].revents)
+                                continue;
+                        if (opensock_end (fds[i].fd, attempt[i]) == 0) {
+                                sockfd = fds[i].fd;
+                                fds[i] = fds[--n];
+                                attempt[i] = attempt[n];
+                                attempt_started[i] = attempt_started[n];
+                                break;
                         }
-                        break;  /* success */
-		}
+                        /* failed: drop it, and go on with the next one */
+                        close (fds[i].fd);
+                        fds[i] = fds[--n];
+                        attempt[i] = attempt[n];
+                        attempt_started[i] = attempt_started[n];
+                        failed = TRUE;
+                        i--;
+                }
+        }
 
-                close (sockfd);
-        } while ((res = res->ai_next) != NULL);
+        for (i = 0; i < n; i++) {
+                if (msec_since (&attempt_started[i]) >= delay)
+                        opensock_given_up (attempt[i]);
+                close (fds[i].fd);
+        }
+        dns_free (res);
 
-        freeaddrinfo (ressave);
-        if (res == NULL) {
+        if (sockfd < 0) {
                 log_message (LOG_ERR,
                              "opensock: Could not establish a connection to %s:%d",
                              host,
@@ -209,33 +751,22 @@ int opensock (const char *host, int port, const char *bind_to)
                 return -1;
         }
 
+        socket_nonblocking (sockfd, 0);
         return sockfd;
 }
 
-/**
- * Try to listen on one socket based on the addrinfo
- * as returned from getaddrinfo.
+/*
+ * Create one listening socket for the address.  With "reuseport" set,
+ * SO_REUSEPORT lets several of them share the address, and the kernel
+ * spreads incoming connections among them.
  *
  * Return the file descriptor upon success, -1 upon error.
  */
-static int listen_on_one_socket(struct addrinfo *ad)
+static int listen_socket(struct addrinfo *ad, int reuseport)
 {
         int listenfd;
         int ret;
         const int on = 1;
-        char numerichost[NI_MAXHOST];
-        int flags = NI_NUMERICHOST;
-
-        ret = getnameinfo(ad->ai_addr, ad->ai_addrlen,
-                          numerichost, NI_MAXHOST, NULL, 0, flags);
-        if (ret != 0) {
-                log_message(LOG_ERR, "getnameinfo failed: %s", get_gai_error (ret));
-                return -1;
-        }
-
-        log_message(LOG_INFO, "trying to listen on host[%s], family[%d], "
-                    "socktype[%d], proto[%d]", numerichost,
-                    ad->ai_family, ad->ai_socktype, ad->ai_protocol);
 
         listenfd = socket(ad->ai_family, ad->ai_socktype, ad->ai_protocol);
         if (listenfd == -1) {
@@ -252,6 +783,20 @@ static int listen_on_one_socket(struct addrinfo *ad)
                 return -1;
         }
 
+#ifdef SO_REUSEPORT
+        if (reuseport) {
+                ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on,
+                                 sizeof(on));
+                if (ret != 0) {
+                        log_message(LOG_ERR,
+                                    "setsockopt failed to set SO_REUSEPORT: %s",
+                                    strerror(errno));
+                        close(listenfd);
+                        return -1;
+                }
+        }
+#endif
+
         if (ad->ai_family == AF_INET6) {
                 ret = setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &on,
                                  sizeof(on));
@@ -271,6 +816,18 @@ static int listen_on_one_socket(struct addrinfo *ad)
                return -1;
         }
 
+#ifdef TCP_FASTOPEN
+        if (config->fastopen_listen > 0) {
+                int qlen = config->fastopen_listen;
+
+                if (setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+                               sizeof(qlen)) != 0)
+                        log_message(LOG_WARNING,
+                                    "setsockopt failed to set TCP_FASTOPEN: %s",
+                                    strerror(errno));
+        }
+#endif
+
         ret = listen(listenfd, MAXLISTEN);
         if (ret != 0) {
                 log_message(LOG_ERR, "listen failed: %s", strerror(errno));
@@ -283,6 +840,52 @@ static int listen_on_one_socket(struct addrinfo *ad)
         return listenfd;
 }
 
+/**
+ * Try to listen on one socket based on the addrinfo
+ * as returned from getaddrinfo.  With "copies" > 1, that many
+ * SO_REUSEPORT sockets are opened for the address instead, one for
+ * each event engine worker.  Either all of them are added to
+ * listen_fds, or none.
+ *
+ * Return 0 upon success, -1 upon error.
+ */
+static int listen_on_one_socket(struct addrinfo *ad, unsigned int copies,
+                                sblist *listen_fds)
+{
+        int listenfd;
+        int ret;
+        unsigned int i;
+        char numerichost[NI_MAXHOST];
+        int flags = NI_NUMERICHOST;
+
+        ret = getnameinfo(ad->ai_addr, ad->ai_addrlen,
+                          numerichost, NI_MAXHOST, NULL, 0, flags);
+        if (ret != 0) {
+                log_message(LOG_ERR, "getnameinfo failed: %s", get_gai_error (ret));
+                return -1;
+        }
+
+        log_message(LOG_INFO, "trying to listen on host[%s], family[%d], "
+                    "socktype[%d], proto[%d]", numerichost,
+                    ad->ai_family, ad->ai_socktype, ad->ai_protocol);
+
+        for (i = 0; i < copies; i++) {
+                listenfd = listen_socket(ad, copies > 1);
+                if (listenfd == -1 || !sblist_add(listen_fds, &listenfd)) {
+                        if (listenfd != -1)
+                                close(listenfd);
+                        while (i-- > 0) {
+                                size_t last = sblist_getsize(listen_fds) - 1;
+                                close(*(int *) sblist_get(listen_fds, last));
+                                sblist_delete(listen_fds, last);
+                        }
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
 /*
  * Start listening on a socket. Create a socket with the selected port.
  * If the provided address is NULL, we may listen on multiple sockets,
@@ -291,9 +894,11 @@ static int listen_on_one_socket(struct addrinfo *ad)
  * address reported by getaddrinfo that works.
  *
  * Upon success, the listen-fds are added to the listen_fds list
+ * ("copies" of them for every address, see listen_on_one_socket())
  * and 0 is returned. Upon error,  -1 is returned.
  */
-int listen_sock (const char *addr, uint16_t port, sblist* listen_fds)
+int listen_sock (const char *addr, uint16_t port, unsigned int copies,
+                 sblist* listen_fds)
 {
         struct addrinfo hints, *result, *rp;
         char portstr[6];
@@ -324,15 +929,10 @@ int listen_sock (const char *addr, uint16_t port, sblist* listen_fds)
         }
 
         for (rp = result; rp != NULL; rp = rp->ai_next) {
-                int listenfd;
-
-                listenfd = listen_on_one_socket(rp);
-                if (listenfd == -1) {
+                if (listen_on_one_socket(rp, copies, listen_fds) == -1) {
                         continue;
                 }
 
-                sblist_add (listen_fds, &listenfd);
-
                 /* success */
                 ret = 0;
 
@@ -50,10 +50,24 @@ union sockaddr_union {
         struct sockaddr_in6 v6;
 };
 
+/* connects to the addresses of a server under way at once, at most */
+#define CONNECT_ATTEMPTS_MAX    4
+
 extern int opensock (const char *host, int port, const char *bind_to);
-extern int listen_sock (const char *addr, uint16_t port, sblist* listen_fds);
+extern struct addrinfo *resolve_host (const char *host, int port);
+extern struct addrinfo *opensock_order (struct addrinfo *res);
+extern void opensock_given_up (struct addrinfo *res);
+extern int opensock_begin (struct addrinfo *res, const char *bind_to,
+                           int fastopen);
+extern int opensock_end (int sockfd, struct addrinfo *res);
+extern int socket_nonblocking (int fd, int on);
+extern int socket_fastopened (int fd);
+extern int listen_sock (const char *addr, uint16_t port, unsigned int copies,
+                        sblist* listen_fds);
 
 extern void set_socket_timeout(int fd);
+extern void socket_block_timeout (int fd, unsigned int secs);
+extern void bind_get_stats (char *buf, size_t len);
 
 extern int getsock_ip (int fd, char *ipaddr);
 extern void getpeer_information (union sockaddr_union *addr, char *ipaddr, size_t ipaddr_len);
@@ -27,9 +27,14 @@
 
 #include "main.h"
 
+#include "buffer.h"
+#include "dns.h"
 #include "log.h"
 #include "heap.h"
 #include "html-error.h"
+#include "origin-pool.h"
+#include "pool.h"
+#include "sock.h"
 #include "stats.h"
 #include "utils.h"
 #include "conf.h"
@@ -41,6 +46,13 @@ struct stat_s {
         unsigned long int num_open;
         unsigned long int num_refused;
         unsigned long int num_denied;
+        unsigned long int num_queued;
+        unsigned long int queue_msec;
+        unsigned long int num_fast_rejects;
+        unsigned long int num_error_pages;
+        unsigned long int num_timeouts[TIMEOUT_PHASES];
+        unsigned long int num_fastopen;
+        unsigned long int num_fastopen_clients;
 };
 
 static struct stat_s stats_buf, *stats;
@@ -63,13 +75,68 @@ showstats (struct conn_s *connptr)
 {
         char *message_buffer;
         char opens[16], reqs[16], badconns[16], denied[16], refused[16];
+        char queued[16], queuetime[16], fastrejects[16], errorpages[16];
+        char poolhits[16], poolmisses[16], poolresident[16];
+        char bufactive[16], bufidle[16], bufmemory[16];
+        char originhits[16], originmisses[16], originidle[16];
+        char dnshits[16], dnsmisses[16], dnstime[16];
+        char timeouts[TIMEOUT_PHASES][16];
+        char bindsources[512];
+        char fastopenout[16], fastopenin[16];
+        unsigned long avg_queue_msec;
+        unsigned long pool_hits, pool_misses, pool_resident;
+        unsigned long buf_active, buf_idle, buf_memory;
+        unsigned long origin_hits, origin_misses, origin_idle;
+        unsigned long dns_hits, dns_misses, dns_msec;
         FILE *statfile;
+        unsigned int i;
+
+        avg_queue_msec = stats->num_queued ?
+                stats->queue_msec / stats->num_queued : 0;
 
         snprintf (opens, sizeof (opens), "%lu", stats->num_open);
         snprintf (reqs, sizeof (reqs), "%lu", stats->num_reqs);
         snprintf (badconns, sizeof (badconns), "%lu", stats->num_badcons);
         snprintf (denied, sizeof (denied), "%lu", stats->num_denied);
         snprintf (refused, sizeof (refused), "%lu", stats->num_refused);
+        snprintf (queued, sizeof (queued), "%lu", stats->num_queued);
+        snprintf (queuetime, sizeof (queuetime), "%lu", avg_queue_msec);
+        snprintf (fastrejects, sizeof (fastrejects), "%lu",
+                  stats->num_fast_rejects);
+        snprintf (errorpages, sizeof (errorpages), "%lu",
+                  stats->num_error_pages);
+
+        pool_get_stats (&pool_hits, &pool_misses, &pool_resident);
+        pool_resident /= 1024;
+        snprintf (poolhits, sizeof (poolhits), "%lu", pool_hits);
+        snprintf (poolmisses, sizeof (poolmisses), "%lu", pool_misses);
+        snprintf (poolresident, sizeof (poolresident), "%lu", pool_resident);
+
+        buffer_get_stats (&buf_active, &buf_idle);
+        buf_memory = buf_active * (MAXBUFFSIZE / 1024);
+        snprintf (bufactive, sizeof (bufactive), "%lu", buf_active);
+        snprintf (bufidle, sizeof (bufidle), "%lu", buf_idle);
+        snprintf (bufmemory, sizeof (bufmemory), "%lu", buf_memory);
+
+        origin_pool_get_stats (&origin_hits, &origin_misses, &origin_idle);
+        snprintf (originhits, sizeof (originhits), "%lu", origin_hits);
+        snprintf (originmisses, sizeof (originmisses), "%lu", origin_misses);
+        snprintf (originidle, sizeof (originidle), "%lu", origin_idle);
+
+        dns_get_stats (&dns_hits, &dns_misses, &dns_msec);
+        snprintf (dnshits, sizeof (dnshits), "%lu", dns_hits);
+        snprintf (dnsmisses, sizeof (dnsmisses), "%lu", dns_misses);
+        snprintf (dnstime, sizeof (dnstime), "%lu", dns_msec);
+
+        bind_get_stats (bindsources, sizeof (bindsources));
+        snprintf (fastopenout, sizeof (fastopenout), "%lu",
+                  stats->num_fastopen);
+        snprintf (fastopenin, sizeof (fastopenin), "%lu",
+                  stats->num_fastopen_clients);
+
+        for (i = 0; i < TIMEOUT_PHASES; i++)
+                snprintf (timeouts[i], sizeof (timeouts[i]), "%lu",
+                          stats->num_timeouts[i]);
 
         pthread_mutex_lock(&stats_file_lock);
 
@@ -95,7 +162,32 @@ err_minus_one:
                    "Number of requests: %lu<br />\n"
                    "Number of bad connections: %lu<br />\n"
                    "Number of denied connections: %lu<br />\n"
-                   "Number of refused connections due to high load: %lu\n"
+                   "Number of refused connections due to high load: %lu<br />\n"
+                   "Number of connections queued due to high load: %lu<br />\n"
+                   "Average time in queue (ms): %lu<br />\n"
+                   "Requests turned away with the short response: %lu<br />\n"
+                   "Error pages sent in full: %lu<br />\n"
+                   "Memory pool hits: %lu<br />\n"
+                   "Memory pool misses: %lu<br />\n"
+                   "Memory pool size (KB): %lu<br />\n"
+                   "Relay buffers holding data: %lu<br />\n"
+                   "Relay buffers idle (no memory held): %lu<br />\n"
+                   "Relay buffer memory in use (KB): %lu<br />\n"
+                   "Server connections reused: %lu<br />\n"
+                   "Server connections opened anew: %lu<br />\n"
+                   "Idle server connections: %lu<br />\n"
+                   "Name lookups answered from the cache: %lu<br />\n"
+                   "Name lookups sent to the name servers: %lu<br />\n"
+                   "Average name server lookup time (ms): %lu<br />\n"
+                   "Request heads timed out: %lu<br />\n"
+                   "Name lookups timed out: %lu<br />\n"
+                   "Connects timed out: %lu<br />\n"
+                   "Upstream handshakes timed out: %lu<br />\n"
+                   "Responses timed out: %lu<br />\n"
+                   "Connections closed when idle: %lu<br />\n"
+                   "Connections made from each Bind address: %s<br />\n"
+                   "Server connections opened with TCP Fast Open: %lu<br />\n"
+                   "Client connections opened with TCP Fast Open: %lu\n"
                    "</p>\n"
                    "<hr />\n"
                    "<p><em>Generated by %s.</em></p>\n" "</body>\n"
@@ -104,7 +196,21 @@ err_minus_one:
                    stats->num_open,
                    stats->num_reqs,
                    stats->num_badcons, stats->num_denied,
-                   stats->num_refused, PACKAGE);
+                   stats->num_refused,
+                   stats->num_queued, avg_queue_msec,
+                   stats->num_fast_rejects, stats->num_error_pages,
+                   pool_hits, pool_misses, pool_resident,
+                   buf_active, buf_idle, buf_memory,
+                   origin_hits, origin_misses, origin_idle,
+                   dns_hits, dns_misses, dns_msec,
+                   stats->num_timeouts[TIMEOUT_HEAD],
+                   stats->num_timeouts[TIMEOUT_DNS],
+                   stats->num_timeouts[TIMEOUT_CONNECT],
+                   stats->num_timeouts[TIMEOUT_HANDSHAKE],
+                   stats->num_timeouts[TIMEOUT_RESPONSE],
+                   stats->num_timeouts[TIMEOUT_IDLE], bindsources,
+                   stats->num_fastopen, stats->num_fastopen_clients,
+                   PACKAGE);
 
                 if (send_http_message (connptr, 200, "OK",
                                        message_buffer) < 0) {
@@ -121,6 +227,34 @@ err_minus_one:
         add_error_variable (connptr, "badconns", badconns);
         add_error_variable (connptr, "deniedconns", denied);
         add_error_variable (connptr, "refusedconns", refused);
+        add_error_variable (connptr, "queuedconns", queued);
+        add_error_variable (connptr, "queuetime", queuetime);
+        add_error_variable (connptr, "fastrejects", fastrejects);
+        add_error_variable (connptr, "errorpages", errorpages);
+        add_error_variable (connptr, "poolhits", poolhits);
+        add_error_variable (connptr, "poolmisses", poolmisses);
+        add_error_variable (connptr, "poolresident", poolresident);
+        add_error_variable (connptr, "bufactive", bufactive);
+        add_error_variable (connptr, "bufidle", bufidle);
+        add_error_variable (connptr, "bufmemory", bufmemory);
+        add_error_variable (connptr, "originhits", originhits);
+        add_error_variable (connptr, "originmisses", originmisses);
+        add_error_variable (connptr, "originidle", originidle);
+        add_error_variable (connptr, "dnshits", dnshits);
+        add_error_variable (connptr, "dnsmisses", dnsmisses);
+        add_error_variable (connptr, "dnstime", dnstime);
+        add_error_variable (connptr, "timeouthead", timeouts[TIMEOUT_HEAD]);
+        add_error_variable (connptr, "timeoutdns", timeouts[TIMEOUT_DNS]);
+        add_error_variable (connptr, "timeoutconnect",
+                            timeouts[TIMEOUT_CONNECT]);
+        add_error_variable (connptr, "timeouthandshake",
+                            timeouts[TIMEOUT_HANDSHAKE]);
+        add_error_variable (connptr, "timeoutresponse",
+                            timeouts[TIMEOUT_RESPONSE]);
+        add_error_variable (connptr, "timeoutidle", timeouts[TIMEOUT_IDLE]);
+        add_error_variable (connptr, "bindsources", bindsources);
+        add_error_variable (connptr, "fastopenout", fastopenout);
+        add_error_variable (connptr, "fastopenin", fastopenin);
         add_standard_vars (connptr);
         send_http_headers (connptr, 200, "Statistic requested", "");
         send_html_file (statfile, connptr);
@@ -135,26 +269,62 @@ err_minus_one:
  * stats.h
  */
 int update_stats (status_t update_level)
+{
+        return update_stats_by (update_level, 1);
+}
+
+/*
+ * Same as update_stats(), for the statistics that do not simply count
+ * events (like STAT_QUEUE_TIME.)
+ */
+int update_stats_by (status_t update_level, unsigned long amount)
 {
         int ret = 0;
 
         pthread_mutex_lock(&stats_update_lock);
         switch (update_level) {
         case STAT_BADCONN:
-                ++stats->num_badcons;
+                stats->num_badcons += amount;
                 break;
         case STAT_OPEN:
-                ++stats->num_open;
-                ++stats->num_reqs;
+                stats->num_open += amount;
+                stats->num_reqs += amount;
                 break;
         case STAT_CLOSE:
-                --stats->num_open;
+                stats->num_open -= amount;
                 break;
         case STAT_REFUSE:
-                ++stats->num_refused;
+                stats->num_refused += amount;
                 break;
         case STAT_DENIED:
-                ++stats->num_denied;
+                stats->num_denied += amount;
+                break;
+        case STAT_QUEUED:
+                stats->num_queued += amount;
+                break;
+        case STAT_QUEUE_TIME:
+                stats->queue_msec += amount;
+                break;
+        case STAT_FAST_REJECT:
+                stats->num_fast_rejects += amount;
+                break;
+        case STAT_ERROR_PAGE:
+                stats->num_error_pages += amount;
+                break;
+        case STAT_TIMEOUT_HEAD:
+        case STAT_TIMEOUT_DNS:
+        case STAT_TIMEOUT_CONNECT:
+        case STAT_TIMEOUT_HANDSHAKE:
+        case STAT_TIMEOUT_RESPONSE:
+        case STAT_TIMEOUT_IDLE:
+                stats->num_timeouts[update_level - STAT_TIMEOUT_HEAD]
+                        += amount;
+                break;
+        case STAT_FASTOPEN:
+                stats->num_fastopen += amount;
+                break;
+        case STAT_FASTOPEN_CLIENT:
+                stats->num_fastopen_clients += amount;
                 break;
         default:
                 ret = -1;
@@ -31,7 +31,19 @@ typedef enum {
         STAT_OPEN,              /* connection opened */
         STAT_CLOSE,             /* connection closed */
         STAT_REFUSE,            /* connection refused (to outside world) */
-        STAT_DENIED             /* connection denied to tinyproxy itself */
+        STAT_DENIED,            /* connection denied to tinyproxy itself */
+        STAT_QUEUED,            /* connection had to wait for a thread */
+        STAT_QUEUE_TIME,        /* milliseconds spent waiting for a thread */
+        STAT_FAST_REJECT,       /* turned away with the short response */
+        STAT_ERROR_PAGE,        /* error page sent from its template */
+        STAT_TIMEOUT_HEAD,      /* a phase timed out, in the order of */
+        STAT_TIMEOUT_DNS,       /* enum timeout_phase */
+        STAT_TIMEOUT_CONNECT,
+        STAT_TIMEOUT_HANDSHAKE,
+        STAT_TIMEOUT_RESPONSE,
+        STAT_TIMEOUT_IDLE,
+        STAT_FASTOPEN,          /* request sent in the SYN to the server */
+        STAT_FASTOPEN_CLIENT    /* client sent its request in the SYN */
 } status_t;
 
 /*
@@ -40,5 +52,6 @@ typedef enum {
 extern void init_stats (void);
 extern int showstats (struct conn_s *connptr);
 extern int update_stats (status_t update_level);
+extern int update_stats_by (status_t update_level, unsigned long amount);
 
 #endif
@@ -0,0 +1,284 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The timeouts of the phases a connection goes through: reading the
+ * request head, looking up the server, connecting to it, the handshake
+ * with an upstream proxy, waiting for the response and the relay.  Each
+ * has a directive of its own (HeadTimeout and so on), falling back to
+ * Timeout.
+ *
+ * They are kept on a timer wheel: a slot per second, with the timers
+ * due in that second (give or take a turn of the wheel) chained to it.
+ * Setting, moving and cancelling a timer takes constant time, and each
+ * second only one slot is looked at.  A timer pushed further out, as
+ * the idle timeout is on every bit of data relayed, stays where it is
+ * until its slot comes up and is moved on only then.
+ *
+ * Every engine worker has a wheel of its own.  The threads of the
+ * "threads" model share one, run by a watchdog thread: when the phase
+ * of a connection takes too long, it shuts the socket down that the
+ * connection's thread is blocked on, which then finds the deadline
+ * passed (see deadline_clear()).
+ */
+
+#include "main.h"
+
+#include "timers.h"
+#include "conf.h"
+#include "conns.h"
+#include "log.h"
+#include <pthread.h>
+
+/* the "slot" of a timer which is about to go off */
+#define TIMER_FIRING    ((time_t) -1)
+
+static const char *timeout_names[TIMEOUT_PHASES] = {
+        "Request head",
+        "Name lookup",
+        "Connect",
+        "Upstream handshake",
+        "Response",
+        "Idle"
+};
+
+static struct timer_entry **timer_head (struct timer_wheel *tw,
+                                        struct timer_entry *t)
+{
+        if (t->slot == TIMER_FIRING)
+                return &tw->firing;
+        return &tw->slots[t->slot % TIMER_SLOTS];
+}
+
+static void timer_link (struct timer_wheel *tw, struct timer_entry *t,
+                        time_t slot)
+{
+        struct timer_entry **head;
+
+        t->slot = slot;
+        head = timer_head (tw, t);
+        t->prev = NULL;
+        t->next = *head;
+        if (*head)
+                (*head)->prev = t;
+        *head = t;
+}
+
+static void timer_unlink (struct timer_wheel *tw, struct timer_entry *t)
+{
+        if (t->prev)
+                t->prev->next = t->next;
+        else
+                *timer_head (tw, t) = t->next;
+        if (t->next)
+                t->next->prev = t->prev;
+        t->prev = t->next = NULL;
+        t->slot = 0;
+}
+
+void timer_wheel_init (struct timer_wheel *tw, time_t now)
+{
+        memset (tw, 0, sizeof (*tw));
+        tw->now = now;
+}
+
+/*
+ * Have "t" go off once the second "expires" is over, for the given
+ * phase.  The time it was set at is only known to the second, so a
+ * timeout of n seconds is given between n and n + 1, never less.
+ */
+void timer_set (struct timer_wheel *tw, struct timer_entry *t,
+                unsigned int phase, time_t expires)
+{
+        if (expires < tw->now)
+                expires = tw->now;
+        t->phase = phase;
+        t->fired = FALSE;
+        t->expires = expires;
+
+        /* Its slot comes up first; it is moved on from there. */
+        if (t->slot > 0 && t->slot <= expires + 1)
+                return;
+
+        if (t->slot != 0)
+                timer_unlink (tw, t);
+        timer_link (tw, t, expires + 1);
+}
+
+void timer_cancel (struct timer_wheel *tw, struct timer_entry *t)
+{
+        if (t->slot != 0)
+                timer_unlink (tw, t);
+}
+
+/*
+ * Move the wheel on to "now", calling "fire" for each timer that is
+ * due.  A timer is off the wheel by then and may be set again.
+ */
+void timer_wheel_run (struct timer_wheel *tw, time_t now,
+                      timer_func fire, void *data)
+{
+        struct timer_entry *t, *next;
+        time_t tick;
+
+        if (now <= tw->now)
+                return;
+
+        /* Once round the wheel covers every slot. */
+        tick = tw->now;
+        if (now - tick > TIMER_SLOTS)
+                tick = now - TIMER_SLOTS;
+
+        while (tick < now) {
+                tick++;
+                for (t = tw->slots[tick % TIMER_SLOTS]; t; t = next) {
+                        next = t->next;
+                        if (t->slot > tick)
+                                continue;
+                        timer_unlink (tw, t);
+                        timer_link (tw, t, t->expires >= tick ?
+                                    t->expires + 1 : TIMER_FIRING);
+                }
+
+                tw->now = tick;
+                while ((t = tw->firing) != NULL) {
+                        timer_unlink (tw, t);
+                        t->fired = TRUE;
+                        fire (t, data);
+                }
+        }
+}
+
+/*
+ * How many seconds a phase may take.
+ */
+unsigned int timeout_for (unsigned int phase)
+{
+        unsigned int secs;
+
+        switch (phase) {
+        case TIMEOUT_HEAD:
+                secs = config->head_timeout;
+                break;
+        case TIMEOUT_DNS:
+                secs = config->dns_timeout;
+                break;
+        case TIMEOUT_CONNECT:
+                secs = config->connect_timeout;
+                break;
+        case TIMEOUT_HANDSHAKE:
+                secs = config->handshake_timeout;
+                break;
+        case TIMEOUT_RESPONSE:
+                secs = config->response_timeout;
+                break;
+        case TIMEOUT_LINGER:
+                return config->reject_linger;
+        default:
+                secs = 0;
+        }
+
+        return secs > 0 ? secs : config->idletimeout;
+}
+
+const char *timeout_name (unsigned int phase)
+{
+        return phase < TIMEOUT_PHASES ? timeout_names[phase] : "Linger";
+}
+
+/*
+ * The watchdog of the "threads" model.
+ */
+static struct timer_wheel watchdog;
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t watchdog_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Wake up the connection's thread: a read of the request head sees the
+ * end of it, and anything on the server connection fails.
+ */
+static void watchdog_fire (struct timer_entry *t, void *data)
+{
+        struct conn_s *connptr = (struct conn_s *) t->owner;
+
+        (void) data;
+        if (t->phase == TIMEOUT_HEAD)
+                shutdown (connptr->client_fd, SHUT_RD);
+        else if (connptr->server_fd >= 0)
+                shutdown (connptr->server_fd, SHUT_RDWR);
+}
+
+static void *watchdog_thread (void *arg)
+{
+        (void) arg;
+
+        for (;;) {
+                sleep (1);
+                pthread_mutex_lock (&watchdog_lock);
+                timer_wheel_run (&watchdog, time (NULL), watchdog_fire, NULL);
+                pthread_mutex_unlock (&watchdog_lock);
+        }
+
+        return NULL;
+}
+
+static void watchdog_start (void)
+{
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        timer_wheel_init (&watchdog, time (NULL));
+
+        pthread_attr_init (&attr);
+        pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create (&thread, &attr, watchdog_thread, NULL) != 0)
+                log_message (LOG_WARNING, "Could not start the watchdog "
+                             "thread; phase timeouts are not enforced");
+        pthread_attr_destroy (&attr);
+}
+
+/*
+ * Give the connection's thread until the timeout of "phase" to get
+ * through it.
+ */
+void deadline_set (struct conn_s *connptr, unsigned int phase)
+{
+        pthread_once (&watchdog_once, watchdog_start);
+
+        pthread_mutex_lock (&watchdog_lock);
+        connptr->deadline.owner = connptr;
+        timer_set (&watchdog, &connptr->deadline, phase,
+                   time (NULL) + timeout_for (phase));
+        pthread_mutex_unlock (&watchdog_lock);
+}
+
+/*
+ * The phase is over.  Returns 1 if it ran out of time, in which case
+ * the socket it was waiting on has been shut down.
+ */
+int deadline_clear (struct conn_s *connptr)
+{
+        int fired;
+
+        pthread_mutex_lock (&watchdog_lock);
+        timer_cancel (&watchdog, &connptr->deadline);
+        fired = connptr->deadline.fired;
+        connptr->deadline.fired = FALSE;
+        pthread_mutex_unlock (&watchdog_lock);
+
+        return fired;
+}
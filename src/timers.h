@@ -0,0 +1,78 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'timers.c' for detailed information. */
+
+#ifndef TINYPROXY_TIMERS_H
+#define TINYPROXY_TIMERS_H
+
+#include "common.h"
+
+/*
+ * The phases of a connection that have a timeout of their own.
+ */
+enum timeout_phase {
+        TIMEOUT_HEAD,           /* reading the request head */
+        TIMEOUT_DNS,            /* looking up the server's name */
+        TIMEOUT_CONNECT,        /* connecting to the server */
+        TIMEOUT_HANDSHAKE,      /* the handshake with an upstream proxy */
+        TIMEOUT_RESPONSE,       /* waiting for the response to begin */
+        TIMEOUT_IDLE,           /* nothing relayed, or no next request */
+        TIMEOUT_PHASES,
+        TIMEOUT_LINGER = TIMEOUT_PHASES /* a client turned away (not
+                                           counted) */
+};
+
+#define TIMER_SLOTS     256
+
+struct timer_entry {
+        struct timer_entry *prev, *next;
+        time_t expires;
+        time_t slot;            /* when its slot comes up, 0: not set */
+        unsigned int phase;     /* enum timeout_phase */
+        unsigned int fired;     /* boolean: went off since it was set */
+        void *owner;
+};
+
+/*
+ * A wheel of one second slots, each holding the timers that expire
+ * when it comes up (or TIMER_SLOTS seconds later, and so on.)
+ */
+struct timer_wheel {
+        struct timer_entry *slots[TIMER_SLOTS];
+        struct timer_entry *firing;     /* due, about to go off */
+        time_t now;             /* the last second handled */
+};
+
+typedef void (*timer_func) (struct timer_entry *t, void *data);
+
+extern void timer_wheel_init (struct timer_wheel *tw, time_t now);
+extern void timer_set (struct timer_wheel *tw, struct timer_entry *t,
+                       unsigned int phase, time_t expires);
+extern void timer_cancel (struct timer_wheel *tw, struct timer_entry *t);
+extern void timer_wheel_run (struct timer_wheel *tw, time_t now,
+                             timer_func fire, void *data);
+
+extern unsigned int timeout_for (unsigned int phase);
+extern const char *timeout_name (unsigned int phase);
+
+struct conn_s;
+extern void deadline_set (struct conn_s *connptr, unsigned int phase);
+extern int deadline_clear (struct conn_s *connptr);
+
+#endif
@@ -62,7 +62,7 @@ do_transparent_proxy (struct conn_s *connptr, pseudomap *hashofheaders,
         size_t ulen = strlen (*url);
         size_t i;
 
-        data = pseudomap_find (hashofheaders, "host");
+        data = pseudomap_find_id (hashofheaders, HDR_host);
         if (!data) {
                 union sockaddr_union dest_addr;
                 const void *dest_inaddr;
@@ -29,8 +29,16 @@
 #include "log.h"
 #include "base64.h"
 #include "basicauth.h"
+#include "origin-pool.h"
+#include <pthread.h>
 
 #ifdef UPSTREAM_SUPPORT
+
+/* After this many failed requests in a row an upstream proxy is down. */
+#define UPSTREAM_MAX_FAILURES 3
+
+static pthread_mutex_t upstream_health_lock = PTHREAD_MUTEX_INITIALIZER;
+
 const char *
 proxy_type_name(proxy_type type)
 {
@@ -74,6 +82,7 @@ static struct upstream *upstream_build (const char *host, int port, char *domain
         }
 
         up->type = type;
+        up->failures = 0;
         up->target.type = HST_NONE;
         up->host = up->ua.user = up->pass = NULL;
         if (user) {
@@ -223,6 +232,48 @@ struct upstream *upstream_get (char *host, struct upstream *up)
         return up;
 }
 
+/*
+ * Keep track of whether an upstream proxy answers.  Once requests
+ * through it failed UPSTREAM_MAX_FAILURES times in a row, the idle
+ * connections to it are closed, and no more are kept until it answers
+ * again.
+ */
+void upstream_report (struct upstream *up, int ok)
+{
+        unsigned int failures;
+
+        pthread_mutex_lock (&upstream_health_lock);
+        failures = up->failures;
+        up->failures = ok ? 0 : failures + 1;
+        pthread_mutex_unlock (&upstream_health_lock);
+
+        if (ok && failures >= UPSTREAM_MAX_FAILURES) {
+                log_message (LOG_NOTICE, "Upstream proxy %s:%d is back up",
+                             up->host, up->port);
+        } else if (!ok && failures + 1 == UPSTREAM_MAX_FAILURES) {
+                log_message (LOG_WARNING,
+                             "Upstream proxy %s:%d is down after %u "
+                             "failed requests", up->host, up->port,
+                             failures + 1);
+                if (up->type == PT_HTTP)
+                        origin_pool_flush (up->host, up->port, TRUE);
+        }
+}
+
+/*
+ * Tell whether the last requests through an upstream proxy went well.
+ */
+int upstream_healthy (struct upstream *up)
+{
+        int healthy;
+
+        pthread_mutex_lock (&upstream_health_lock);
+        healthy = up->failures < UPSTREAM_MAX_FAILURES;
+        pthread_mutex_unlock (&upstream_health_lock);
+
+        return healthy;
+}
+
 void free_upstream_list (struct upstream *up)
 {
         while (up) {
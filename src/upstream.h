@@ -60,6 +60,7 @@ struct upstream {
         int port;
         struct hostspec target;
         proxy_type type;
+        unsigned int failures;  /* requests in a row it failed */
 };
 
 #ifdef UPSTREAM_SUPPORT
@@ -70,6 +71,8 @@ extern enum upstream_build_error upstream_add (
                           proxy_type type, struct upstream **upstream_list);
 extern struct upstream *upstream_get (char *host, struct upstream *up);
 extern void free_upstream_list (struct upstream *up);
+extern void upstream_report (struct upstream *up, int ok);
+extern int upstream_healthy (struct upstream *up);
 extern const char* upstream_build_error_string(enum upstream_build_error);
 #endif /* UPSTREAM_SUPPORT */
 
@@ -0,0 +1,227 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Just enough of an io_uring to drive the event engine, talking to the
+ * kernel directly so that no extra library is needed: poll, accept,
+ * cancel and timeout requests, no data transfer.  A ring is a pair
+ * of queues shared with the kernel: requests (SQEs) are queued on the
+ * submission side and handed over in batches by uring_submit(), which can
+ * also wait for completions (CQEs) to show up on the other side.
+ *
+ * A ring belongs to one thread; nothing here is locked.
+ */
+
+#include "main.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+#define load_acquire(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+
+int uring_init (struct uring *ring, unsigned int entries)
+{
+        struct io_uring_params p;
+        char *sq, *cq;
+        unsigned int i;
+
+        memset (ring, 0, sizeof (*ring));
+        memset (&p, 0, sizeof (p));
+
+        ring->fd = (int) syscall (__NR_io_uring_setup, entries, &p);
+        if (ring->fd < 0)
+                return -1;
+
+        ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+        ring->cq_map_size = p.cq_off.cqes
+                + p.cq_entries * sizeof (struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_map_size > ring->sq_map_size)
+                        ring->sq_map_size = ring->cq_map_size;
+                ring->cq_map_size = ring->sq_map_size;
+        }
+
+        ring->sq_map = mmap (NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_SQ_RING);
+        if (ring->sq_map == MAP_FAILED)
+                goto fail;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                ring->cq_map = ring->sq_map;
+        else {
+                ring->cq_map = mmap (NULL, ring->cq_map_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd,
+                                     IORING_OFF_CQ_RING);
+                if (ring->cq_map == MAP_FAILED)
+                        goto fail;
+        }
+
+        ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+        ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+                goto fail;
+
+        sq = ring->sq_map;
+        ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+        ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+        ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+        ring->sq_entries = p.sq_entries;
+        ring->sq_queued = *ring->sq_tail;
+
+        cq = ring->cq_map;
+        ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+        ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+        ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+        /* SQE i always goes into slot i. */
+        for (i = 0; i < ring->sq_entries; i++)
+                ring->sq_array[i] = i;
+
+        return 0;
+
+fail:
+        uring_exit (ring);
+        return -1;
+}
+
+void uring_exit (struct uring *ring)
+{
+        if (ring->sqes && ring->sqes != MAP_FAILED)
+                munmap (ring->sqes, ring->sqes_size);
+        if (ring->cq_map && ring->cq_map != MAP_FAILED
+            && ring->cq_map != ring->sq_map)
+                munmap (ring->cq_map, ring->cq_map_size);
+        if (ring->sq_map && ring->sq_map != MAP_FAILED)
+                munmap (ring->sq_map, ring->sq_map_size);
+        if (ring->fd >= 0)
+                close (ring->fd);
+        memset (ring, 0, sizeof (*ring));
+        ring->fd = -1;
+}
+
+/*
+ * Hand the queued requests to the kernel and, if "wait_nr" is not 0, wait
+ * until that many completions are available.  Returns -1 with errno set
+ * on error.
+ */
+int uring_submit (struct uring *ring, unsigned int wait_nr)
+{
+        unsigned int to_submit;
+        int ret;
+
+        store_release (ring->sq_tail, ring->sq_queued);
+        to_submit = ring->sq_queued - load_acquire (ring->sq_head);
+
+        do {
+                ret = (int) syscall (__NR_io_uring_enter, ring->fd, to_submit,
+                                     wait_nr,
+                                     wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                                     NULL, 0);
+        } while (ret < 0 && errno == EINTR && wait_nr == 0);
+
+        return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Return a cleared request to fill in, submitting what is queued first if
+ * the submission queue is full.  Returns NULL if there is no room at all.
+ */
+struct io_uring_sqe *uring_get_sqe (struct uring *ring)
+{
+        struct io_uring_sqe *sqe;
+
+        if (ring->sq_queued - load_acquire (ring->sq_head) >= ring->sq_entries
+            && (uring_submit (ring, 0) < 0
+                || ring->sq_queued - load_acquire (ring->sq_head)
+                   >= ring->sq_entries))
+                return NULL;
+
+        sqe = &ring->sqes[ring->sq_queued & *ring->sq_mask];
+        ring->sq_queued++;
+        memset (sqe, 0, sizeof (*sqe));
+        return sqe;
+}
+
+/*
+ * Return the oldest completion not yet seen, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe (struct uring *ring)
+{
+        unsigned int head = *ring->cq_head;
+
+        if (head == load_acquire (ring->cq_tail))
+                return NULL;
+        return &ring->cqes[head & *ring->cq_mask];
+}
+
+/*
+ * Mark the completion returned by uring_peek_cqe() as consumed.
+ */
+void uring_cqe_seen (struct uring *ring)
+{
+        store_release (ring->cq_head, *ring->cq_head + 1);
+}
+
+#else /* no io_uring system calls */
+
+int uring_init (struct uring *ring, unsigned int entries)
+{
+        memset (ring, 0, sizeof (*ring));
+        ring->fd = -1;
+        errno = ENOSYS;
+        return -1;
+}
+
+void uring_exit (struct uring *ring)
+{
+}
+
+struct io_uring_sqe *uring_get_sqe (struct uring *ring)
+{
+        return NULL;
+}
+
+int uring_submit (struct uring *ring, unsigned int wait_nr)
+{
+        errno = ENOSYS;
+        return -1;
+}
+
+struct io_uring_cqe *uring_peek_cqe (struct uring *ring)
+{
+        return NULL;
+}
+
+void uring_cqe_seen (struct uring *ring)
+{
+}
+
+#endif
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,54 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ * This file: Copyright (C) 2026 tinyproxy contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'uring.c' for detailed information. */
+
+#ifndef TINYPROXY_URING_H
+#define TINYPROXY_URING_H
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+
+struct uring {
+        int fd;
+
+        /* submission queue, shared with the kernel */
+        unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned int sq_entries;
+        struct io_uring_sqe *sqes;
+        unsigned int sq_queued;         /* our tail, not yet published */
+
+        /* completion queue, shared with the kernel */
+        unsigned int *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void *sq_map, *cq_map;
+        size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+extern int uring_init (struct uring *ring, unsigned int entries);
+extern void uring_exit (struct uring *ring);
+extern struct io_uring_sqe *uring_get_sqe (struct uring *ring);
+extern int uring_submit (struct uring *ring, unsigned int wait_nr);
+extern struct io_uring_cqe *uring_peek_cqe (struct uring *ring);
+extern void uring_cqe_seen (struct uring *ring);
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif
@@ -0,0 +1,238 @@
+#!/usr/bin/perl -w
+
+# Benchmark for CONNECT tunnel throughput.
+#
+# Starts a data source and runs tinyproxy once with "Splice No" and once
+# with "Splice Yes", pulling the same amount of data through CONNECT
+# tunnels each time.  Reports the throughput and the CPU time tinyproxy
+# used for it.
+#
+# This file: Copyright (C) 2026 tinyproxy contributors
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+use strict;
+
+use IO::Socket;
+use POSIX ":sys_wait_h";
+use Time::HiRes qw(time sleep);
+use File::Temp qw(tempdir);
+use FindBin;
+use Getopt::Long;
+use Pod::Usage;
+
+my $EOL = "\015\012";
+
+my $tinyproxy = "$FindBin::Bin/../../src/tinyproxy";
+my $megabytes = 1024;
+my $streams = 4;
+my $engine = "threads";
+my $proxy_port = 12322;
+my $source_port = 32124;
+my $help = 0;
+
+sub process_options() {
+	my $result = GetOptions("help|?" => \$help,
+				"tinyproxy=s" => \$tinyproxy,
+				"megabytes=i" => \$megabytes,
+				"streams=i" => \$streams,
+				"engine=s" => \$engine,
+				"proxy-port=i" => \$proxy_port,
+				"source-port=i" => \$source_port);
+	die "Error reading cmdline options! $!" unless $result;
+
+	pod2usage(1) if $help;
+}
+
+# Serve $bytes of data to every client that connects, then close.
+sub start_source($) {
+	my $bytes = shift;
+
+	my $server = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					   LocalPort => $source_port,
+					   Proto => "tcp",
+					   ReuseAddr => 1,
+					   Listen => 64)
+		or die "Could not listen on port $source_port: $!";
+
+	my $pid = fork();
+	die "fork: $!" unless defined $pid;
+	return $pid if $pid;
+
+	$SIG{CHLD} = "IGNORE";
+	my $chunk = "x" x 65536;
+	while (my $client = $server->accept()) {
+		next if fork();
+		my $left = $bytes;
+		while ($left > 0) {
+			my $len = $left < length($chunk) ? $left : length($chunk);
+			my $n = syswrite($client, $chunk, $len);
+			last unless defined $n;
+			$left -= $n;
+		}
+		close($client);
+		exit(0);
+	}
+	exit(0);
+}
+
+sub start_tinyproxy($$) {
+	my ($dir, $splice) = @_;
+	my $user = getpwuid($<);
+
+	open(my $conf, ">", "$dir/tinyproxy.conf") or die "$dir: $!";
+	print $conf <<EOF;
+User $user
+Port $proxy_port
+Listen 127.0.0.1
+Timeout 60
+MaxClients 100
+Allow 127.0.0.1
+ConnectPort $source_port
+LogLevel Warning
+Logfile "$dir/tinyproxy.log"
+IOEngine $engine
+Splice $splice
+EOF
+	close($conf);
+
+	my $pid = fork();
+	die "fork: $!" unless defined $pid;
+	if (!$pid) {
+		exec($tinyproxy, "-d", "-c", "$dir/tinyproxy.conf");
+		die "exec $tinyproxy: $!";
+	}
+
+	for (1 .. 50) {
+		my $s = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+					      PeerPort => $proxy_port,
+					      Proto => "tcp");
+		if ($s) {
+			close($s);
+			return $pid;
+		}
+		sleep(0.1);
+	}
+	die "tinyproxy did not come up";
+}
+
+# CPU seconds (user + system) used by a process so far.
+sub cpu_seconds($) {
+	my $pid = shift;
+
+	open(my $stat, "<", "/proc/$pid/stat") or return 0;
+	my @f = split(/\s+/, (split(/\)\s+/, <$stat>))[1]);
+	close($stat);
+	return ($f[11] + $f[12]) / POSIX::sysconf(POSIX::_SC_CLK_TCK);
+}
+
+# Pull $bytes through one tunnel; returns the number of bytes received.
+sub tunnel($) {
+	my $bytes = shift;
+
+	my $s = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+				      PeerPort => $proxy_port,
+				      Proto => "tcp")
+		or die "Could not connect to tinyproxy: $!";
+	print $s "CONNECT 127.0.0.1:$source_port HTTP/1.0$EOL$EOL";
+
+	my $head = "";
+	while ($head !~ /\r\n\r\n/) {
+		my $n = sysread($s, $head, 1, length($head));
+		die "tunnel was not established" unless $n;
+	}
+	die "tunnel was not established: $head" unless $head =~ m{^HTTP/1\.\d 200};
+
+	my ($buf, $got) = ("", 0);
+	while (my $n = sysread($s, $buf, 262144)) {
+		$got += $n;
+	}
+	close($s);
+	return $got;
+}
+
+sub run($$) {
+	my ($splice, $per_stream) = @_;
+	my $dir = tempdir(CLEANUP => 1);
+	my $tp = start_tinyproxy($dir, $splice);
+	my $cpu = cpu_seconds($tp);
+	my $start = time();
+
+	my @kids;
+	for (1 .. $streams) {
+		my $pid = fork();
+		die "fork: $!" unless defined $pid;
+		if (!$pid) {
+			exit(tunnel($per_stream) == $per_stream ? 0 : 1);
+		}
+		push(@kids, $pid);
+	}
+	my $failed = 0;
+	for my $pid (@kids) {
+		waitpid($pid, 0);
+		$failed++ if $?;
+	}
+
+	my $elapsed = time() - $start;
+	$cpu = cpu_seconds($tp) - $cpu;
+	kill("TERM", $tp);
+	waitpid($tp, 0);
+
+	die "$failed tunnel(s) did not receive all data" if $failed;
+
+	printf("Splice %-3s %8.1f MB/s  %6.2f s CPU  (%.2f s CPU per GB)\n",
+	       $splice, $megabytes / $elapsed, $cpu,
+	       $cpu * 1024 / $megabytes);
+}
+
+# "main"
+
+process_options();
+
+my $per_stream = int($megabytes * 1048576 / $streams);
+my $source = start_source($per_stream);
+
+print "Relaying $megabytes MB over $streams CONNECT tunnel(s) ($engine):\n";
+eval {
+	run("No", $per_stream);
+	run("Yes", $per_stream);
+};
+my $error = $@;
+
+kill("TERM", $source);
+waitpid($source, 0);
+die $error if $error;
+
+exit(0);
+
+__END__
+
+=head1 bench_connect.pl
+
+bench_connect.pl - compare CONNECT tunnel throughput with and without splice
+
+=head1 SYNOPSIS
+
+bench_connect.pl [options]
+
+ Options:
+   --tinyproxy=PATH	tinyproxy binary (default: the one in src/)
+   --megabytes=N	total amount of data to relay (default: 1024)
+   --streams=N		number of tunnels used in parallel (default: 4)
+   --engine=E		IOEngine to use, threads or epoll (default: threads)
+   --proxy-port=P	port for tinyproxy to listen on (default: 12322)
+   --source-port=P	port for the data source (default: 32124)
+   --help		show this help
+
+=cut
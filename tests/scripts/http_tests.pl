@@ -0,0 +1,1457 @@
+#!/usr/bin/perl -w
+
+# Functional tests of how tinyproxy handles HTTP messages.
+#
+# Starts a test web server and a tinyproxy of its own, sends requests
+# byte for byte as written here, and checks what comes back and what
+# happens to the connections on either side.  The web server, on
+# 127.0.0.1 and on ::1, numbers its connections, tells in an X-Conn
+# header which one a response came over, and keeps the state of each
+# in a file ("<requests> open" or "<requests> closed"), so that tests
+# can see whether tinyproxy kept, reused or closed a server connection.
+#
+# tinyproxy looks names up with a stub name server, which answers as
+# the first label of the name says and logs every question it gets,
+# and goes through a stub SOCKS5 proxy for the names under socks.test.
+# There is a single engine worker, for the tests to show when it is
+# held up.
+#
+# This file: Copyright (C) 2026 tinyproxy contributors
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+use strict;
+
+use IO::Socket;
+use IO::Socket::IP;
+use IO::Select;
+use Socket qw(AF_INET6 inet_pton);
+use Time::HiRes qw(time sleep);
+use File::Temp qw(tempdir);
+use FindBin;
+use Getopt::Long;
+use Pod::Usage;
+
+my $EOL = "\015\012";
+
+my $tinyproxy = "$FindBin::Bin/../../src/tinyproxy";
+my $engine = "threads";
+my $proxy_port = 12324;
+my $server_port = 32126;
+my $dns_port = 32153;
+my $socks_port = 32154;
+my $help = 0;
+
+my $dir;
+my $origin;
+my $proxy;
+my %pending;	# what was read from a socket past the last message
+
+sub process_options() {
+	my $result = GetOptions("help|?" => \$help,
+				"tinyproxy=s" => \$tinyproxy,
+				"engine=s" => \$engine,
+				"proxy-port=i" => \$proxy_port,
+				"server-port=i" => \$server_port,
+				"dns-port=i" => \$dns_port,
+				"socks-port=i" => \$socks_port);
+	die "Error reading cmdline options! $!" unless $result;
+
+	pod2usage(1) if $help;
+
+	$origin = "http://127.0.0.1:$server_port";
+}
+
+#
+# Reading messages, for both the client and the server side.
+#
+
+# Read more from a socket; returns 0 at its end, undef on timeout.
+sub fill($$) {
+	my ($s, $timeout) = @_;
+	my $fd = fileno($s);
+
+	$pending{$fd} = "" unless defined $pending{$fd};
+	return undef unless IO::Select->new($s)->can_read($timeout);
+	my $n = sysread($s, $pending{$fd}, 65536, length($pending{$fd}));
+	return $n || 0;
+}
+
+sub take($$) {
+	my ($s, $len) = @_;
+
+	return substr($pending{fileno($s)}, 0, $len, "");
+}
+
+# The next message head, or undef if none comes.
+sub read_head($$) {
+	my ($s, $timeout) = @_;
+	my $fd = fileno($s);
+
+	while (!defined $pending{$fd} || $pending{$fd} !~ /\r\n\r\n/) {
+		return undef unless fill($s, $timeout);
+	}
+	return take($s, index($pending{$fd}, "$EOL$EOL") + 4);
+}
+
+sub parse_head($) {
+	my $head = shift;
+	my ($line, @fields) = split(/\r\n/, $head);
+	my %headers;
+
+	foreach my $field (@fields) {
+		my ($name, $value) = $field =~ /^([^:]+):[ \t]*(.*?)[ \t]*$/
+			or next;
+		$name = lc($name);
+		$headers{$name} = defined $headers{$name}
+			? "$headers{$name}, $value" : $value;
+	}
+	return ($line, \%headers);
+}
+
+sub read_bytes($$$) {
+	my ($s, $len, $timeout) = @_;
+	my $fd = fileno($s);
+
+	while (length($pending{$fd}) < $len) {
+		die "short body\n" unless fill($s, $timeout);
+	}
+	return take($s, $len);
+}
+
+sub read_line($$) {
+	my ($s, $timeout) = @_;
+	my $fd = fileno($s);
+
+	while ($pending{$fd} !~ /\n/) {
+		die "short chunk line\n" unless fill($s, $timeout);
+	}
+	return take($s, index($pending{$fd}, "\n") + 1);
+}
+
+# The body after a head: by Content-Length, in chunks, or (for a
+# response) up to the end of the connection.
+sub read_body($$$$) {
+	my ($s, $headers, $request, $timeout) = @_;
+	my $te = $headers->{"transfer-encoding"};
+	my $body = "";
+
+	if (defined $te && $te =~ /chunked\s*$/i) {
+		while (1) {
+			my ($size) = read_line($s, $timeout) =~ /^([0-9a-f]+)/i;
+			die "bad chunk line\n" unless defined $size;
+			$size = hex($size);
+			if ($size == 0) {
+				1 while read_line($s, $timeout) ne $EOL;
+				last;
+			}
+			$body .= read_bytes($s, $size, $timeout);
+			read_bytes($s, 2, $timeout);
+		}
+	} elsif (defined $headers->{"content-length"}) {
+		$body = read_bytes($s, $headers->{"content-length"}, $timeout);
+	} elsif (!$request) {
+		1 while fill($s, $timeout);
+		$body = take($s, length($pending{fileno($s)}));
+	}
+	return $body;
+}
+
+# A response, as { status, line, headers, body }, or undef if none
+# comes.  The body of a response to HEAD is not read.
+sub read_response($;$$) {
+	my ($s, $timeout, $method) = @_;
+	$timeout = 10 unless defined $timeout;
+
+	my $head = read_head($s, $timeout);
+	return undef unless defined $head;
+
+	my ($line, $headers) = parse_head($head);
+	my ($status) = $line =~ m{^HTTP/\d\.\d (\d{3})} or return undef;
+	my $body = "";
+	$body = read_body($s, $headers, 0, $timeout)
+		unless ($method && $method eq "HEAD") || $status < 200
+			|| $status == 204 || $status == 304;
+
+	return { status => $status, line => $line, headers => $headers,
+		 body => $body };
+}
+
+# Whether the other end closes the connection within $timeout seconds.
+sub closed($$) {
+	my ($s, $timeout) = @_;
+	my $end = time() + $timeout;
+
+	while (time() < $end) {
+		my $n = fill($s, $end - time());
+		return 1 if defined $n && $n == 0;
+	}
+	return 0;
+}
+
+#
+# The test web server.
+#
+
+sub conn_state($) {
+	my $id = shift;
+
+	open(my $f, "<", "$dir/conn.$id") or return "";
+	my $state = <$f>;
+	close($f);
+	return defined $state ? $state : "";
+}
+
+# Wait for a server connection to be closed (by tinyproxy).
+sub server_closed($$) {
+	my ($id, $timeout) = @_;
+	my $end = time() + $timeout;
+
+	do {
+		return 1 if conn_state($id) =~ /closed/;
+		sleep(0.1);
+	} while (time() < $end);
+	return 0;
+}
+
+# Canned responses for /raw/<name>; X-Conn is added after the status
+# line.
+my %raw = (
+	"te-cl" => "HTTP/1.1 200 OK$EOL"
+		. "Transfer-Encoding: chunked$EOL"
+		. "Content-Length: 3$EOL$EOL"
+		. "3${EOL}abc${EOL}0$EOL$EOL",
+	"dup-cl" => "HTTP/1.1 200 OK$EOL"
+		. "Content-Length: 3$EOL"
+		. "Content-Length: 3$EOL$EOL"
+		. "abc",
+	"bad-cl" => "HTTP/1.1 200 OK$EOL"
+		. "Content-Length: +3$EOL$EOL"
+		. "abc",
+	"te-gzip" => "HTTP/1.1 200 OK$EOL"
+		. "Transfer-Encoding: gzip$EOL$EOL"
+		. "abc",
+	"lf-chunks" => "HTTP/1.1 200 OK$EOL"
+		. "Transfer-Encoding: chunked$EOL$EOL"
+		. "3\nabc\n0\n\n",
+	"folded" => "HTTP/1.1 200 OK$EOL"
+		. "X-Folded: one$EOL"
+		. " \t two$EOL"
+		. "Content-Length: 3$EOL$EOL"
+		. "abc",
+	"eof" => "HTTP/1.1 200 OK$EOL$EOL"
+		. "abc",
+	"ntlm" => "HTTP/1.1 401 Unauthorized$EOL"
+		. "WWW-Authenticate: Basic realm=\"test\"$EOL"
+		. "WWW-Authenticate: NTLM$EOL"
+		. "Content-Length: 0$EOL$EOL",
+	"te-space" => "HTTP/1.1 200 OK$EOL"
+		. "Transfer-Encoding : chunked$EOL"
+		. "Content-Length: 3$EOL$EOL"
+		. "3${EOL}abc${EOL}0$EOL$EOL",
+);
+
+# Those after which the server closes the connection.
+my %raw_close = ("te-gzip" => 1, "lf-chunks" => 1, "eof" => 1);
+
+# /drop closes the connection a moment after the response, without
+# saying so; after /vanish the next request on the connection is not
+# answered.  /slow is answered after four seconds, and /peer with the
+# address the connection came from.  A request expecting 100-continue
+# gets it, but for /refuse, which gets 417 instead.
+sub respond($$$$$) {
+	my ($s, $id, $path, $head, $body) = @_;
+	my $close = 0;
+	my $reply;
+
+	if ($path =~ m{^/raw/([\w-]+)} && $raw{$1}) {
+		my $name = $1;
+
+		$reply = $raw{$name};
+		$reply =~ s/\r\n/${EOL}X-Conn: $id$EOL/;
+		syswrite($s, $reply);
+		return $raw_close{$name};
+	}
+
+	if ($path eq "/head") {
+		$reply = $head;
+	} elsif ($path eq "/body") {
+		$reply = $body;
+	} elsif ($path eq "/peer") {
+		$reply = $s->peerhost();
+	} else {
+		$reply = $id;
+	}
+	$close = 1 if $path eq "/close";
+	sleep(4) if $path eq "/slow";
+
+	syswrite($s, "HTTP/1.1 200 OK${EOL}X-Conn: $id$EOL"
+		 . ($close ? "Connection: close$EOL" : "")
+		 . "Content-Length: " . length($reply) . "$EOL$EOL$reply");
+	if ($path eq "/drop") {
+		sleep(0.2);
+		return 1;
+	}
+	return $close;
+}
+
+sub serve($$) {
+	my ($s, $id) = @_;
+	my $served = 0;
+	my $state = sub {
+		open(my $f, ">", "$dir/conn.$id") or return;
+		print $f "$served $_[0]";
+		close($f);
+	};
+
+	$state->("open");
+	eval {
+		my $vanish = 0;
+
+		while (defined(my $head = read_head($s, 30))) {
+			my ($line, $headers) = parse_head($head);
+			my (undef, $path) = split(/ /, $line);
+			$path =~ s{^http://[^/]*}{};
+
+			if (($headers->{expect} || "") =~ /100-continue/i) {
+				if ($path eq "/refuse") {
+					syswrite($s, "HTTP/1.1 417 Expectation "
+						 . "Failed${EOL}X-Conn: $id$EOL"
+						 . "Content-Length: 0$EOL$EOL");
+					last;
+				}
+				syswrite($s, "HTTP/1.1 100 Continue$EOL$EOL");
+			}
+			my $body = read_body($s, $headers, 1, 30);
+			last if $vanish;
+			$vanish = $path eq "/vanish";
+			$served++;
+			$state->("open");
+			last if respond($s, $id, $path, $head, $body);
+		}
+	};
+	$state->("closed");
+	close($s);
+}
+
+sub start_server($) {
+	my $addr = shift;
+	my $server = IO::Socket::IP->new(LocalHost => $addr,
+					 LocalPort => $server_port,
+					 Proto => "tcp",
+					 ReuseAddr => 1,
+					 Listen => 64)
+		or die "Could not listen on $addr port $server_port: $!";
+
+	my $pid = fork();
+	die "fork: $!" unless defined $pid;
+	if ($pid) {
+		close($server);
+		return $pid;
+	}
+
+	# killed along with the connections it serves
+	setpgrp(0, 0);
+	$SIG{CHLD} = "IGNORE";
+	my $id = 0;
+	while (1) {
+		my $client = $server->accept() or next;
+		$id++;
+		if (fork()) {
+			close($client);
+			next;
+		}
+		close($server);
+		serve($client, $id);
+		exit(0);
+	}
+}
+
+#
+# The stub name server.  Every name has the address 127.0.0.1 and no
+# IPv6 one, except for:
+#
+#   nx.*	does not exist
+#   tc.*	the answer is truncated
+#   spoof.*	an answer with another ID and address comes first
+#   silent.*	no answer at all
+#   nul.*	an answer for the name with NUL bytes added to its last
+#		label, and another address, comes first
+#
+# and those in %dns_addrs, with several addresses.
+#
+
+# The addresses of a name, by its first label: the IPv4 ones and the
+# IPv6 ones.  Nothing listens on the port of the web server at
+# 127.0.0.4; the tests turn the others into black holes.
+my %dns_addrs = (
+	"blackhole" => [ [ "127.0.0.3", "127.0.0.1" ], [] ],
+	"refused" => [ [ "127.0.0.4", "127.0.0.1" ], [] ],
+	"families" => [ [ "127.0.0.5", "127.0.0.6" ], [ "::1" ] ],
+);
+
+sub dns_question($) {
+	my $pkt = shift;
+	my ($off, @labels) = (12);
+
+	while ($off < length($pkt)) {
+		my $len = ord(substr($pkt, $off, 1));
+		last if $len == 0;
+		push(@labels, substr($pkt, $off + 1, $len));
+		$off += $len + 1;
+	}
+	my $type = unpack("n", substr($pkt, $off + 1, 2));
+	return (lc(join(".", @labels)), $type, substr($pkt, 12, $off + 5 - 12));
+}
+
+sub dns_reply(@) {
+	my ($id, $flags, $question, $ns, @answers) = @_;
+
+	return pack("n6", $id, 0x8180 | $flags, 1, scalar(@answers),
+		    $ns ? 1 : 0, 0)
+		. $question . join("", @answers) . ($ns || "");
+}
+
+# The question with two NUL bytes added to the last label of its name.
+sub dns_padded($) {
+	my $question = shift;
+	my ($off, $last) = (0, 0);
+
+	while (my $len = ord(substr($question, $off, 1))) {
+		$last = $off;
+		$off += $len + 1;
+	}
+	return substr($question, 0, $last)
+		. chr(ord(substr($question, $last, 1)) + 2)
+		. substr($question, $last + 1, $off - $last - 1) . "\0\0"
+		. substr($question, $off);
+}
+
+sub dns_a($) {
+	return pack("n3Nn", 0xc00c, 1, 1, 60, 4) . inet_aton(shift);
+}
+
+sub dns_aaaa($) {
+	return pack("n3Nn", 0xc00c, 28, 1, 60, 16) . inet_pton(AF_INET6, shift);
+}
+
+# no such name, for a minute
+my $dns_soa = pack("n3Nn", 0xc00c, 6, 1, 60, 22) . "\0\0"
+	. pack("N5", 1, 2, 3, 4, 60);
+
+sub start_dns() {
+	my $sock = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					 LocalPort => $dns_port,
+					 Proto => "udp")
+		or die "Could not listen on port $dns_port: $!";
+
+	my $pid = fork();
+	die "fork: $!" unless defined $pid;
+	if ($pid) {
+		close($sock);
+		return $pid;
+	}
+
+	open(my $log, ">>", "$dir/dns.log") or die "$dir: $!";
+	$log->autoflush(1);
+	while (1) {
+		my $peer = $sock->recv(my $pkt, 512) or next;
+		next if length($pkt) < 17;
+		my $id = unpack("n", $pkt);
+		my ($name, $type, $question) = dns_question($pkt);
+		my ($port) = sockaddr_in($peer);
+		print $log "$name $type $id $port\n";
+		next if $name =~ /^silent\./;
+
+		my @reply = ($id, 0, $question, undef);
+		my ($first) = split(/\./, $name);
+		if ($dns_addrs{$first}) {
+			push(@reply, $type == 1
+			     ? map { dns_a($_) } @{$dns_addrs{$first}[0]}
+			     : map { dns_aaaa($_) } @{$dns_addrs{$first}[1]});
+		} elsif ($name =~ /^nx\./) {
+			@reply = ($id, 3, $question, $dns_soa);
+		} elsif ($type == 1) {
+			push(@reply, dns_a("127.0.0.1"));
+			$reply[1] = 0x0200 if $name =~ /^tc\./;
+			send($sock, dns_reply($id ^ 1, 0, $question, undef,
+					      dns_a("127.0.0.2")), 0, $peer)
+				if $name =~ /^spoof\./;
+			send($sock, dns_reply($id, 0, dns_padded($question),
+					      undef, dns_a("127.0.0.2")),
+			     0, $peer)
+				if $name =~ /^nul\./;
+		}
+		send($sock, dns_reply(@reply), 0, $peer);
+	}
+}
+
+# The questions the name server got about $name so far, as
+# [ type, id, port ].
+sub dns_questions($) {
+	my $name = shift;
+	my @questions;
+
+	open(my $log, "<", "$dir/dns.log") or return ();
+	while (<$log>) {
+		my ($n, @q) = split;
+		push(@questions, \@q) if $n eq $name;
+	}
+	close($log);
+	return @questions;
+}
+
+#
+# The stub SOCKS5 proxy.  It dribbles its replies out a byte at a
+# time, and then connects through to the test web server, whatever
+# the name asked for.  For the names starting with "stall." it never
+# replies to the connect request.
+#
+
+sub socks_dribble($$) {
+	my ($s, $data) = @_;
+
+	foreach my $byte (split(//, $data)) {
+		syswrite($s, $byte);
+		sleep(0.05);
+	}
+}
+
+sub socks_read($$) {
+	my ($s, $len) = @_;
+	my $data = "";
+
+	while (length($data) < $len) {
+		sysread($s, $data, $len - length($data), length($data))
+			or exit(0);
+	}
+	return $data;
+}
+
+sub socks_serve($) {
+	my $s = shift;
+
+	my (undef, $methods) = unpack("C2", socks_read($s, 2));
+	socks_read($s, $methods);
+	socks_dribble($s, "\x05\x00");
+
+	my (undef, undef, undef, $atyp) = unpack("C4", socks_read($s, 4));
+	exit(0) unless $atyp == 3;
+	my $name = socks_read($s, unpack("C", socks_read($s, 1)));
+	socks_read($s, 2);
+	if ($name =~ /^stall\./) {
+		sleep(30);
+		exit(0);
+	}
+
+	my $server = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+					   PeerPort => $server_port,
+					   Proto => "tcp") or exit(0);
+	socks_dribble($s, "\x05\x00\x00\x03\x04test\x00\x50");
+
+	my $sel = IO::Select->new($s, $server);
+	while (my @ready = $sel->can_read(30)) {
+		foreach my $from (@ready) {
+			my $to = $from == $s ? $server : $s;
+			sysread($from, my $data, 65536) or exit(0);
+			syswrite($to, $data);
+		}
+	}
+	exit(0);
+}
+
+sub start_socks() {
+	my $listener = IO::Socket::INET->new(LocalAddr => "127.0.0.1",
+					     LocalPort => $socks_port,
+					     Proto => "tcp",
+					     ReuseAddr => 1,
+					     Listen => 16)
+		or die "Could not listen on port $socks_port: $!";
+
+	my $pid = fork();
+	die "fork: $!" unless defined $pid;
+	if ($pid) {
+		close($listener);
+		return $pid;
+	}
+
+	setpgrp(0, 0);
+	$SIG{CHLD} = "IGNORE";
+	while (1) {
+		my $client = $listener->accept() or next;
+		if (fork()) {
+			close($client);
+			next;
+		}
+		close($listener);
+		socks_serve($client);
+	}
+}
+
+# Write the configuration, with the lines in $extra added.
+sub write_config(;$) {
+	my $extra = shift;
+	my $user = getpwuid($<);
+
+	open(my $conf, ">", "$dir/tinyproxy.conf") or die "$dir: $!";
+	print $conf <<EOF;
+User $user
+Port $proxy_port
+Listen 127.0.0.1
+Timeout 30
+MaxClients 100
+Allow 127.0.0.1
+LogLevel Info
+Logfile "$dir/tinyproxy.log"
+IOEngine $engine
+Workers 1
+KeepAliveTimeout 2
+OriginIdleTimeout 2
+HeadTimeout 2
+DnsTimeout 2
+ResponseTimeout 2
+DnsServer 127.0.0.1 $dns_port
+Upstream socks5 127.0.0.1:$socks_port ".socks.test"
+Upstream http 127.0.0.1:$server_port ".upstream.test"
+UpstreamIdleTimeout 2
+ConnectAttemptDelay 400
+HandshakeTimeout 2
+Filter "$dir/filter"
+FastReject On
+EOF
+	print $conf $extra if defined $extra;
+	close($conf);
+}
+
+sub start_tinyproxy() {
+	open(my $filter, ">", "$dir/filter") or die "$dir: $!";
+	print $filter "^blocked\\.test\$\n";
+	close($filter);
+
+	write_config();
+	my $pid = fork();
+	die "fork: $!" unless defined $pid;
+	if (!$pid) {
+		exec($tinyproxy, "-d", "-c", "$dir/tinyproxy.conf");
+		die "exec $tinyproxy: $!";
+	}
+
+	for (1 .. 50) {
+		my $s = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+					      PeerPort => $proxy_port,
+					      Proto => "tcp");
+		if ($s) {
+			close($s);
+			return $pid;
+		}
+		sleep(0.1);
+	}
+	die "tinyproxy did not come up";
+}
+
+#
+# The client side.
+#
+
+sub proxy_connect() {
+	my $s = IO::Socket::INET->new(PeerAddr => "127.0.0.1",
+				      PeerPort => $proxy_port,
+				      Proto => "tcp")
+		or die "Could not connect to tinyproxy: $!\n";
+	$pending{fileno($s)} = "";
+	return $s;
+}
+
+# A request for $path on the test web server, with extra header
+# lines and a body.
+sub request($$;$$) {
+	my ($method, $path, $fields, $body) = @_;
+
+	return "$method $origin$path HTTP/1.1$EOL"
+		. "Host: 127.0.0.1:$server_port$EOL"
+		. join("", map { "$_$EOL" } @{$fields || []})
+		. $EOL . (defined $body ? $body : "");
+}
+
+# The status of a request for / on the test web server, by the name
+# given.
+sub named_get($) {
+	my $name = shift;
+
+	my $r = exchange("GET http://$name:$server_port/ HTTP/1.1$EOL"
+			 . "Host: $name:$server_port$EOL$EOL");
+	return $r->{status};
+}
+
+# Write all of $data, however long.
+sub send_all($$) {
+	my ($s, $data) = @_;
+	my $off = 0;
+
+	while ($off < length($data)) {
+		my $n = syswrite($s, $data, length($data) - $off, $off);
+		die "write: $!\n" unless $n;
+		$off += $n;
+	}
+}
+
+# Send $data on a new connection and read one response.
+sub exchange($) {
+	my $data = shift;
+	my $s = proxy_connect();
+
+	send_all($s, $data);
+	my $r = read_response($s);
+	close($s);
+	die "no response\n" unless $r;
+	return $r;
+}
+
+sub expect_status($$) {
+	my ($r, $status) = @_;
+
+	die "no response\n" unless $r;
+	die "got \"$r->{line}\", expected $status\n"
+		unless $r->{status} == $status;
+	return $r;
+}
+
+#
+# The tests, each returning if it passed and dying with the reason if
+# not.
+#
+
+# The header fields of a request as the web server got them.
+sub relayed_fields($) {
+	my $r = expect_status(exchange(shift), 200);
+	my (undef, $headers) = parse_head($r->{body});
+	return $headers;
+}
+
+# Dies unless header field $name came out as $expected (or not at all,
+# if undef).
+sub expect_field($$$) {
+	my ($headers, $name, $expected) = @_;
+	my $value = $headers->{lc($name)};
+
+	return if !defined $value && !defined $expected;
+	die "$name: " . (defined $value ? "\"$value\"" : "missing") . "\n"
+		unless defined $value && defined $expected
+			&& $value eq $expected;
+}
+
+# Send a request on a new connection and check whether the connection
+# is kept open for another one (or closed) after the response.
+sub kept_alive($$) {
+	my ($data, $kept) = @_;
+	my $s = proxy_connect();
+	syswrite($s, $data);
+	my $r = expect_status(read_response($s), 200);
+	my $connection = $r->{headers}{connection} || "";
+
+	if ($kept) {
+		die "Connection: $connection\n"
+			unless $connection =~ /keep-alive/i;
+		syswrite($s, request("GET", "/"));
+		expect_status(read_response($s), 200);
+	} else {
+		die "Connection: $connection\n" unless $connection =~ /close/i;
+		die "client connection kept\n" unless closed($s, 1);
+	}
+	close($s);
+}
+
+# The server connection a response came over.
+sub conn_of($) {
+	my $r = expect_status(exchange(request("GET", shift)), 200);
+	return $r->{headers}{"x-conn"};
+}
+
+# The same for a request through the upstream proxy (the web server)
+# to server $name.
+sub upstream_conn_of($$) {
+	my ($name, $path) = @_;
+	my $r = expect_status(exchange("GET http://$name.upstream.test$path "
+				       . "HTTP/1.1${EOL}"
+				       . "Host: $name.upstream.test$EOL$EOL"),
+			      200);
+	return $r->{headers}{"x-conn"};
+}
+
+# A request turned away with the short response of FastReject, after
+# which the connection is closed even though the client goes on
+# sending.
+sub rejected_fast($$) {
+	my ($data, $status) = @_;
+	my $s = proxy_connect();
+	syswrite($s, $data);
+	my $r = expect_status(read_response($s, 5), $status);
+	my $end = time() + 3;
+
+	die "Content-Type: $r->{headers}{'content-type'}\n"
+		unless $r->{headers}{"content-type"} eq "text/plain";
+	die "Connection: $r->{headers}{connection}\n"
+		unless $r->{headers}{connection} eq "close";
+	while (1) {
+		die "client connection kept\n" if time() > $end;
+		last unless syswrite($s, "more$EOL");
+		my $n = fill($s, 0.2);
+		last if defined $n && $n == 0;
+	}
+	close($s);
+}
+
+# A socket listening on $addr at the port of the web server whose
+# queue of connections is full, so that connects to it get no answer.
+sub blackhole($) {
+	my $addr = shift;
+	my $s = IO::Socket::INET->new(LocalAddr => $addr,
+				      LocalPort => $server_port,
+				      Proto => "tcp",
+				      ReuseAddr => 1,
+				      Listen => 1)
+		or die "Could not listen on $addr port $server_port: $!\n";
+	my @queued = map {
+		IO::Socket::INET->new(PeerAddr => $addr,
+				      PeerPort => $server_port,
+				      Proto => "tcp",
+				      Blocking => 0);
+	} 1 .. 2;
+
+	sleep(0.1);
+	return [ $s, @queued ];
+}
+
+# How long a request to $name, on a connection of its own, took.
+sub connect_time($) {
+	my $name = shift;
+	my $start = time();
+
+	expect_status(exchange("GET http://$name:$server_port/close HTTP/1.1$EOL"
+			       . "Host: $name:$server_port$EOL$EOL"), 200);
+	return time() - $start;
+}
+
+# Have tinyproxy reload its configuration with the lines in $extra
+# added, and give it the time to.
+sub reconfigure(;$) {
+	write_config(shift);
+	kill("USR1", $proxy);
+	sleep(1.5);
+}
+
+# The addresses four connections to the web server came from.  HTTP/1.0
+# requests are never sent over a pooled connection.
+sub sources() {
+	return map {
+		expect_status(exchange("GET $origin/peer HTTP/1.0$EOL$EOL"),
+			      200)->{body};
+	} 1 .. 4;
+}
+
+# A request whose body length can't be told for sure is refused.
+sub refused_framing(@) {
+	my @fields = @_;
+
+	expect_status(exchange(request("POST", "/body", \@fields,
+				       "3${EOL}abc${EOL}0$EOL$EOL")), 400);
+}
+
+# A chunked request body which has to be refused, sent either with the
+# head or after it.
+sub refused_chunks($$) {
+	my ($chunks, $later) = @_;
+	my $s = proxy_connect();
+	my $head = request("POST", "/body", [ "Transfer-Encoding: chunked" ]);
+
+	if ($later) {
+		syswrite($s, "$head$later");
+		sleep(0.5);
+	}
+	syswrite($s, $chunks . request("GET", "/smuggled"));
+
+	my $r = read_response($s);
+	die "got \"$r->{line}\"\n" if $r && $r->{status} != 400;
+	die "connection kept\n" unless closed($s, 5);
+	close($s);
+}
+
+# A chunked request body which is relayed as it is.
+sub relayed_chunks($$) {
+	my ($chunks, $expected) = @_;
+	my $s = proxy_connect();
+
+	syswrite($s, request("POST", "/body", [ "Transfer-Encoding: chunked" ],
+			     $chunks) . request("GET", "/body"));
+	my $r = expect_status(read_response($s), 200);
+	die "body \"$r->{body}\" relayed\n" if $r->{body} ne $expected;
+	$r = expect_status(read_response($s), 200);
+	die "next request out of step\n" if $r->{body} ne "";
+	close($s);
+}
+
+my @tests = (
+	[ "request header continued on the next lines", sub {
+		my $h = relayed_fields(request("GET", "/head",
+					       [ "X-Folded: one", "  two",
+						 "\tthree", "X-After: 1" ]));
+		expect_field($h, "X-Folded", "one two three");
+		expect_field($h, "X-After", "1");
+	} ],
+	[ "request header values trimmed", sub {
+		my $h = relayed_fields(request("GET", "/head",
+					       [ "X-Space: \t value \t",
+						 "X-Empty:" ]));
+		expect_field($h, "X-Space", "value");
+	} ],
+	[ "request header lines without a colon skipped", sub {
+		my $h = relayed_fields(request("GET", "/head",
+					       [ "X-Before: 1", "no colon",
+						 "X-After: 2" ]));
+		expect_field($h, "X-Before", "1");
+		expect_field($h, "X-After", "2");
+		expect_field($h, "no colon", undef);
+	} ],
+	[ "request head with bare LF line endings", sub {
+		my $h = relayed_fields("GET $origin/head HTTP/1.1\n"
+				       . "Host: 127.0.0.1:$server_port\n"
+				       . "X-Lf: 1\n\n");
+		expect_field($h, "X-Lf", "1");
+	} ],
+	[ "fields named in Connection dropped", sub {
+		my $h = relayed_fields(request("GET", "/head",
+					       [ "Connection: X-Hop, x-other",
+						 "X-Hop: 1", "X-Other: 2",
+						 "X-End: 3" ]));
+		expect_field($h, "X-Hop", undef);
+		expect_field($h, "X-Other", undef);
+		expect_field($h, "X-End", "3");
+	} ],
+	[ "response header continued on the next line", sub {
+		my $r = expect_status(exchange(request("GET", "/raw/folded")),
+				      200);
+		expect_field($r->{headers}, "X-Folded", "one two");
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abc";
+	} ],
+	[ "client connection kept for the next request", sub {
+		kept_alive(request("GET", "/"), 1);
+	} ],
+	[ "client connection closed when the client asks for it", sub {
+		kept_alive(request("GET", "/", [ "Connection: close" ]), 0);
+	} ],
+	[ "HTTP/1.0 client connection closed", sub {
+		kept_alive("GET $origin/ HTTP/1.0$EOL$EOL", 0);
+	} ],
+	[ "HTTP/1.0 client connection kept when asked for", sub {
+		kept_alive("GET $origin/ HTTP/1.0${EOL}"
+			   . "Connection: keep-alive$EOL$EOL", 1);
+	} ],
+	[ "idle client connection closed after KeepAliveTimeout", sub {
+		my $s = proxy_connect();
+		syswrite($s, request("GET", "/"));
+		expect_status(read_response($s), 200);
+		die "closed too early\n" if closed($s, 1);
+		die "client connection kept\n" unless closed($s, 3);
+		close($s);
+	} ],
+	[ "response ending with the connection", sub {
+		my $s = proxy_connect();
+		syswrite($s, request("GET", "/raw/eof"));
+		my $r = expect_status(read_response($s, 3), 200);
+		die "client connection kept\n"
+			unless ($r->{headers}{connection} || "") =~ /close/i;
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abc";
+		close($s);
+	} ],
+	[ "server connection reused by the next client", sub {
+		my $first = conn_of("/");
+		sleep(0.2);
+		my $next = conn_of("/");
+		die "server connection $first not reused\n" if $next != $first;
+		die "server connection closed\n" if server_closed($first, 0);
+	} ],
+	[ "server connection with NTLM from the client not reused", sub {
+		my $r = expect_status(exchange(request("GET", "/",
+				[ "Authorization: NTLM TlRMTVNTUAABAAAA" ])),
+				      200);
+		my $first = $r->{headers}{"x-conn"};
+		die "server connection kept\n" unless server_closed($first, 3);
+		die "server connection reused\n" if conn_of("/") == $first;
+	} ],
+	[ "server connection asking for NTLM not reused", sub {
+		my $r = expect_status(exchange(request("GET", "/raw/ntlm")),
+				      401);
+		my $first = $r->{headers}{"x-conn"};
+		die "server connection kept\n" unless server_closed($first, 3);
+		die "server connection reused\n" if conn_of("/") == $first;
+	} ],
+	[ "server connection closed when the server asks for it", sub {
+		my $first = conn_of("/close");
+		die "server connection kept\n" unless server_closed($first, 3);
+		die "closed server connection reused\n"
+			if conn_of("/") == $first;
+	} ],
+	[ "server connection closed by the server while idle", sub {
+		my $first = conn_of("/drop");
+		die "server did not close\n" unless server_closed($first, 3);
+		die "closed server connection reused\n"
+			if conn_of("/") == $first;
+	} ],
+	[ "request retried when a reused connection fails", sub {
+		my $first = conn_of("/vanish");
+		sleep(0.2);
+		my $next = conn_of("/");
+		die "request went over $first again\n" if $next == $first;
+	} ],
+	[ "idle server connection closed after OriginIdleTimeout", sub {
+		my $first = conn_of("/");
+		sleep(3.5);
+		my $next = conn_of("/");
+		die "server connection $first reused\n" if $next == $first;
+		die "server connection $first kept\n"
+			unless server_closed($first, 1);
+	} ],
+	[ "upstream connection reused for another server", sub {
+		my $first = upstream_conn_of("one", "/");
+		sleep(0.2);
+		my $next = upstream_conn_of("two", "/");
+		die "upstream connection $first not reused\n"
+			if $next != $first;
+	} ],
+	[ "upstream connection closed by the proxy while idle", sub {
+		my $first = upstream_conn_of("one", "/drop");
+		die "proxy did not close\n" unless server_closed($first, 3);
+		die "closed upstream connection reused\n"
+			if upstream_conn_of("one", "/") == $first;
+	} ],
+	[ "idle upstream connection closed after UpstreamIdleTimeout", sub {
+		my $first = upstream_conn_of("one", "/");
+		sleep(3.5);
+		my $next = upstream_conn_of("one", "/");
+		die "upstream connection $first reused\n" if $next == $first;
+		die "upstream connection $first kept\n"
+			unless server_closed($first, 1);
+	} ],
+	[ "large request body relayed", sub {
+		my $body = join("", map { chr(32 + $_ % 95) } 1 .. 4 << 20);
+		my $r = expect_status(exchange(request("POST", "/body",
+				[ "Content-Length: " . length($body) ],
+				$body)), 200);
+		die "body of " . length($r->{body}) . " bytes relayed\n"
+			if $r->{body} ne $body;
+	} ],
+	[ "large chunked request body relayed", sub {
+		my $chunk = "x" x (1 << 20);
+		my $r = expect_status(exchange(request("POST", "/body",
+				[ "Transfer-Encoding: chunked" ],
+				join("", map { "100000$EOL$chunk$EOL" } 1 .. 3)
+				. "0$EOL$EOL")), 200);
+		die "body of " . length($r->{body}) . " bytes relayed\n"
+			if $r->{body} ne $chunk x 3;
+	} ],
+	[ "slow request body holds nothing else up", sub {
+		my $slow = proxy_connect();
+		my $start = time();
+
+		syswrite($slow, request("POST", "/body",
+					[ "Content-Length: 6" ], "abc"));
+		sleep(0.2);
+		expect_status(exchange(request("GET", "/")), 200);
+		die "held up for " . int(time() - $start) . " seconds\n"
+			if time() - $start > 1;
+		syswrite($slow, "def");
+		my $r = expect_status(read_response($slow), 200);
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abcdef";
+		close($slow);
+	} ],
+	[ "100 Continue passed on before the body", sub {
+		my $s = proxy_connect();
+		syswrite($s, request("POST", "/body",
+				     [ "Content-Length: 3",
+				       "Expect: 100-continue" ]));
+		expect_status(read_response($s, 5), 100);
+		syswrite($s, "abc");
+		my $r = expect_status(read_response($s), 200);
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abc";
+		close($s);
+	} ],
+	[ "body held back when the server refuses it", sub {
+		my $s = proxy_connect();
+		syswrite($s, request("POST", "/refuse",
+				     [ "Content-Length: 3",
+				       "Expect: 100-continue" ]));
+		my $r = expect_status(read_response($s, 5), 417);
+		die "client connection kept\n" unless closed($s, 3);
+		die "server connection kept\n"
+			unless server_closed($r->{headers}{"x-conn"}, 3);
+		close($s);
+	} ],
+	[ "100 Continue kept from HTTP/1.0 clients", sub {
+		my $r = expect_status(exchange("POST $origin/body HTTP/1.0$EOL"
+					       . "Content-Length: 3$EOL"
+					       . "Expect: 100-continue$EOL$EOL"
+					       . "abc"), 200);
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abc";
+	} ],
+	[ "filtered request turned away with a short response", sub {
+		rejected_fast("GET http://blocked.test/ HTTP/1.1$EOL"
+			      . "Host: blocked.test$EOL$EOL", 403);
+	} ],
+	[ "bad request turned away with a short response", sub {
+		rejected_fast("NOT A REQUEST$EOL$EOL", 400);
+	} ],
+	[ "request head trickled in closed after HeadTimeout", sub {
+		my $s = proxy_connect();
+		my $start = time();
+
+		syswrite($s, "GET $origin/ HTTP/1.1$EOL");
+		while (time() - $start < 5) {
+			last unless syswrite($s, "X-Byte: 1$EOL");
+			my $n = fill($s, 0.3);
+			last if defined $n && $n == 0;
+		}
+		my $took = time() - $start;
+		die "closed after $took seconds\n" if $took < 1.5 || $took > 4;
+		close($s);
+	} ],
+	[ "name lookup given up after DnsTimeout", sub {
+		my $start = time();
+		my $status = named_get("silent.dns.test");
+		my $took = time() - $start;
+		die "got $status\n" if $status == 200;
+		die "gave up after $took seconds\n" if $took < 1.5 || $took > 4;
+	} ],
+	[ "slow response given up after ResponseTimeout", sub {
+		my $s = proxy_connect();
+		my $start = time();
+
+		syswrite($s, request("GET", "/slow"));
+		expect_status(read_response($s, 5), 504);
+		my $took = time() - $start;
+		die "gave up after $took seconds\n" if $took < 1.5 || $took > 4;
+		close($s);
+	} ],
+	[ "request with Transfer-Encoding and Content-Length", sub {
+		refused_framing("Transfer-Encoding: chunked",
+				"Content-Length: 3");
+	} ],
+	[ "request with whitespace before a field's colon", sub {
+		refused_framing("Transfer-Encoding : chunked",
+				"Content-Length: 3");
+	} ],
+	[ "request with chunked before another coding", sub {
+		refused_framing("Transfer-Encoding: chunked, gzip");
+	} ],
+	[ "request with chunked applied twice", sub {
+		refused_framing("Transfer-Encoding: chunked, chunked");
+	} ],
+	[ "request with chunked in an earlier Transfer-Encoding field", sub {
+		refused_framing("Transfer-Encoding: chunked",
+				"Transfer-Encoding: gzip");
+	} ],
+	[ "request with a coding other than chunked last", sub {
+		refused_framing("Transfer-Encoding: gzip");
+	} ],
+	[ "request with Content-Length twice", sub {
+		refused_framing("Content-Length: 3", "Content-Length: 3");
+	} ],
+	[ "request with conflicting Content-Lengths", sub {
+		refused_framing("Content-Length: 3", "Content-Length: 4");
+	} ],
+	[ "request with a Content-Length list", sub {
+		refused_framing("Content-Length: 3, 3");
+	} ],
+	[ "request with a signed Content-Length", sub {
+		refused_framing("Content-Length: +3");
+	} ],
+	[ "request with a negative Content-Length", sub {
+		refused_framing("Content-Length: -1");
+	} ],
+	[ "request with a hexadecimal Content-Length", sub {
+		refused_framing("Content-Length: 0x3");
+	} ],
+	[ "request with a Content-Length out of range", sub {
+		refused_framing("Content-Length: 99999999999999999999999");
+	} ],
+	[ "chunked request with another coding first", sub {
+		my $s = proxy_connect();
+
+		syswrite($s, request("POST", "/body",
+				     [ "Transfer-Encoding: gzip, chunked" ],
+				     "3${EOL}abc${EOL}0$EOL$EOL")
+			 . request("GET", "/body"));
+		my $r = expect_status(read_response($s), 200);
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abc";
+		$r = expect_status(read_response($s), 200);
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "";
+		close($s);
+	} ],
+	[ "response with Transfer-Encoding and Content-Length", sub {
+		my $r = expect_status(exchange(request("GET", "/raw/te-cl")),
+				      200);
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abc";
+		die "server connection kept\n"
+			unless server_closed($r->{headers}{"x-conn"}, 3);
+	} ],
+	[ "response with Content-Length twice", sub {
+		my $s = proxy_connect();
+
+		syswrite($s, request("GET", "/raw/dup-cl"));
+		expect_status(read_response($s), 502);
+		close($s);
+	} ],
+	[ "response with whitespace before a field's colon", sub {
+		expect_status(exchange(request("GET", "/raw/te-space")), 502);
+	} ],
+	[ "response with a signed Content-Length", sub {
+		expect_status(exchange(request("GET", "/raw/bad-cl")), 502);
+	} ],
+	[ "chunk size followed by garbage", sub {
+		refused_chunks("5g${EOL}hello${EOL}0$EOL$EOL", undef);
+	} ],
+	[ "chunk size line ending in a bare CR", sub {
+		refused_chunks("5\rX\nhello${EOL}0$EOL$EOL", undef);
+	} ],
+	[ "chunked body with bare LF line endings", sub {
+		refused_chunks("5\nhello\n0\n\n", undef);
+	} ],
+	[ "chunk data not followed by CRLF", sub {
+		refused_chunks("5${EOL}helloX0$EOL$EOL", undef);
+	} ],
+	[ "trailer line ending in a bare LF", sub {
+		refused_chunks("0${EOL}X-Trailer: 1\n$EOL", undef);
+	} ],
+	[ "broken chunks after the head went out", sub {
+		refused_chunks("1g${EOL}x${EOL}0$EOL$EOL", "3${EOL}abc$EOL");
+	} ],
+	[ "chunks with extensions and whitespace", sub {
+		relayed_chunks("3;name=value${EOL}abc${EOL}2 \t;x$EOL"
+			       . "de${EOL}0$EOL$EOL", "abcde");
+	} ],
+	[ "chunked body with trailer fields", sub {
+		relayed_chunks("3${EOL}abc${EOL}0${EOL}X-Trailer: 1$EOL$EOL",
+			       "abc");
+	} ],
+	[ "chunks split across reads", sub {
+		my $s = proxy_connect();
+
+		syswrite($s, request("POST", "/body",
+				     [ "Transfer-Encoding: chunked" ]));
+		foreach my $part ("1", "0", "\r", "\n", "x" x 16, "\r\n0",
+				  "\r\n", "\r\n") {
+			sleep(0.1);
+			syswrite($s, $part);
+		}
+		my $r = expect_status(read_response($s), 200);
+		die "body of " . length($r->{body}) . " bytes relayed\n"
+			if $r->{body} ne "x" x 16;
+		close($s);
+	} ],
+	[ "response with broken chunks", sub {
+		my $s = proxy_connect();
+
+		syswrite($s, request("GET", "/raw/lf-chunks"));
+		my $head = read_head($s, 10);
+		die "no response\n" unless defined $head;
+		die "client connection kept\n" unless closed($s, 5);
+		close($s);
+	} ],
+	[ "response with a coding other than chunked last", sub {
+		my $r = expect_status(exchange(request("GET",
+						       "/raw/te-gzip")), 200);
+		die "body \"$r->{body}\" relayed\n" if $r->{body} ne "abc";
+	} ],
+	[ "name looked up with the name server", sub {
+		my $status = named_get("one.dns.test");
+		die "got $status\n" if $status != 200;
+		my @q = dns_questions("one.dns.test");
+		die scalar(@q) . " questions asked\n" if @q != 2;
+	} ],
+	[ "answer taken from the cache", sub {
+		my $status = named_get("one.dns.test");
+		die "got $status\n" if $status != 200;
+		my @q = dns_questions("one.dns.test");
+		die "asked again\n" if @q != 2;
+	} ],
+	[ "name which does not exist", sub {
+		foreach (1, 2) {
+			my $status = named_get("nx.dns.test");
+			die "got $status\n" if $status == 200;
+		}
+		my @q = dns_questions("nx.dns.test");
+		die "asked " . scalar(@q) . " times\n" if @q != 2;
+	} ],
+	[ "answer with another ID ignored", sub {
+		my $status = named_get("spoof.dns.test");
+		die "got $status\n" if $status != 200;
+	} ],
+	[ "answer for a name with NUL bytes ignored", sub {
+		my $status = named_get("nul.dns.test");
+		die "got $status\n" if $status != 200;
+	} ],
+	[ "truncated answer not taken or cached", sub {
+		my $status = named_get("tc.dns.test");
+		die "got $status\n" if $status == 200;
+		my $asked = () = dns_questions("tc.dns.test");
+		named_get("tc.dns.test");
+		die "not asked again\n"
+			if dns_questions("tc.dns.test") <= $asked;
+	} ],
+	[ "questions from random ports and IDs", sub {
+		my (%ports, %ids);
+
+		foreach my $n (1 .. 8) {
+			my $status = named_get("r$n.dns.test");
+			die "got $status\n" if $status != 200;
+			my @q = dns_questions("r$n.dns.test");
+			die "A and AAAA IDs related\n"
+				if @q == 2 && ($q[0][1] ^ 0 + $q[1][1]) == 0x8000;
+			foreach (@q) {
+				$ids{$_->[1]}++;
+				$ports{$_->[2]}++;
+			}
+		}
+		die "IDs used twice\n" if keys(%ids) != 16;
+		die "ports used again\n" if keys(%ports) != 8;
+	} ],
+	[ "request through a SOCKS5 proxy replying slowly", sub {
+		my $status = named_get("one.socks.test");
+		die "got $status\n" if $status != 200;
+	} ],
+	[ "stalled SOCKS5 handshake holds nothing else up", sub {
+		my $stalled = proxy_connect();
+		my $start = time();
+
+		syswrite($stalled, "GET http://stall.socks.test/ HTTP/1.1$EOL"
+			 . "Host: stall.socks.test$EOL$EOL");
+		sleep(0.2);
+		expect_status(exchange(request("GET", "/")), 200);
+		die "held up for " . int(time() - $start) . " seconds\n"
+			if time() - $start > 1;
+		expect_status(read_response($stalled), 504);
+		close($stalled);
+	} ],
+	[ "connect to an address not answering falls through to the next",
+	  sub {
+		my $hole = blackhole("127.0.0.3");
+		my $took = connect_time("blackhole.dns.test");
+		die "took $took seconds\n" if $took < 0.35 || $took > 1;
+		$took = connect_time("blackhole.dns.test");
+		die "address not answering tried first again\n" if $took > 0.2;
+	} ],
+	[ "refused connect falls through to the next address at once", sub {
+		my $took = connect_time("refused.dns.test");
+		die "took $took seconds\n" if $took > 0.2;
+	} ],
+	[ "connects alternating between IPv4 and IPv6", sub {
+		my @holes = map { blackhole($_) } "127.0.0.5", "127.0.0.6";
+		my $took = connect_time("families.dns.test");
+		die "took $took seconds\n" if $took < 0.35 || $took > 0.7;
+	} ],
+	[ "connections bound to the first Bind address", sub {
+		reconfigure("Bind 127.0.0.2\nBind 127.0.0.1\n"
+			    . "BindRotation order\n");
+		my @from = sources();
+		die "connections from @from\n" if grep { $_ ne "127.0.0.2" } @from;
+	} ],
+	[ "connections bound to each Bind address in turn", sub {
+		reconfigure("Bind 127.0.0.1\nBind 127.0.0.2\n"
+			    . "BindRotation roundrobin\n");
+		my @from = sources();
+		die "connections from @from\n"
+			if grep { $from[$_] eq $from[$_ - 1] } 1 .. $#from;
+	} ],
+	[ "connections to a server bound to the same Bind address", sub {
+		reconfigure("Bind 127.0.0.1\nBind 127.0.0.2\n"
+			    . "BindRotation hash\n");
+		my @from = sources();
+		die "connections from @from\n" if grep { $_ ne $from[0] } @from;
+		reconfigure();
+		@from = sources();
+		die "connections from @from without Bind\n"
+			if grep { $_ ne "127.0.0.1" } @from;
+	} ],
+);
+
+sub run_tests() {
+	my $failed = 0;
+
+	foreach my $test (@tests) {
+		my ($name, $code) = @$test;
+
+		printf("checking %s...", $name);
+		eval {
+			local $SIG{ALRM} = sub { die "timed out\n" };
+			alarm(20);
+			$code->();
+			alarm(0);
+		};
+		alarm(0);
+		if ($@) {
+			print " FAILED: $@";
+			$failed++;
+		} else {
+			print " ok\n";
+		}
+	}
+	return $failed;
+}
+
+# "main"
+
+process_options();
+
+$| = 1;
+$SIG{PIPE} = "IGNORE";
+$dir = tempdir(CLEANUP => 1);
+
+my $server = start_server("127.0.0.1");
+my $server6 = start_server("::1");
+my $dns = start_dns();
+my $socks = start_socks();
+$proxy = eval { start_tinyproxy() };
+my $failed = $proxy ? run_tests() : 1;
+print "could not start tinyproxy: $@" unless $proxy;
+
+kill("TERM", $proxy) if $proxy;
+kill("TERM", -$server, -$server6, -$socks, $dns);
+waitpid($proxy, 0) if $proxy;
+waitpid($server, 0);
+waitpid($server6, 0);
+waitpid($dns, 0);
+waitpid($socks, 0);
+
+print "$failed HTTP test(s) failed\n" if $failed;
+exit($failed);
+
+__END__
+
+=head1 http_tests.pl
+
+http_tests.pl - functional tests of tinyproxy's handling of HTTP messages
+
+=head1 SYNOPSIS
+
+http_tests.pl [options]
+
+ Options:
+   --tinyproxy=PATH	tinyproxy binary (default: the one in src/)
+   --engine=E		IOEngine to use (default: threads)
+   --proxy-port=P	port for tinyproxy to listen on (default: 12324)
+   --server-port=P	port for the test web server (default: 32126)
+   --dns-port=P		port for the stub name server (default: 32153)
+   --socks-port=P	port for the stub SOCKS5 proxy (default: 32154)
+   --help		show this help
+
+=cut
@@ -38,6 +38,7 @@ TINYPROXY_FILTER_FILE=$TINYPROXY_CONF_DIR/filter
 TINYPROXY_STDERR_LOG=$TINYPROXY_LOG_DIR/tinyproxy.stderr.log
 TINYPROXY_BIN=$BASEDIR/src/tinyproxy
 TINYPROXY_STATHOST_IP="127.0.0.127"
+TINYPROXY_IOENGINE=${TINYPROXY_IOENGINE:-threads}
 
 WEBSERVER_IP=127.0.0.3
 WEBSERVER_PORT=32123
@@ -50,6 +51,8 @@ WEBSERVER_BIN=$SCRIPTS_DIR/$WEBSERVER_BIN_FILE
 WEBCLIENT_LOG=$LOG_DIR/webclient.log
 WEBCLIENT_BIN=$SCRIPTS_DIR/webclient.pl
 
+HTTPTESTS_BIN=$SCRIPTS_DIR/http_tests.pl
+
 provision_initial() {
 	if test -e "$TESTENV_DIR" ; then
 		TESTENV_DIR_OLD=$TESTENV_DIR.old
@@ -89,6 +92,9 @@ Logfile "$TINYPROXY_LOG_FILE"
 PidFile "$TINYPROXY_PID_FILE"
 LogLevel Info
 MaxClients 100
+IOEngine $TINYPROXY_IOENGINE
+Workers 2
+ReusePort Yes
 Allow 127.0.0.0/8
 ViaProxyName "tinyproxy"
 #DisableViaHeader Yes
@@ -252,10 +258,17 @@ run_failure_webclient_request 502 "$TINYPROXY_IP:$TINYPROXY_PORT" "http://bogus.
 test "$?" = "0" || FAILED=$((FAILED + 1))
 }
 
+http_test() {
+echo "running the HTTP message tests..."
+"$HTTPTESTS_BIN" --tinyproxy "$TINYPROXY_BIN" --engine "$TINYPROXY_IOENGINE"
+FAILED=$((FAILED + $?))
+}
+
 basic_test
 reload_config
 basic_test
 ext_test
+http_test
 
 echo "$FAILED errors"
 